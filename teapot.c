@@ -12,41 +12,7 @@
 #include <math.h>
 #include <teatime.h>
 
-void teatime_demo(void);
-
-void TEA_cpu_encrypt(const uint32_t input[2],
-                   const uint32_t key[4],
-                   uint32_t output[2], uint16_t rounds)
-{
-    uint32_t v0 = input[0];
-    uint32_t v1 = input[1];
-    const uint32_t DELTA = 0x9e3779b9;
-    uint32_t sum = 0;
-    for (uint16_t i = 0; i < rounds; ++i) {
-        sum += DELTA;
-        v0 += ((v1 << 4) + key[0]) ^ (v1 + sum) ^ ((v1 >> 5) + key[1]);
-        v1 += ((v0 << 4) + key[2]) ^ (v0 + sum) ^ ((v0 >> 5) + key[3]);
-    }
-    output[0] = v0;
-    output[1] = v1;
-}
-
-void TEA_cpu_decrypt(const uint32_t input[2],
-                   const uint32_t key[4],
-                   uint32_t output[2], uint16_t rounds)
-{
-    uint32_t v0 = input[0];
-    uint32_t v1 = input[1];
-    const uint32_t DELTA = 0x9e3779b9;
-    uint32_t sum = DELTA * rounds;
-    for (uint16_t i = 0; i < rounds; ++i) {
-        v1 -= ((v0 << 4) + key[2]) ^ (v0 + sum) ^ ((v0 >> 5) + key[3]);
-        v0 -= ((v1 << 4) + key[0]) ^ (v1 + sum) ^ ((v1 >> 5) + key[1]);
-        sum -= DELTA;
-    }
-    output[0] = v0;
-    output[1] = v1;
-}
+int teatime_demo(void);
 
 void teapot_reshape(int w, int h)
 {
@@ -85,7 +51,7 @@ void teapot_idle(void)
 #define INPUT_SZ 64
 #define TEA_ROUNDS 32
 
-void teatime_demo(void)
+int teatime_demo(void)
 {
     int rc = 0;
     teatime_t *tea = NULL;
@@ -98,6 +64,7 @@ void teatime_demo(void)
         uint32_t expected[INPUT_SZ];
         uint32_t ikey[4] = { 0xDEADBEEF, 0xCAFEFACE, 0xFACEB00C, 0xF00D1337 };
         uint32_t rounds = TEA_ROUNDS;
+        teatime_fingerprint_t gpu_fp, cpu_fp;
         for (uint32_t i = 0; i < ilen; ++i)
             input[i] = 0xFFFF0000 |(i + 1) * 5;
         for (uint32_t i = 0; i < olen; ++i)
@@ -117,7 +84,7 @@ void teatime_demo(void)
         rc = teatime_create_textures(tea, input, ilen);
         if (rc < 0)
             break;
-        rc = teatime_create_program(tea, teatime_encrypt_source());
+        rc = teatime_load_program_rounds(tea, TEATIME_ENCRYPT, rounds);
         if (rc < 0)
             break;
         rc = teatime_run_program(tea, ikey, rounds);
@@ -150,7 +117,7 @@ void teatime_demo(void)
         rc = teatime_create_textures(tea, output, olen);
         if (rc < 0)
             break;
-        rc = teatime_create_program(tea, teatime_decrypt_source());
+        rc = teatime_load_program_rounds(tea, TEATIME_DECRYPT, rounds);
         if (rc < 0)
             break;
         rc = teatime_run_program(tea, ikey, rounds);
@@ -163,13 +130,22 @@ void teatime_demo(void)
             printf("%u. Decrypting Input = %08x Output = %08x Expected = %08x\n", i, output[i],
                     expected[i], input[i]);
         }
+        /* the round trip must give back the input */
+        rc = teatime_fingerprint_output(tea, &gpu_fp);
+        if (rc < 0)
+            break;
+        teatime_fingerprint(input, ilen, &cpu_fp);
+        printf("Round trip fingerprint %s\n",
+                memcmp(&gpu_fp, &cpu_fp, sizeof(cpu_fp)) == 0 ? "matches" : "DIFFERS");
         teatime_delete_textures(tea);
         teatime_delete_program(tea);
     } while (0);
+    teatime_print_stats(tea, stderr);
     teatime_cleanup(tea);
+    return rc;
 }
 
-int main(int argc, char **argv)
+int teapot_main(int argc, char **argv)
 {
     GLenum err = GLEW_OK;
     GLint wnd; /* window handle */
@@ -195,3 +171,11 @@ int main(int argc, char **argv)
     glutMainLoop();
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    /* the teapot window is optional, by default we run headless */
+    if (argc > 1 && strcmp(argv[1], "--glut") == 0)
+        return teapot_main(argc, argv);
+    return (teatime_demo() < 0) ? -1 : 0;
+}
@@ -4,62 +4,253 @@
  * AUTHOR: Stealthy Labs
  * SOFTWARE: Tea Time
  */
+#define _POSIX_C_SOURCE 200809L
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#ifdef WIN32
+    #include <direct.h>
+    #include <process.h>
+    #define mkdir(A,B) _mkdir(A)
+    #define getpid _getpid
+#else
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+#include <sys/stat.h>
 #include <teatime.h>
 
 static int teatime_check_gl_version(uint32_t *major, uint32_t *minor);
 static int teatime_check_program_errors(GLuint program);
 static int teatime_check_shader_errors(GLuint shader);
+static int teatime_dispatch(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds);
+static uint64_t teatime_tile_words(const teatime_t *obj);
+static int teatime_check_rounds(const teatime_t *obj, uint32_t rounds);
+static int teatime_check_program(const teatime_t *obj, uint32_t rounds);
+static void teatime_compute_groups(const teatime_t *obj, GLuint count,
+        GLuint *groups_x, GLuint *groups_y);
+static int teatime_run_cpu(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds,
+        const uint32_t *input, uint32_t *output, uint32_t nwords);
+static int teatime_dispatch_compute(teatime_t *obj, GLuint ibuf, GLuint obuf,
+        const uint32_t ikey[4], uint32_t rounds);
+static char *teatime_kernel_source(const teatime_t *obj, int algorithm,
+        uint32_t block_words, int direction, uint32_t rounds);
+static int teatime_check_length(const teatime_t *obj, uint32_t nwords);
+static uint64_t teatime_stats_begin(teatime_t *obj, int stage, bool gpu);
+static void teatime_stats_end(teatime_t *obj, int stage, uint64_t start,
+        uint64_t bytes);
+static int teatime_parse_log_level(const char *str);
+static void teatime_read_env(void);
+static void teatime_shader_source(const teatime_t *obj, GLuint shader,
+        const char *source);
+static int teatime_vertex_shader(teatime_t *obj);
+static uint64_t teatime_vertex_hash(const teatime_t *obj, uint64_t hash);
+static void APIENTRY teatime_debug_callback(GLenum source, GLenum type, GLuint id,
+        GLenum severity, GLsizei length, const GLchar *message, const void *user);
+
+/*
+ * glGetError() and glCheckFramebufferStatus() make many drivers wait for the
+ * commands already queued, so release builds can check once per operation
+ * instead of after every call. They are built with -DTEATIME_FAST_CHECKS or
+ * switched at runtime with teatime_set_error_checks().
+ */
+#ifdef TEATIME_FAST_CHECKS
+    static int teatime_error_checks = TEATIME_CHECKS_FAST;
+#else
+    static int teatime_error_checks = TEATIME_CHECKS_FULL;
+#endif
+static int teatime_log_level = TEATIME_LOG_WARN;
+#ifndef WIN32
+    static pthread_once_t teatime_env_once = PTHREAD_ONCE_INIT;
+    #define TEATIME_READ_ENV() pthread_once(&teatime_env_once, teatime_read_env)
+#else
+    /* the Windows build has no threads of its own */
+    static bool teatime_env_read = false;
+    #define TEATIME_READ_ENV() do { if (!teatime_env_read) { \
+        teatime_env_read = true; teatime_read_env(); } } while (0)
+#endif
 
-#define TEATIME_BREAKONERROR(FN,RC)  if ((RC = teatime_check_gl_errors(__LINE__, #FN )) < 0) break
-#define TEATIME_BREAKONERROR_FB(FN,RC)  if ((RC = teatime_check_gl_fb_errors(__LINE__, #FN )) < 0) break
+#define TEATIME_BREAKONERROR(FN,RC)  if (teatime_error_checks == TEATIME_CHECKS_FULL && \
+        (RC = teatime_check_gl_errors(__LINE__, #FN )) < 0) break
+#define TEATIME_BREAKONERROR_FB(FN,RC)  if (teatime_error_checks == TEATIME_CHECKS_FULL && \
+        (RC = teatime_check_gl_fb_errors(__LINE__, #FN )) < 0) break
+/* the single check at the end of an operation in fast mode */
+#define TEATIME_CHECK_OPERATION(O,RC)  if ((RC) == 0 && (O)->have_gl && \
+        teatime_error_checks == TEATIME_CHECKS_FAST) RC = teatime_check_gl_errors(__LINE__, __func__)
+/* the CPU backend has no program object, only a direction */
+#define TEATIME_HAS_PROGRAM(O) ((O)->program > 0 || (O)->program_direction >= 0)
+
+/* the CPU backend needs no OpenGL state at all */
+static int teatime_setup_cpu(teatime_t *obj)
+{
+    if (!obj->cpu) {
+        obj->cpu = teatime_cpu_create(0);
+        if (!obj->cpu)
+            return -ENOMEM;
+    }
+    obj->backend = TEATIME_BACKEND_CPU;
+    obj->fanout = 1;
+    teatime_log(TEATIME_LOG_INFO, "Using the %s backend\n",
+            teatime_backend_name(obj->backend));
+    return 0;
+}
 
 teatime_t *teatime_setup()
 {
     int rc = 0;
     teatime_t *obj = calloc(1, sizeof(teatime_t));
     if (!obj) {
-        fprintf(stderr, "Out of memory allocating %zu bytes\n",
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
                 sizeof(teatime_t));
         return NULL;
     }
     do {
         uint32_t version[2] = { 0, 0};
+        const char *backend = getenv("TEATIME_BACKEND");
+        obj->program_direction = -1;
+        obj->program_block_words = obj->block_words = 2;
+        obj->hybrid_crossover = TEATIME_HYBRID_CROSSOVER;
+        obj->pool_size = TEATIME_POOL_SIZE;
+        obj->workgroup_size = TEATIME_WORKGROUP_SIZE;
+        obj->timer_stage = -1;
+        TEATIME_READ_ENV();
+        if (backend && strcmp(backend, "cpu") == 0) {
+            rc = teatime_setup_cpu(obj);
+            break;
+        }
+        /* no current context, so create a headless one that we own */
+        if (!glGetString(GL_VERSION)) {
+            obj->ctx = teatime_context_create();
+            if (!obj->ctx) {
+                teatime_log(TEATIME_LOG_WARN, "Unable to create a headless OpenGL context. "
+                        "Falling back to the CPU backend\n");
+                rc = teatime_setup_cpu(obj);
+                break;
+            }
+        }
         if (teatime_check_gl_version(&version[0], &version[1]) < 0) {
-            fprintf(stderr, "Unable to verify OpenGL version\n");
+            teatime_log(TEATIME_LOG_ERROR, "Unable to verify OpenGL version\n");
             rc = -1;
             break;
         }
         if (version[0] < 3) {
-            fprintf(stderr, "Minimum Required OpenGL version 3.0. You have %u.%u\n",
-                    version[0], version[1]);
-            rc = -1;
+            teatime_log(TEATIME_LOG_WARN, "Minimum Required OpenGL version 3.0. You have %u.%u. "
+                    "Falling back to the CPU backend\n", version[0], version[1]);
+            teatime_context_destroy(obj->ctx);
+            obj->ctx = NULL;
+            rc = teatime_setup_cpu(obj);
             break;
         }
+        obj->have_gl = true;
+        /* KHR_debug reports errors as they happen, with a description and
+         * without a sync, which is what the fast checks rely on */
+        if (version[0] > 4 || (version[0] == 4 && version[1] >= 3) ||
+            glewIsSupported("GL_KHR_debug")) {
+            glDebugMessageCallback(teatime_debug_callback, NULL);
+            /* notifications cost time in the driver even if not printed */
+            glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE,
+                    GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL,
+                    teatime_log_level >= TEATIME_LOG_DEBUG);
+            glEnable(GL_DEBUG_OUTPUT);
+            TEATIME_BREAKONERROR(glDebugMessageCallback, rc);
+            obj->have_debug = true;
+        }
+        /* without the fixed-function state and immediate mode a core profile
+         * needs GLSL 1.50, see teatime_shader_source() */
+        if (version[0] > 3 || (version[0] == 3 && version[1] >= 2)) {
+            GLint mask = 0;
+            glGetIntegerv(GL_CONTEXT_PROFILE_MASK, &mask);
+            TEATIME_BREAKONERROR(glGetIntegerv, rc);
+            obj->have_core = (mask & GL_CONTEXT_CORE_PROFILE_BIT) != 0;
+        }
+        /* the full-screen triangle has no vertex data, but a core profile
+         * draws nothing without a vertex array bound */
+        glGenVertexArrays(1, &(obj->vao));
+        TEATIME_BREAKONERROR(glGenVertexArrays, rc);
         /* initialize off-screen framebuffer */
         /*
-         * This is the EXT_framebuffer_object OpenGL extension that allows us to
+         * This is the framebuffer object of OpenGL 3.0 that allows us to
          * use an offscreen buffer as a target for rendering operations such as
          * vector calculations, providing full precision and removing unwanted
          * clamping issues.
          * we are turning off the traditional framebuffer here apparently.
          */
-        glGenFramebuffersEXT(1, &(obj->ofb));
-        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, obj->ofb);
-        TEATIME_BREAKONERROR(glBindFramebufferEXT, rc);
-        fprintf(stderr, "Successfully created off-screen framebuffer with id: %d\n",
+        glGenFramebuffers(1, &(obj->ofb));
+        glBindFramebuffer(GL_FRAMEBUFFER, obj->ofb);
+        TEATIME_BREAKONERROR(glBindFramebuffer, rc);
+        teatime_log(TEATIME_LOG_INFO, "Successfully created off-screen framebuffer with id: %d\n",
                 obj->ofb);
         /* get the texture size */
         obj->maxtexsz = -1;
         glGetIntegerv(GL_MAX_TEXTURE_SIZE, &(obj->maxtexsz));
-        fprintf(stderr, "Maximum Texture size for the GPU: %d\n", obj->maxtexsz);
+        teatime_log(TEATIME_LOG_INFO, "Maximum Texture size for the GPU: %d\n",
+                obj->maxtexsz);
+        obj->tile_width = obj->tile_height =
+            (obj->maxtexsz < TEATIME_TILE_SIZE) ? obj->maxtexsz : TEATIME_TILE_SIZE;
         obj->itexid = obj->otexid = 0;
-        obj->shader = obj->program = 0;
+        obj->program = 0;
+        obj->fanout = 1;
+        /* uploads are tightly packed */
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        /* program binaries need OpenGL 4.1 or ARB_get_program_binary and at
+         * least one binary format supported by the driver */
+        if (version[0] > 4 || (version[0] == 4 && version[1] >= 1) ||
+            glewIsSupported("GL_ARB_get_program_binary")) {
+            GLint nformats = 0;
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nformats);
+            TEATIME_BREAKONERROR(glGetIntegerv, rc);
+            obj->program_binary = (nformats > 0);
+        }
+        obj->have_sync = (version[0] > 3 || (version[0] == 3 && version[1] >= 2) ||
+            glewIsSupported("GL_ARB_sync"));
+        obj->have_barrier = (version[0] > 4 || (version[0] == 4 && version[1] >= 5) ||
+            glewIsSupported("GL_ARB_texture_barrier"));
+        obj->have_timer = (version[0] > 3 || (version[0] == 3 && version[1] >= 3) ||
+            glewIsSupported("GL_ARB_timer_query"));
+        obj->stats_gpu = obj->have_timer;
+        /* persistent coherent mappings for teatime_ring_create() */
+        obj->have_buffer_storage = (version[0] > 4 || (version[0] == 4 && version[1] >= 4) ||
+            glewIsSupported("GL_ARB_buffer_storage"));
+        /* the compute kernels are GLSL 4.30 with shader storage buffers */
+        obj->have_compute = (version[0] > 4 || (version[0] == 4 && version[1] >= 3));
+        obj->backend = TEATIME_BACKEND_FRAGMENT;
+        if (obj->have_compute) {
+            GLint64 maxblock = 0;
+            GLint maxgroups = 0;
+            glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxblock);
+            TEATIME_BREAKONERROR(glGetInteger64v, rc);
+            glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &maxgroups);
+            TEATIME_BREAKONERROR(glGetIntegeri_v, rc);
+            /* whole texels only, so every invocation reads a full uvec4 */
+            obj->ssbo_words = ((uint64_t)maxblock / sizeof(uint32_t)) & ~(uint64_t)3;
+            obj->max_groups = (GLuint)maxgroups;
+            /* prefer compute when available unless told otherwise */
+            if (!backend || strcmp(backend, "fragment") != 0)
+                obj->backend = TEATIME_BACKEND_COMPUTE;
+        }
+        teatime_log(TEATIME_LOG_INFO, "Using the %s backend\n",
+                teatime_backend_name(obj->backend));
+        if (obj->program_binary) {
+            const char *cdir = getenv("TEATIME_CACHE_DIR");
+            char defdir[4096] = { 0 };
+            if (!cdir) {
+                const char *xdg = getenv("XDG_CACHE_HOME");
+                const char *home = getenv("HOME");
+                if (xdg && xdg[0] != '\0')
+                    snprintf(defdir, sizeof(defdir), "%s/teatime", xdg);
+                else if (home && home[0] != '\0')
+                    snprintf(defdir, sizeof(defdir), "%s/.cache/teatime", home);
+                cdir = defdir;
+            }
+            /* the cache is an optimization, so failing to create it is not
+             * an error */
+            teatime_set_cache_dir(obj, cdir);
+        }
     } while (0);
     if (rc < 0) {
         teatime_cleanup(obj);
@@ -71,129 +262,567 @@ teatime_t *teatime_setup()
 void teatime_cleanup(teatime_t *obj)
 {
     if (obj) {
-        teatime_delete_program(obj);
-        teatime_delete_textures(obj);
-        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
-        glDeleteFramebuffersEXT(1, &(obj->ofb));
-        glFlush();
+        teatime_clear_programs(obj);
+        teatime_set_streaming(obj, 0);
+        teatime_clear_pool(obj);
+        for (int i = 0; i < TEATIME_NUM_STAGES; ++i) {
+            for (int j = 0; j < TEATIME_STATS_QUERIES; ++j) {
+                if (obj->timers[i][j].query > 0)
+                    glDeleteQueries(1, &(obj->timers[i][j].query));
+            }
+        }
+        if (obj->have_debug) {
+            glDisable(GL_DEBUG_OUTPUT);
+            glDebugMessageCallback(NULL, NULL);
+        }
+        if (obj->vao > 0) {
+            glBindVertexArray(0);
+            glDeleteVertexArrays(1, &(obj->vao));
+        }
+        if (obj->vertex_shader > 0)
+            glDeleteShader(obj->vertex_shader);
+        if (obj->ofb > 0) {
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glDeleteFramebuffers(1, &(obj->ofb));
+            glFlush();
+        }
+        teatime_context_destroy(obj->ctx);
+        teatime_cpu_destroy(obj->cpu);
+        free(obj->cpu_data);
+        free(obj->cache_dir);
         free(obj);
         obj = NULL;
     }
 }
 
+/*
+ * Each texel holds 4 words, i.e. two 64-bit TEA blocks. The texels are laid out
+ * in a rectangle that is as square as the tile limits allow. The last row may
+ * be partially filled and the last texel may hold a single block, which is
+ * the tail that teatime_transfer_textures() handles explicitly.
+ */
+static void teatime_tile_shape(const teatime_t *obj, uint32_t texels,
+        GLuint *width, GLuint *height)
+{
+    GLuint w = (GLuint)ceil(sqrt((double)texels));
+    if (w > obj->tile_width)
+        w = obj->tile_width;
+    if (w == 0)
+        w = 1;
+    if ((texels + w - 1) / w > obj->tile_height)
+        w = obj->tile_width;
+    *width = w;
+    *height = (texels + w - 1) / w;
+}
+
+static void teatime_apply_viewport(teatime_t *obj, GLuint width, GLuint height,
+        uint32_t len)
+{
+    /* viewport mapping 1:1 pixel = texel = data mapping, the full-screen
+     * triangle covers it whatever its size */
+    glViewport(0, 0, width, height);
+    obj->data_width = width;
+    obj->data_height = height;
+    obj->data_len = len;
+}
+
+/* the fragment kernels address their texels by gl_FragCoord, so a draw is
+ * one triangle covering the viewport whose corners the vertex shader makes
+ * up from gl_VertexID, with no vertex data and no fixed-function state */
+static void teatime_draw(teatime_t *obj)
+{
+    glBindVertexArray(obj->vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
 int teatime_set_viewport(teatime_t *obj, uint32_t ilen)
 {
-    uint32_t texsz = (uint32_t)((long)(sqrt(ilen / 4.0)));
-    if (obj && texsz > 0 && texsz < (GLuint)obj->maxtexsz) {
-        /* viewport mapping 1:1 pixel = texel = data mapping */
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        gluOrtho2D(0.0, texsz, 0.0, texsz);
-        glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
-        glViewport(0, 0, texsz, texsz);
-        obj->tex_size = texsz;
-        fprintf(stderr, "Texture size: %u x %u\n", texsz, texsz);
+    if (obj && ilen > 0 && (ilen % 2) == 0 &&
+        obj->backend != TEATIME_BACKEND_FRAGMENT) {
+        /* there is no viewport on the compute and CPU backends, the data
+         * is a single row of texels */
+        if ((uint64_t)ilen > teatime_tile_words(obj)) {
+            teatime_log(TEATIME_LOG_ERROR, "Input length %u exceeds the max. tile of "
+                    "%llu words. Use teatime_run() for multi-tile inputs\n", ilen,
+                    (unsigned long long)teatime_tile_words(obj));
+            return -E2BIG;
+        }
+        obj->data_width = (ilen + 3) / 4;
+        obj->data_height = 1;
+        obj->data_len = ilen;
+        return 0;
+    } else if (obj && ilen > 0 && (ilen % 2) == 0) {
+        GLuint width = 0, height = 0;
+        /* with fan-out the texels are split over that many planes */
+        uint32_t texels = ((ilen + 3) / 4 + obj->fanout - 1) / obj->fanout;
+        if ((uint64_t)texels > (uint64_t)obj->tile_width * obj->tile_height) {
+            teatime_log(TEATIME_LOG_ERROR, "Input length %u exceeds the tile size %u x %u. "
+                    "Use teatime_run() for multi-tile inputs\n", ilen,
+                    obj->tile_width, obj->tile_height);
+            return -E2BIG;
+        }
+        teatime_tile_shape(obj, texels, &width, &height);
+        teatime_apply_viewport(obj, width, height, ilen);
+        teatime_log(TEATIME_LOG_DEBUG, "Viewport size: %u x %u for %u words\n",
+                width, height, ilen);
+        return 0;
+    } else if (obj) {
+        teatime_log(TEATIME_LOG_ERROR, "Input length %u is not a whole no. of 64-bit blocks\n",
+                ilen);
+    }
+    return -EINVAL;
+}
+
+int teatime_set_tile_size(teatime_t *obj, GLuint width, GLuint height)
+{
+    /* without OpenGL there is only the CPU backend, which ignores tiles */
+    if (obj && width > 0 && height > 0 && (!obj->have_gl ||
+        (width <= (GLuint)obj->maxtexsz && height <= (GLuint)obj->maxtexsz))) {
+        obj->tile_width = width;
+        obj->tile_height = height;
         return 0;
     } else if (obj) {
-        fprintf(stderr, "Max. texture size is %d. Calculated: %u from input length: %u\n",
-                obj->maxtexsz, texsz, ilen);
+        teatime_log(TEATIME_LOG_ERROR, "Max. texture size is %d. Tile size requested: %u x %u\n",
+                obj->maxtexsz, width, height);
     }
     return -EINVAL;
 }
 
+/* no. of words in a full tile across all the fan-out planes */
+static uint64_t teatime_tile_words(const teatime_t *obj)
+{
+    uint64_t words = (uint64_t)obj->tile_width * obj->tile_height * 4 * obj->fanout;
+    /* compute tiles are bounded by the storage block size instead */
+    if (obj->backend == TEATIME_BACKEND_COMPUTE && words > obj->ssbo_words)
+        words = obj->ssbo_words;
+    /* and hold whole XXTEA blocks */
+    if (obj->backend == TEATIME_BACKEND_COMPUTE)
+        words -= words % obj->program_block_words;
+    /* and the CPU is not bounded at all */
+    if (obj->backend == TEATIME_BACKEND_CPU)
+        words = (uint64_t)UINT32_MAX + 1;
+    return words;
+}
+
+static uint32_t teatime_pow2(uint32_t n)
+{
+    uint32_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+static int teatime_create_texture(GLuint *texid, GLuint width, GLuint height,
+        GLuint layers)
+{
+    int rc = 0;
+    /* fan-out planes are the layers of an array texture */
+    GLenum target = TEATIME_TEXTURE_TARGET(layers);
+    do {
+        glGenTextures(1, texid);
+        /* the texture target can vary depending on GPU */
+        glBindTexture(target, *texid);
+        TEATIME_BREAKONERROR(glBindTexture, rc);
+        /* turn off filtering and set proper wrap mode - this is obligatory for
+         * floating point textures */
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        TEATIME_BREAKONERROR(glTexParameteri, rc);
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        TEATIME_BREAKONERROR(glTexParameteri, rc);
+        glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        TEATIME_BREAKONERROR(glTexParameteri, rc);
+        glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        TEATIME_BREAKONERROR(glTexParameteri, rc);
+        /* create a 2D texture of the size class of the data
+         * internal format: GL_RGBA32UI_EXT
+         * texture format: GL_RGBA_INTEGER
+         * texture type: GL_UNSIGNED_INT
+         */
+        if (layers > 1) {
+            glTexImage3D(target, 0, GL_RGBA32UI_EXT, width, height, layers, 0,
+                    GL_RGBA_INTEGER, GL_UNSIGNED_INT, NULL);
+            TEATIME_BREAKONERROR(glTexImage3D, rc);
+        } else {
+            glTexImage2D(target, 0, GL_RGBA32UI_EXT,
+                    width, height, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, NULL);
+            TEATIME_BREAKONERROR(glTexImage2D, rc);
+        }
+        rc = 0;
+    } while (0);
+    return rc;
+}
+
+/* attaches the output texture to the bound framebuffer, a layer per target */
+static int teatime_attach_output(GLuint otexid, GLuint layers)
+{
+    int rc = 0;
+    do {
+        if (layers > 1) {
+            for (GLuint i = 0; i < layers; ++i) {
+                glFramebufferTextureLayer(GL_FRAMEBUFFER,
+                        GL_COLOR_ATTACHMENT0 + i, otexid, 0, i);
+                TEATIME_BREAKONERROR(glFramebufferTextureLayer, rc);
+            }
+            if (rc < 0)
+                break;
+        } else {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                    GL_TEXTURE_2D, otexid, 0);
+            TEATIME_BREAKONERROR(glFramebufferTexture2D, rc);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                    GL_TEXTURE_2D, otexid, 0);
+            TEATIME_BREAKONERROR(glFramebufferTexture2D, rc);
+        }
+        rc = 0;
+    } while (0);
+    return rc;
+}
+
+static void teatime_free_texpair(teatime_texpair_t *pair)
+{
+    if (pair->fbo > 0)
+        glDeleteFramebuffers(1, &(pair->fbo));
+    if (pair->itexid > 0)
+        glDeleteTextures(1, &(pair->itexid));
+    if (pair->otexid > 0)
+        glDeleteTextures(1, &(pair->otexid));
+    if (pair->pbo > 0)
+        glDeleteBuffers(1, &(pair->pbo));
+    pair->fbo = pair->itexid = pair->otexid = pair->pbo = 0;
+    pair->pbo_size = 0;
+}
+
+static int teatime_create_texpair(teatime_texpair_t *pair)
+{
+    int rc = 0;
+    const GLenum buffers[TEATIME_FANOUT_MAX] = {
+        GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
+        GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3,
+        GL_COLOR_ATTACHMENT4, GL_COLOR_ATTACHMENT5,
+        GL_COLOR_ATTACHMENT6, GL_COLOR_ATTACHMENT7
+    };
+    do {
+        rc = teatime_create_texture(&(pair->itexid), pair->width, pair->height,
+                pair->layers);
+        if (rc < 0)
+            break;
+        rc = teatime_create_texture(&(pair->otexid), pair->width, pair->height,
+                pair->layers);
+        if (rc < 0)
+            break;
+        /* each pair has its own framebuffer so that the attachments are set
+         * up only once */
+        glGenFramebuffers(1, &(pair->fbo));
+        glBindFramebuffer(GL_FRAMEBUFFER, pair->fbo);
+        TEATIME_BREAKONERROR(glBindFramebuffer, rc);
+        /* attach texture */
+        rc = teatime_attach_output(pair->otexid, pair->layers);
+        if (rc < 0)
+            break;
+        TEATIME_BREAKONERROR_FB(teatime_attach_output, rc);
+        if (pair->layers > 1) {
+            glDrawBuffers(pair->layers, buffers);
+            TEATIME_BREAKONERROR(glDrawBuffers, rc);
+        } else {
+            glDrawBuffer(GL_COLOR_ATTACHMENT0);
+            TEATIME_BREAKONERROR(glDrawBuffer, rc);
+        }
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        TEATIME_BREAKONERROR(glReadBuffer, rc);
+        teatime_log(TEATIME_LOG_DEBUG, "Created texture pair %u/%u of size %u x %u x %u with framebuffer: %u\n",
+                pair->itexid, pair->otexid, pair->width, pair->height,
+                pair->layers, pair->fbo);
+        rc = 0;
+    } while (0);
+    if (rc < 0)
+        teatime_free_texpair(pair);
+    return rc;
+}
+
+static int teatime_pool_acquire(teatime_t *obj, GLuint width, GLuint height)
+{
+    teatime_texpair_t *pair = NULL;
+    /* textures are bucketed by power-of-two size classes */
+    GLuint pw = teatime_pow2(width);
+    GLuint ph = teatime_pow2(height);
+    if (pw > (GLuint)obj->maxtexsz)
+        pw = obj->maxtexsz;
+    if (ph > (GLuint)obj->maxtexsz)
+        ph = obj->maxtexsz;
+    for (uint32_t i = 0; i < obj->pool_len; ++i) {
+        if (!obj->pool[i].in_use && obj->pool[i].width == pw &&
+            obj->pool[i].height == ph && obj->pool[i].layers == obj->fanout) {
+            pair = &(obj->pool[i]);
+            break;
+        }
+    }
+    if (pair) {
+        obj->pool_stats.hits++;
+    } else {
+        int rc = 0;
+        obj->pool_stats.misses++;
+        if (obj->pool_len == obj->pool_max) {
+            uint32_t maxp = obj->pool_max ? obj->pool_max * 2 : 4;
+            teatime_texpair_t *pool = realloc(obj->pool,
+                    maxp * sizeof(teatime_texpair_t));
+            if (!pool) {
+                teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                        maxp * sizeof(teatime_texpair_t));
+                return -ENOMEM;
+            }
+            obj->pool = pool;
+            obj->pool_max = maxp;
+        }
+        pair = &(obj->pool[obj->pool_len]);
+        memset(pair, 0, sizeof(*pair));
+        pair->width = pw;
+        pair->height = ph;
+        pair->layers = obj->fanout;
+        rc = teatime_create_texpair(pair);
+        if (rc < 0)
+            return rc;
+        obj->pool_len++;
+        obj->pool_stats.pairs = obj->pool_len;
+    }
+    pair->in_use = true;
+    pair->last_used = ++obj->pool_clock;
+    obj->pool_stats.in_use++;
+    obj->itexid = pair->itexid;
+    obj->otexid = pair->otexid;
+    obj->tex_width = pair->width;
+    obj->tex_height = pair->height;
+    obj->tex_layers = pair->layers;
+    glBindFramebuffer(GL_FRAMEBUFFER, pair->fbo);
+    return 0;
+}
+
+static void teatime_pool_release(teatime_t *obj, GLuint itexid)
+{
+    uint32_t nfree = 0;
+    for (uint32_t i = 0; i < obj->pool_len; ++i) {
+        if (obj->pool[i].in_use && obj->pool[i].itexid == itexid) {
+            obj->pool[i].in_use = false;
+            obj->pool_stats.in_use--;
+        }
+        if (!obj->pool[i].in_use)
+            nfree++;
+    }
+    /* evict the least recently used free pairs beyond the pool size */
+    while (nfree > obj->pool_size) {
+        uint32_t lru = obj->pool_len;
+        for (uint32_t i = 0; i < obj->pool_len; ++i) {
+            if (!obj->pool[i].in_use && (lru == obj->pool_len ||
+                    obj->pool[i].last_used < obj->pool[lru].last_used))
+                lru = i;
+        }
+        teatime_free_texpair(&(obj->pool[lru]));
+        obj->pool[lru] = obj->pool[--obj->pool_len];
+        obj->pool_stats.evictions++;
+        obj->pool_stats.pairs = obj->pool_len;
+        nfree--;
+    }
+}
+
+/*
+ * Transfers data_len words between the host and the current textures. With
+ * fan-out the words are split into contiguous planes of data_width x
+ * data_height texels, one per layer. For each plane the full rows go in one
+ * call, then the partial last row, then the last texel if it only holds a
+ * single block, which goes through a zero-padded copy.
+ * If buffered is true a pixel buffer object is bound and data is an offset
+ * into it. The buffer is sized in whole texels, so the last texel is
+ * transferred in place.
+ */
+static int teatime_transfer_textures(teatime_t *obj, uint32_t *data, bool upload,
+        bool buffered)
+{
+    int rc = 0;
+    uint32_t texels = obj->data_len / 4;
+    uint32_t tail = obj->data_len % 4;
+    uint32_t plane = obj->data_width * obj->data_height;
+    uint32_t pad[4] = { 0, 0, 0, 0 };
+    int stage = upload ? TEATIME_STAGE_UPLOAD : TEATIME_STAGE_READBACK;
+    uint64_t start = teatime_stats_begin(obj, stage, true);
+    for (uint32_t layer = 0; layer < obj->tex_layers && rc == 0; ++layer) {
+        uint32_t first = layer * plane;
+        uint32_t n = 0, rows = 0, rem = 0;
+        bool has_tail = false;
+        if (first > texels || (first == texels && tail == 0))
+            break;
+        n = (texels - first < plane) ? (texels - first) : plane;
+        has_tail = (tail > 0 && texels - first < plane);
+        rows = n / obj->data_width;
+        rem = n % obj->data_width;
+        {
+            struct {
+                GLint x, y;
+                GLsizei w, h;
+                size_t offset; /* in words */
+            } rects[3] = {
+                { 0, 0, obj->data_width, rows, (size_t)first * 4 },
+                { 0, rows, rem, 1, ((size_t)first + rows * obj->data_width) * 4 },
+                { rem, rows, 1, has_tail ? 1 : 0, (size_t)texels * 4 }
+            };
+            if (has_tail && upload && !buffered)
+                memcpy(pad, data + rects[2].offset, tail * sizeof(uint32_t));
+            if (!upload && obj->tex_layers > 1) {
+                glReadBuffer(GL_COLOR_ATTACHMENT0 + layer);
+                TEATIME_BREAKONERROR(glReadBuffer, rc);
+            }
+            for (int i = 0; i < 3; ++i) {
+                uint32_t *ptr = (uint32_t *)((uintptr_t)data +
+                        rects[i].offset * sizeof(uint32_t));
+                if (rects[i].w == 0 || rects[i].h == 0)
+                    continue;
+                if (i == 2 && !buffered)
+                    ptr = pad;
+                if (upload && obj->tex_layers > 1) {
+                    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, rects[i].x,
+                            rects[i].y, layer, rects[i].w, rects[i].h, 1,
+                            GL_RGBA_INTEGER, GL_UNSIGNED_INT, ptr);
+                    TEATIME_BREAKONERROR(glTexSubImage3D, rc);
+                } else if (upload) {
+                    glTexSubImage2D(GL_TEXTURE_2D, 0, rects[i].x, rects[i].y,
+                            rects[i].w, rects[i].h, GL_RGBA_INTEGER, GL_UNSIGNED_INT,
+                            ptr);
+                    TEATIME_BREAKONERROR(glTexSubImage2D, rc);
+                } else {
+                    glReadPixels(rects[i].x, rects[i].y, rects[i].w, rects[i].h,
+                            GL_RGBA_INTEGER, GL_UNSIGNED_INT, ptr);
+                    TEATIME_BREAKONERROR(glReadPixels, rc);
+                }
+            }
+            if (rc == 0 && has_tail && !upload && !buffered)
+                memcpy(data + rects[2].offset, pad, tail * sizeof(uint32_t));
+        }
+    }
+    teatime_stats_end(obj, stage, start, (uint64_t)obj->data_len * sizeof(uint32_t));
+    return rc;
+}
+
+/*
+ * The compute backend keeps one input and one output storage buffer that
+ * only ever grow, so repeated runs of similar sizes do not reallocate. The
+ * sizes are rounded up to whole texels since each invocation reads a uvec4.
+ */
+static int teatime_ssbo_reserve(teatime_t *obj, uint32_t len)
+{
+    int rc = 0;
+    GLsizeiptr size = (GLsizeiptr)((len + 3) / 4) * 4 * sizeof(uint32_t);
+    if (obj->ssbo_size >= size)
+        return 0;
+    do {
+        if (obj->issbo == 0)
+            glGenBuffers(1, &(obj->issbo));
+        if (obj->ossbo == 0)
+            glGenBuffers(1, &(obj->ossbo));
+        TEATIME_BREAKONERROR(glGenBuffers, rc);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, obj->issbo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STREAM_DRAW);
+        TEATIME_BREAKONERROR(glBufferData, rc);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, obj->ossbo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STREAM_READ);
+        TEATIME_BREAKONERROR(glBufferData, rc);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        obj->ssbo_size = size;
+        teatime_log(TEATIME_LOG_DEBUG, "Allocated storage buffers of %lld bytes\n",
+                (long long)size);
+        rc = 0;
+    } while (0);
+    return rc;
+}
+
+static int teatime_ssbo_upload(teatime_t *obj, GLuint buf, const uint32_t *input,
+        uint32_t len)
+{
+    int rc = 0;
+    uint64_t start = teatime_stats_begin(obj, TEATIME_STAGE_UPLOAD, true);
+    do {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buf);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                (GLsizeiptr)len * sizeof(uint32_t), input);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        TEATIME_BREAKONERROR(glBufferSubData, rc);
+        rc = 0;
+    } while (0);
+    teatime_stats_end(obj, TEATIME_STAGE_UPLOAD, start, (uint64_t)len * sizeof(uint32_t));
+    return rc;
+}
+
+static int teatime_ssbo_read(teatime_t *obj, GLuint buf, uint32_t *output,
+        uint32_t len)
+{
+    int rc = 0;
+    uint64_t start = teatime_stats_begin(obj, TEATIME_STAGE_READBACK, true);
+    do {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buf);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                (GLsizeiptr)len * sizeof(uint32_t), output);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        TEATIME_BREAKONERROR(glGetBufferSubData, rc);
+        rc = 0;
+    } while (0);
+    teatime_stats_end(obj, TEATIME_STAGE_READBACK, start, (uint64_t)len * sizeof(uint32_t));
+    return rc;
+}
 
+/* a NULL input allocates the textures without an upload, for the keystream */
 int teatime_create_textures(teatime_t *obj, const uint32_t *input, uint32_t ilen)
 {
-    if (obj && input && ilen > 0) {
+    if (obj && ilen > 0) {
         int rc = 0;
         do {
-            uint32_t texsz = (uint32_t)((long)(sqrt(ilen / 4.0)));
-            if (texsz != obj->tex_size) {
-                fprintf(stderr, "Viewport texture size(%u) != Input texture size (%u)\n",
-                        obj->tex_size, texsz);
+            if (ilen != obj->data_len) {
+                teatime_log(TEATIME_LOG_ERROR, "Viewport input length(%u) != Input length (%u)\n",
+                        obj->data_len, ilen);
                 rc = -EINVAL;
                 break;
             }
-            glGenTextures(1, &(obj->itexid));
-            glGenTextures(1, &(obj->otexid));
-            fprintf(stderr, "Created input texture with ID: %u\n", obj->itexid);
-            fprintf(stderr, "Created output texture with ID: %u\n", obj->otexid);
-            /** BIND ONE TEXTURE AT A TIME **/
-            /* the texture target can vary depending on GPU */
-            glBindTexture(GL_TEXTURE_2D, obj->itexid);
-            TEATIME_BREAKONERROR(glBindTexture, rc);
-            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-            /* turn off filtering and set proper wrap mode - this is obligatory for
-             * floating point textures */
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-            TEATIME_BREAKONERROR(glTexParameteri, rc);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-            TEATIME_BREAKONERROR(glTexParameteri, rc);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-            TEATIME_BREAKONERROR(glTexParameteri, rc);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-            TEATIME_BREAKONERROR(glTexParameteri, rc);
-            /* create a 2D texture of the same size as the data
-             * internal format: GL_RGBA32UI_EXT
-             * texture format: GL_RGBA_INTEGER
-             * texture type: GL_UNSIGNED_INT
-             */
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32UI_EXT,
-                    texsz, texsz, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, NULL);
-            TEATIME_BREAKONERROR(glTexImage2D, rc);
-            /* transfer data to texture */
-#ifdef WIN32
-            glTexSubImage2D
-#else
-            glTexSubImage2DEXT
-#endif
-                (GL_TEXTURE_2D, 0, 0, 0, obj->tex_size,
-                    obj->tex_size, GL_RGBA_INTEGER, GL_UNSIGNED_INT, input);
-#ifdef WIN32
-            TEATIME_BREAKONERROR(glTexSubImage2D, rc);
-#else
-            TEATIME_BREAKONERROR(glTexSubImage2DEXT, rc);
-#endif
-            fprintf(stderr, "Successfully transferred input data to texture ID: %u\n", obj->itexid);
-            /* BIND the OUTPUT texture and work on it */
-            /* the texture target can vary depending on GPU */
-            glBindTexture(GL_TEXTURE_2D, obj->otexid);
+            /* release any textures the caller did not */
+            teatime_delete_textures(obj);
+            if (obj->backend == TEATIME_BACKEND_CPU) {
+                /* the staging buffer only grows, like the texture pool */
+                if (obj->cpu_size < ilen) {
+                    uint32_t *data = realloc(obj->cpu_data, ilen * sizeof(uint32_t));
+                    if (!data) {
+                        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                                ilen * sizeof(uint32_t));
+                        rc = -ENOMEM;
+                        break;
+                    }
+                    obj->cpu_data = data;
+                    obj->cpu_size = ilen;
+                }
+                if (input) {
+                    uint64_t start = teatime_stats_begin(obj, TEATIME_STAGE_UPLOAD, false);
+                    memcpy(obj->cpu_data, input, ilen * sizeof(uint32_t));
+                    teatime_stats_end(obj, TEATIME_STAGE_UPLOAD, start,
+                            (uint64_t)ilen * sizeof(uint32_t));
+                }
+                obj->data_loaded = true;
+                break;
+            }
+            if (obj->backend == TEATIME_BACKEND_COMPUTE) {
+                rc = teatime_ssbo_reserve(obj, ilen);
+                if (rc < 0)
+                    break;
+                if (input)
+                    rc = teatime_ssbo_upload(obj, obj->issbo, input, ilen);
+                obj->data_loaded = (rc == 0);
+                break;
+            }
+            rc = teatime_pool_acquire(obj, obj->data_width, obj->data_height);
+            if (rc < 0)
+                break;
+            if (!input)
+                break;
+            /* transfer data to the input texture, the rest of the setup was
+             * done when the pair was added to the pool */
+            glBindTexture(TEATIME_TEXTURE_TARGET(obj->tex_layers), obj->itexid);
             TEATIME_BREAKONERROR(glBindTexture, rc);
-            /* turn off filtering and set proper wrap mode - this is obligatory for
-             * floating point textures */
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-            TEATIME_BREAKONERROR(glTexParameteri, rc);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-            TEATIME_BREAKONERROR(glTexParameteri, rc);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-            TEATIME_BREAKONERROR(glTexParameteri, rc);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-            TEATIME_BREAKONERROR(glTexParameteri, rc);
-            /* create a 2D texture of the same size as the data
-             * internal format: GL_RGBA32UI_EXT
-             * texture format: GL_RGBA_INTEGER
-             * texture type: GL_UNSIGNED_INT
-             */
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32UI_EXT,
-                    texsz, texsz, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, NULL);
-            TEATIME_BREAKONERROR(glTexImage2D, rc);
-            /* change tex-env to replace instead of the default modulate */
-            glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-            TEATIME_BREAKONERROR(glTexEnvi, rc);
-            /* attach texture */
-            glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT,
-                    GL_TEXTURE_2D, obj->otexid, 0);
-            TEATIME_BREAKONERROR(glFramebufferTexture2DEXT, rc);
-            TEATIME_BREAKONERROR_FB(glFramebufferTexture2DEXT, rc);
-            glDrawBuffer(GL_COLOR_ATTACHMENT0_EXT);
-            TEATIME_BREAKONERROR(glDrawBuffer, rc);
-            glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT1_EXT,
-                    GL_TEXTURE_2D, obj->otexid, 0);
-            TEATIME_BREAKONERROR(glFramebufferTexture2DEXT, rc);
-            TEATIME_BREAKONERROR_FB(glFramebufferTexture2DEXT, rc);
-            rc = 0;
+            rc = teatime_transfer_textures(obj, (uint32_t *)input, true, false);
         } while (0);
+        TEATIME_CHECK_OPERATION(obj, rc);
         return rc;
     }
     return -EINVAL;
@@ -201,172 +830,3041 @@ int teatime_create_textures(teatime_t *obj, const uint32_t *input, uint32_t ilen
 
 int teatime_read_textures(teatime_t *obj, uint32_t *output, uint32_t olen)
 {
-    if (obj && output && olen > 0 && obj->otexid > 0) {
+    if (obj && output && olen > 0 && (obj->otexid > 0 || obj->data_loaded)) {
         int rc = 0;
         do {
-            uint32_t texsz = (uint32_t)((long)(sqrt(olen / 4.0)));
-            if (texsz != obj->tex_size) {
-                fprintf(stderr, "Viewport texture size(%u) != Input texture size (%u)\n",
-                        obj->tex_size, texsz);
+            if (olen < obj->data_len) {
+                teatime_log(TEATIME_LOG_ERROR, "Output length(%u) < Viewport input length (%u)\n",
+                        olen, obj->data_len);
                 rc = -EINVAL;
                 break;
             }
+            if (obj->backend == TEATIME_BACKEND_CPU) {
+                uint64_t start = teatime_stats_begin(obj, TEATIME_STAGE_READBACK, false);
+                memcpy(output, obj->cpu_data, obj->data_len * sizeof(uint32_t));
+                teatime_stats_end(obj, TEATIME_STAGE_READBACK, start,
+                        (uint64_t)obj->data_len * sizeof(uint32_t));
+                break;
+            }
+            if (obj->backend == TEATIME_BACKEND_COMPUTE) {
+                rc = teatime_ssbo_read(obj, obj->ossbo, output, obj->data_len);
+                break;
+            }
             /* read the texture back */
-            glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
-            TEATIME_BREAKONERROR(glReadBuffer, rc);
-            glReadPixels(0, 0, obj->tex_size, obj->tex_size, GL_RGBA_INTEGER, GL_UNSIGNED_INT, output);
-            TEATIME_BREAKONERROR(glReadPixels, rc);
-            fprintf(stderr, "Successfully read data from the texture\n");
+            rc = teatime_transfer_textures(obj, output, false, false);
         } while (0);
+        TEATIME_CHECK_OPERATION(obj, rc);
         return rc;
     }
     return -EINVAL;
 }
 
-int teatime_create_program(teatime_t *obj, const char *source)
+/* copies a completed chunk out of its pack buffer and frees the slot */
+static int teatime_stream_complete(teatime_t *obj, teatime_stream_slot_t *slot,
+        bool copy)
 {
-    if (obj && source) {
-        int rc = 0;
-        do {
-            obj->program = glCreateProgram();
-            TEATIME_BREAKONERROR(glCreateProgram, rc);
-            obj->shader = glCreateShader(GL_FRAGMENT_SHADER_ARB);
-            TEATIME_BREAKONERROR(glCreateShader, rc);
-            glShaderSource(obj->shader, 1, &source, NULL);
-            TEATIME_BREAKONERROR(glShaderSource, rc);
-            glCompileShader(obj->shader);
-            rc = teatime_check_shader_errors(obj->shader);
-            if (rc < 0) break;
-            TEATIME_BREAKONERROR(glCompileShader, rc);
-            glAttachShader(obj->program, obj->shader);
-            TEATIME_BREAKONERROR(glAttachShader, rc);
-            glLinkProgram(obj->program);
-            rc = teatime_check_program_errors(obj->program);
-            if (rc < 0) break;
-            TEATIME_BREAKONERROR(glLinkProgram, rc);
-            obj->locn_input = glGetUniformLocation(obj->program, "idata");
-            TEATIME_BREAKONERROR(glGetUniformLocation, rc);
-            obj->locn_output = glGetUniformLocation(obj->program, "odata");
-            TEATIME_BREAKONERROR(glGetUniformLocation, rc);
-            obj->locn_key = glGetUniformLocation(obj->program, "ikey");
-            TEATIME_BREAKONERROR(glGetUniformLocation, rc);
-            obj->locn_rounds = glGetUniformLocation(obj->program, "rounds");
-            TEATIME_BREAKONERROR(glGetUniformLocation, rc);
-            rc = 0;
-        } while (0);
-        return rc;
-    }
-    return -EINVAL;
+    int rc = 0;
+    do {
+        if (!slot->pending)
+            break;
+        if (copy) {
+            const void *ptr = NULL;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->dpbo);
+            TEATIME_BREAKONERROR(glBindBuffer, rc);
+            /* this waits only for this chunk, the later ones keep running */
+            ptr = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                    (GLsizeiptr)slot->len * sizeof(uint32_t), GL_MAP_READ_BIT);
+            TEATIME_BREAKONERROR(glMapBufferRange, rc);
+            if (ptr)
+                memcpy(slot->output, ptr, (size_t)slot->len * sizeof(uint32_t));
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            if (!ptr) {
+                teatime_log(TEATIME_LOG_ERROR, "Unable to map pixel pack buffer %u\n",
+                        slot->dpbo);
+                rc = -EIO;
+                break;
+            }
+        }
+        rc = 0;
+    } while (0);
+    if (slot->pending)
+        teatime_pool_release(obj, slot->itexid);
+    slot->itexid = 0;
+    slot->pending = false;
+    return rc;
 }
 
-int teatime_run_program(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds)
+/*
+ * The last ciphertext block of a tile is the IV of the next one. This is
+ * called once the tile has been uploaded, and before its output is written
+ * back over the input.
+ */
+static void teatime_cbc_chain(teatime_t *obj, const uint32_t *input, uint32_t len)
 {
-    if (obj && obj->program > 0) {
-        int rc = 0;
-        do {
-            glUseProgram(obj->program);
-            TEATIME_BREAKONERROR(glUseProgram, rc);
-            glActiveTexture(GL_TEXTURE0);	
-            TEATIME_BREAKONERROR(glActiveTexture, rc);
-            glBindTexture(GL_TEXTURE_2D, obj->itexid);
-            TEATIME_BREAKONERROR(glBindTexture, rc);
-            glUniform1i(obj->locn_input, 0);
-            TEATIME_BREAKONERROR(glUniform1i, rc);
-            glActiveTexture(GL_TEXTURE1);	
-            TEATIME_BREAKONERROR(glActiveTexture, rc);
-            glBindTexture(GL_TEXTURE_2D, obj->otexid);
-            TEATIME_BREAKONERROR(glBindTexture, rc);
-            glUniform1i(obj->locn_output, 1);
-            TEATIME_BREAKONERROR(glUniform1i, rc);
-            glUniform4uiv(obj->locn_key, 1, ikey);
-            TEATIME_BREAKONERROR(glUniform1uiv, rc);
-            glUniform1ui(obj->locn_rounds, rounds);
-            TEATIME_BREAKONERROR(glUniform1ui, rc);
-            glFinish();
-            glPolygonMode(GL_FRONT, GL_FILL);
-            /* render */
-            glBegin(GL_QUADS);
-                glTexCoord2i(0, 0);
-                glVertex2i(0, 0);
-                //glTexCoord2i(obj->tex_size, 0);
-                glTexCoord2i(1, 0);
-                glVertex2i(obj->tex_size, 0);
-                //glTexCoord2i(obj->tex_size, obj->tex_size);
-                glTexCoord2i(1, 1);
-                glVertex2i(obj->tex_size, obj->tex_size);
-                glTexCoord2i(0, 1);
-                //glTexCoord2i(0, obj->tex_size);
-                glVertex2i(0, obj->tex_size);
-            glEnd();
-            glFinish();
-            TEATIME_BREAKONERROR_FB(Rendering, rc);
-            TEATIME_BREAKONERROR(Rendering, rc);
-            rc = 0;
-        } while (0);
-        return rc;
+    if (obj->program_direction == TEATIME_CBC_DECRYPT) {
+        obj->iv[0] = input[len - 2];
+        obj->iv[1] = input[len - 1];
     }
-    return -EINVAL;
 }
 
-void teatime_delete_textures(teatime_t *obj)
+/*
+ * Each chunk goes through a slot of the ring: the input is written into the
+ * slot's unpack buffer and uploaded from it, the chunk is drawn into the
+ * slot's own texture pair and read back into the slot's pack buffer. None of
+ * these wait, so the copy-out of a chunk only happens when its slot comes
+ * around again, by which time the next chunks have already been queued behind
+ * it and the upload, compute and readback of consecutive chunks overlap.
+ */
+static int teatime_run_streaming(teatime_t *obj, const uint32_t ikey[4],
+        uint32_t rounds, const uint32_t *input, uint32_t *output, uint32_t nwords)
 {
-    if (obj) {
-        if (obj->itexid != 0) {
-            glDeleteTextures(1, &(obj->itexid));
-            obj->itexid = 0;
+    int rc = 0;
+    uint64_t tile_words = teatime_tile_words(obj);
+    uint64_t chunk = 0;
+    /* the current pair is owned by the slots from now on */
+    teatime_delete_textures(obj);
+    for (uint64_t off = 0; off < nwords; off += tile_words, ++chunk) {
+        teatime_stream_slot_t *slot = &(obj->slots[chunk % obj->nslots]);
+        uint32_t len = (uint32_t)((nwords - off < tile_words) ?
+                (nwords - off) : tile_words);
+        /* whole texels, so that the tail texel is transferred in place */
+        GLsizeiptr size = (GLsizeiptr)((len + 3) / 4) * 4 * sizeof(uint32_t);
+        void *ptr = NULL;
+        rc = teatime_stream_complete(obj, slot, true);
+        if (rc < 0)
+            break;
+        rc = teatime_set_viewport(obj, len);
+        if (rc < 0)
+            break;
+        /* acquire before binding the unpack buffer since a new pair is
+         * allocated with glTexImage2D() */
+        rc = teatime_pool_acquire(obj, obj->data_width, obj->data_height);
+        if (rc < 0)
+            break;
+        slot->itexid = obj->itexid;
+        slot->output = output + off;
+        slot->len = len;
+        slot->pending = true;
+        if (slot->size < size) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->upbo);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+            TEATIME_BREAKONERROR(glBufferData, rc);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->dpbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+            TEATIME_BREAKONERROR(glBufferData, rc);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            slot->size = size;
         }
-        if (obj->otexid != 0) {
-            glDeleteTextures(1, &(obj->otexid));
-            obj->otexid = 0;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->upbo);
+        TEATIME_BREAKONERROR(glBindBuffer, rc);
+        /* invalidating lets the driver hand out fresh memory instead of
+         * waiting for the previous upload from this buffer */
+        ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        TEATIME_BREAKONERROR(glMapBufferRange, rc);
+        if (!ptr) {
+            teatime_log(TEATIME_LOG_ERROR, "Unable to map pixel unpack buffer %u\n",
+                    slot->upbo);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            rc = -EIO;
+            break;
         }
+        memcpy(ptr, input + off, (size_t)len * sizeof(uint32_t));
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindTexture(TEATIME_TEXTURE_TARGET(obj->tex_layers), obj->itexid);
+        rc = teatime_transfer_textures(obj, NULL, true, true);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (rc < 0)
+            break;
+        rc = teatime_dispatch(obj, ikey, rounds);
+        if (rc < 0)
+            break;
+        teatime_cbc_chain(obj, input + off, len);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->dpbo);
+        rc = teatime_transfer_textures(obj, NULL, false, true);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if (rc < 0)
+            break;
+    }
+    /* drain the ring in submission order */
+    for (uint32_t i = 0; i < obj->nslots; ++i) {
+        teatime_stream_slot_t *slot = &(obj->slots[(chunk + i) % obj->nslots]);
+        int rc2 = teatime_stream_complete(obj, slot, rc == 0);
+        if (rc == 0)
+            rc = rc2;
     }
+    obj->itexid = obj->otexid = 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, obj->ofb);
+    TEATIME_CHECK_OPERATION(obj, rc);
+    return rc;
 }
 
-void teatime_delete_program(teatime_t *obj)
+static teatime_texpair_t *teatime_pool_find(teatime_t *obj, GLuint itexid)
 {
-    if (obj) {
-        if (obj->shader > 0 && obj->program > 0) {
-            glDetachShader(obj->program, obj->shader);
-        }
-        if (obj->shader > 0)
-            glDeleteShader(obj->shader);
-        if (obj->program > 0)
-            glDeleteProgram(obj->program);
-        obj->shader = 0;
-        obj->program = 0;
+    for (uint32_t i = 0; i < obj->pool_len; ++i) {
+        if (obj->pool[i].itexid == itexid)
+            return &(obj->pool[i]);
     }
+    return NULL;
 }
 
-void teatime_print_version(FILE *fp)
+/* copies a signaled tile out and returns its pair to the pool */
+static int teatime_job_tile_complete(teatime_t *obj, teatime_job_tile_t *tile,
+        bool copy)
 {
-    const GLubyte *version = NULL;
-    version = glGetString(GL_VERSION);
-    fprintf(fp, "GL Version: %s\n", (const char *)version);
-    version = glGetString(GL_SHADING_LANGUAGE_VERSION);
-    fprintf(fp, "GLSL Version: %s\n", (const char *)version);
-    version = glGetString(GL_VENDOR);
-    fprintf(fp, "GL Vendor: %s\n", (const char *)version);
+    int rc = 0;
+    teatime_texpair_t *pair = teatime_pool_find(obj, tile->itexid);
+    if (tile->ssbo > 0) {
+        if (copy && tile->len > 0)
+            rc = teatime_ssbo_read(obj, tile->ssbo, tile->output, tile->len);
+    } else if (copy && tile->len > 0 && pair) {
+        const void *ptr = NULL;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pair->pbo);
+        ptr = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                (GLsizeiptr)tile->len * sizeof(uint32_t), GL_MAP_READ_BIT);
+        if (ptr) {
+            memcpy(tile->output, ptr, (size_t)tile->len * sizeof(uint32_t));
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        } else {
+            teatime_log(TEATIME_LOG_ERROR, "Unable to map pixel pack buffer %u\n",
+                    pair->pbo);
+            rc = -EIO;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    if (tile->itexid > 0)
+        teatime_pool_release(obj, tile->itexid);
+    tile->itexid = 0;
+    tile->len = 0;
+    if (tile->fence) {
+        glDeleteSync(tile->fence);
+        tile->fence = NULL;
+    }
+    return rc;
 }
 
-int teatime_check_gl_version(uint32_t *major, uint32_t *minor)
+/* copies the results of a signaled job out and frees its buffers */
+static int teatime_job_complete(teatime_t *obj, teatime_job_t *job, bool copy)
 {
-    const GLubyte *version = NULL;
-    version = glGetString(GL_VERSION);
-    if (version) {
-        uint32_t ver[2] = { 0, 0 };
-        char *endp = NULL;
-        char *endp2 = NULL;
-        errno = 0;
-        ver[0] = strtol((const char *)version, &endp, 10);
-        if (errno == ERANGE || (const void *)endp == (const void *)version) {
-            fprintf(stderr, "Version string %s cannot be parsed\n", (const char *)version);
-            return -1;
-        }
-        /* endp[0] = '.' and endp[1] points to minor */
-        errno = 0;
-        ver[1] = strtol((const char *)&endp[1], &endp2, 10);
+    int rc = 0;
+    for (uint32_t i = 0; i < job->ntiles; ++i) {
+        teatime_job_tile_t *tile = &(job->tiles[i]);
+        int rc2 = teatime_job_tile_complete(obj, tile, copy && rc == 0);
+        if (rc == 0)
+            rc = rc2;
+        if (tile->ssbo > 0)
+            glDeleteBuffers(1, &(tile->ssbo));
+        tile->ssbo = 0;
+    }
+    if (job->fence) {
+        glDeleteSync(job->fence);
+        job->fence = NULL;
+    }
+    job->done = true;
+    return rc;
+}
+
+/* waits for the oldest tile of a job so that its buffers can be reused */
+static int teatime_job_tile_recycle(teatime_t *obj, teatime_job_tile_t *tile)
+{
+    GLenum st = glClientWaitSync(tile->fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+            GL_TIMEOUT_IGNORED);
+    if (st != GL_ALREADY_SIGNALED && st != GL_CONDITION_SATISFIED) {
+        teatime_check_gl_errors(__LINE__, "glClientWaitSync");
+        return -EIO;
+    }
+    return teatime_job_tile_complete(obj, tile, true);
+}
+
+teatime_job_t *teatime_submit(teatime_t *obj, const uint32_t ikey[4],
+        uint32_t rounds, const uint32_t *input, uint32_t *output, uint32_t nwords)
+{
+    teatime_job_t *job = NULL;
+    if (obj && ikey && input && output && nwords > 0 &&
+        TEATIME_HAS_PROGRAM(obj)) {
+        int rc = 0;
+        uint64_t tile_words = teatime_tile_words(obj);
+        uint32_t ntiles = (uint32_t)((nwords + tile_words - 1) / tile_words);
+        uint32_t nslots = (ntiles < TEATIME_JOB_TILES_MAX) ? ntiles :
+            TEATIME_JOB_TILES_MAX;
+        uint32_t t = 0;
+        if (obj->backend == TEATIME_BACKEND_CPU) {
+            /* the threads of the CPU engine are busy with the job anyway,
+             * so it is complete by the time it is returned */
+            job = calloc(1, sizeof(teatime_job_t));
+            if (!job) {
+                teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                        sizeof(teatime_job_t));
+                return NULL;
+            }
+            if (teatime_run_cpu(obj, ikey, rounds, input, output, nwords) < 0) {
+                free(job);
+                return NULL;
+            }
+            job->done = true;
+            return job;
+        }
+        if (!obj->have_sync) {
+            teatime_log(TEATIME_LOG_ERROR, "Asynchronous jobs need OpenGL 3.2 or ARB_sync\n");
+            return NULL;
+        }
+        job = calloc(1, sizeof(teatime_job_t) + nslots * sizeof(teatime_job_tile_t));
+        if (!job) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                    sizeof(teatime_job_t) + nslots * sizeof(teatime_job_tile_t));
+            return NULL;
+        }
+        job->tiles = (teatime_job_tile_t *)(job + 1);
+        /* the pairs are owned by the job until it completes */
+        teatime_delete_textures(obj);
+        for (uint64_t off = 0; off < nwords; off += tile_words, ++t) {
+            teatime_job_tile_t *tile = &(job->tiles[t % nslots]);
+            teatime_texpair_t *pair = NULL;
+            uint32_t len = (uint32_t)((nwords - off < tile_words) ?
+                    (nwords - off) : tile_words);
+            GLsizeiptr size = (GLsizeiptr)((len + 3) / 4) * 4 * sizeof(uint32_t);
+            /* a job keeps at most nslots tiles in flight, so a larger job
+             * blocks here until the oldest one is read back */
+            if (t >= nslots) {
+                rc = teatime_job_tile_recycle(obj, tile);
+                if (rc < 0)
+                    break;
+            } else {
+                job->ntiles++;
+            }
+            rc = teatime_set_viewport(obj, len);
+            if (rc < 0)
+                break;
+            if (obj->backend == TEATIME_BACKEND_COMPUTE) {
+                /* the shared input buffer is reused by the next tile, the
+                 * driver orders the upload after this dispatch */
+                tile->output = output + off;
+                tile->len = len;
+                if (tile->size < size) {
+                    if (tile->ssbo == 0)
+                        glGenBuffers(1, &(tile->ssbo));
+                    glBindBuffer(GL_SHADER_STORAGE_BUFFER, tile->ssbo);
+                    glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STREAM_READ);
+                    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+                    TEATIME_BREAKONERROR(glBufferData, rc);
+                    tile->size = size;
+                }
+                rc = teatime_ssbo_reserve(obj, len);
+                if (rc < 0)
+                    break;
+                rc = teatime_ssbo_upload(obj, obj->issbo, input + off, len);
+                if (rc < 0)
+                    break;
+                rc = teatime_dispatch_compute(obj, obj->issbo, tile->ssbo,
+                        ikey, rounds);
+                if (rc < 0)
+                    break;
+                teatime_cbc_chain(obj, input + off, len);
+            } else {
+                rc = teatime_pool_acquire(obj, obj->data_width, obj->data_height);
+                if (rc < 0)
+                    break;
+                tile->itexid = obj->itexid;
+                tile->output = output + off;
+                tile->len = len;
+                /* the upload copies the input so it can be reused on return */
+                glBindTexture(TEATIME_TEXTURE_TARGET(obj->tex_layers), obj->itexid);
+                rc = teatime_transfer_textures(obj, (uint32_t *)input + off, true, false);
+                if (rc < 0)
+                    break;
+                rc = teatime_dispatch(obj, ikey, rounds);
+                if (rc < 0)
+                    break;
+                teatime_cbc_chain(obj, input + off, len);
+                /* the readback goes into the pair's own pack buffer */
+                pair = teatime_pool_find(obj, obj->itexid);
+                if (pair->pbo_size < size) {
+                    if (pair->pbo == 0)
+                        glGenBuffers(1, &(pair->pbo));
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, pair->pbo);
+                    glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+                    TEATIME_BREAKONERROR(glBufferData, rc);
+                    pair->pbo_size = size;
+                }
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, pair->pbo);
+                rc = teatime_transfer_textures(obj, NULL, false, true);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                if (rc < 0)
+                    break;
+            }
+            /* only the tiles that get recycled need a fence of their own */
+            if (ntiles > nslots) {
+                tile->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                if (!tile->fence) {
+                    teatime_check_gl_errors(__LINE__, "glFenceSync");
+                    rc = -EIO;
+                    break;
+                }
+            }
+        }
+        obj->itexid = obj->otexid = 0;
+        glBindFramebuffer(GL_FRAMEBUFFER, obj->ofb);
+        TEATIME_CHECK_OPERATION(obj, rc);
+        if (rc == 0) {
+            /* one fence covers the tiles in flight since commands complete in order */
+            job->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            if (!job->fence) {
+                teatime_check_gl_errors(__LINE__, "glFenceSync");
+                rc = -EIO;
+            }
+        }
+        if (rc < 0) {
+            teatime_job_complete(obj, job, false);
+            free(job);
+            return NULL;
+        }
+        /* make sure the commands are on their way to the GPU */
+        glFlush();
+    }
+    return job;
+}
+
+int teatime_poll(teatime_t *obj, teatime_job_t *job)
+{
+    return teatime_wait(obj, job, 0);
+}
+
+int teatime_wait(teatime_t *obj, teatime_job_t *job, uint64_t timeout_ns)
+{
+    if (obj && job) {
+        GLenum st;
+        if (job->done)
+            return 1;
+        st = glClientWaitSync(job->fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                (timeout_ns == TEATIME_WAIT_FOREVER) ? GL_TIMEOUT_IGNORED : timeout_ns);
+        switch (st) {
+        case GL_ALREADY_SIGNALED:
+        case GL_CONDITION_SATISFIED:
+            return (teatime_job_complete(obj, job, true) < 0) ? -EIO : 1;
+        case GL_TIMEOUT_EXPIRED:
+            return 0;
+        default:
+            teatime_check_gl_errors(__LINE__, "glClientWaitSync");
+            teatime_job_complete(obj, job, false);
+            return -EIO;
+        }
+    }
+    return -EINVAL;
+}
+
+void teatime_job_release(teatime_t *obj, teatime_job_t *job)
+{
+    if (obj && job) {
+        /* the GPU finishes with the pairs before any later command that
+         * reuses them, so there is no need to wait here */
+        if (!job->done)
+            teatime_job_complete(obj, job, false);
+        free(job);
+    }
+}
+
+/*
+ * A ring gives the caller host pointers into buffers that stay mapped for
+ * their whole life, so the input is written where the GPU reads it and the
+ * output is read where the GPU writes it, without the copies of
+ * teatime_submit(). The mappings are coherent, and a fence per slot tells
+ * when the GPU is done with it. On the compute backend the kernel reads and
+ * writes the slot's buffers directly. The fragment backend uploads from the
+ * input buffer and reads back into the output buffer, both on the GPU.
+ * Slots are handed out in ring order, and a slot released while its run is
+ * in flight is only handed out again once its fence is signaled.
+ */
+static int teatime_ring_slot_wait(teatime_ring_slot_t *slot, uint64_t timeout_ns)
+{
+    GLenum st;
+    if (!slot->fence)
+        return 1;
+    st = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+            (timeout_ns == TEATIME_WAIT_FOREVER) ? GL_TIMEOUT_IGNORED : timeout_ns);
+    switch (st) {
+    case GL_ALREADY_SIGNALED:
+    case GL_CONDITION_SATISFIED:
+        glDeleteSync(slot->fence);
+        slot->fence = NULL;
+        return 1;
+    case GL_TIMEOUT_EXPIRED:
+        return 0;
+    default:
+        teatime_check_gl_errors(__LINE__, "glClientWaitSync");
+        return -EIO;
+    }
+}
+
+static int teatime_ring_map(teatime_ring_slot_t *slot, GLsizeiptr size)
+{
+    int rc = 0;
+    const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT |
+        GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    do {
+        GLuint *bufs[2] = { &(slot->ibuf), &(slot->obuf) };
+        uint32_t **ptrs[2] = { &(slot->input), &(slot->output) };
+        for (int i = 0; i < 2 && rc == 0; ++i) {
+            glGenBuffers(1, bufs[i]);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, *bufs[i]);
+            /* the driver picks memory the GPU can reach and the host can
+             * map for good, there is no glBufferData() later */
+            glBufferStorage(GL_COPY_WRITE_BUFFER, size, NULL, flags);
+            TEATIME_BREAKONERROR(glBufferStorage, rc);
+            *ptrs[i] = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+            TEATIME_BREAKONERROR(glMapBufferRange, rc);
+            if (!*ptrs[i]) {
+                teatime_log(TEATIME_LOG_ERROR, "Unable to map buffer %u\n", *bufs[i]);
+                rc = -EIO;
+            }
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    } while (0);
+    return rc;
+}
+
+teatime_ring_t *teatime_ring_create(teatime_t *obj, uint32_t nslots,
+        uint32_t slot_words)
+{
+    teatime_ring_t *ring = NULL;
+    if (obj && nslots > 0 && slot_words > 0 && (slot_words % 2) == 0) {
+        int rc = 0;
+        /* whole texels, so that the tail texel is transferred in place */
+        GLsizeiptr size = (GLsizeiptr)(((uint64_t)slot_words + 3) / 4) * 4 *
+            sizeof(uint32_t);
+        if (obj->backend != TEATIME_BACKEND_CPU && !obj->have_buffer_storage) {
+            teatime_log(TEATIME_LOG_ERROR, "Mapped rings need OpenGL 4.4 or ARB_buffer_storage\n");
+            return NULL;
+        }
+        if (obj->backend != TEATIME_BACKEND_CPU && !obj->have_sync) {
+            teatime_log(TEATIME_LOG_ERROR, "Mapped rings need OpenGL 3.2 or ARB_sync\n");
+            return NULL;
+        }
+        if ((uint64_t)slot_words > teatime_tile_words(obj)) {
+            teatime_log(TEATIME_LOG_ERROR, "Slot length %u exceeds the max. tile of %llu words\n",
+                    slot_words, (unsigned long long)teatime_tile_words(obj));
+            return NULL;
+        }
+        ring = calloc(1, sizeof(teatime_ring_t) + nslots * sizeof(teatime_ring_slot_t));
+        if (!ring) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                    sizeof(teatime_ring_t) + nslots * sizeof(teatime_ring_slot_t));
+            return NULL;
+        }
+        ring->slots = (teatime_ring_slot_t *)(ring + 1);
+        ring->nslots = nslots;
+        ring->slot_words = slot_words;
+        for (uint32_t i = 0; i < nslots && rc == 0; ++i) {
+            teatime_ring_slot_t *slot = &(ring->slots[i]);
+            if (obj->backend != TEATIME_BACKEND_CPU) {
+                rc = teatime_ring_map(slot, size);
+                continue;
+            }
+            /* the CPU engine works on host memory anyway */
+            slot->input = malloc((size_t)size);
+            slot->output = malloc((size_t)size);
+            if (!slot->input || !slot->output) {
+                teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                        (size_t)size);
+                rc = -ENOMEM;
+            }
+        }
+        TEATIME_CHECK_OPERATION(obj, rc);
+        if (rc < 0) {
+            teatime_ring_destroy(obj, ring);
+            return NULL;
+        }
+        teatime_log(TEATIME_LOG_DEBUG, "Created a ring of %u slots of %u words\n",
+                nslots, slot_words);
+    }
+    return ring;
+}
+
+int teatime_ring_acquire(teatime_t *obj, teatime_ring_t *ring)
+{
+    if (obj && ring) {
+        uint32_t i = ring->next;
+        teatime_ring_slot_t *slot = &(ring->slots[i]);
+        int rc;
+        if (slot->acquired) {
+            teatime_log(TEATIME_LOG_ERROR, "Ring slot %u has not been released\n", i);
+            return -EBUSY;
+        }
+        /* the GPU may still read the input or write the output */
+        rc = teatime_ring_slot_wait(slot, TEATIME_WAIT_FOREVER);
+        if (rc < 0)
+            return rc;
+        slot->acquired = true;
+        slot->submitted = false;
+        slot->len = 0;
+        ring->next = (i + 1) % ring->nslots;
+        return (int)i;
+    }
+    return -EINVAL;
+}
+
+int teatime_ring_submit(teatime_t *obj, teatime_ring_t *ring, uint32_t slot,
+        const uint32_t ikey[4], uint32_t rounds, uint32_t nwords)
+{
+    if (obj && ring && slot < ring->nslots && ikey && nwords > 0 &&
+        nwords <= ring->slot_words && TEATIME_HAS_PROGRAM(obj)) {
+        int rc = 0;
+        teatime_ring_slot_t *s = &(ring->slots[slot]);
+        if (!s->acquired || s->submitted) {
+            teatime_log(TEATIME_LOG_ERROR, "Ring slot %u is not acquired or already submitted\n",
+                    slot);
+            return -EINVAL;
+        }
+        if (obj->backend == TEATIME_BACKEND_CPU) {
+            rc = teatime_run_cpu(obj, ikey, rounds, s->input, s->output, nwords);
+            if (rc == 0) {
+                s->len = nwords;
+                s->submitted = true;
+            }
+            return rc;
+        }
+        if (s->ibuf == 0) {
+            teatime_log(TEATIME_LOG_ERROR, "Ring was created for the CPU backend\n");
+            return -EINVAL;
+        }
+        /* the current pair, if any, is not needed by the run */
+        teatime_delete_textures(obj);
+        do {
+            rc = teatime_set_viewport(obj, nwords);
+            if (rc < 0)
+                break;
+            if (obj->backend == TEATIME_BACKEND_COMPUTE) {
+                rc = teatime_dispatch_compute(obj, s->ibuf, s->obuf, ikey, rounds);
+                if (rc < 0)
+                    break;
+                teatime_cbc_chain(obj, s->input, nwords);
+                /* shader writes only reach a mapping after this barrier */
+                glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+                TEATIME_BREAKONERROR(glMemoryBarrier, rc);
+                break;
+            }
+            rc = teatime_pool_acquire(obj, obj->data_width, obj->data_height);
+            if (rc < 0)
+                break;
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s->ibuf);
+            glBindTexture(TEATIME_TEXTURE_TARGET(obj->tex_layers), obj->itexid);
+            rc = teatime_transfer_textures(obj, NULL, true, true);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            if (rc < 0)
+                break;
+            rc = teatime_dispatch(obj, ikey, rounds);
+            if (rc < 0)
+                break;
+            teatime_cbc_chain(obj, s->input, nwords);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, s->obuf);
+            rc = teatime_transfer_textures(obj, NULL, false, true);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        } while (0);
+        /* the pair goes back to the pool right away since the readback went
+         * into the slot, and a later user of the pair is ordered after it */
+        teatime_delete_textures(obj);
+        TEATIME_CHECK_OPERATION(obj, rc);
+        if (rc == 0) {
+            s->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            if (!s->fence) {
+                teatime_check_gl_errors(__LINE__, "glFenceSync");
+                rc = -EIO;
+            }
+        }
+        if (rc < 0)
+            return rc;
+        s->len = nwords;
+        s->submitted = true;
+        /* make sure the commands are on their way to the GPU */
+        glFlush();
+        return 0;
+    }
+    return -EINVAL;
+}
+
+int teatime_ring_wait(teatime_t *obj, teatime_ring_t *ring, uint32_t slot,
+        uint64_t timeout_ns)
+{
+    if (obj && ring && slot < ring->nslots && ring->slots[slot].submitted)
+        return teatime_ring_slot_wait(&(ring->slots[slot]), timeout_ns);
+    return -EINVAL;
+}
+
+int teatime_ring_release(teatime_t *obj, teatime_ring_t *ring, uint32_t slot)
+{
+    if (obj && ring && slot < ring->nslots && ring->slots[slot].acquired) {
+        /* the fence, if still pending, is waited for on the next acquire */
+        ring->slots[slot].acquired = false;
+        ring->slots[slot].submitted = false;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+void teatime_ring_destroy(teatime_t *obj, teatime_ring_t *ring)
+{
+    if (obj && ring) {
+        for (uint32_t i = 0; i < ring->nslots; ++i) {
+            teatime_ring_slot_t *slot = &(ring->slots[i]);
+            /* deleting a buffer the GPU still uses is deferred by GL, and
+             * unmaps it */
+            if (slot->fence)
+                glDeleteSync(slot->fence);
+            if (slot->ibuf > 0)
+                glDeleteBuffers(1, &(slot->ibuf));
+            if (slot->obuf > 0)
+                glDeleteBuffers(1, &(slot->obuf));
+            if (slot->ibuf == 0) {
+                free(slot->input);
+                free(slot->output);
+            }
+        }
+        free(ring);
+    }
+}
+
+/*
+ * Swaps the roles of the current input and output textures so that the
+ * output of the last draw becomes the input of the next one. Only the color
+ * attachments of the pair's framebuffer change.
+ */
+static int teatime_swap_textures(teatime_t *obj)
+{
+    int rc = 0;
+    teatime_texpair_t *pair = teatime_pool_find(obj, obj->itexid);
+    GLuint texid = obj->itexid;
+    if (!pair)
+        return -EINVAL;
+    do {
+        obj->itexid = pair->itexid = obj->otexid;
+        obj->otexid = pair->otexid = texid;
+        rc = teatime_attach_output(obj->otexid, pair->layers);
+        if (rc < 0)
+            break;
+        rc = 0;
+    } while (0);
+    return rc;
+}
+
+/* makes the buffer's pair the current textures */
+static int teatime_buffer_bind(teatime_t *obj, teatime_buffer_t *buf)
+{
+    teatime_texpair_t *pair = teatime_pool_find(obj, buf->itexid);
+    if (!pair)
+        return -EINVAL;
+    if (obj->itexid != buf->itexid)
+        teatime_delete_textures(obj);
+    obj->itexid = pair->itexid;
+    obj->otexid = pair->otexid;
+    obj->tex_width = pair->width;
+    obj->tex_height = pair->height;
+    obj->tex_layers = pair->layers;
+    glBindFramebuffer(GL_FRAMEBUFFER, pair->fbo);
+    teatime_apply_viewport(obj, buf->data_width, buf->data_height, buf->len);
+    return 0;
+}
+
+/* the pair stays with the buffer and not the object */
+static void teatime_buffer_unbind(teatime_t *obj, teatime_buffer_t *buf)
+{
+    buf->itexid = obj->itexid;
+    obj->itexid = obj->otexid = 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, obj->ofb);
+}
+
+teatime_buffer_t *teatime_buffer_create(teatime_t *obj, const uint32_t *input,
+        uint32_t nwords)
+{
+    teatime_buffer_t *buf = NULL;
+    if (obj && input && nwords > 0) {
+        int rc = 0;
+        buf = calloc(1, sizeof(teatime_buffer_t));
+        if (!buf) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                    sizeof(teatime_buffer_t));
+            return NULL;
+        }
+        do {
+            rc = teatime_set_viewport(obj, nwords);
+            if (rc < 0)
+                break;
+            if (obj->backend == TEATIME_BACKEND_CPU) {
+                buf->data = malloc(nwords * sizeof(uint32_t));
+                if (!buf->data) {
+                    teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                            nwords * sizeof(uint32_t));
+                    rc = -ENOMEM;
+                    break;
+                }
+                memcpy(buf->data, input, nwords * sizeof(uint32_t));
+                buf->data_width = obj->data_width;
+                buf->data_height = obj->data_height;
+                buf->len = nwords;
+                break;
+            }
+            if (obj->backend == TEATIME_BACKEND_COMPUTE) {
+                /* the buffer owns both storage buffers and ping-pongs
+                 * between them */
+                GLsizeiptr size = (GLsizeiptr)obj->data_width * 4 * sizeof(uint32_t);
+                buf->data_width = obj->data_width;
+                buf->data_height = obj->data_height;
+                buf->len = nwords;
+                buf->in_output = false;
+                glGenBuffers(2, buf->ssbo);
+                for (int i = 0; i < 2; ++i) {
+                    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buf->ssbo[i]);
+                    glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_DYNAMIC_COPY);
+                }
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+                TEATIME_BREAKONERROR(glBufferData, rc);
+                rc = teatime_ssbo_upload(obj, buf->ssbo[0], input, nwords);
+                break;
+            }
+            rc = teatime_create_textures(obj, input, nwords);
+            if (rc < 0)
+                break;
+            buf->data_width = obj->data_width;
+            buf->data_height = obj->data_height;
+            buf->len = nwords;
+            buf->in_output = false;
+            teatime_buffer_unbind(obj, buf);
+        } while (0);
+        TEATIME_CHECK_OPERATION(obj, rc);
+        if (rc < 0) {
+            teatime_delete_textures(obj);
+            if (buf->ssbo[0] > 0)
+                glDeleteBuffers(2, buf->ssbo);
+            free(buf->data);
+            free(buf);
+            buf = NULL;
+        }
+    }
+    return buf;
+}
+
+int teatime_buffer_run(teatime_t *obj, teatime_buffer_t *buf,
+        const uint32_t ikey[4], uint32_t rounds)
+{
+    if (obj && buf && ikey && TEATIME_HAS_PROGRAM(obj)) {
+        int rc = 0;
+        if (buf->data)
+            return teatime_run_cpu(obj, ikey, rounds, buf->data, buf->data, buf->len);
+        if (buf->ssbo[0] > 0) {
+            obj->data_width = buf->data_width;
+            obj->data_height = buf->data_height;
+            obj->data_len = buf->len;
+            rc = teatime_dispatch_compute(obj, buf->ssbo[buf->in_output ? 1 : 0],
+                    buf->ssbo[buf->in_output ? 0 : 1], ikey, rounds);
+            if (rc == 0)
+                buf->in_output = !buf->in_output;
+            return rc;
+        }
+        do {
+            rc = teatime_buffer_bind(obj, buf);
+            if (rc < 0)
+                break;
+            /* the result of the last run is the input of this one */
+            if (buf->in_output) {
+                rc = teatime_swap_textures(obj);
+                if (rc < 0)
+                    break;
+                buf->in_output = false;
+            }
+            rc = teatime_dispatch(obj, ikey, rounds);
+            if (rc < 0)
+                break;
+            buf->in_output = true;
+        } while (0);
+        TEATIME_CHECK_OPERATION(obj, rc);
+        teatime_buffer_unbind(obj, buf);
+        return rc;
+    }
+    return -EINVAL;
+}
+
+int teatime_buffer_read(teatime_t *obj, teatime_buffer_t *buf, uint32_t *output,
+        uint32_t olen)
+{
+    if (obj && buf && output && olen >= buf->len) {
+        int rc = 0;
+        if (buf->data) {
+            memcpy(output, buf->data, buf->len * sizeof(uint32_t));
+            return 0;
+        }
+        if (buf->ssbo[0] > 0)
+            return teatime_ssbo_read(obj, buf->ssbo[buf->in_output ? 1 : 0], output,
+                    buf->len);
+        do {
+            rc = teatime_buffer_bind(obj, buf);
+            if (rc < 0)
+                break;
+            /* only the output texture is attached for reading */
+            if (!buf->in_output) {
+                rc = teatime_swap_textures(obj);
+                if (rc < 0)
+                    break;
+                buf->in_output = true;
+            }
+            rc = teatime_transfer_textures(obj, output, false, false);
+        } while (0);
+        TEATIME_CHECK_OPERATION(obj, rc);
+        teatime_buffer_unbind(obj, buf);
+        return rc;
+    }
+    return -EINVAL;
+}
+
+void teatime_buffer_release(teatime_t *obj, teatime_buffer_t *buf)
+{
+    if (obj && buf) {
+        if (buf->ssbo[0] > 0)
+            glDeleteBuffers(2, buf->ssbo);
+        else if (!buf->data)
+            teatime_pool_release(obj, buf->itexid);
+        free(buf->data);
+        free(buf);
+    }
+}
+
+int teatime_set_streaming(teatime_t *obj, uint32_t nslots)
+{
+    if (obj && (nslots == 0 || (nslots >= 2 && nslots <= TEATIME_STREAM_SLOTS_MAX))) {
+        teatime_stream_slot_t *slots = NULL;
+        int rc = 0;
+        if (nslots > 0) {
+            slots = calloc(nslots, sizeof(teatime_stream_slot_t));
+            if (!slots) {
+                teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                        nslots * sizeof(teatime_stream_slot_t));
+                return -ENOMEM;
+            }
+            for (uint32_t i = 0; i < nslots; ++i) {
+                glGenBuffers(1, &(slots[i].upbo));
+                glGenBuffers(1, &(slots[i].dpbo));
+            }
+            if ((rc = teatime_check_gl_errors(__LINE__, "glGenBuffers")) < 0)
+                nslots = 0;
+        }
+        /* release the old ring */
+        for (uint32_t i = 0; i < obj->nslots; ++i) {
+            teatime_stream_complete(obj, &(obj->slots[i]), false);
+            glDeleteBuffers(1, &(obj->slots[i].upbo));
+            glDeleteBuffers(1, &(obj->slots[i].dpbo));
+        }
+        free(obj->slots);
+        obj->slots = slots;
+        obj->nslots = nslots;
+        if (rc == 0 && nslots > 0)
+            teatime_log(TEATIME_LOG_INFO, "Streaming with %u pixel buffer slots\n", nslots);
+        return rc;
+    } else if (obj) {
+        teatime_log(TEATIME_LOG_ERROR, "No. of streaming slots must be 0 or 2 to %d. Requested: %u\n",
+                TEATIME_STREAM_SLOTS_MAX, nslots);
+    }
+    return -EINVAL;
+}
+
+static int teatime_run_gpu(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds,
+        const uint32_t *input, uint32_t *output, uint32_t nwords)
+{
+    int rc = 0;
+    do {
+        /* storage buffers need no texture layout, so the compute
+         * backend does not use the pixel buffer ring */
+        if (obj->nslots > 0 && obj->backend == TEATIME_BACKEND_FRAGMENT && input)
+            return teatime_run_streaming(obj, ikey, rounds, input, output, nwords);
+        /* inputs larger than a tile are dispatched one tile after another */
+        uint64_t tile_words = teatime_tile_words(obj);
+        for (uint64_t off = 0; off < nwords; off += tile_words) {
+            uint32_t len = (uint32_t)((nwords - off < tile_words) ?
+                    (nwords - off) : tile_words);
+            rc = teatime_set_viewport(obj, len);
+            if (rc < 0)
+                break;
+            rc = teatime_create_textures(obj, input ? (input + off) : NULL, len);
+            if (rc < 0)
+                break;
+            rc = teatime_run_program(obj, ikey, rounds);
+            if (rc < 0)
+                break;
+            if (input)
+                teatime_cbc_chain(obj, input + off, len);
+            rc = teatime_read_textures(obj, output + off, len);
+            if (rc < 0)
+                break;
+        }
+        teatime_delete_textures(obj);
+    } while (0);
+    return rc;
+}
+
+/* a moving average so that the split follows the recent throughput */
+static void teatime_update_rate(double *rate, uint32_t nwords, uint64_t elapsed_ns)
+{
+    double latest;
+    if (elapsed_ns == 0)
+        return;
+    latest = (double)nwords * 1e9 / (double)elapsed_ns;
+    if (*rate > 0)
+        *rate = (1.0 - TEATIME_HYBRID_WEIGHT) * (*rate) + TEATIME_HYBRID_WEIGHT * latest;
+    else
+        *rate = latest;
+}
+
+/*
+ * Splits a run between the GPU and the CPU engine in proportion to their
+ * recent throughput so that both finish at about the same time. The CPU part
+ * is started first and runs on the pool while this thread drives the GPU.
+ * Small inputs do not amortize the texture setup, upload and readback, so
+ * they go to the CPU only.
+ */
+static int teatime_run_hybrid(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds,
+        const uint32_t *input, uint32_t *output, uint32_t nwords)
+{
+    int rc = 0;
+    do {
+        uint64_t start_ns = teatime_clock_ns(), gpu_ns = 0, cpu_ns = 0;
+        double share = 0.5;
+        uint32_t cpu_words, gpu_words;
+        if (nwords < obj->hybrid_crossover) {
+            rc = teatime_run_cpu(obj, ikey, rounds, input, output, nwords);
+            if (rc == 0)
+                teatime_update_rate(&(obj->cpu_rate), nwords,
+                        teatime_clock_ns() - start_ns);
+            break;
+        }
+        rc = teatime_check_program(obj, rounds);
+        if (rc < 0)
+            break;
+        /* an even split until both sides have been measured */
+        if (obj->gpu_rate > 0 && obj->cpu_rate > 0)
+            share = obj->cpu_rate / (obj->cpu_rate + obj->gpu_rate);
+        rc = teatime_check_length(obj, nwords);
+        if (rc < 0)
+            break;
+        cpu_words = (uint32_t)((double)nwords * share);
+        cpu_words -= cpu_words % obj->program_block_words;
+        gpu_words = nwords - cpu_words;
+        teatime_cpu_set_algorithm(obj->cpu, obj->program_algorithm,
+                obj->program_block_words);
+        if (cpu_words > 0) {
+            /* the CPU part starts after the last block of the GPU part */
+            if (gpu_words > 0 && input)
+                teatime_cpu_set_iv(obj->cpu, input + gpu_words - 2);
+            else
+                teatime_cpu_set_iv(obj->cpu, obj->iv);
+            teatime_cpu_set_counter(obj->cpu, obj->counter + gpu_words / 2);
+            rc = teatime_cpu_start(obj->cpu, obj->program_direction, ikey, rounds,
+                    input ? (input + gpu_words) : NULL, output + gpu_words,
+                    cpu_words);
+            if (rc < 0)
+                break;
+        }
+        if (gpu_words > 0) {
+            start_ns = teatime_clock_ns();
+            rc = teatime_run_gpu(obj, ikey, rounds, input, output, gpu_words);
+            gpu_ns = teatime_clock_ns() - start_ns;
+        }
+        /* the CPU part has to be finished even if the GPU part failed */
+        if (cpu_words > 0)
+            teatime_cpu_finish(obj->cpu, &cpu_ns);
+        if (rc < 0)
+            break;
+        /* the GPU dispatches only advanced the counter past their part */
+        if (TEATIME_IS_CTR(obj->program_direction))
+            obj->counter += cpu_words / 2;
+        if (cpu_words > 0 && obj->program_direction == TEATIME_CBC_DECRYPT)
+            teatime_cpu_get_iv(obj->cpu, obj->iv);
+        if (gpu_words > 0)
+            teatime_update_rate(&(obj->gpu_rate), gpu_words, gpu_ns);
+        if (cpu_words > 0)
+            teatime_update_rate(&(obj->cpu_rate), cpu_words, cpu_ns);
+        teatime_log(TEATIME_LOG_DEBUG, "Hybrid run of %u words: %u on the GPU, %u on the CPU\n",
+                nwords, gpu_words, cpu_words);
+    } while (0);
+    return rc;
+}
+
+int teatime_run(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds,
+        const uint32_t *input, uint32_t *output, uint32_t nwords)
+{
+    if (obj && ikey && (input || obj->program_direction == TEATIME_KEYSTREAM) &&
+        output && nwords > 0 && TEATIME_HAS_PROGRAM(obj)) {
+        if (obj->backend == TEATIME_BACKEND_CPU)
+            return teatime_run_cpu(obj, ikey, rounds, input, output, nwords);
+        /* the CPU can only share the built-in kernels */
+        if (obj->hybrid && obj->program_direction >= 0)
+            return teatime_run_hybrid(obj, ikey, rounds, input, output, nwords);
+        return teatime_run_gpu(obj, ikey, rounds, input, output, nwords);
+    }
+    return -EINVAL;
+}
+
+int teatime_set_counter(teatime_t *obj, uint64_t counter)
+{
+    if (obj) {
+        obj->counter = counter;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+int teatime_set_iv(teatime_t *obj, const uint32_t iv[2])
+{
+    if (obj && iv) {
+        obj->iv[0] = iv[0];
+        obj->iv[1] = iv[1];
+        return 0;
+    }
+    return -EINVAL;
+}
+
+/* as many whole streams per dispatch as fit in a storage block */
+static int teatime_cbc_encrypt_compute(teatime_t *obj, const uint32_t ikey[4],
+        uint32_t rounds, const uint32_t *ivs, const uint32_t *input,
+        uint32_t *output, uint32_t nstreams, uint32_t stream_words)
+{
+    int rc = 0;
+    GLuint ivbuf = 0;
+    uint64_t per_tile = obj->ssbo_words / stream_words;
+    if (per_tile == 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Stream length %u exceeds the max. storage block of "
+                "%llu words\n", stream_words, (unsigned long long)obj->ssbo_words);
+        return -E2BIG;
+    }
+    if (per_tile > nstreams)
+        per_tile = nstreams;
+    do {
+        glGenBuffers(1, &ivbuf);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ivbuf);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                (GLsizeiptr)per_tile * 2 * sizeof(uint32_t), NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        TEATIME_BREAKONERROR(glBufferData, rc);
+        glUseProgram(obj->program);
+        TEATIME_BREAKONERROR(glUseProgram, rc);
+        glUniform4uiv(obj->locn_key, 1, ikey);
+        TEATIME_BREAKONERROR(glUniform4uiv, rc);
+        glUniform1ui(obj->locn_rounds, rounds);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        glUniform1ui(obj->locn_width, stream_words / 4);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        for (uint32_t first = 0; first < nstreams; first += (uint32_t)per_tile) {
+            uint32_t n = (nstreams - first < per_tile) ? (nstreams - first) :
+                (uint32_t)per_tile;
+            uint32_t len = n * stream_words;
+            size_t off = (size_t)first * stream_words;
+            GLuint groups_x, groups_y;
+            uint64_t start = 0;
+            rc = teatime_ssbo_reserve(obj, len);
+            if (rc < 0)
+                break;
+            rc = teatime_ssbo_upload(obj, obj->issbo, input + off, len);
+            if (rc < 0)
+                break;
+            rc = teatime_ssbo_upload(obj, ivbuf, ivs + 2 * (size_t)first, 2 * n);
+            if (rc < 0)
+                break;
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, obj->issbo);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, obj->ossbo);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ivbuf);
+            TEATIME_BREAKONERROR(glBindBufferBase, rc);
+            glUniform1ui(obj->locn_count, n);
+            TEATIME_BREAKONERROR(glUniform1ui, rc);
+            teatime_compute_groups(obj, n, &groups_x, &groups_y);
+            start = teatime_stats_begin(obj, TEATIME_STAGE_DRAW, true);
+            glDispatchCompute(groups_x, groups_y, 1);
+            teatime_stats_end(obj, TEATIME_STAGE_DRAW, start,
+                    (uint64_t)len * sizeof(uint32_t));
+            TEATIME_BREAKONERROR(glDispatchCompute, rc);
+            glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+            TEATIME_BREAKONERROR(glMemoryBarrier, rc);
+            rc = teatime_ssbo_read(obj, obj->ossbo, output + off, len);
+            if (rc < 0)
+                break;
+        }
+    } while (0);
+    TEATIME_CHECK_OPERATION(obj, rc);
+    if (ivbuf > 0)
+        glDeleteBuffers(1, &ivbuf);
+    return rc;
+}
+
+/* one stream per texel row and one draw per column of texels */
+static int teatime_cbc_encrypt_fragment(teatime_t *obj, const uint32_t ikey[4],
+        uint32_t rounds, const uint32_t *ivs, const uint32_t *input,
+        uint32_t *output, uint32_t nstreams, uint32_t stream_words)
+{
+    int rc = 0;
+    GLuint ivtex = 0;
+    GLuint width = stream_words / 4;
+    uint32_t per_tile = (nstreams < obj->tile_height) ? nstreams : obj->tile_height;
+    if (!obj->have_barrier) {
+        teatime_log(TEATIME_LOG_ERROR, "CBC encryption on the fragment backend needs OpenGL 4.5 "
+                "or ARB_texture_barrier\n");
+        return -ENOTSUP;
+    }
+    if (width > obj->tile_width) {
+        teatime_log(TEATIME_LOG_ERROR, "Stream length %u exceeds the tile width of %u texels\n",
+                stream_words, obj->tile_width);
+        return -E2BIG;
+    }
+    teatime_delete_textures(obj);
+    do {
+        /* the IVs go in a one texel wide texture, one row per stream */
+        glGenTextures(1, &ivtex);
+        glBindTexture(GL_TEXTURE_2D, ivtex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, 1, per_tile, 0, GL_RG_INTEGER,
+                GL_UNSIGNED_INT, NULL);
+        TEATIME_BREAKONERROR(glTexImage2D, rc);
+        for (uint32_t first = 0; first < nstreams; first += per_tile) {
+            uint32_t n = (nstreams - first < per_tile) ? (nstreams - first) : per_tile;
+            uint32_t len = n * stream_words;
+            size_t off = (size_t)first * stream_words;
+            uint64_t start = 0;
+            teatime_apply_viewport(obj, width, n, len);
+            rc = teatime_pool_acquire(obj, width, n);
+            if (rc < 0)
+                break;
+            glBindTexture(GL_TEXTURE_2D, obj->itexid);
+            rc = teatime_transfer_textures(obj, (uint32_t *)input + off, true, false);
+            if (rc < 0)
+                break;
+            glBindTexture(GL_TEXTURE_2D, ivtex);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 1, n, GL_RG_INTEGER,
+                    GL_UNSIGNED_INT, ivs + 2 * (size_t)first);
+            TEATIME_BREAKONERROR(glTexSubImage2D, rc);
+            glUseProgram(obj->program);
+            TEATIME_BREAKONERROR(glUseProgram, rc);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, obj->itexid);
+            glUniform1i(obj->locn_input, 0);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, obj->otexid);
+            glUniform1i(obj->locn_chain, 1);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, ivtex);
+            glUniform1i(obj->locn_ivs, 2);
+            glActiveTexture(GL_TEXTURE0);
+            TEATIME_BREAKONERROR(glBindTexture, rc);
+            glUniform4uiv(obj->locn_key, 1, ikey);
+            TEATIME_BREAKONERROR(glUniform4uiv, rc);
+            glUniform1ui(obj->locn_rounds, rounds);
+            TEATIME_BREAKONERROR(glUniform1ui, rc);
+            start = teatime_stats_begin(obj, TEATIME_STAGE_DRAW, true);
+            for (GLuint col = 0; col < width; ++col) {
+                /* the previous column is read from the texture being
+                 * rendered to, so its writes have to land first */
+                if (col > 0)
+                    glTextureBarrier();
+                /* gl_FragCoord is in window coordinates, so narrowing the
+                 * viewport to the column keeps the kernel unchanged */
+                glViewport(col, 0, 1, n);
+                teatime_draw(obj);
+            }
+            glViewport(0, 0, width, n);
+            teatime_stats_end(obj, TEATIME_STAGE_DRAW, start,
+                    (uint64_t)len * sizeof(uint32_t));
+            TEATIME_BREAKONERROR_FB(Rendering, rc);
+            TEATIME_BREAKONERROR(Rendering, rc);
+            rc = teatime_transfer_textures(obj, output + off, false, false);
+            if (rc < 0)
+                break;
+            teatime_delete_textures(obj);
+        }
+    } while (0);
+    TEATIME_CHECK_OPERATION(obj, rc);
+    teatime_delete_textures(obj);
+    if (ivtex > 0)
+        glDeleteTextures(1, &ivtex);
+    return rc;
+}
+
+int teatime_cbc_encrypt(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds,
+        const uint32_t *ivs, const uint32_t *input, uint32_t *output,
+        uint32_t nstreams, uint32_t stream_words)
+{
+    if (obj && ikey && ivs && input && output && nstreams > 0 &&
+        stream_words > 0 && (stream_words % 4) == 0 &&
+        (uint64_t)nstreams * stream_words <= UINT32_MAX &&
+        obj->program_direction == TEATIME_CBC_ENCRYPT) {
+        int rc = teatime_check_rounds(obj, rounds);
+        if (rc < 0)
+            return rc;
+        if (obj->backend == TEATIME_BACKEND_CPU) {
+            teatime_cpu_set_algorithm(obj->cpu, obj->program_algorithm,
+                    obj->program_block_words);
+            return teatime_cpu_cbc_encrypt(obj->cpu, ikey, rounds, ivs, input,
+                    output, nstreams, stream_words);
+        }
+        if (obj->backend == TEATIME_BACKEND_COMPUTE)
+            return teatime_cbc_encrypt_compute(obj, ikey, rounds, ivs, input,
+                    output, nstreams, stream_words);
+        return teatime_cbc_encrypt_fragment(obj, ikey, rounds, ivs, input,
+                output, nstreams, stream_words);
+    } else if (obj && (stream_words % 4) != 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Stream length %u is not a whole no. of texels of 4 "
+                "words\n", stream_words);
+    } else if (obj && obj->program_direction != TEATIME_CBC_ENCRYPT) {
+        teatime_log(TEATIME_LOG_ERROR, "Use teatime_load_program() with TEATIME_CBC_ENCRYPT first\n");
+    }
+    return -EINVAL;
+}
+
+static int teatime_run_batch_compute(teatime_t *obj, const uint32_t *keys,
+        uint32_t nkeys, uint32_t rounds, const uint32_t *key_index,
+        const uint32_t *input, uint32_t *output, uint32_t nsegments,
+        uint32_t segment_words)
+{
+    int rc = 0;
+    GLuint kbuf[2] = { 0, 0 };
+    uint64_t per_tile = obj->ssbo_words / segment_words;
+    if (per_tile == 0 || (uint64_t)nkeys * 4 > obj->ssbo_words) {
+        teatime_log(TEATIME_LOG_ERROR, "Segment length %u or %u keys exceed the max. storage "
+                "block of %llu words\n", segment_words, nkeys,
+                (unsigned long long)obj->ssbo_words);
+        return -E2BIG;
+    }
+    if (per_tile > nsegments)
+        per_tile = nsegments;
+    do {
+        /* all the keys, and the key indices of a tile */
+        glGenBuffers(2, kbuf);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, kbuf[0]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                (GLsizeiptr)nkeys * 4 * sizeof(uint32_t), keys, GL_STATIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, kbuf[1]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                (GLsizeiptr)per_tile * sizeof(uint32_t), NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        TEATIME_BREAKONERROR(glBufferData, rc);
+        glUseProgram(obj->program);
+        TEATIME_BREAKONERROR(glUseProgram, rc);
+        glUniform1ui(obj->locn_rounds, rounds);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        glUniform1ui(obj->locn_width, segment_words / 4);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        for (uint32_t first = 0; first < nsegments; first += (uint32_t)per_tile) {
+            uint32_t n = (nsegments - first < per_tile) ? (nsegments - first) :
+                (uint32_t)per_tile;
+            uint32_t len = n * segment_words;
+            size_t off = (size_t)first * segment_words;
+            GLuint groups_x, groups_y;
+            uint64_t start = 0;
+            rc = teatime_ssbo_reserve(obj, len);
+            if (rc < 0)
+                break;
+            rc = teatime_ssbo_upload(obj, obj->issbo, input + off, len);
+            if (rc < 0)
+                break;
+            rc = teatime_ssbo_upload(obj, kbuf[1], key_index + first, n);
+            if (rc < 0)
+                break;
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, obj->issbo);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, obj->ossbo);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, kbuf[0]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, kbuf[1]);
+            TEATIME_BREAKONERROR(glBindBufferBase, rc);
+            glUniform1ui(obj->locn_count, len / 4);
+            TEATIME_BREAKONERROR(glUniform1ui, rc);
+            teatime_compute_groups(obj, len / 4, &groups_x, &groups_y);
+            start = teatime_stats_begin(obj, TEATIME_STAGE_DRAW, true);
+            glDispatchCompute(groups_x, groups_y, 1);
+            teatime_stats_end(obj, TEATIME_STAGE_DRAW, start,
+                    (uint64_t)len * sizeof(uint32_t));
+            TEATIME_BREAKONERROR(glDispatchCompute, rc);
+            glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+            TEATIME_BREAKONERROR(glMemoryBarrier, rc);
+            rc = teatime_ssbo_read(obj, obj->ossbo, output + off, len);
+            if (rc < 0)
+                break;
+        }
+    } while (0);
+    TEATIME_CHECK_OPERATION(obj, rc);
+    if (kbuf[0] > 0 || kbuf[1] > 0)
+        glDeleteBuffers(2, kbuf);
+    return rc;
+}
+
+static int teatime_run_batch_fragment(teatime_t *obj, const uint32_t *keys,
+        uint32_t nkeys, uint32_t rounds, const uint32_t *key_index,
+        const uint32_t *input, uint32_t *output, uint32_t nsegments,
+        uint32_t segment_words)
+{
+    int rc = 0;
+    GLuint ktex = 0, kitex = 0;
+    GLuint width = segment_words / 4;
+    GLuint kwidth = (nkeys < (uint32_t)obj->maxtexsz) ? nkeys : (GLuint)obj->maxtexsz;
+    GLuint kheight = (nkeys + kwidth - 1) / kwidth;
+    /* segments are packed side by side in rows of whole segments */
+    uint32_t per_row = (width > 0) ? obj->tile_width / width : 0;
+    uint32_t per_tile = 0;
+    if (per_row > nsegments)
+        per_row = nsegments;
+    per_tile = per_row * obj->tile_height;
+    if (per_tile > nsegments)
+        per_tile = nsegments;
+    if (width > obj->tile_width) {
+        teatime_log(TEATIME_LOG_ERROR, "Segment length %u exceeds the tile width of %u texels\n",
+                segment_words, obj->tile_width);
+        return -E2BIG;
+    }
+    if (kheight > (GLuint)obj->maxtexsz) {
+        teatime_log(TEATIME_LOG_ERROR, "%u keys exceed the max. texture size of %d\n",
+                nkeys,
+                obj->maxtexsz);
+        return -E2BIG;
+    }
+    teatime_delete_textures(obj);
+    do {
+        /* the keys fill the rows of a texture, and the key indices go in a
+         * texture of per_row texels per row, one texel per segment */
+        rc = teatime_create_texture(&ktex, kwidth, kheight, 1);
+        if (rc < 0)
+            break;
+        if (nkeys / kwidth > 0)
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kwidth, nkeys / kwidth,
+                    GL_RGBA_INTEGER, GL_UNSIGNED_INT, keys);
+        if (nkeys % kwidth > 0)
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, nkeys / kwidth, nkeys % kwidth, 1,
+                    GL_RGBA_INTEGER, GL_UNSIGNED_INT,
+                    keys + 4 * (size_t)(nkeys / kwidth) * kwidth);
+        TEATIME_BREAKONERROR(glTexSubImage2D, rc);
+        glGenTextures(1, &kitex);
+        glBindTexture(GL_TEXTURE_2D, kitex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, per_row,
+                (per_tile + per_row - 1) / per_row, 0, GL_RED_INTEGER,
+                GL_UNSIGNED_INT, NULL);
+        TEATIME_BREAKONERROR(glTexImage2D, rc);
+        glUseProgram(obj->program);
+        TEATIME_BREAKONERROR(glUseProgram, rc);
+        glUniform1ui(obj->locn_width, width);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        for (uint32_t first = 0; first < nsegments; first += per_tile) {
+            uint32_t n = (nsegments - first < per_tile) ? (nsegments - first) : per_tile;
+            uint32_t rows = (n + per_row - 1) / per_row;
+            uint32_t len = n * segment_words;
+            size_t off = (size_t)first * segment_words;
+            uint64_t start = 0;
+            teatime_apply_viewport(obj, per_row * width, rows, len);
+            rc = teatime_pool_acquire(obj, per_row * width, rows);
+            if (rc < 0)
+                break;
+            glBindTexture(GL_TEXTURE_2D, obj->itexid);
+            rc = teatime_transfer_textures(obj, (uint32_t *)input + off, true, false);
+            if (rc < 0)
+                break;
+            glBindTexture(GL_TEXTURE_2D, kitex);
+            if (n / per_row > 0)
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, per_row, n / per_row,
+                        GL_RED_INTEGER, GL_UNSIGNED_INT, key_index + first);
+            if (n % per_row > 0)
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, n / per_row, n % per_row, 1,
+                        GL_RED_INTEGER, GL_UNSIGNED_INT,
+                        key_index + first + (size_t)(n / per_row) * per_row);
+            TEATIME_BREAKONERROR(glTexSubImage2D, rc);
+            glUseProgram(obj->program);
+            TEATIME_BREAKONERROR(glUseProgram, rc);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, obj->itexid);
+            glUniform1i(obj->locn_input, 0);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, ktex);
+            glUniform1i(obj->locn_keys, 1);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, kitex);
+            glUniform1i(obj->locn_kindex, 2);
+            glActiveTexture(GL_TEXTURE0);
+            TEATIME_BREAKONERROR(glBindTexture, rc);
+            glUniform1ui(obj->locn_rounds, rounds);
+            TEATIME_BREAKONERROR(glUniform1ui, rc);
+            /* all the segments of the tile in one draw */
+            start = teatime_stats_begin(obj, TEATIME_STAGE_DRAW, true);
+            teatime_draw(obj);
+            teatime_stats_end(obj, TEATIME_STAGE_DRAW, start,
+                    (uint64_t)len * sizeof(uint32_t));
+            TEATIME_BREAKONERROR_FB(Rendering, rc);
+            TEATIME_BREAKONERROR(Rendering, rc);
+            rc = teatime_transfer_textures(obj, output + off, false, false);
+            if (rc < 0)
+                break;
+            teatime_delete_textures(obj);
+        }
+    } while (0);
+    TEATIME_CHECK_OPERATION(obj, rc);
+    teatime_delete_textures(obj);
+    if (ktex > 0)
+        glDeleteTextures(1, &ktex);
+    if (kitex > 0)
+        glDeleteTextures(1, &kitex);
+    return rc;
+}
+
+/*
+ * Runs nsegments segments of segment_words words each, one after the other,
+ * with segment i under the key at keys + 4 * key_index[i]. This needs a
+ * program loaded with TEATIME_BATCH_ENCRYPT or TEATIME_BATCH_DECRYPT. All the
+ * segments that fit in a tile go out in one dispatch and come back in one
+ * readback, so many small records under different keys cost about as much
+ * as one large one.
+ */
+int teatime_run_batch(teatime_t *obj, const uint32_t *keys, uint32_t nkeys,
+        uint32_t rounds, const uint32_t *key_index, const uint32_t *input,
+        uint32_t *output, uint32_t nsegments, uint32_t segment_words)
+{
+    if (obj && keys && nkeys > 0 && key_index && input && output && nsegments > 0 &&
+        segment_words > 0 && (segment_words % 4) == 0 &&
+        (uint64_t)nsegments * segment_words <= UINT32_MAX &&
+        TEATIME_IS_BATCH(obj->program_direction)) {
+        int rc = teatime_check_rounds(obj, rounds);
+        if (rc < 0)
+            return rc;
+        /* the kernels trust the indices */
+        for (uint32_t i = 0; i < nsegments; ++i) {
+            if (key_index[i] >= nkeys) {
+                teatime_log(TEATIME_LOG_ERROR, "Key index %u of segment %u exceeds the %u keys\n",
+                        key_index[i], i, nkeys);
+                return -EINVAL;
+            }
+        }
+        if (obj->backend == TEATIME_BACKEND_CPU) {
+            teatime_cpu_set_algorithm(obj->cpu, obj->program_algorithm,
+                    obj->program_block_words);
+            return teatime_cpu_batch(obj->cpu, obj->program_direction, keys, nkeys,
+                    rounds, key_index, input, output, nsegments, segment_words);
+        }
+        if (obj->backend == TEATIME_BACKEND_COMPUTE)
+            return teatime_run_batch_compute(obj, keys, nkeys, rounds, key_index,
+                    input, output, nsegments, segment_words);
+        return teatime_run_batch_fragment(obj, keys, nkeys, rounds, key_index,
+                input, output, nsegments, segment_words);
+    } else if (obj && (segment_words % 4) != 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Segment length %u is not a whole no. of texels of 4 "
+                "words\n", segment_words);
+    } else if (obj && !TEATIME_IS_BATCH(obj->program_direction)) {
+        teatime_log(TEATIME_LOG_ERROR, "Use teatime_load_program() with TEATIME_BATCH_ENCRYPT or "
+                "TEATIME_BATCH_DECRYPT first\n");
+    }
+    return -EINVAL;
+}
+
+/* rows of the output read back at a time when a search tile has hits */
+#define TEATIME_SEARCH_STRIP_ROWS 64
+
+/* sets the uniforms of a key search dispatch, see TEA_SEARCH_KEY */
+static int teatime_search_uniforms(teatime_t *obj, const uint32_t key[4],
+        uint32_t rounds, const uint32_t known[4], const uint32_t target[4])
+{
+    int rc = 0;
+    do {
+        glUseProgram(obj->program);
+        TEATIME_BREAKONERROR(glUseProgram, rc);
+        glUniform4uiv(obj->locn_key, 1, key);
+        TEATIME_BREAKONERROR(glUniform4uiv, rc);
+        glUniform1ui(obj->locn_rounds, rounds);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        glUniform2ui(obj->locn_counter, key[2], key[3]);
+        TEATIME_BREAKONERROR(glUniform2ui, rc);
+        glUniform4uiv(obj->locn_known, 1, known);
+        TEATIME_BREAKONERROR(glUniform4uiv, rc);
+        glUniform4uiv(obj->locn_target, 1, target);
+        TEATIME_BREAKONERROR(glUniform4uiv, rc);
+        rc = 0;
+    } while (0);
+    return rc;
+}
+
+/*
+ * Tries count candidates in one draw. The occlusion query counts the
+ * fragments that were not discarded, so nothing is read back unless there
+ * are hits, and then only the flags in strips of rows.
+ */
+static int teatime_search_fragment(teatime_t *obj, GLuint query,
+        const uint32_t key[4], uint32_t rounds, const uint32_t known[4],
+        const uint32_t target[4], uint32_t count, uint32_t *hits, uint32_t *nhits)
+{
+    int rc = 0;
+    GLuint width = (count < obj->tile_width) ? count : obj->tile_width;
+    GLuint height = (count + width - 1) / width;
+    GLuint samples = 0;
+    uint32_t *strip = NULL;
+    const GLuint zero[4] = { 0, 0, 0, 0 };
+    *nhits = 0;
+    do {
+        teatime_apply_viewport(obj, width, height, 4 * count);
+        rc = teatime_pool_acquire(obj, width, height);
+        if (rc < 0)
+            break;
+        /* the discarded fragments leave the output as it was */
+        glClearBufferuiv(GL_COLOR, 0, zero);
+        TEATIME_BREAKONERROR(glClearBufferuiv, rc);
+        rc = teatime_search_uniforms(obj, key, rounds, known, target);
+        if (rc < 0)
+            break;
+        glUniform1ui(obj->locn_width, width);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        glBeginQuery(GL_SAMPLES_PASSED, query);
+        TEATIME_BREAKONERROR(glBeginQuery, rc);
+        teatime_draw(obj);
+        glEndQuery(GL_SAMPLES_PASSED);
+        TEATIME_BREAKONERROR_FB(Rendering, rc);
+        TEATIME_BREAKONERROR(Rendering, rc);
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT, &samples);
+        TEATIME_BREAKONERROR(glGetQueryObjectuiv, rc);
+        if (samples == 0)
+            break;
+        strip = malloc((size_t)width * TEATIME_SEARCH_STRIP_ROWS * sizeof(uint32_t));
+        if (!strip) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                    (size_t)width * TEATIME_SEARCH_STRIP_ROWS * sizeof(uint32_t));
+            rc = -ENOMEM;
+            break;
+        }
+        for (GLuint y = 0; y < height; y += TEATIME_SEARCH_STRIP_ROWS) {
+            GLuint rows = (height - y < TEATIME_SEARCH_STRIP_ROWS) ? (height - y) :
+                TEATIME_SEARCH_STRIP_ROWS;
+            glReadPixels(0, y, width, rows, GL_RED_INTEGER, GL_UNSIGNED_INT, strip);
+            TEATIME_BREAKONERROR(glReadPixels, rc);
+            for (uint32_t i = 0; i < width * rows; ++i) {
+                /* the last row may run past the candidates */
+                uint32_t n = y * width + i;
+                if (strip[i] == 0 || n >= count)
+                    continue;
+                if (*nhits < TEATIME_SEARCH_MAX_HITS)
+                    hits[*nhits] = n;
+                (*nhits)++;
+            }
+        }
+    } while (0);
+    free(strip);
+    teatime_delete_textures(obj);
+    return rc;
+}
+
+/*
+ * Tries count candidates in one dispatch. Only the hit counter is read back
+ * unless there are hits, and then only the hit list.
+ */
+static int teatime_search_compute(teatime_t *obj, GLuint hbuf,
+        const uint32_t key[4], uint32_t rounds, const uint32_t known[4],
+        const uint32_t target[4], uint32_t count, uint32_t *hits, uint32_t *nhits)
+{
+    int rc = 0;
+    uint32_t list[1 + TEATIME_SEARCH_MAX_HITS] = { 0 };
+    do {
+        GLuint groups_x, groups_y;
+        rc = teatime_ssbo_upload(obj, hbuf, list, 1);
+        if (rc < 0)
+            break;
+        rc = teatime_search_uniforms(obj, key, rounds, known, target);
+        if (rc < 0)
+            break;
+        glUniform1ui(obj->locn_count, count);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, hbuf);
+        TEATIME_BREAKONERROR(glBindBufferBase, rc);
+        teatime_compute_groups(obj, count, &groups_x, &groups_y);
+        glDispatchCompute(groups_x, groups_y, 1);
+        TEATIME_BREAKONERROR(glDispatchCompute, rc);
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        TEATIME_BREAKONERROR(glMemoryBarrier, rc);
+        rc = teatime_ssbo_read(obj, hbuf, list, 1);
+        if (rc < 0 || list[0] == 0)
+            break;
+        rc = teatime_ssbo_read(obj, hbuf, list, 1 + ((list[0] < TEATIME_SEARCH_MAX_HITS) ?
+                    list[0] : TEATIME_SEARCH_MAX_HITS));
+        if (rc < 0)
+            break;
+        memcpy(hits, list + 1, ((list[0] < TEATIME_SEARCH_MAX_HITS) ? list[0] :
+                    TEATIME_SEARCH_MAX_HITS) * sizeof(uint32_t));
+    } while (0);
+    *nhits = list[0];
+    return rc;
+}
+
+/*
+ * Searches count candidate keys for those that encrypt the two known
+ * plaintext blocks into the two target blocks, for auditing deployments
+ * with weak or partly known keys. Candidate n is key with n added to its
+ * last 64 bits, high word first, so the first two words are fixed. Pass the
+ * same block twice if only one is known, at the cost of more false hits.
+ * This needs a program loaded with TEATIME_KEY_SEARCH. The search goes a
+ * tile of candidates per dispatch and prints its progress every second.
+ * Up to maxfound matching keys go in found, 4 words each and in no
+ * particular order, and the no. of keys stored is returned.
+ */
+int teatime_search_keys(teatime_t *obj, const uint32_t key[4], uint64_t count,
+        uint32_t rounds, const uint32_t known[4], const uint32_t target[4],
+        uint32_t *found, uint32_t maxfound, teatime_search_stats_t *stats)
+{
+    int rc = 0;
+    uint64_t first, done = 0, nhits = 0, begin_ns, report_ns, elapsed_ns;
+    uint32_t per_dispatch, n = 0;
+    uint32_t hits[TEATIME_SEARCH_MAX_HITS];
+    GLuint query = 0, hbuf = 0;
+    if (!obj || !key || count == 0 || !known || !target || (!found && maxfound > 0))
+        return -EINVAL;
+    if (obj->program_direction != TEATIME_KEY_SEARCH) {
+        teatime_log(TEATIME_LOG_ERROR, "Use teatime_load_program() with TEATIME_KEY_SEARCH "
+                "first\n");
+        return -EINVAL;
+    }
+    rc = teatime_check_rounds(obj, rounds);
+    if (rc < 0)
+        return rc;
+    first = ((uint64_t)key[2] << 32) | key[3];
+    /* the CPU ignores tiles, but progress is still reported per dispatch */
+    per_dispatch = (obj->backend == TEATIME_BACKEND_CPU) ?
+        TEATIME_TILE_SIZE * TEATIME_TILE_SIZE : obj->tile_width * obj->tile_height;
+    begin_ns = report_ns = teatime_clock_ns();
+    do {
+        if (obj->backend == TEATIME_BACKEND_FRAGMENT) {
+            teatime_delete_textures(obj);
+            glGenQueries(1, &query);
+            TEATIME_BREAKONERROR(glGenQueries, rc);
+        } else if (obj->backend == TEATIME_BACKEND_COMPUTE) {
+            glGenBuffers(1, &hbuf);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, hbuf);
+            glBufferData(GL_SHADER_STORAGE_BUFFER,
+                    (1 + TEATIME_SEARCH_MAX_HITS) * sizeof(uint32_t), NULL,
+                    GL_DYNAMIC_READ);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+            TEATIME_BREAKONERROR(glBufferData, rc);
+        } else {
+            teatime_cpu_set_algorithm(obj->cpu, obj->program_algorithm,
+                    obj->program_block_words);
+        }
+        for (done = 0; done < count; done += n) {
+            uint64_t base = first + done;
+            uint32_t dkey[4] = { key[0], key[1], (uint32_t)(base >> 32),
+                (uint32_t)base };
+            uint32_t m = 0;
+            uint64_t now_ns;
+            n = (count - done < per_dispatch) ? (uint32_t)(count - done) : per_dispatch;
+            if (obj->backend == TEATIME_BACKEND_CPU)
+                rc = teatime_cpu_search(obj->cpu, dkey, rounds, known, target, n,
+                        hits, TEATIME_SEARCH_MAX_HITS, &m);
+            else if (obj->backend == TEATIME_BACKEND_COMPUTE)
+                rc = teatime_search_compute(obj, hbuf, dkey, rounds, known, target,
+                        n, hits, &m);
+            else
+                rc = teatime_search_fragment(obj, query, dkey, rounds, known,
+                        target, n, hits, &m);
+            if (rc < 0)
+                break;
+            if (m > TEATIME_SEARCH_MAX_HITS)
+                teatime_log(TEATIME_LOG_WARN, "Kept %u of %u hits in a dispatch\n",
+                        TEATIME_SEARCH_MAX_HITS, m);
+            for (uint32_t i = 0; i < m && i < TEATIME_SEARCH_MAX_HITS; ++i) {
+                uint64_t c = base + hits[i];
+                if (nhits + i < maxfound) {
+                    uint32_t *k = found + 4 * (nhits + i);
+                    k[0] = key[0];
+                    k[1] = key[1];
+                    k[2] = (uint32_t)(c >> 32);
+                    k[3] = (uint32_t)c;
+                }
+            }
+            nhits += m;
+            now_ns = teatime_clock_ns();
+            if (now_ns - report_ns >= 1000000000ULL && done + n < count) {
+                teatime_log(TEATIME_LOG_INFO, "Searched %llu of %llu keys (%.1f%%) at %.2f "
+                        "Mkeys/s, %llu hits\n", (unsigned long long)(done + n),
+                        (unsigned long long)count, 100.0 * (done + n) / count,
+                        (done + n) * 1e3 / (double)(now_ns - begin_ns),
+                        (unsigned long long)nhits);
+                report_ns = now_ns;
+            }
+        }
+    } while (0);
+    if (query > 0)
+        glDeleteQueries(1, &query);
+    if (hbuf > 0)
+        glDeleteBuffers(1, &hbuf);
+    TEATIME_CHECK_OPERATION(obj, rc);
+    elapsed_ns = teatime_clock_ns() - begin_ns;
+    if (stats) {
+        stats->searched = done;
+        stats->nhits = nhits;
+        stats->elapsed_ns = elapsed_ns;
+        stats->keys_per_sec = elapsed_ns ? done * 1e9 / (double)elapsed_ns : 0;
+    }
+    if (rc < 0)
+        return rc;
+    teatime_log(TEATIME_LOG_INFO, "Searched %llu keys in %.3f s at %.2f Mkeys/s, %llu hits\n",
+            (unsigned long long)count, elapsed_ns / 1e9,
+            elapsed_ns ? count * 1e3 / (double)elapsed_ns : 0,
+            (unsigned long long)nhits);
+    return (int)((nhits < maxfound) ? nhits : maxfound);
+}
+
+int teatime_set_hybrid(teatime_t *obj, bool enable, uint32_t crossover)
+{
+    if (obj) {
+        if (enable && !obj->cpu) {
+            obj->cpu = teatime_cpu_create(0);
+            if (!obj->cpu)
+                return -ENOMEM;
+        }
+        obj->hybrid = enable;
+        obj->hybrid_crossover = (crossover > 0) ? crossover : TEATIME_HYBRID_CROSSOVER;
+        /* the throughput is measured again from scratch */
+        obj->gpu_rate = obj->cpu_rate = 0;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+uint64_t teatime_clock_ns(void)
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static void teatime_stats_histogram(uint64_t *histogram, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    uint32_t bucket = 0;
+    while (us > 1 && bucket < TEATIME_STATS_BUCKETS - 1) {
+        us >>= 1;
+        ++bucket;
+    }
+    histogram[bucket]++;
+}
+
+/*
+ * Waits for the result of a query if the GPU has not finished the call yet.
+ * A result longer than the time since the query began is a driver glitch,
+ * e.g. llvmpipe can time the first draw from the epoch, and is dropped. So is
+ * a result of 0, which only means the call was below the timer resolution.
+ */
+static void teatime_stats_collect(teatime_t *obj, int stage, teatime_timer_t *timer)
+{
+    teatime_stage_stats_t *st = &(obj->stats.stages[stage]);
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(timer->query, GL_QUERY_RESULT, &ns);
+    timer->pending = false;
+    if (ns == 0 || ns > teatime_clock_ns() - timer->start_ns)
+        return;
+    st->gpu_count++;
+    st->gpu_bytes += timer->bytes;
+    st->gpu_ns += ns;
+    if (obj->stats_histograms)
+        teatime_stats_histogram(st->gpu_histogram, ns);
+}
+
+static void teatime_stats_collect_all(teatime_t *obj)
+{
+    for (int stage = 0; stage < TEATIME_NUM_STAGES; ++stage) {
+        /* oldest first, so the histograms see them in order */
+        for (uint32_t i = 0; i < TEATIME_STATS_QUERIES; ++i) {
+            teatime_timer_t *timer = &(obj->timers[stage][(obj->timer_next[stage] + i) %
+                TEATIME_STATS_QUERIES]);
+            if (timer->pending)
+                teatime_stats_collect(obj, stage, timer);
+        }
+    }
+}
+
+/*
+ * Every stage is timed with the CPU wall clock. GPU calls are also timed with
+ * a GL_TIME_ELAPSED query, unless one is already active since they cannot be
+ * nested. The queries of a stage form a ring, and a result is only waited for
+ * when its query comes round again or the statistics are read, so that the
+ * timing does not stall the pipeline.
+ */
+static uint64_t teatime_stats_begin(teatime_t *obj, int stage, bool gpu)
+{
+    if (gpu && obj->stats_gpu && obj->timer_stage < 0) {
+        teatime_timer_t *timer = &(obj->timers[stage][obj->timer_next[stage]]);
+        if (timer->pending)
+            teatime_stats_collect(obj, stage, timer);
+        if (timer->query == 0)
+            glGenQueries(1, &(timer->query));
+        glBeginQuery(GL_TIME_ELAPSED, timer->query);
+        timer->start_ns = teatime_clock_ns();
+        obj->timer_stage = stage;
+    }
+    return teatime_clock_ns();
+}
+
+static void teatime_stats_end(teatime_t *obj, int stage, uint64_t start,
+        uint64_t bytes)
+{
+    teatime_stage_stats_t *st = &(obj->stats.stages[stage]);
+    uint64_t elapsed = teatime_clock_ns() - start;
+    st->count++;
+    st->bytes += bytes;
+    st->wall_ns += elapsed;
+    if (elapsed > st->max_wall_ns)
+        st->max_wall_ns = elapsed;
+    if (obj->stats_histograms)
+        teatime_stats_histogram(st->wall_histogram, elapsed);
+    if (obj->timer_stage == stage) {
+        teatime_timer_t *timer = &(obj->timers[stage][obj->timer_next[stage]]);
+        glEndQuery(GL_TIME_ELAPSED);
+        timer->bytes = bytes;
+        timer->pending = true;
+        obj->timer_next[stage] = (obj->timer_next[stage] + 1) % TEATIME_STATS_QUERIES;
+        obj->timer_stage = -1;
+    }
+}
+
+/*
+ * GPU timing is on by default when the driver supports it. The histograms
+ * are off by default, and turning them on does not fill them in for the
+ * calls already counted.
+ */
+int teatime_set_stats(teatime_t *obj, bool gpu_timers, bool histograms)
+{
+    if (obj) {
+        if (gpu_timers && !obj->have_timer) {
+            teatime_log(TEATIME_LOG_ERROR, "GL_TIME_ELAPSED queries are not supported\n");
+            return -ENOTSUP;
+        }
+        /* the results of the queries in flight are still counted */
+        if (!gpu_timers)
+            teatime_stats_collect_all(obj);
+        obj->stats_gpu = gpu_timers;
+        obj->stats_histograms = histograms;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+int teatime_get_stats(teatime_t *obj, teatime_stats_t *stats)
+{
+    if (obj && stats) {
+        teatime_stats_collect_all(obj);
+        memcpy(stats, &(obj->stats), sizeof(*stats));
+        for (int i = 0; i < TEATIME_NUM_STAGES; ++i) {
+            teatime_stage_stats_t *st = &(stats->stages[i]);
+            st->wall_gbps = (st->wall_ns > 0) ?
+                (double)st->bytes / (double)st->wall_ns : 0;
+            /* a few ns of GPU time, as some drivers report, give no
+             * meaningful rate */
+            st->gpu_gbps = (st->gpu_ns >= TEATIME_STATS_MIN_GPU_NS) ?
+                (double)st->gpu_bytes / (double)st->gpu_ns : 0;
+        }
+        return 0;
+    }
+    return -EINVAL;
+}
+
+void teatime_reset_stats(teatime_t *obj)
+{
+    if (obj) {
+        teatime_stats_collect_all(obj);
+        memset(&(obj->stats), 0, sizeof(obj->stats));
+    }
+}
+
+const char *teatime_stage_name(int stage)
+{
+    switch (stage) {
+    case TEATIME_STAGE_UPLOAD:
+        return "upload";
+    case TEATIME_STAGE_DRAW:
+        return "draw";
+    case TEATIME_STAGE_READBACK:
+        return "readback";
+    default:
+        break;
+    }
+    return "unknown";
+}
+
+void teatime_print_stats(teatime_t *obj, FILE *fp)
+{
+    teatime_stats_t stats;
+    if (!fp || teatime_get_stats(obj, &stats) < 0)
+        return;
+    for (int i = 0; i < TEATIME_NUM_STAGES; ++i) {
+        const teatime_stage_stats_t *st = &(stats.stages[i]);
+        fprintf(fp, "%-8s: %llu calls %llu bytes wall %.3f ms (max %.3f ms) %.3f GB/s",
+                teatime_stage_name(i), (unsigned long long)st->count,
+                (unsigned long long)st->bytes, st->wall_ns / 1e6,
+                st->max_wall_ns / 1e6, st->wall_gbps);
+        if (st->gpu_count > 0)
+            fprintf(fp, " gpu %llu calls %.3f ms",
+                    (unsigned long long)st->gpu_count, st->gpu_ns / 1e6);
+        if (st->gpu_count > 0 && st->gpu_ns >= TEATIME_STATS_MIN_GPU_NS)
+            fprintf(fp, " %.3f GB/s", st->gpu_gbps);
+        fprintf(fp, "\n");
+        if (!obj->stats_histograms)
+            continue;
+        for (int h = 0; h < 2; ++h) {
+            const uint64_t *histogram = h ? st->gpu_histogram : st->wall_histogram;
+            for (int b = 0; b < TEATIME_STATS_BUCKETS; ++b) {
+                if (histogram[b] > 0)
+                    fprintf(fp, "    %s < %llu us: %llu\n", h ? "gpu " : "wall",
+                            1ULL << (b + 1), (unsigned long long)histogram[b]);
+            }
+        }
+    }
+}
+
+static uint64_t teatime_hash(const void *data, size_t len, uint64_t hash)
+{
+    /* FNV-1a */
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* the length guards against two sources whose hashes collide */
+static teatime_program_t *teatime_find_program(teatime_t *obj, uint64_t hash,
+        size_t length)
+{
+    for (uint32_t i = 0; i < obj->num_programs; ++i) {
+        if (obj->programs[i].hash == hash && obj->programs[i].length == length)
+            return &(obj->programs[i]);
+    }
+    return NULL;
+}
+
+/* the binary depends on the driver as much as on the source */
+static uint64_t teatime_program_binary_hash(uint64_t hash)
+{
+    const GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        const char *str = (const char *)glGetString(names[i]);
+        if (str)
+            hash = teatime_hash(str, strlen(str), hash);
+    }
+    return hash;
+}
+
+static int teatime_program_binary_path(teatime_t *obj, uint64_t hash,
+        char *path, size_t plen)
+{
+    int wb = snprintf(path, plen, "%s/%016llx.bin", obj->cache_dir,
+            (unsigned long long)teatime_program_binary_hash(
+                teatime_vertex_hash(obj, hash)));
+    return (wb < 0 || (size_t)wb >= plen) ? -ENAMETOOLONG : 0;
+}
+
+/* file header of a cached program binary */
+typedef struct {
+    uint32_t magic;
+    uint32_t format;
+    uint32_t length; /* of the binary that follows */
+    uint32_t source_length; /* of the shader source it was built from */
+} teatime_binary_header_t;
+
+#define TEATIME_BINARY_MAGIC 0x42414554 /* TEAB */
+
+static int teatime_load_program_binary(teatime_t *obj, teatime_program_t *prog)
+{
+    int rc = 0;
+    FILE *fp = NULL;
+    void *buf = NULL;
+    char path[4096];
+    if (!obj->program_binary || !obj->cache_dir)
+        return -ENOTSUP;
+    do {
+        teatime_binary_header_t hdr;
+        struct stat st;
+        GLint status = GL_FALSE;
+        rc = teatime_program_binary_path(obj, prog->hash, path, sizeof(path));
+        if (rc < 0)
+            break;
+        fp = fopen(path, "rb");
+        if (!fp) {
+            rc = -ENOENT;
+            break;
+        }
+        if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            hdr.magic != TEATIME_BINARY_MAGIC || hdr.length == 0 ||
+            hdr.source_length != (uint32_t)prog->length) {
+            teatime_log(TEATIME_LOG_WARN, "Ignoring invalid program binary %s\n", path);
+            rc = -EINVAL;
+            break;
+        }
+        /* do not trust the length of a truncated or corrupt file */
+        if (fstat(fileno(fp), &st) < 0 || st.st_size < (off_t)sizeof(hdr) ||
+            (uint64_t)hdr.length > (uint64_t)st.st_size - sizeof(hdr)) {
+            teatime_log(TEATIME_LOG_WARN, "Ignoring truncated program binary %s\n", path);
+            rc = -EINVAL;
+            break;
+        }
+        buf = malloc(hdr.length);
+        if (!buf) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %u bytes\n",
+                    hdr.length);
+            rc = -ENOMEM;
+            break;
+        }
+        if (fread(buf, hdr.length, 1, fp) != 1) {
+            teatime_log(TEATIME_LOG_WARN, "Ignoring truncated program binary %s\n", path);
+            rc = -EINVAL;
+            break;
+        }
+        prog->program = glCreateProgram();
+        TEATIME_BREAKONERROR(glCreateProgram, rc);
+        glProgramBinary(prog->program, (GLenum)hdr.format, buf, (GLsizei)hdr.length);
+        /* a driver update invalidates the binary, that is not an error */
+        glGetProgramiv(prog->program, GL_LINK_STATUS, &status);
+        while (glGetError() != GL_NO_ERROR)
+            ;
+        if (status != GL_TRUE) {
+            teatime_log(TEATIME_LOG_WARN, "Program binary %s is stale, recompiling\n",
+                    path);
+            rc = -EINVAL;
+            break;
+        }
+        teatime_log(TEATIME_LOG_DEBUG, "Loaded program binary from %s\n", path);
+        obj->binary_loads++;
+        rc = 0;
+    } while (0);
+    if (fp)
+        fclose(fp);
+    free(buf);
+    if (rc < 0 && prog->program > 0) {
+        glDeleteProgram(prog->program);
+        prog->program = 0;
+    }
+    return rc;
+}
+
+static int teatime_save_program_binary(teatime_t *obj, const teatime_program_t *prog)
+{
+    int rc = 0;
+    FILE *fp = NULL;
+    void *buf = NULL;
+    char path[4096];
+    char tmppath[4096 + 48];
+    if (!obj->program_binary || !obj->cache_dir)
+        return -ENOTSUP;
+    do {
+        teatime_binary_header_t hdr;
+        GLint blen = 0;
+        GLsizei wb = 0;
+        GLenum format = 0;
+        glGetProgramiv(prog->program, GL_PROGRAM_BINARY_LENGTH, &blen);
+        TEATIME_BREAKONERROR(glGetProgramiv, rc);
+        if (blen <= 0) {
+            rc = -ENOTSUP;
+            break;
+        }
+        buf = malloc(blen);
+        if (!buf) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %d bytes\n", blen);
+            rc = -ENOMEM;
+            break;
+        }
+        glGetProgramBinary(prog->program, blen, &wb, &format, buf);
+        TEATIME_BREAKONERROR(glGetProgramBinary, rc);
+        rc = teatime_program_binary_path(obj, prog->hash, path, sizeof(path));
+        if (rc < 0)
+            break;
+        /* write to a temporary file and rename so that concurrent processes
+         * and the threads of a context pool never see a partially written
+         * binary */
+        snprintf(tmppath, sizeof(tmppath), "%s.%ld.%p", path, (long)getpid(),
+                (void *)obj);
+        fp = fopen(tmppath, "wb");
+        if (!fp) {
+            teatime_log(TEATIME_LOG_WARN, "Unable to open %s for writing: %s\n", tmppath,
+                    strerror(errno));
+            rc = -errno;
+            break;
+        }
+        hdr.magic = TEATIME_BINARY_MAGIC;
+        hdr.format = (uint32_t)format;
+        hdr.length = (uint32_t)wb;
+        hdr.source_length = (uint32_t)prog->length;
+        if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            fwrite(buf, wb, 1, fp) != 1) {
+            teatime_log(TEATIME_LOG_WARN, "Unable to write %s\n", tmppath);
+            rc = -EIO;
+        }
+        if (fclose(fp) != 0 && rc == 0)
+            rc = -EIO;
+        fp = NULL;
+        if (rc < 0 || rename(tmppath, path) != 0) {
+            remove(tmppath);
+            rc = (rc < 0) ? rc : -EIO;
+            break;
+        }
+        teatime_log(TEATIME_LOG_DEBUG, "Saved program binary to %s\n", path);
+        rc = 0;
+    } while (0);
+    free(buf);
+    return rc;
+}
+
+static int teatime_compile_program(teatime_t *obj, teatime_program_t *prog,
+        const char *source)
+{
+    int rc = 0;
+    GLuint shader = 0;
+    do {
+        GLint status = GL_FALSE;
+        prog->program = glCreateProgram();
+        TEATIME_BREAKONERROR(glCreateProgram, rc);
+        shader = glCreateShader((obj->backend == TEATIME_BACKEND_COMPUTE) ?
+                GL_COMPUTE_SHADER : GL_FRAGMENT_SHADER_ARB);
+        TEATIME_BREAKONERROR(glCreateShader, rc);
+        teatime_shader_source(obj, shader, source);
+        TEATIME_BREAKONERROR(glShaderSource, rc);
+        glCompileShader(shader);
+        rc = teatime_check_shader_errors(shader);
+        if (rc < 0) break;
+        TEATIME_BREAKONERROR(glCompileShader, rc);
+        glAttachShader(prog->program, shader);
+        TEATIME_BREAKONERROR(glAttachShader, rc);
+        /* fan-out kernels write an array, one element per draw buffer */
+        if (obj->backend == TEATIME_BACKEND_FRAGMENT) {
+            rc = teatime_vertex_shader(obj);
+            if (rc < 0)
+                break;
+            glAttachShader(prog->program, obj->vertex_shader);
+            TEATIME_BREAKONERROR(glAttachShader, rc);
+            glBindFragDataLocation(prog->program, 0, "odata");
+            TEATIME_BREAKONERROR(glBindFragDataLocation, rc);
+        }
+        if (obj->program_binary) {
+            glProgramParameteri(prog->program,
+                    GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+            TEATIME_BREAKONERROR(glProgramParameteri, rc);
+        }
+        glLinkProgram(prog->program);
+        rc = teatime_check_program_errors(prog->program);
+        if (rc < 0) break;
+        TEATIME_BREAKONERROR(glLinkProgram, rc);
+        glGetProgramiv(prog->program, GL_LINK_STATUS, &status);
+        if (status != GL_TRUE) {
+            teatime_log(TEATIME_LOG_ERROR, "Unable to link program\n");
+            rc = -EINVAL;
+            break;
+        }
+        /* the shaders are not needed once the program is linked */
+        glDetachShader(prog->program, shader);
+        TEATIME_BREAKONERROR(glDetachShader, rc);
+        if (obj->backend == TEATIME_BACKEND_FRAGMENT) {
+            glDetachShader(prog->program, obj->vertex_shader);
+            TEATIME_BREAKONERROR(glDetachShader, rc);
+        }
+        rc = 0;
+    } while (0);
+    if (shader > 0)
+        glDeleteShader(shader);
+    if (rc < 0 && prog->program > 0) {
+        glDeleteProgram(prog->program);
+        prog->program = 0;
+    }
+    return rc;
+}
+
+static int teatime_add_program(teatime_t *obj, uint64_t hash, size_t length,
+        const char *source)
+{
+    int rc = 0;
+    teatime_program_t *prog = NULL;
+    if (obj->num_programs == obj->max_programs) {
+        uint32_t maxp = obj->max_programs ? obj->max_programs * 2 : 4;
+        teatime_program_t *progs = realloc(obj->programs,
+                maxp * sizeof(teatime_program_t));
+        if (!progs) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                    maxp * sizeof(teatime_program_t));
+            return -ENOMEM;
+        }
+        obj->programs = progs;
+        obj->max_programs = maxp;
+    }
+    /* the slot is only claimed once the program is complete */
+    prog = &(obj->programs[obj->num_programs]);
+    memset(prog, 0, sizeof(*prog));
+    prog->hash = hash;
+    prog->length = length;
+    do {
+        if (teatime_load_program_binary(obj, prog) < 0) {
+            rc = teatime_compile_program(obj, prog, source);
+            if (rc < 0)
+                break;
+            teatime_save_program_binary(obj, prog);
+        }
+        prog->locn_input = glGetUniformLocation(prog->program, "idata");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_output = glGetUniformLocation(prog->program, "odata");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_key = glGetUniformLocation(prog->program, "ikey");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->direction = -1;
+        prog->locn_rounds = glGetUniformLocation(prog->program, "rounds");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_counter = glGetUniformLocation(prog->program, "counter");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_width = glGetUniformLocation(prog->program, "width");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_iv = glGetUniformLocation(prog->program, "iv");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_chain = glGetUniformLocation(prog->program, "cdata");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_ivs = glGetUniformLocation(prog->program, "ivdata");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_keys = glGetUniformLocation(prog->program, "kdata");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_kindex = glGetUniformLocation(prog->program, "kidata");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_known = glGetUniformLocation(prog->program, "known");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        prog->locn_target = glGetUniformLocation(prog->program, "target");
+        TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+        if (obj->backend == TEATIME_BACKEND_COMPUTE) {
+            GLint local_size[3] = { 0, 0, 0 };
+            prog->locn_count = glGetUniformLocation(prog->program, "count");
+            TEATIME_BREAKONERROR(glGetUniformLocation, rc);
+            /* the dispatch must use the size the program was built with */
+            glGetProgramiv(prog->program, GL_COMPUTE_WORK_GROUP_SIZE, local_size);
+            TEATIME_BREAKONERROR(glGetProgramiv, rc);
+            prog->local_size = (GLuint)local_size[0];
+        } else {
+            prog->locn_count = -1;
+        }
+        obj->num_programs++;
+        teatime_log(TEATIME_LOG_DEBUG, "Cached program %u with hash: %016llx\n",
+                prog->program, (unsigned long long)prog->hash);
+        rc = 0;
+    } while (0);
+    if (rc < 0 && prog->program > 0) {
+        glDeleteProgram(prog->program);
+        prog->program = 0;
+    }
+    return rc;
+}
+
+/* makes a cached program the current one */
+static void teatime_select_program(teatime_t *obj, const teatime_program_t *prog)
+{
+    obj->program = prog->program;
+    obj->program_fanout = prog->fanout;
+    obj->program_local_size = prog->local_size;
+    obj->program_rounds = prog->rounds;
+    obj->program_direction = prog->direction;
+    obj->program_algorithm = prog->algorithm;
+    obj->program_block_words = prog->block_words;
+    obj->locn_input = prog->locn_input;
+    obj->locn_output = prog->locn_output;
+    obj->locn_key = prog->locn_key;
+    obj->locn_rounds = prog->locn_rounds;
+    obj->locn_count = prog->locn_count;
+    obj->locn_counter = prog->locn_counter;
+    obj->locn_width = prog->locn_width;
+    obj->locn_iv = prog->locn_iv;
+    obj->locn_chain = prog->locn_chain;
+    obj->locn_ivs = prog->locn_ivs;
+    obj->locn_keys = prog->locn_keys;
+    obj->locn_kindex = prog->locn_kindex;
+    obj->locn_known = prog->locn_known;
+    obj->locn_target = prog->locn_target;
+}
+
+static int teatime_use_program(teatime_t *obj, const char *source,
+        uint32_t fanout, uint64_t variant, uint32_t rounds, int direction,
+        int algorithm, uint32_t block_words)
+{
+    int rc = 0;
+    do {
+        size_t length = strlen(source);
+        uint64_t hash = teatime_hash(source, length, 0xcbf29ce484222325ULL);
+        teatime_program_t *prog = teatime_find_program(obj, hash, length);
+        if (!prog) {
+            rc = teatime_add_program(obj, hash, length, source);
+            if (rc < 0)
+                break;
+            prog = &(obj->programs[obj->num_programs - 1]);
+            prog->fanout = fanout;
+            prog->rounds = rounds;
+            prog->algorithm = algorithm;
+            prog->block_words = block_words;
+        }
+        if (variant != 0)
+            prog->variant = variant;
+        if (direction >= 0) {
+            prog->direction = direction;
+            prog->algorithm = algorithm;
+            prog->block_words = block_words;
+        }
+        teatime_select_program(obj, prog);
+        rc = 0;
+    } while (0);
+    return rc;
+}
+
+/*
+ * Generated kernels are keyed by what they are generated from, so a cached
+ * one is found without building and hashing its source again.
+ */
+static uint64_t teatime_variant(const teatime_t *obj, int algorithm,
+        uint32_t block_words, int direction, uint32_t rounds)
+{
+    uint32_t key[7];
+    key[0] = (uint32_t)obj->backend;
+    key[1] = (uint32_t)direction;
+    key[2] = (obj->backend == TEATIME_BACKEND_FRAGMENT) ? obj->fanout : 0;
+    key[3] = (obj->backend == TEATIME_BACKEND_COMPUTE) ? obj->workgroup_size : 0;
+    key[4] = rounds;
+    key[5] = (uint32_t)algorithm;
+    key[6] = block_words;
+    /* 0 is reserved for caller sources */
+    return teatime_hash(key, sizeof(key), 0xcbf29ce484222325ULL) | 1;
+}
+
+static teatime_program_t *teatime_find_variant(teatime_t *obj, uint64_t variant)
+{
+    for (uint32_t i = 0; i < obj->num_programs; ++i) {
+        if (obj->programs[i].variant == variant)
+            return &(obj->programs[i]);
+    }
+    return NULL;
+}
+
+/* the built-in source of a fragment kernel without fan-out, if there is one */
+static const char *teatime_builtin_source(int algorithm, int direction)
+{
+    if (algorithm == TEATIME_ALG_TEA && direction == TEATIME_ENCRYPT)
+        return teatime_encrypt_source();
+    if (algorithm == TEATIME_ALG_TEA && direction == TEATIME_DECRYPT)
+        return teatime_decrypt_source();
+    if (algorithm == TEATIME_ALG_XTEA && direction == TEATIME_ENCRYPT)
+        return teatime_xtea_encrypt_source();
+    if (algorithm == TEATIME_ALG_XTEA && direction == TEATIME_DECRYPT)
+        return teatime_xtea_decrypt_source();
+    return NULL;
+}
+
+static int teatime_load_kernel(teatime_t *obj, int algorithm,
+        uint32_t block_words, int direction, uint32_t rounds)
+{
+    int rc = 0;
+    char *source = NULL;
+    uint64_t variant = 0;
+    teatime_program_t *prog = NULL;
+    /* the CTR, CBC and key search kernels work on the two blocks of a texel */
+    if (direction > TEATIME_DECRYPT && !TEATIME_IS_BATCH(direction) &&
+        block_words != 2) {
+        teatime_log(TEATIME_LOG_ERROR, "CTR, CBC and key search kernels need 64-bit blocks\n");
+        return -ENOTSUP;
+    }
+    /* and the batch kernels look up one key per texel */
+    if (TEATIME_IS_BATCH(direction) && block_words > 4) {
+        teatime_log(TEATIME_LOG_ERROR, "Batch kernels take blocks of up to 4 words\n");
+        return -ENOTSUP;
+    }
+    if (obj->backend == TEATIME_BACKEND_CPU) {
+        /* the CPU kernels take the rounds as they come */
+        teatime_delete_program(obj);
+        obj->program_direction = direction;
+        obj->program_rounds = rounds;
+        obj->program_algorithm = algorithm;
+        obj->program_block_words = block_words;
+        return 0;
+    }
+    /* a fragment only writes the texel it is drawn for */
+    if (obj->backend == TEATIME_BACKEND_FRAGMENT && block_words > 4) {
+        teatime_log(TEATIME_LOG_ERROR, "Fragment kernels take XXTEA blocks of up to 4 words\n");
+        return -ENOTSUP;
+    }
+    /* the block counters and the neighbouring blocks come from the
+     * fragment coordinates, which are the same in all the layers */
+    if (direction > TEATIME_DECRYPT && obj->fanout > 1) {
+        teatime_log(TEATIME_LOG_ERROR, "CTR, CBC, batch and key search kernels need a fan-out "
+                "of 1\n");
+        return -ENOTSUP;
+    }
+    if (obj->backend == TEATIME_BACKEND_FRAGMENT && obj->fanout == 1 &&
+        rounds == 0 && teatime_builtin_source(algorithm, direction)) {
+        return teatime_use_program(obj, teatime_builtin_source(algorithm, direction),
+                1, 0, 0, direction, algorithm, block_words);
+    }
+    variant = teatime_variant(obj, algorithm, block_words, direction, rounds);
+    prog = teatime_find_variant(obj, variant);
+    if (prog) {
+        teatime_select_program(obj, prog);
+        return 0;
+    }
+    source = teatime_kernel_source(obj, algorithm, block_words, direction, rounds);
+    if (!source)
+        return -ENOMEM;
+    rc = teatime_use_program(obj, source, (obj->backend == TEATIME_BACKEND_FRAGMENT) ?
+            obj->fanout : 1, variant, rounds, direction, algorithm, block_words);
+    free(source);
+    return rc;
+}
+
+int teatime_create_program(teatime_t *obj, const char *source)
+{
+    if (obj && source) {
+        int direction = -1;
+        int algorithm = TEATIME_ALG_TEA;
+        if (strcmp(source, teatime_encrypt_source()) == 0) {
+            direction = TEATIME_ENCRYPT;
+        } else if (strcmp(source, teatime_decrypt_source()) == 0) {
+            direction = TEATIME_DECRYPT;
+        } else if (strcmp(source, teatime_xtea_encrypt_source()) == 0) {
+            direction = TEATIME_ENCRYPT;
+            algorithm = TEATIME_ALG_XTEA;
+        } else if (strcmp(source, teatime_xtea_decrypt_source()) == 0) {
+            direction = TEATIME_DECRYPT;
+            algorithm = TEATIME_ALG_XTEA;
+        }
+        /* callers of the built-in kernels keep working on the compute
+         * and CPU backends, which have their own versions of them */
+        if (obj->backend != TEATIME_BACKEND_FRAGMENT && direction >= 0)
+            return teatime_load_kernel(obj, algorithm, 2, direction, 0);
+        if (obj->backend == TEATIME_BACKEND_CPU) {
+            teatime_log(TEATIME_LOG_ERROR, "Shader sources need an OpenGL backend\n");
+            return -ENOTSUP;
+        }
+        return teatime_use_program(obj, source, 1, 0, 0, direction, algorithm, 2);
+    }
+    return -EINVAL;
+}
+
+int teatime_load_program(teatime_t *obj, int direction)
+{
+    return teatime_load_program_rounds(obj, direction, 0);
+}
+
+int teatime_load_program_rounds(teatime_t *obj, int direction, uint32_t rounds)
+{
+    if (obj && direction >= TEATIME_ENCRYPT && direction <= TEATIME_KEY_SEARCH &&
+        rounds <= TEATIME_UNROLL_MAX) {
+        return teatime_load_kernel(obj, obj->algorithm, obj->block_words,
+                direction, rounds);
+    } else if (obj && rounds > TEATIME_UNROLL_MAX) {
+        teatime_log(TEATIME_LOG_ERROR, "Kernels can be specialized for up to %d rounds. "
+                "Requested: %u\n", TEATIME_UNROLL_MAX, rounds);
+    }
+    return -EINVAL;
+}
+
+/*
+ * Selects the block cipher of the kernels loaded from now on. TEA and XTEA
+ * work on 64-bit blocks and block_words must be 2. XXTEA takes blocks of any
+ * even no. of words up to TEATIME_XXTEA_MAX_WORDS, and the input of a run
+ * must be a whole no. of them.
+ */
+int teatime_set_algorithm(teatime_t *obj, int algorithm, uint32_t block_words)
+{
+    if (obj && (algorithm == TEATIME_ALG_TEA || algorithm == TEATIME_ALG_XTEA) &&
+        block_words == 2) {
+        obj->algorithm = algorithm;
+        obj->block_words = block_words;
+        return 0;
+    } else if (obj && algorithm == TEATIME_ALG_XXTEA && block_words >= 2 &&
+        (block_words % 2) == 0 && block_words <= TEATIME_XXTEA_MAX_WORDS) {
+        obj->algorithm = algorithm;
+        obj->block_words = block_words;
+        teatime_log(TEATIME_LOG_INFO, "XXTEA set to %u-word blocks\n", block_words);
+        return 0;
+    } else if (obj && algorithm == TEATIME_ALG_XXTEA) {
+        teatime_log(TEATIME_LOG_ERROR, "XXTEA blocks must be an even no. of words up to %d. "
+                "Requested: %u\n", TEATIME_XXTEA_MAX_WORDS, block_words);
+    } else if (obj) {
+        teatime_log(TEATIME_LOG_ERROR, "Invalid algorithm %d with %u-word blocks\n",
+                algorithm,
+                block_words);
+    }
+    return -EINVAL;
+}
+
+int teatime_set_fanout(teatime_t *obj, uint32_t fanout)
+{
+    if (obj && fanout > 1 && obj->backend != TEATIME_BACKEND_FRAGMENT) {
+        teatime_log(TEATIME_LOG_ERROR, "Fan-out needs the fragment backend\n");
+        return -ENOTSUP;
+    } else if (obj && (fanout == 1 || fanout == 2 || fanout == 4 || fanout == 8)) {
+        GLint maxbufs = 0, maxlayers = 0;
+        glGetIntegerv(GL_MAX_DRAW_BUFFERS, &maxbufs);
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxlayers);
+        if (fanout > 1 && (fanout > (uint32_t)maxbufs || fanout > (uint32_t)maxlayers)) {
+            teatime_log(TEATIME_LOG_ERROR, "Fan-out %u exceeds the max. draw buffers %d or "
+                    "array layers %d\n", fanout, maxbufs, maxlayers);
+            return -ENOTSUP;
+        }
+        /* the current textures have the old no. of layers */
+        teatime_delete_textures(obj);
+        obj->fanout = fanout;
+        teatime_log(TEATIME_LOG_INFO, "Fan-out set to %u block pairs per fragment\n",
+                fanout);
+        return 0;
+    } else if (obj) {
+        teatime_log(TEATIME_LOG_ERROR, "Fan-out must be 1, 2, 4 or 8. Requested: %u\n",
+                fanout);
+    }
+    return -EINVAL;
+}
+
+int teatime_set_backend(teatime_t *obj, int backend)
+{
+    if (obj && (backend == TEATIME_BACKEND_FRAGMENT ||
+                backend == TEATIME_BACKEND_COMPUTE ||
+                backend == TEATIME_BACKEND_CPU)) {
+        if (backend == TEATIME_BACKEND_COMPUTE && !obj->have_compute) {
+            teatime_log(TEATIME_LOG_ERROR, "Compute backend needs OpenGL 4.3\n");
+            return -ENOTSUP;
+        }
+        if (backend == TEATIME_BACKEND_FRAGMENT && !obj->have_gl) {
+            teatime_log(TEATIME_LOG_ERROR, "Fragment backend needs OpenGL 3.0\n");
+            return -ENOTSUP;
+        }
+        /* the current program and data belong to the old backend */
+        teatime_delete_textures(obj);
+        teatime_delete_program(obj);
+        if (backend != TEATIME_BACKEND_FRAGMENT && obj->fanout > 1) {
+            teatime_log(TEATIME_LOG_INFO, "Fan-out reset to 1 for the %s backend\n",
+                    teatime_backend_name(backend));
+            obj->fanout = 1;
+        }
+        if (backend == TEATIME_BACKEND_CPU)
+            return teatime_setup_cpu(obj);
+        obj->backend = backend;
+        teatime_log(TEATIME_LOG_INFO, "Using the %s backend\n",
+                teatime_backend_name(backend));
+        return 0;
+    } else if (obj) {
+        teatime_log(TEATIME_LOG_ERROR, "Invalid backend %d\n", backend);
+    }
+    return -EINVAL;
+}
+
+const char *teatime_backend_name(int backend)
+{
+    switch (backend) {
+    case TEATIME_BACKEND_FRAGMENT:
+        return "fragment";
+    case TEATIME_BACKEND_COMPUTE:
+        return "compute";
+    case TEATIME_BACKEND_CPU:
+        return "cpu";
+    default:
+        break;
+    }
+    return "none";
+}
+
+int teatime_set_workgroup_size(teatime_t *obj, uint32_t size)
+{
+    if (obj && size > 0 && obj->have_compute) {
+        GLint maxsize = 0, maxinvocations = 0;
+        glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxsize);
+        glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxinvocations);
+        if (size > (uint32_t)maxsize || size > (uint32_t)maxinvocations) {
+            teatime_log(TEATIME_LOG_ERROR, "Workgroup size %u exceeds the max. %d x 1 x 1 or "
+                    "%d invocations\n", size, maxsize, maxinvocations);
+            return -ENOTSUP;
+        }
+        /* programs are compiled with the size, see teatime_load_program() */
+        obj->workgroup_size = size;
+        teatime_log(TEATIME_LOG_INFO, "Workgroup size set to %u invocations\n", size);
+        return 0;
+    } else if (obj && !obj->have_compute) {
+        teatime_log(TEATIME_LOG_ERROR, "Compute backend needs OpenGL 4.3\n");
+        return -ENOTSUP;
+    }
+    return -EINVAL;
+}
+
+/* a specialized kernel only runs the rounds it was generated for */
+static int teatime_check_rounds(const teatime_t *obj, uint32_t rounds)
+{
+    if (obj->program_rounds > 0 && rounds != obj->program_rounds) {
+        teatime_log(TEATIME_LOG_ERROR, "Program is specialized for %u rounds. Requested: %u\n",
+                obj->program_rounds, rounds);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* the current program runs block by block with these rounds */
+static int teatime_check_program(const teatime_t *obj, uint32_t rounds)
+{
+    if (obj->program_direction == TEATIME_CBC_ENCRYPT) {
+        teatime_log(TEATIME_LOG_ERROR, "CBC encryption is serial, use teatime_cbc_encrypt()\n");
+        return -EINVAL;
+    }
+    if (TEATIME_IS_BATCH(obj->program_direction)) {
+        teatime_log(TEATIME_LOG_ERROR, "Batch kernels need keys, use teatime_run_batch()\n");
+        return -EINVAL;
+    }
+    if (obj->program_direction == TEATIME_KEY_SEARCH) {
+        teatime_log(TEATIME_LOG_ERROR, "Key search kernels have no input, use "
+                "teatime_search_keys()\n");
+        return -EINVAL;
+    }
+    return teatime_check_rounds(obj, rounds);
+}
+
+/* the XXTEA kernels only see whole blocks */
+static int teatime_check_length(const teatime_t *obj, uint32_t nwords)
+{
+    if ((nwords % obj->program_block_words) != 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Input length %u is not a whole no. of %u-bit blocks\n",
+                nwords, 32 * obj->program_block_words);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int teatime_run_cpu(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds,
+        const uint32_t *input, uint32_t *output, uint32_t nwords)
+{
+    uint64_t start = 0;
+    int rc = teatime_check_program(obj, rounds);
+    if (rc < 0)
+        return rc;
+    teatime_cpu_set_algorithm(obj->cpu, obj->program_algorithm,
+            obj->program_block_words);
+    teatime_cpu_set_counter(obj->cpu, obj->counter);
+    teatime_cpu_set_iv(obj->cpu, obj->iv);
+    start = teatime_stats_begin(obj, TEATIME_STAGE_DRAW, false);
+    rc = teatime_cpu_run(obj->cpu, obj->program_direction, ikey, rounds, input,
+            output, nwords);
+    teatime_stats_end(obj, TEATIME_STAGE_DRAW, start, (uint64_t)nwords * sizeof(uint32_t));
+    if (rc == 0 && TEATIME_IS_CTR(obj->program_direction))
+        obj->counter += nwords / 2;
+    /* the engine saved the last ciphertext block before overwriting it */
+    if (rc == 0 && obj->program_direction == TEATIME_CBC_DECRYPT)
+        teatime_cpu_get_iv(obj->cpu, obj->iv);
+    return rc;
+}
+
+/* spreads the workgroups over two dimensions when one is not enough */
+static void teatime_compute_groups(const teatime_t *obj, GLuint count,
+        GLuint *groups_x, GLuint *groups_y)
+{
+    GLuint groups = (count + obj->program_local_size - 1) / obj->program_local_size;
+    *groups_x = (groups < obj->max_groups) ? groups : obj->max_groups;
+    *groups_y = (groups + *groups_x - 1) / *groups_x;
+}
+
+/*
+ * Issues the compute dispatch from one storage buffer to another without
+ * waiting for it. One invocation handles one texel worth of data, and the
+ * workgroups are spread over two dimensions when a single one is not enough.
+ */
+static int teatime_dispatch_compute(teatime_t *obj, GLuint ibuf, GLuint obuf,
+        const uint32_t ikey[4], uint32_t rounds)
+{
+    int rc = 0;
+    do {
+        GLuint count = obj->data_width * obj->data_height;
+        GLuint groups_x, groups_y;
+        uint64_t start = 0;
+        /* long XXTEA blocks get an invocation each */
+        if (obj->program_block_words > 4)
+            count = obj->data_len / obj->program_block_words;
+        if (obj->program_local_size == 0) {
+            teatime_log(TEATIME_LOG_ERROR, "Program is not a compute program. Use "
+                    "teatime_load_program() after teatime_set_backend()\n");
+            rc = -EINVAL;
+            break;
+        }
+        rc = teatime_check_program(obj, rounds);
+        if (rc < 0)
+            break;
+        rc = teatime_check_length(obj, obj->data_len);
+        if (rc < 0)
+            break;
+        teatime_compute_groups(obj, count, &groups_x, &groups_y);
+        glUseProgram(obj->program);
+        TEATIME_BREAKONERROR(glUseProgram, rc);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ibuf);
+        TEATIME_BREAKONERROR(glBindBufferBase, rc);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, obuf);
+        TEATIME_BREAKONERROR(glBindBufferBase, rc);
+        glUniform4uiv(obj->locn_key, 1, ikey);
+        TEATIME_BREAKONERROR(glUniform4uiv, rc);
+        glUniform1ui(obj->locn_rounds, rounds);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        glUniform1ui(obj->locn_count, count);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        if (TEATIME_IS_CTR(obj->program_direction)) {
+            glUniform2ui(obj->locn_counter, (GLuint)(obj->counter >> 32),
+                    (GLuint)obj->counter);
+            TEATIME_BREAKONERROR(glUniform2ui, rc);
+        }
+        if (obj->program_direction == TEATIME_CBC_DECRYPT) {
+            glUniform2ui(obj->locn_iv, obj->iv[0], obj->iv[1]);
+            TEATIME_BREAKONERROR(glUniform2ui, rc);
+        }
+        start = teatime_stats_begin(obj, TEATIME_STAGE_DRAW, true);
+        glDispatchCompute(groups_x, groups_y, 1);
+        teatime_stats_end(obj, TEATIME_STAGE_DRAW, start,
+                (uint64_t)obj->data_len * sizeof(uint32_t));
+        TEATIME_BREAKONERROR(glDispatchCompute, rc);
+        /* the next dispatch carries on from the last block of this one */
+        if (TEATIME_IS_CTR(obj->program_direction))
+            obj->counter += obj->data_len / 2;
+        /* the output is either read back or the input of the next run */
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+        TEATIME_BREAKONERROR(glMemoryBarrier, rc);
+        rc = 0;
+    } while (0);
+    return rc;
+}
+
+/* issues the draw for the current textures without waiting for it */
+static int teatime_dispatch(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds)
+{
+    int rc = 0;
+    if (obj->backend == TEATIME_BACKEND_COMPUTE)
+        return teatime_dispatch_compute(obj, obj->issbo, obj->ossbo, ikey, rounds);
+    do {
+        uint64_t start = 0;
+        if (obj->program_fanout != obj->tex_layers) {
+            teatime_log(TEATIME_LOG_ERROR, "Program fan-out %u does not match the texture layers %u. "
+                    "Use teatime_load_program() after teatime_set_fanout()\n",
+                    obj->program_fanout, obj->tex_layers);
+            rc = -EINVAL;
+            break;
+        }
+        rc = teatime_check_program(obj, rounds);
+        if (rc < 0)
+            break;
+        rc = teatime_check_length(obj, obj->data_len);
+        if (rc < 0)
+            break;
+        glUseProgram(obj->program);
+        TEATIME_BREAKONERROR(glUseProgram, rc);
+        glActiveTexture(GL_TEXTURE0);
+        TEATIME_BREAKONERROR(glActiveTexture, rc);
+        glBindTexture(TEATIME_TEXTURE_TARGET(obj->tex_layers), obj->itexid);
+        TEATIME_BREAKONERROR(glBindTexture, rc);
+        glUniform1i(obj->locn_input, 0);
+        TEATIME_BREAKONERROR(glUniform1i, rc);
+        glActiveTexture(GL_TEXTURE1);
+        TEATIME_BREAKONERROR(glActiveTexture, rc);
+        glBindTexture(TEATIME_TEXTURE_TARGET(obj->tex_layers), obj->otexid);
+        TEATIME_BREAKONERROR(glBindTexture, rc);
+        glUniform1i(obj->locn_output, 1);
+        TEATIME_BREAKONERROR(glUniform1i, rc);
+        glUniform4uiv(obj->locn_key, 1, ikey);
+        TEATIME_BREAKONERROR(glUniform1uiv, rc);
+        glUniform1ui(obj->locn_rounds, rounds);
+        TEATIME_BREAKONERROR(glUniform1ui, rc);
+        if (TEATIME_IS_CTR(obj->program_direction)) {
+            glUniform2ui(obj->locn_counter, (GLuint)(obj->counter >> 32),
+                    (GLuint)obj->counter);
+            TEATIME_BREAKONERROR(glUniform2ui, rc);
+            glUniform1ui(obj->locn_width, obj->data_width);
+            TEATIME_BREAKONERROR(glUniform1ui, rc);
+        }
+        if (obj->program_direction == TEATIME_CBC_DECRYPT) {
+            glUniform2ui(obj->locn_iv, obj->iv[0], obj->iv[1]);
+            TEATIME_BREAKONERROR(glUniform2ui, rc);
+            glUniform1ui(obj->locn_width, obj->data_width);
+            TEATIME_BREAKONERROR(glUniform1ui, rc);
+        }
+        /* render */
+        start = teatime_stats_begin(obj, TEATIME_STAGE_DRAW, true);
+        teatime_draw(obj);
+        teatime_stats_end(obj, TEATIME_STAGE_DRAW, start,
+                (uint64_t)obj->data_len * sizeof(uint32_t));
+        /* the next dispatch carries on from the last block of this one */
+        if (TEATIME_IS_CTR(obj->program_direction))
+            obj->counter += obj->data_len / 2;
+        rc = 0;
+    } while (0);
+    return rc;
+}
+
+int teatime_run_program(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds)
+{
+    if (obj && TEATIME_HAS_PROGRAM(obj) && (obj->itexid > 0 || obj->data_loaded)) {
+        int rc = 0;
+        if (obj->backend == TEATIME_BACKEND_CPU)
+            return teatime_run_cpu(obj, ikey, rounds, obj->cpu_data, obj->cpu_data,
+                    obj->data_len);
+        do {
+            /* in fast mode the readback is what waits for the draw */
+            if (teatime_error_checks == TEATIME_CHECKS_FULL)
+                glFinish();
+            rc = teatime_dispatch(obj, ikey, rounds);
+            if (rc < 0)
+                break;
+            if (teatime_error_checks == TEATIME_CHECKS_FULL)
+                glFinish();
+            if (obj->backend == TEATIME_BACKEND_FRAGMENT)
+                TEATIME_BREAKONERROR_FB(Rendering, rc);
+            TEATIME_BREAKONERROR(Rendering, rc);
+            rc = 0;
+        } while (0);
+        TEATIME_CHECK_OPERATION(obj, rc);
+        return rc;
+    }
+    return -EINVAL;
+}
+
+void teatime_delete_textures(teatime_t *obj)
+{
+    /* the textures go back to the pool for the next request */
+    if (obj) {
+        if (obj->itexid != 0) {
+            teatime_pool_release(obj, obj->itexid);
+            glBindFramebuffer(GL_FRAMEBUFFER, obj->ofb);
+        }
+        obj->itexid = obj->otexid = 0;
+        obj->data_loaded = false;
+    }
+}
+
+void teatime_clear_pool(teatime_t *obj)
+{
+    if (obj) {
+        teatime_delete_textures(obj);
+        for (uint32_t i = 0; i < obj->pool_len; ++i)
+            teatime_free_texpair(&(obj->pool[i]));
+        free(obj->pool);
+        obj->pool = NULL;
+        obj->pool_len = obj->pool_max = 0;
+        if (obj->issbo > 0)
+            glDeleteBuffers(1, &(obj->issbo));
+        if (obj->ossbo > 0)
+            glDeleteBuffers(1, &(obj->ossbo));
+        obj->issbo = obj->ossbo = 0;
+        obj->ssbo_size = 0;
+        obj->pool_stats.pairs = obj->pool_stats.in_use = 0;
+    }
+}
+
+void teatime_set_pool_size(teatime_t *obj, uint32_t npairs)
+{
+    if (obj) {
+        obj->pool_size = npairs;
+        /* evict anything beyond the new size */
+        teatime_pool_release(obj, 0);
+    }
+}
+
+void teatime_get_pool_stats(const teatime_t *obj, teatime_pool_stats_t *stats)
+{
+    if (obj && stats)
+        *stats = obj->pool_stats;
+}
+
+void teatime_delete_program(teatime_t *obj)
+{
+    /* the program stays resident in the cache for the next caller */
+    if (obj) {
+        obj->program = 0;
+        obj->program_fanout = 0;
+        obj->program_local_size = 0;
+        obj->program_rounds = 0;
+        obj->program_direction = -1;
+        obj->program_algorithm = TEATIME_ALG_TEA;
+        obj->program_block_words = 2;
+        obj->locn_input = obj->locn_output = -1;
+        obj->locn_key = obj->locn_rounds = -1;
+        obj->locn_count = -1;
+        obj->locn_counter = obj->locn_width = -1;
+        obj->locn_iv = obj->locn_chain = obj->locn_ivs = -1;
+        obj->locn_keys = obj->locn_kindex = -1;
+        obj->locn_known = obj->locn_target = -1;
+    }
+}
+
+void teatime_clear_programs(teatime_t *obj)
+{
+    if (obj) {
+        teatime_delete_program(obj);
+        for (uint32_t i = 0; i < obj->num_programs; ++i) {
+            if (obj->programs[i].program > 0)
+                glDeleteProgram(obj->programs[i].program);
+        }
+        free(obj->programs);
+        obj->programs = NULL;
+        obj->num_programs = obj->max_programs = 0;
+    }
+}
+
+int teatime_set_cache_dir(teatime_t *obj, const char *dir)
+{
+    if (obj) {
+        char *cdir = NULL;
+        if (dir && dir[0] != '\0') {
+            cdir = strdup(dir);
+            if (!cdir) {
+                teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                        strlen(dir) + 1);
+                return -ENOMEM;
+            }
+            /* create the directory and its parents if necessary */
+            for (char *p = strchr(cdir + 1, '/'); ; p = strchr(p + 1, '/')) {
+                if (p)
+                    *p = '\0';
+                if (mkdir(cdir, 0700) < 0 && errno != EEXIST) {
+                    int err = errno;
+                    teatime_log(TEATIME_LOG_WARN, "Unable to create cache directory %s: %s\n",
+                            cdir, strerror(err));
+                    free(cdir);
+                    return -err;
+                }
+                if (!p)
+                    break;
+                *p = '/';
+            }
+            teatime_log(TEATIME_LOG_INFO, "Using program binary cache directory: %s\n",
+                    cdir);
+        }
+        free(obj->cache_dir);
+        obj->cache_dir = cdir;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+void teatime_print_version(FILE *fp)
+{
+    const GLubyte *version = NULL;
+    version = glGetString(GL_VERSION);
+    fprintf(fp, "GL Version: %s\n", (const char *)version);
+    version = glGetString(GL_SHADING_LANGUAGE_VERSION);
+    fprintf(fp, "GLSL Version: %s\n", (const char *)version);
+    version = glGetString(GL_VENDOR);
+    fprintf(fp, "GL Vendor: %s\n", (const char *)version);
+}
+
+int teatime_check_gl_version(uint32_t *major, uint32_t *minor)
+{
+    const GLubyte *version = NULL;
+    version = glGetString(GL_VERSION);
+    if (version) {
+        uint32_t ver[2] = { 0, 0 };
+        char *endp = NULL;
+        char *endp2 = NULL;
+        errno = 0;
+        ver[0] = strtol((const char *)version, &endp, 10);
+        if (errno == ERANGE || (const void *)endp == (const void *)version) {
+            teatime_log(TEATIME_LOG_ERROR, "Version string %s cannot be parsed\n",
+                    (const char *)version);
+            return -1;
+        }
+        /* endp[0] = '.' and endp[1] points to minor */
+        errno = 0;
+        ver[1] = strtol((const char *)&endp[1], &endp2, 10);
         if (errno == ERANGE || endp2 == &endp[1]) {
-            fprintf(stderr, "Version string %s cannot be parsed\n", (const char *)version);
+            teatime_log(TEATIME_LOG_ERROR, "Version string %s cannot be parsed\n",
+                    (const char *)version);
             return -1;
         }
         if (major)
@@ -378,134 +3876,1352 @@ int teatime_check_gl_version(uint32_t *major, uint32_t *minor)
     return -1;
 }
 
-int teatime_check_gl_errors(int line, const char *fn_name)
+void teatime_log(int level, const char *fmt, ...)
+{
+    va_list ap;
+    if (level <= TEATIME_LOG_NONE || level > teatime_log_level)
+        return;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void teatime_set_log_level(int level)
+{
+    TEATIME_READ_ENV();
+    if (level < TEATIME_LOG_NONE)
+        level = TEATIME_LOG_NONE;
+    if (level > TEATIME_LOG_DEBUG)
+        level = TEATIME_LOG_DEBUG;
+    teatime_log_level = level;
+}
+
+int teatime_get_log_level(void)
+{
+    return teatime_log_level;
+}
+
+/* the level is a name such as "warn" or a no. */
+static int teatime_parse_log_level(const char *str)
+{
+    const char *names[] = { "none", "error", "warn", "info", "debug" };
+    for (int i = TEATIME_LOG_NONE; i <= TEATIME_LOG_DEBUG; ++i) {
+        if (strcmp(str, names[i]) == 0)
+            return i;
+    }
+    return atoi(str);
+}
+
+/*
+ * The environment sets the defaults once per process, so that it neither
+ * overrides what the caller set nor races with threads that set up engine
+ * objects of their own.
+ */
+static void teatime_read_env(void)
+{
+    const char *level = getenv("TEATIME_LOG_LEVEL");
+    const char *checks = getenv("TEATIME_CHECKS");
+    if (level) {
+        teatime_log_level = teatime_parse_log_level(level);
+        if (teatime_log_level < TEATIME_LOG_NONE)
+            teatime_log_level = TEATIME_LOG_NONE;
+        if (teatime_log_level > TEATIME_LOG_DEBUG)
+            teatime_log_level = TEATIME_LOG_DEBUG;
+    }
+    if (checks)
+        teatime_error_checks = (strcmp(checks, "fast") == 0) ?
+            TEATIME_CHECKS_FAST : TEATIME_CHECKS_FULL;
+}
+
+/*
+ * Fast checks apply to every engine object of the process, since the checks
+ * are made in helpers that do not know which object they work for.
+ */
+int teatime_set_error_checks(int mode)
+{
+    TEATIME_READ_ENV();
+    if (mode == TEATIME_CHECKS_FULL || mode == TEATIME_CHECKS_FAST) {
+        teatime_error_checks = mode;
+        return 0;
+    }
+    teatime_log(TEATIME_LOG_ERROR, "Invalid error checking mode %d\n", mode);
+    return -EINVAL;
+}
+
+int teatime_get_error_checks(void)
+{
+    return teatime_error_checks;
+}
+
+/*
+ * KHR_debug messages, which may come from a driver thread. Only GL errors are
+ * logged as errors. The rest are mostly performance hints and driver chatter,
+ * so they are logged a level below their severity.
+ */
+static void APIENTRY teatime_debug_callback(GLenum source, GLenum type, GLuint id,
+        GLenum severity, GLsizei length, const GLchar *message, const void *user)
+{
+    int level = TEATIME_LOG_DEBUG;
+    (void)source;
+    (void)user;
+    if (type == GL_DEBUG_TYPE_ERROR)
+        level = TEATIME_LOG_ERROR;
+    else if (severity == GL_DEBUG_SEVERITY_HIGH)
+        level = TEATIME_LOG_WARN;
+    else if (severity == GL_DEBUG_SEVERITY_MEDIUM)
+        level = TEATIME_LOG_INFO;
+    while (length > 0 && message[length - 1] == '\n')
+        --length;
+    teatime_log(level, "GL debug message %u: %.*s\n", id, (int)length, message);
+}
+
+int teatime_check_gl_errors(int line, const char *fn_name)
+{
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR) {
+        const GLubyte *estr = gluErrorString(err);
+        teatime_log(TEATIME_LOG_ERROR, "%s(): GL Error(%d) on line %d: %s\n", fn_name,
+                err, line, (const char *)estr);
+        return -1;
+    }
+    return 0;
+}
+
+int teatime_check_gl_fb_errors(int line, const char *fn_name)
+{
+    GLenum st = (GLenum)glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    switch (st) {
+    case GL_FRAMEBUFFER_COMPLETE:
+        return 0;
+    case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:
+        teatime_log(TEATIME_LOG_ERROR, "%s(): GL FB error on line %d: incomplete attachment\n",
+                fn_name, line);
+        break;
+    case GL_FRAMEBUFFER_UNSUPPORTED:
+        teatime_log(TEATIME_LOG_ERROR, "%s(): GL FB error on line %d: unsupported\n",
+                fn_name, line);
+        break;
+    case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT:
+        teatime_log(TEATIME_LOG_ERROR, "%s(): GL FB error on line %d: incomplete missing attachment\n",
+                fn_name, line);
+        break;
+    case GL_FRAMEBUFFER_INCOMPLETE_DIMENSIONS_EXT:
+        teatime_log(TEATIME_LOG_ERROR, "%s(): GL FB error on line %d: incomplete dimensions\n",
+                fn_name, line);
+        break;
+    case GL_FRAMEBUFFER_INCOMPLETE_FORMATS_EXT:
+        teatime_log(TEATIME_LOG_ERROR, "%s(): GL FB error on line %d: incomplete formats\n",
+                fn_name, line);
+        break;
+    case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:
+        teatime_log(TEATIME_LOG_ERROR, "%s(): GL FB error on line %d: incomplete draw buffer\n",
+                fn_name, line);
+        break;
+    case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:
+        teatime_log(TEATIME_LOG_ERROR, "%s(): GL FB error on line %d: incomplete read buffer\n",
+                fn_name, line);
+        break;
+    default:
+        teatime_log(TEATIME_LOG_ERROR, "%s(): GL FB error on line %d: Unknown. Error Value: %d\n",
+                fn_name, line, st);
+        break;
+    }
+    return -1;
+}
+
+int teatime_check_program_errors(GLuint program)
+{
+    GLint ilen = 0;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &ilen);
+    if (ilen > 1) {
+        GLsizei wb = 0;
+        GLchar *buf = calloc(ilen, sizeof(GLchar));
+        if (!buf) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %d bytes\n", ilen);
+            return -ENOMEM;
+        }
+        glGetProgramInfoLog(program, ilen, &wb, buf);
+        buf[wb] = '\0';
+        teatime_log(TEATIME_LOG_ERROR, "Program Errors:\n%s\n",
+                (const char *)buf);
+        free(buf);
+    }
+    return 0;
+}
+
+int teatime_check_shader_errors(GLuint shader)
+{
+    GLint ilen = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &ilen);
+    if (ilen > 1) {
+        GLsizei wb = 0;
+        GLchar *buf = calloc(ilen, sizeof(GLchar));
+        if (!buf) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %d bytes\n", ilen);
+            return -ENOMEM;
+        }
+        glGetShaderInfoLog(shader, ilen, &wb, buf);
+        buf[wb] = '\0';
+        teatime_log(TEATIME_LOG_ERROR, "Shader Errors:\n%s\n",
+                (const char *)buf);
+        free(buf);
+    }
+    return 0;
+}
+
+#define TEA_SHADER_HEADER \
+"#version 130\n" \
+"#extension GL_EXT_gpu_shader4 : enable\n"
+
+/* replaces TEA_SHADER_HEADER in a core profile, where the kernels need
+ * nothing beyond GLSL 1.50 */
+#define TEA_CORE_SHADER_HEADER "#version 150\n"
+
+/* one triangle, (-1,-1) (3,-1) (-1,3), whose clipped part is the viewport */
+#define TEA_VERTEX_SOURCE \
+"void main(void) { \n" \
+" vec2 p = vec2(float((gl_VertexID & 1) << 2), float((gl_VertexID & 2) << 1)); \n" \
+" gl_Position = vec4(p - 1.0, 0.0, 1.0); \n" \
+"}\n"
+
+static void teatime_shader_source(const teatime_t *obj, GLuint shader,
+        const char *source)
+{
+    const char *strings[2] = { TEA_CORE_SHADER_HEADER, source };
+    size_t hlen = strlen(TEA_SHADER_HEADER);
+    /* the engine's own sources are rewritten, caller sources are not */
+    if (obj->have_core && strncmp(source, TEA_SHADER_HEADER, hlen) == 0) {
+        strings[1] = source + hlen;
+        glShaderSource(shader, 2, strings, NULL);
+    } else {
+        glShaderSource(shader, 1, &source, NULL);
+    }
+}
+
+static int teatime_vertex_shader(teatime_t *obj)
+{
+    int rc = 0;
+    if (obj->vertex_shader > 0)
+        return 0;
+    do {
+        obj->vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+        TEATIME_BREAKONERROR(glCreateShader, rc);
+        teatime_shader_source(obj, obj->vertex_shader,
+                TEA_SHADER_HEADER TEA_VERTEX_SOURCE);
+        TEATIME_BREAKONERROR(glShaderSource, rc);
+        glCompileShader(obj->vertex_shader);
+        rc = teatime_check_shader_errors(obj->vertex_shader);
+        if (rc < 0) break;
+        TEATIME_BREAKONERROR(glCompileShader, rc);
+    } while (0);
+    if (rc < 0 && obj->vertex_shader > 0) {
+        glDeleteShader(obj->vertex_shader);
+        obj->vertex_shader = 0;
+    }
+    return rc;
+}
+
+/* fragment program binaries include the vertex shader, whose source differs
+ * between the profiles */
+static uint64_t teatime_vertex_hash(const teatime_t *obj, uint64_t hash)
+{
+    const char *vs = obj->have_core ? TEA_CORE_SHADER_HEADER TEA_VERTEX_SOURCE :
+        TEA_SHADER_HEADER TEA_VERTEX_SOURCE;
+    if (obj->backend != TEATIME_BACKEND_FRAGMENT)
+        return hash;
+    return teatime_hash(vs, strlen(vs), hash);
+}
+
+#define TEA_SHADER_UNIFORMS \
+"uniform uvec4 ikey; \n" \
+"uniform uint rounds; \n"
+
+#define TEA_ENCRYPT_ROUNDS \
+" uint delta = uint(0x9e3779b9); \n" \
+" uint sum = uint(0); \n" \
+" for (uint i = uint(0); i < rounds; ++i) {\n" \
+"  sum += delta; \n" \
+"  x[0] += (((x[1] << 4) + ikey[0]) ^ (x[1] + sum)) ^ ((x[1] >> 5) + ikey[1]);\n" \
+"  x[1] += (((x[0] << 4) + ikey[2]) ^ (x[0] + sum)) ^ ((x[0] >> 5) + ikey[3]);\n" \
+"  x[2] += (((x[3] << 4) + ikey[0]) ^ (x[3] + sum)) ^ ((x[3] >> 5) + ikey[1]);\n" \
+"  x[3] += (((x[2] << 4) + ikey[2]) ^ (x[2] + sum)) ^ ((x[2] >> 5) + ikey[3]);\n" \
+" }\n"
+
+#define TEA_DECRYPT_ROUNDS \
+" uint delta = uint(0x9e3779b9); \n" \
+" uint sum = delta * rounds; \n" \
+" for (uint i = uint(0); i < rounds; ++i) {\n" \
+"  x[1] -= (((x[0] << 4) + ikey[2]) ^ (x[0] + sum)) ^ ((x[0] >> 5) + ikey[3]);\n" \
+"  x[0] -= (((x[1] << 4) + ikey[0]) ^ (x[1] + sum)) ^ ((x[1] >> 5) + ikey[1]);\n" \
+"  x[3] -= (((x[2] << 4) + ikey[2]) ^ (x[2] + sum)) ^ ((x[2] >> 5) + ikey[3]);\n" \
+"  x[2] -= (((x[3] << 4) + ikey[0]) ^ (x[3] + sum)) ^ ((x[3] >> 5) + ikey[1]);\n" \
+"  sum -= delta; \n" \
+" }\n"
+
+/*
+ * The specialized kernels bake the round sums in as constants and unroll
+ * every round. The first words of both blocks of a texel go in one uvec2 and
+ * the second words in another, so each statement works on both blocks.
+ */
+#define TEA_UNROLLED_BEGIN \
+" uvec2 y = x.xz; \n" \
+" uvec2 z = x.yw; \n"
+
+#define TEA_UNROLLED_ENCRYPT_ROUND \
+" y += ((z << 4u) + ikey.x) ^ (z + %uu) ^ ((z >> 5u) + ikey.y);\n" \
+" z += ((y << 4u) + ikey.z) ^ (y + %uu) ^ ((y >> 5u) + ikey.w);\n"
+
+#define TEA_UNROLLED_DECRYPT_ROUND \
+" z -= ((y << 4u) + ikey.z) ^ (y + %uu) ^ ((y >> 5u) + ikey.w);\n" \
+" y -= ((z << 4u) + ikey.x) ^ (z + %uu) ^ ((z >> 5u) + ikey.y);\n"
+
+#define TEA_UNROLLED_END \
+" x = uvec4(y.x, z.x, y.y, z.y); \n"
+
+/*
+ * XTEA picks the key word of each half-round from the running sum, which
+ * is the same in all the fragments, so the runtime loop indexes the key and
+ * the specialized kernels bake the choice in along with the sums.
+ */
+#define XTEA_ENCRYPT_ROUNDS \
+" uint delta = uint(0x9e3779b9); \n" \
+" uint sum = uint(0); \n" \
+" for (uint i = uint(0); i < rounds; ++i) {\n" \
+"  uint k = ikey[sum & 3u]; \n" \
+"  x[0] += (((x[1] << 4) ^ (x[1] >> 5)) + x[1]) ^ (sum + k);\n" \
+"  x[2] += (((x[3] << 4) ^ (x[3] >> 5)) + x[3]) ^ (sum + k);\n" \
+"  sum += delta; \n" \
+"  k = ikey[(sum >> 11) & 3u]; \n" \
+"  x[1] += (((x[0] << 4) ^ (x[0] >> 5)) + x[0]) ^ (sum + k);\n" \
+"  x[3] += (((x[2] << 4) ^ (x[2] >> 5)) + x[2]) ^ (sum + k);\n" \
+" }\n"
+
+#define XTEA_DECRYPT_ROUNDS \
+" uint delta = uint(0x9e3779b9); \n" \
+" uint sum = delta * rounds; \n" \
+" for (uint i = uint(0); i < rounds; ++i) {\n" \
+"  uint k = ikey[(sum >> 11) & 3u]; \n" \
+"  x[1] -= (((x[0] << 4) ^ (x[0] >> 5)) + x[0]) ^ (sum + k);\n" \
+"  x[3] -= (((x[2] << 4) ^ (x[2] >> 5)) + x[2]) ^ (sum + k);\n" \
+"  sum -= delta; \n" \
+"  k = ikey[sum & 3u]; \n" \
+"  x[0] -= (((x[1] << 4) ^ (x[1] >> 5)) + x[1]) ^ (sum + k);\n" \
+"  x[2] -= (((x[3] << 4) ^ (x[3] >> 5)) + x[3]) ^ (sum + k);\n" \
+" }\n"
+
+#define XTEA_UNROLLED_ENCRYPT_ROUND \
+" y += (((z << 4u) ^ (z >> 5u)) + z) ^ (ikey.%c + %uu);\n" \
+" z += (((y << 4u) ^ (y >> 5u)) + y) ^ (ikey.%c + %uu);\n"
+
+#define XTEA_UNROLLED_DECRYPT_ROUND \
+" z -= (((y << 4u) ^ (y >> 5u)) + y) ^ (ikey.%c + %uu);\n" \
+" y -= (((z << 4u) ^ (z >> 5u)) + z) ^ (ikey.%c + %uu);\n"
+
+/*
+ * XXTEA works on an array v of n words. The runtime loop is formatted with
+ * n, and the specialized kernels unroll the passes over the block as well
+ * as the words of each pass. Blocks of 2 or 4 words are taken from the
+ * texel in x, longer blocks are loaded by TEA_COMPUTE_WORDS_PROLOGUE.
+ */
+#define XXTEA_MX(S, K) \
+"(((z >> 5u) ^ (y << 2u)) + ((y >> 3u) ^ (z << 4u))) ^ ((" S " ^ y) + (" K " ^ z))"
+
+#define XXTEA_ENCRYPT_ROUNDS \
+" {\n" \
+"  const uint n = %uu; \n" \
+"  uint sum = 0u; \n" \
+"  uint z = v[n - 1u]; \n" \
+"  for (uint i = 0u; i < rounds; ++i) {\n" \
+"   sum += 0x9e3779b9u; \n" \
+"   uint e = (sum >> 2u) & 3u; \n" \
+"   for (uint p = 0u; p < n; ++p) {\n" \
+"    uint y = v[(p + 1u) %% n]; \n" \
+"    v[p] += " XXTEA_MX("sum", "ikey[(p & 3u) ^ e]") "; \n" \
+"    z = v[p]; \n" \
+"   }\n" \
+"  }\n" \
+" }\n"
+
+#define XXTEA_DECRYPT_ROUNDS \
+" {\n" \
+"  const uint n = %uu; \n" \
+"  uint sum = rounds * 0x9e3779b9u; \n" \
+"  uint y = v[0]; \n" \
+"  for (uint i = 0u; i < rounds; ++i) {\n" \
+"   uint e = (sum >> 2u) & 3u; \n" \
+"   for (uint q = n; q > 0u; --q) {\n" \
+"    uint p = q - 1u; \n" \
+"    uint z = v[(p + n - 1u) %% n]; \n" \
+"    v[p] -= " XXTEA_MX("sum", "ikey[(p & 3u) ^ e]") "; \n" \
+"    y = v[p]; \n" \
+"   }\n" \
+"   sum -= 0x9e3779b9u; \n" \
+"  }\n" \
+" }\n"
+
+#define XXTEA_UNROLLED_BEGIN \
+" {\n" \
+"  uint y = v[0]; \n" \
+"  uint z = v[%u]; \n"
+
+#define XXTEA_UNROLLED_ENCRYPT_WORD \
+"  y = v[%u]; \n" \
+"  v[%u] += " XXTEA_MX("%uu", "ikey.%c") "; \n" \
+"  z = v[%u]; \n"
+
+#define XXTEA_UNROLLED_DECRYPT_WORD \
+"  z = v[%u]; \n" \
+"  v[%u] -= " XXTEA_MX("%uu", "ikey.%c") "; \n" \
+"  y = v[%u]; \n"
+
+#define XXTEA_UNROLLED_END " }\n"
+
+#define XXTEA_TEXEL_BEGIN_2 " {\n uint v[2] = uint[2](x.%c, x.%c); \n"
+#define XXTEA_TEXEL_END_2 "  x.%c%c = uvec2(v[0], v[1]); \n }\n"
+#define XXTEA_TEXEL_BEGIN_4 " {\n uint v[4] = uint[4](x.x, x.y, x.z, x.w); \n"
+#define XXTEA_TEXEL_END_4 "  x = uvec4(v[0], v[1], v[2], v[3]); \n }\n"
+
+#define TEA_DELTA 0x9e3779b9U
+
+#define TEA_KERNEL_PROLOGUE \
+TEA_SHADER_HEADER \
+"uniform usampler2D idata;\n" \
+TEA_SHADER_UNIFORMS \
+"out uvec4 odata; \n" \
+"void main(void) {\n" \
+" uvec4 x = texelFetch(idata, ivec2(gl_FragCoord.xy), 0);\n"
+
+#define TEA_KERNEL_EPILOGUE \
+" odata = x; \n" \
+"}\n"
+
+#define TEA_ENCRYPT_SOURCE \
+TEA_KERNEL_PROLOGUE \
+TEA_ENCRYPT_ROUNDS \
+TEA_KERNEL_EPILOGUE
+
+#define TEA_DECRYPT_SOURCE \
+TEA_KERNEL_PROLOGUE \
+TEA_DECRYPT_ROUNDS \
+TEA_KERNEL_EPILOGUE
+
+#define XTEA_ENCRYPT_SOURCE \
+TEA_KERNEL_PROLOGUE \
+XTEA_ENCRYPT_ROUNDS \
+TEA_KERNEL_EPILOGUE
+
+#define XTEA_DECRYPT_SOURCE \
+TEA_KERNEL_PROLOGUE \
+XTEA_DECRYPT_ROUNDS \
+TEA_KERNEL_EPILOGUE
+
+/*
+ * The fan-out kernels read one texel from each layer of the input array
+ * texture and write each result to its own render target.
+ */
+#define TEA_FANOUT_PROLOGUE \
+TEA_SHADER_HEADER \
+"uniform usampler2DArray idata;\n" \
+TEA_SHADER_UNIFORMS
+
+#define TEA_FANOUT_OUTPUT "out uvec4 odata[%u]; \n"
+#define TEA_FN_BEGIN "uvec4 tea(uvec4 x) {\n"
+#define TEA_FN_END " return x; \n}\n"
+#define TEA_FANOUT_MAIN_BEGIN "void main(void) {\n"
+#define TEA_FANOUT_MAIN_LAYER \
+" odata[%u] = tea(texelFetch(idata, ivec3(ivec2(gl_FragCoord.xy), %u), 0));\n"
+#define TEA_FANOUT_MAIN_END "}\n"
+
+/*
+ * The compute kernels read a texel worth of data, i.e. two blocks, per
+ * invocation straight from the input storage buffer. The tail of the last
+ * texel may be stale data whose result is never read back.
+ */
+#define TEA_COMPUTE_DECLS \
+"#version 430\n" \
+"layout(local_size_x = %u) in;\n" \
+"layout(std430, binding = 0) readonly buffer ibuf { uvec4 idata[]; };\n" \
+"layout(std430, binding = 1) writeonly buffer obuf { uvec4 odata[]; };\n" \
+TEA_SHADER_UNIFORMS \
+"uniform uint count; \n"
+
+#define TEA_COMPUTE_MAIN \
+"void main(void) {\n" \
+" uint idx = (gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x) *\n" \
+"  gl_WorkGroupSize.x + gl_LocalInvocationID.x;\n" \
+" if (idx >= count) return;\n"
+
+#define TEA_COMPUTE_PROLOGUE \
+TEA_COMPUTE_DECLS \
+TEA_COMPUTE_MAIN \
+" uvec4 x = idata[idx];\n"
+
+#define TEA_COMPUTE_EPILOGUE \
+" odata[idx] = x; \n" \
+"}\n"
+
+/*
+ * XXTEA blocks longer than a texel get an invocation each, which reads its
+ * block word by word into v. It is formatted with the workgroup size and
+ * then the block length three times.
+ */
+#define TEA_COMPUTE_WORDS_PROLOGUE \
+"#version 430\n" \
+"layout(local_size_x = %u) in;\n" \
+"layout(std430, binding = 0) readonly buffer ibuf { uint idata[]; };\n" \
+"layout(std430, binding = 1) writeonly buffer obuf { uint odata[]; };\n" \
+TEA_SHADER_UNIFORMS \
+"uniform uint count; \n" \
+TEA_COMPUTE_MAIN \
+" uint v[%u]; \n" \
+" for (uint j = 0u; j < %uu; ++j) v[j] = idata[idx * %uu + j]; \n"
+
+/* formatted with the block length twice */
+#define TEA_COMPUTE_WORDS_EPILOGUE \
+" for (uint j = 0u; j < %uu; ++j) odata[idx * %uu + j] = v[j]; \n" \
+"}\n"
+
+/*
+ * The CTR kernels encrypt the counters of the two blocks of a texel instead
+ * of its data. The counter of block n of a dispatch is counter + n as a 64-bit
+ * number, high word first, and n follows from the texel's position so no
+ * counters are uploaded. The keystream kernels never read the input.
+ */
+#define TEA_CTR_UNIFORMS \
+"uniform uvec2 counter; \n"
+
+#define TEA_CTR_COUNTER \
+" uint lo = counter.y + n; \n" \
+" uint hi = counter.x + ((lo < n) ? 1u : 0u); \n" \
+" uvec4 x = uvec4(hi, lo, hi + ((lo == 0xffffffffu) ? 1u : 0u), lo + 1u); \n"
+
+#define TEA_CTR_PROLOGUE \
+TEA_SHADER_HEADER \
+"uniform usampler2D idata;\n" \
+TEA_SHADER_UNIFORMS \
+TEA_CTR_UNIFORMS \
+"uniform uint width; \n" \
+"out uvec4 odata; \n" \
+"void main(void) {\n" \
+" uint n = 2u * (uint(gl_FragCoord.y) * width + uint(gl_FragCoord.x)); \n" \
+TEA_CTR_COUNTER
+
+#define TEA_CTR_EPILOGUE \
+" odata = x ^ texelFetch(idata, ivec2(gl_FragCoord.xy), 0); \n" \
+"}\n"
+
+#define TEA_COMPUTE_CTR_PROLOGUE \
+TEA_COMPUTE_DECLS \
+TEA_CTR_UNIFORMS \
+TEA_COMPUTE_MAIN \
+" uint n = 2u * idx; \n" \
+TEA_CTR_COUNTER
+
+#define TEA_COMPUTE_CTR_EPILOGUE \
+" odata[idx] = x ^ idata[idx]; \n" \
+"}\n"
+
+/*
+ * CBC decryption XORs each decrypted block with the ciphertext block before
+ * it, which is the first block of the same texel or the second block of the
+ * previous texel, and the IV for the very first block of a dispatch.
+ */
+#define TEA_CBC_DECRYPT_PROLOGUE \
+TEA_SHADER_HEADER \
+"uniform usampler2D idata;\n" \
+TEA_SHADER_UNIFORMS \
+"uniform uvec2 iv; \n" \
+"uniform uint width; \n" \
+"out uvec4 odata; \n" \
+"void main(void) {\n" \
+" ivec2 p = ivec2(gl_FragCoord.xy); \n" \
+" uvec4 c = texelFetch(idata, p, 0); \n" \
+" uvec2 prev = iv; \n" \
+" if (p.x > 0) prev = texelFetch(idata, ivec2(p.x - 1, p.y), 0).zw; \n" \
+" else if (p.y > 0) prev = texelFetch(idata, ivec2(int(width) - 1, p.y - 1), 0).zw; \n" \
+" uvec4 x = c; \n"
+
+#define TEA_CBC_DECRYPT_EPILOGUE \
+" odata = x ^ uvec4(prev, c.xy); \n" \
+"}\n"
+
+#define TEA_COMPUTE_CBC_DECRYPT_PROLOGUE \
+TEA_COMPUTE_DECLS \
+"uniform uvec2 iv; \n" \
+TEA_COMPUTE_MAIN \
+" uvec4 c = idata[idx]; \n" \
+" uvec2 prev = (idx > 0u) ? idata[idx - 1u].zw : iv; \n" \
+" uvec4 x = c; \n"
+
+#define TEA_COMPUTE_CBC_DECRYPT_EPILOGUE \
+" odata[idx] = x ^ uvec4(prev, c.xy); \n" \
+"}\n"
+
+/*
+ * CBC encryption is serial within a message, so the kernels run many
+ * messages side by side instead. On the fragment backend every texel row is
+ * a message, and each draw encrypts one column reading the ciphertext of
+ * the previous column from the output texture, or the row's IV from the IV
+ * texture. On the compute backend every invocation loops over a message.
+ * Only one block of the two in x is used since the second one depends on
+ * the first.
+ */
+#define TEA_CBC_ENCRYPT_PROLOGUE \
+TEA_SHADER_HEADER \
+"uniform usampler2D idata;\n" \
+"uniform usampler2D cdata;\n" \
+"uniform usampler2D ivdata;\n" \
+TEA_SHADER_UNIFORMS \
+"out uvec4 odata; \n" \
+TEA_FN_BEGIN
+
+#define TEA_CBC_ENCRYPT_EPILOGUE \
+TEA_FN_END \
+"void main(void) {\n" \
+" ivec2 p = ivec2(gl_FragCoord.xy); \n" \
+" uvec4 d = texelFetch(idata, p, 0); \n" \
+" uvec2 c = (p.x > 0) ? texelFetch(cdata, ivec2(p.x - 1, p.y), 0).zw :\n" \
+"  texelFetch(ivdata, ivec2(0, p.y), 0).xy; \n" \
+" uvec4 b = tea(uvec4(d.xy ^ c, 0u, 0u)); \n" \
+" uvec4 e = tea(uvec4(d.zw ^ b.xy, 0u, 0u)); \n" \
+" odata = uvec4(b.xy, e.xy); \n" \
+"}\n"
+
+#define TEA_COMPUTE_CBC_ENCRYPT_PROLOGUE \
+TEA_COMPUTE_DECLS \
+"layout(std430, binding = 2) readonly buffer ivbuf { uvec2 ivs[]; };\n" \
+"uniform uint width; \n" \
+TEA_FN_BEGIN
+
+#define TEA_COMPUTE_CBC_ENCRYPT_EPILOGUE \
+TEA_FN_END \
+TEA_COMPUTE_MAIN \
+" uvec2 c = ivs[idx]; \n" \
+" for (uint i = idx * width; i < (idx + 1u) * width; ++i) {\n" \
+"  uvec4 d = idata[i]; \n" \
+"  uvec4 b = tea(uvec4(d.xy ^ c, 0u, 0u)); \n" \
+"  uvec4 e = tea(uvec4(d.zw ^ b.xy, 0u, 0u)); \n" \
+"  c = e.xy; \n" \
+"  odata[i] = uvec4(b.xy, e.xy); \n" \
+" }\n" \
+"}\n"
+
+/*
+ * The batch kernels run many segments under their own keys at once, and
+ * width is the no. of texels per segment. On the fragment backend a texel row
+ * holds whole segments side by side, and the key index texture has one texel
+ * per segment in the same layout, so texel p takes the index at (p.x / width,
+ * p.y) and its key from a texture of all the keys. The padding at the end of
+ * the last row is clamped to a valid key. On the compute backend the key
+ * indices and keys are in storage buffers. Either way ikey is a local that
+ * hides the uniform of the other kernels.
+ */
+#define TEA_BATCH_PROLOGUE \
+TEA_SHADER_HEADER \
+"uniform usampler2D idata;\n" \
+"uniform usampler2D kdata;\n" \
+"uniform usampler2D kidata;\n" \
+"uniform uint rounds; \n" \
+"uniform uint width; \n" \
+"out uvec4 odata; \n" \
+"void main(void) {\n" \
+" ivec2 p = ivec2(gl_FragCoord.xy); \n" \
+" int k = int(texelFetch(kidata, ivec2(p.x / int(width), p.y), 0).x); \n" \
+" ivec2 ks = textureSize(kdata, 0); \n" \
+" k = min(k, ks.x * ks.y - 1); \n" \
+" uvec4 ikey = texelFetch(kdata, ivec2(k % ks.x, k / ks.x), 0); \n" \
+" uvec4 x = texelFetch(idata, p, 0); \n"
+
+#define TEA_COMPUTE_BATCH_PROLOGUE \
+TEA_COMPUTE_DECLS \
+"layout(std430, binding = 2) readonly buffer kbuf { uvec4 keys[]; };\n" \
+"layout(std430, binding = 3) readonly buffer kibuf { uint kindex[]; };\n" \
+"uniform uint width; \n" \
+TEA_COMPUTE_MAIN \
+" uvec4 ikey = keys[kindex[idx / width]]; \n" \
+" uvec4 x = idata[idx];\n"
+
+/*
+ * The key search kernels try the key whose last 64 bits are counter plus the
+ * candidate's position n, high word first, on the two known plaintext blocks
+ * in a texel. Only keys that give both known ciphertext blocks write
+ * anything. The fragment kernels write a flag and discard the rest, so an
+ * occlusion query counts the hits, and the compute kernels append n to a
+ * hit list behind an atomic counter. The key is a parameter of tea() that
+ * hides the uniform.
+ */
+#define TEA_SEARCH_UNIFORMS \
+TEA_SHADER_UNIFORMS \
+"uniform uvec2 counter; \n" \
+"uniform uvec4 known; \n" \
+"uniform uvec4 target; \n"
+
+#define TEA_SEARCH_FN_BEGIN "uvec4 tea(uvec4 x, uvec4 ikey) {\n"
+
+#define TEA_SEARCH_KEY \
+" uint lo = counter.y + n; \n" \
+" uint hi = counter.x + ((lo < n) ? 1u : 0u); \n" \
+" bool hit = (tea(known, uvec4(ikey.xy, hi, lo)) == target); \n"
+
+#define TEA_SEARCH_PROLOGUE \
+TEA_SHADER_HEADER \
+TEA_SEARCH_UNIFORMS \
+"uniform uint width; \n" \
+"out uvec4 odata; \n" \
+TEA_SEARCH_FN_BEGIN
+
+#define TEA_SEARCH_EPILOGUE \
+TEA_FN_END \
+"void main(void) {\n" \
+" uint n = uint(gl_FragCoord.y) * width + uint(gl_FragCoord.x); \n" \
+TEA_SEARCH_KEY \
+" if (!hit) discard; \n" \
+" odata = uvec4(1u); \n" \
+"}\n"
+
+#define TEA_COMPUTE_SEARCH_PROLOGUE \
+"#version 430\n" \
+"layout(local_size_x = %u) in;\n" \
+"layout(std430, binding = 1) buffer hbuf { uint nhits; uint hits[]; };\n" \
+TEA_SEARCH_UNIFORMS \
+"uniform uint count; \n" \
+TEA_SEARCH_FN_BEGIN
+
+#define TEA_COMPUTE_SEARCH_EPILOGUE \
+TEA_FN_END \
+TEA_COMPUTE_MAIN \
+" uint n = idx; \n" \
+TEA_SEARCH_KEY \
+" if (hit) {\n" \
+"  uint slot = atomicAdd(nhits, 1u); \n" \
+"  if (slot < uint(hits.length())) hits[slot] = n; \n" \
+" }\n" \
+"}\n"
+
+static const char teatime_key_fields[4] = { 'x', 'y', 'z', 'w' };
+
+/* the XXTEA rounds over the array v of n words, see XXTEA_ENCRYPT_ROUNDS */
+static char *teatime_xxtea_source(uint32_t n, bool decrypt, uint32_t rounds)
 {
-    GLenum err = glGetError();
-    if (err != GL_NO_ERROR) {
-        const GLubyte *estr = gluErrorString(err);
-        fprintf(stderr, "%s(): GL Error(%d) on line %d: %s\n", fn_name,
-                err, line, (const char *)estr);
-        return -1;
+    const char *word = decrypt ? XXTEA_UNROLLED_DECRYPT_WORD :
+        XXTEA_UNROLLED_ENCRYPT_WORD;
+    size_t len = (rounds > 0) ? (strlen(XXTEA_UNROLLED_BEGIN) +
+        (size_t)rounds * n * (strlen(word) + 32) + strlen(XXTEA_UNROLLED_END) + 16) :
+        (strlen(decrypt ? XXTEA_DECRYPT_ROUNDS : XXTEA_ENCRYPT_ROUNDS) + 16);
+    char *source = calloc(len, sizeof(char));
+    size_t off = 0;
+    if (!source) {
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n", len);
+        return NULL;
     }
-    return 0;
+    if (rounds == 0) {
+        snprintf(source, len, decrypt ? XXTEA_DECRYPT_ROUNDS : XXTEA_ENCRYPT_ROUNDS, n);
+        return source;
+    }
+    off += snprintf(source + off, len - off, XXTEA_UNROLLED_BEGIN, n - 1);
+    for (uint32_t i = 0; i < rounds; ++i) {
+        /* the sum of pass i is delta * (i + 1), decryption runs backwards */
+        uint32_t sum = TEA_DELTA * (decrypt ? (rounds - i) : (i + 1));
+        uint32_t e = (sum >> 2) & 3;
+        for (uint32_t j = 0; j < n; ++j) {
+            uint32_t p = decrypt ? (n - 1 - j) : j;
+            off += snprintf(source + off, len - off, word,
+                    decrypt ? ((p + n - 1) % n) : ((p + 1) % n), p, sum,
+                    teatime_key_fields[(p & 3) ^ e], p);
+        }
+    }
+    snprintf(source + off, len - off, "%s", XXTEA_UNROLLED_END);
+    return source;
 }
 
-int teatime_check_gl_fb_errors(int line, const char *fn_name)
+/* XXTEA blocks of 2 or 4 words are taken from and put back into x */
+static char *teatime_xxtea_texel_source(uint32_t n, bool decrypt, uint32_t rounds)
 {
-    GLenum st = (GLenum)glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
-    switch (st) {
-    case GL_FRAMEBUFFER_COMPLETE_EXT:
-        return 0;
-    case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT_EXT:
-        fprintf(stderr, "%s(): GL FB error on line %d: incomplete attachment\n", fn_name, line);
-        break;
-    case GL_FRAMEBUFFER_UNSUPPORTED_EXT:
-        fprintf(stderr, "%s(): GL FB error on line %d: unsupported\n", fn_name, line);
-        break;
-    case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT_EXT:
-        fprintf(stderr, "%s(): GL FB error on line %d: incomplete missing attachment\n", fn_name, line);
-        break;
-    case GL_FRAMEBUFFER_INCOMPLETE_DIMENSIONS_EXT:
-        fprintf(stderr, "%s(): GL FB error on line %d: incomplete dimensions\n", fn_name, line);
-        break;
-    case GL_FRAMEBUFFER_INCOMPLETE_FORMATS_EXT:
-        fprintf(stderr, "%s(): GL FB error on line %d: incomplete formats\n", fn_name, line);
-        break;
-    case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER_EXT:
-        fprintf(stderr, "%s(): GL FB error on line %d: incomplete draw buffer\n", fn_name, line);
-        break;
-    case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER_EXT:
-        fprintf(stderr, "%s(): GL FB error on line %d: incomplete read buffer\n", fn_name, line);
-        break;
-    default:
-        fprintf(stderr, "%s(): GL FB error on line %d: Unknown. Error Value: %d\n", fn_name, line, st);
-        break;
+    char *body = teatime_xxtea_source(n, decrypt, rounds);
+    char *source = NULL;
+    size_t len = 0;
+    if (!body)
+        return NULL;
+    len = 2 * (strlen(body) + strlen(XXTEA_TEXEL_BEGIN_4) +
+            strlen(XXTEA_TEXEL_END_4)) + 16;
+    source = calloc(len, sizeof(char));
+    if (!source) {
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n", len);
+    } else if (n == 2) {
+        /* the two blocks of the texel are independent */
+        size_t off = 0;
+        off += snprintf(source + off, len - off, XXTEA_TEXEL_BEGIN_2, 'x', 'y');
+        off += snprintf(source + off, len - off, "%s", body);
+        off += snprintf(source + off, len - off, XXTEA_TEXEL_END_2, 'x', 'y');
+        off += snprintf(source + off, len - off, XXTEA_TEXEL_BEGIN_2, 'z', 'w');
+        off += snprintf(source + off, len - off, "%s", body);
+        snprintf(source + off, len - off, XXTEA_TEXEL_END_2, 'z', 'w');
+    } else {
+        snprintf(source, len, "%s%s%s", XXTEA_TEXEL_BEGIN_4, body, XXTEA_TEXEL_END_4);
     }
-    return -1;
+    free(body);
+    return source;
 }
 
-int teatime_check_program_errors(GLuint program)
+/* the rounds of a kernel, unrolled if rounds > 0 or a runtime loop if not */
+static char *teatime_rounds_source(int algorithm, uint32_t block_words,
+        bool decrypt, uint32_t rounds)
 {
-    GLint ilen = 0;
-    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &ilen);
-    if (ilen > 1) {
-        GLsizei wb = 0;
-        GLchar *buf = calloc(ilen, sizeof(GLchar));
-        if (!buf) {
-            fprintf(stderr, "Out of memory allocating %d bytes\n", ilen);
-            return -ENOMEM;
+    bool xtea = (algorithm == TEATIME_ALG_XTEA);
+    const char *round = xtea ?
+        (decrypt ? XTEA_UNROLLED_DECRYPT_ROUND : XTEA_UNROLLED_ENCRYPT_ROUND) :
+        (decrypt ? TEA_UNROLLED_DECRYPT_ROUND : TEA_UNROLLED_ENCRYPT_ROUND);
+    const char *loop = xtea ?
+        (decrypt ? XTEA_DECRYPT_ROUNDS : XTEA_ENCRYPT_ROUNDS) :
+        (decrypt ? TEA_DECRYPT_ROUNDS : TEA_ENCRYPT_ROUNDS);
+    size_t len = 0, off = 0;
+    char *source = NULL;
+    if (algorithm == TEATIME_ALG_XXTEA) {
+        /* the compute prologue of long blocks has loaded v already */
+        return (block_words > 4) ? teatime_xxtea_source(block_words, decrypt, rounds) :
+            teatime_xxtea_texel_source(block_words, decrypt, rounds);
+    }
+    len = (rounds > 0) ? (strlen(TEA_UNROLLED_BEGIN) +
+        rounds * (strlen(round) + 16) + strlen(TEA_UNROLLED_END) + 16) :
+        (strlen(loop) + 1);
+    source = calloc(len, sizeof(char));
+    if (!source) {
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n", len);
+        return NULL;
+    }
+    if (rounds == 0) {
+        snprintf(source, len, "%s", loop);
+        return source;
+    }
+    off += snprintf(source + off, len - off, "%s", TEA_UNROLLED_BEGIN);
+    for (uint32_t i = 0; i < rounds; ++i) {
+        /* the sum of round i is delta * (i + 1), decryption runs backwards */
+        uint32_t sum = TEA_DELTA * (decrypt ? (rounds - i) : (i + 1));
+        if (xtea && decrypt) {
+            /* the second half-round is the first one undone */
+            uint32_t prev = sum - TEA_DELTA;
+            off += snprintf(source + off, len - off, round,
+                    teatime_key_fields[(sum >> 11) & 3], sum,
+                    teatime_key_fields[prev & 3], prev);
+        } else if (xtea) {
+            uint32_t prev = sum - TEA_DELTA;
+            off += snprintf(source + off, len - off, round,
+                    teatime_key_fields[prev & 3], prev,
+                    teatime_key_fields[(sum >> 11) & 3], sum);
+        } else {
+            off += snprintf(source + off, len - off, round, sum, sum);
         }
-        glGetProgramInfoLog(program, ilen, &wb, buf);
-        buf[wb] = '\0';
-        fprintf(stderr, "Program Errors:\n%s\n",
-                (const char *)buf);
-        free(buf);
     }
-    return 0;
+    snprintf(source + off, len - off, "%s", TEA_UNROLLED_END);
+    return source;
 }
 
-int teatime_check_shader_errors(GLuint shader)
+/* builds the kernel for the backend and fan-out of the object */
+static char *teatime_kernel_source(const teatime_t *obj, int algorithm,
+        uint32_t block_words, int direction, uint32_t rounds)
 {
-    GLint ilen = 0;
-    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &ilen);
-    if (ilen > 1) {
-        GLsizei wb = 0;
-        GLchar *buf = calloc(ilen, sizeof(GLchar));
-        if (!buf) {
-            fprintf(stderr, "Out of memory allocating %d bytes\n", ilen);
-            return -ENOMEM;
+    /* CTR mode, CBC encryption and key searches only ever encrypt */
+    char *body = teatime_rounds_source(algorithm, block_words,
+            direction == TEATIME_DECRYPT || direction == TEATIME_CBC_DECRYPT ||
+            direction == TEATIME_BATCH_DECRYPT, rounds);
+    char *source = NULL;
+    size_t len = 0, off = 0;
+    const char *prologue = TEA_KERNEL_PROLOGUE;
+    const char *epilogue = TEA_KERNEL_EPILOGUE;
+    if (!body)
+        return NULL;
+    if (obj->backend == TEATIME_BACKEND_COMPUTE) {
+        prologue = TEA_COMPUTE_PROLOGUE;
+        epilogue = TEA_COMPUTE_EPILOGUE;
+        if (block_words > 4) {
+            prologue = TEA_COMPUTE_WORDS_PROLOGUE;
+            epilogue = TEA_COMPUTE_WORDS_EPILOGUE;
+        } else if (TEATIME_IS_CTR(direction)) {
+            prologue = TEA_COMPUTE_CTR_PROLOGUE;
+            if (direction == TEATIME_CTR)
+                epilogue = TEA_COMPUTE_CTR_EPILOGUE;
+        } else if (direction == TEATIME_CBC_DECRYPT) {
+            prologue = TEA_COMPUTE_CBC_DECRYPT_PROLOGUE;
+            epilogue = TEA_COMPUTE_CBC_DECRYPT_EPILOGUE;
+        } else if (direction == TEATIME_CBC_ENCRYPT) {
+            prologue = TEA_COMPUTE_CBC_ENCRYPT_PROLOGUE;
+            epilogue = TEA_COMPUTE_CBC_ENCRYPT_EPILOGUE;
+        } else if (TEATIME_IS_BATCH(direction)) {
+            prologue = TEA_COMPUTE_BATCH_PROLOGUE;
+        } else if (direction == TEATIME_KEY_SEARCH) {
+            prologue = TEA_COMPUTE_SEARCH_PROLOGUE;
+            epilogue = TEA_COMPUTE_SEARCH_EPILOGUE;
         }
-        glGetShaderInfoLog(shader, ilen, &wb, buf);
-        buf[wb] = '\0';
-        fprintf(stderr, "Shader Errors:\n%s\n",
-                (const char *)buf);
-        free(buf);
+    } else if (TEATIME_IS_CTR(direction)) {
+        prologue = TEA_CTR_PROLOGUE;
+        if (direction == TEATIME_CTR)
+            epilogue = TEA_CTR_EPILOGUE;
+    } else if (direction == TEATIME_CBC_DECRYPT) {
+        prologue = TEA_CBC_DECRYPT_PROLOGUE;
+        epilogue = TEA_CBC_DECRYPT_EPILOGUE;
+    } else if (direction == TEATIME_CBC_ENCRYPT) {
+        prologue = TEA_CBC_ENCRYPT_PROLOGUE;
+        epilogue = TEA_CBC_ENCRYPT_EPILOGUE;
+    } else if (TEATIME_IS_BATCH(direction)) {
+        prologue = TEA_BATCH_PROLOGUE;
+    } else if (direction == TEATIME_KEY_SEARCH) {
+        prologue = TEA_SEARCH_PROLOGUE;
+        epilogue = TEA_SEARCH_EPILOGUE;
     }
-    return 0;
+    if (obj->backend == TEATIME_BACKEND_COMPUTE) {
+        len = strlen(prologue) + strlen(body) + strlen(epilogue) + 64;
+    } else if (obj->fanout > 1) {
+        len = strlen(TEA_FANOUT_PROLOGUE) + strlen(TEA_FANOUT_OUTPUT) +
+            strlen(TEA_FN_BEGIN) + strlen(body) + strlen(TEA_FN_END) +
+            strlen(TEA_FANOUT_MAIN_BEGIN) +
+            obj->fanout * (strlen(TEA_FANOUT_MAIN_LAYER) + 16) +
+            strlen(TEA_FANOUT_MAIN_END) + 16;
+    } else {
+        len = strlen(prologue) + strlen(body) + strlen(epilogue) + 1;
+    }
+    source = calloc(len, sizeof(char));
+    if (!source) {
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n", len);
+        free(body);
+        return NULL;
+    }
+    if (obj->backend == TEATIME_BACKEND_COMPUTE && block_words > 4) {
+        off += snprintf(source + off, len - off, prologue, obj->workgroup_size,
+                block_words, block_words, block_words);
+        off += snprintf(source + off, len - off, "%s", body);
+        snprintf(source + off, len - off, epilogue, block_words, block_words);
+    } else if (obj->backend == TEATIME_BACKEND_COMPUTE) {
+        off += snprintf(source + off, len - off, prologue, obj->workgroup_size);
+        snprintf(source + off, len - off, "%s%s", body, epilogue);
+    } else if (obj->fanout > 1) {
+        off += snprintf(source + off, len - off, "%s", TEA_FANOUT_PROLOGUE);
+        off += snprintf(source + off, len - off, TEA_FANOUT_OUTPUT, obj->fanout);
+        off += snprintf(source + off, len - off, "%s%s%s%s", TEA_FN_BEGIN,
+                body, TEA_FN_END, TEA_FANOUT_MAIN_BEGIN);
+        for (uint32_t i = 0; i < obj->fanout; ++i)
+            off += snprintf(source + off, len - off, TEA_FANOUT_MAIN_LAYER, i, i);
+        snprintf(source + off, len - off, "%s", TEA_FANOUT_MAIN_END);
+    } else {
+        snprintf(source, len, "%s%s%s", prologue, body, epilogue);
+    }
+    free(body);
+    return source;
 }
 
-#define TEA_ENCRYPT_SOURCE \
-"#version 130\n" \
-"#extension GL_EXT_gpu_shader4 : enable\n" \
-"uniform usampler2D idata;\n" \
-"uniform uvec4 ikey; \n" \
-"uniform uint rounds; \n" \
-"out uvec4 odata; \n" \
+/*
+ * The fragment reductions halve the data in each direction per pass until a
+ * single texel is left. Every pass writes the XOR of its 2x2 texels to
+ * odata[0] and their sum to odata[1]. The first pass reads the data itself
+ * from all the fan-out layers and masks the words past the end of it, and
+ * when comparing it sums the no. of words that differ from the reference
+ * instead. It is formatted with the FETCH macro, the sampler type twice and
+ * the no. of layers.
+ */
+#define TEA_REDUCE_SEED_SOURCE \
+TEA_SHADER_HEADER \
+"#define FETCH(s, q, l) %s \n" \
+"uniform %s idata; \n" \
+"uniform %s rdata; \n" \
+"uniform ivec2 size; \n" \
+"uniform uint len; \n" \
+"uniform bool compare; \n" \
+"out uvec4 odata[2]; \n" \
 "void main(void) {\n" \
-" uvec4 x = texture(idata, gl_TexCoord[0].st);\n" \
-" uint delta = uint(0x9e3779b9); \n" \
-" uint sum = uint(0); \n" \
-" for (uint i = uint(0); i < rounds; ++i) {\n" \
-"  sum += delta; \n" \
-"  x[0] += (((x[1] << 4) + ikey[0]) ^ (x[1] + sum)) ^ ((x[1] >> 5) + ikey[1]);\n" \
-"  x[1] += (((x[0] << 4) + ikey[2]) ^ (x[0] + sum)) ^ ((x[0] >> 5) + ikey[3]);\n" \
-"  x[2] += (((x[3] << 4) + ikey[0]) ^ (x[3] + sum)) ^ ((x[3] >> 5) + ikey[1]);\n" \
-"  x[3] += (((x[2] << 4) + ikey[2]) ^ (x[2] + sum)) ^ ((x[2] >> 5) + ikey[3]);\n" \
+" ivec2 p = 2 * ivec2(gl_FragCoord.xy); \n" \
+" uvec4 x = uvec4(0u); \n" \
+" uvec4 s = uvec4(0u); \n" \
+" for (int l = 0; l < %u; ++l)\n" \
+" for (int j = 0; j < 2; ++j)\n" \
+" for (int i = 0; i < 2; ++i) {\n" \
+"  ivec2 q = p + ivec2(i, j); \n" \
+"  if (q.x >= size.x || q.y >= size.y) continue; \n" \
+"  uint t = uint(l * size.y + q.y) * uint(size.x) + uint(q.x); \n" \
+"  uvec4 valid = uvec4(lessThan(uvec4(4u * t) + uvec4(0u, 1u, 2u, 3u), uvec4(len))); \n" \
+"  uvec4 v = FETCH(idata, q, l) * valid; \n" \
+"  if (compare) s += uvec4(notEqual(v, FETCH(rdata, q, l) * valid)); \n" \
+"  else { x ^= v; s += v; }\n" \
 " }\n" \
-" odata = x; \n" \
+" odata[0] = x; \n" \
+" odata[1] = s; \n" \
 "}\n"
 
-#define TEA_DECRYPT_SOURCE \
-"#version 130\n" \
-"#extension GL_EXT_gpu_shader4 : enable\n" \
-"uniform usampler2D idata;\n" \
-"uniform uvec4 ikey; \n" \
-"uniform uint rounds; \n" \
-"out uvec4 odata; \n" \
+#define TEA_REDUCE_FETCH_2D "texelFetch(s, q, 0)"
+#define TEA_REDUCE_FETCH_ARRAY "texelFetch(s, ivec3(q, l), 0)"
+
+#define TEA_REDUCE_SOURCE \
+TEA_SHADER_HEADER \
+"uniform usampler2D xdata; \n" \
+"uniform usampler2D sdata; \n" \
+"uniform ivec2 size; \n" \
+"out uvec4 odata[2]; \n" \
 "void main(void) {\n" \
-" uvec4 x = texture(idata, gl_TexCoord[0].st);\n" \
-" uint delta = uint(0x9e3779b9); \n" \
-" uint sum = delta * rounds; \n" \
-" for (uint i = uint(0); i < rounds; ++i) {\n" \
-"  x[1] -= (((x[0] << 4) + ikey[2]) ^ (x[0] + sum)) ^ ((x[0] >> 5) + ikey[3]);\n" \
-"  x[0] -= (((x[1] << 4) + ikey[0]) ^ (x[1] + sum)) ^ ((x[1] >> 5) + ikey[1]);\n" \
-"  x[3] -= (((x[2] << 4) + ikey[2]) ^ (x[2] + sum)) ^ ((x[2] >> 5) + ikey[3]);\n" \
-"  x[2] -= (((x[3] << 4) + ikey[0]) ^ (x[3] + sum)) ^ ((x[3] >> 5) + ikey[1]);\n" \
-"  sum -= delta; \n" \
+" ivec2 p = 2 * ivec2(gl_FragCoord.xy); \n" \
+" uvec4 x = uvec4(0u); \n" \
+" uvec4 s = uvec4(0u); \n" \
+" for (int j = 0; j < 2; ++j)\n" \
+" for (int i = 0; i < 2; ++i) {\n" \
+"  ivec2 q = p + ivec2(i, j); \n" \
+"  if (q.x < size.x && q.y < size.y) {\n" \
+"   x ^= texelFetch(xdata, q, 0); \n" \
+"   s += texelFetch(sdata, q, 0); \n" \
+"  }\n" \
+" }\n" \
+" odata[0] = x; \n" \
+" odata[1] = s; \n" \
+"}\n"
+
+/*
+ * The compute reduction is a single pass. Each workgroup reduces its texels
+ * in shared memory and its first invocation adds the result to the eight
+ * words of the output with atomics. It is formatted with the workgroup size
+ * three times.
+ */
+#define TEA_COMPUTE_REDUCE_SOURCE \
+"#version 430\n" \
+"layout(local_size_x = %u) in;\n" \
+"layout(std430, binding = 0) readonly buffer ibuf { uvec4 idata[]; };\n" \
+"layout(std430, binding = 1) readonly buffer rbuf { uvec4 rdata[]; };\n" \
+"layout(std430, binding = 2) buffer obuf { uint oxor[4]; uint osum[4]; };\n" \
+"uniform uint len; \n" \
+"uniform uint count; \n" \
+"uniform bool compare; \n" \
+"shared uvec4 sx[%u]; \n" \
+"shared uvec4 ss[%u]; \n" \
+"void main(void) {\n" \
+" uint idx = (gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x) *\n" \
+"  gl_WorkGroupSize.x + gl_LocalInvocationID.x;\n" \
+" uint lid = gl_LocalInvocationID.x; \n" \
+" uvec4 x = uvec4(0u); \n" \
+" uvec4 s = uvec4(0u); \n" \
+" if (idx < count) {\n" \
+"  uvec4 valid = uvec4(lessThan(uvec4(4u * idx) + uvec4(0u, 1u, 2u, 3u), uvec4(len))); \n" \
+"  uvec4 v = idata[idx] * valid; \n" \
+"  if (compare) s = uvec4(notEqual(v, rdata[idx] * valid)); \n" \
+"  else { x = v; s = v; }\n" \
+" }\n" \
+" sx[lid] = x; \n" \
+" ss[lid] = s; \n" \
+" barrier(); \n" \
+" for (uint n = gl_WorkGroupSize.x; n > 1u; n = (n + 1u) / 2u) {\n" \
+"  uint h = (n + 1u) / 2u; \n" \
+"  if (lid < n - h) {\n" \
+"   sx[lid] ^= sx[lid + h]; \n" \
+"   ss[lid] += ss[lid + h]; \n" \
+"  }\n" \
+"  barrier(); \n" \
+" }\n" \
+" if (lid == 0u) {\n" \
+"  for (int i = 0; i < 4; ++i) {\n" \
+"   atomicXor(oxor[i], sx[0][i]); \n" \
+"   atomicAdd(osum[i], ss[0][i]); \n" \
+"  }\n" \
 " }\n" \
-" odata = x; \n" \
 "}\n"
 
+/* finds or builds a helper program without making it the current one */
+static int teatime_helper_program(teatime_t *obj, const char *source,
+        GLuint *program)
+{
+    size_t length = strlen(source);
+    uint64_t hash = teatime_hash(source, length, 0xcbf29ce484222325ULL);
+    teatime_program_t *prog = teatime_find_program(obj, hash, length);
+    if (!prog) {
+        int rc = teatime_add_program(obj, hash, length, source);
+        if (rc < 0)
+            return rc;
+        prog = &(obj->programs[obj->num_programs - 1]);
+    }
+    *program = prog->program;
+    return 0;
+}
+
+/*
+ * Reduces len words in the layers of itexid, width x height texels each, to
+ * their XOR and sum in out[0-3] and out[4-7], or to the no. of words that
+ * differ from rtexid in out[4-7] if it is not 0. The passes ping-pong
+ * between two pairs of textures, and only the last texel is read back. The
+ * current framebuffer and viewport are restored afterwards.
+ */
+static int teatime_reduce_fragment(teatime_t *obj, GLuint itexid, GLuint rtexid,
+        GLuint layers, GLuint width, GLuint height, uint32_t len, uint32_t out[8])
+{
+    int rc = 0;
+    GLuint tex[2][2] = { { 0, 0 }, { 0, 0 } }, fbo[2] = { 0, 0 };
+    GLuint seed = 0, combine = 0;
+    GLint prev_fbo = 0;
+    GLuint w = (width + 1) / 2, h = (height + 1) / 2;
+    GLuint saved_width = obj->data_width, saved_height = obj->data_height;
+    uint32_t saved_len = obj->data_len;
+    const GLenum bufs[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    char source[sizeof(TEA_REDUCE_SEED_SOURCE) + 64];
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prev_fbo);
+    do {
+        GLuint cur = 0;
+        snprintf(source, sizeof(source), TEA_REDUCE_SEED_SOURCE,
+                (layers > 1) ? TEA_REDUCE_FETCH_ARRAY : TEA_REDUCE_FETCH_2D,
+                (layers > 1) ? "usampler2DArray" : "usampler2D",
+                (layers > 1) ? "usampler2DArray" : "usampler2D", layers);
+        rc = teatime_helper_program(obj, source, &seed);
+        if (rc < 0)
+            break;
+        rc = teatime_helper_program(obj, TEA_REDUCE_SOURCE, &combine);
+        if (rc < 0)
+            break;
+        /* the second pair only ever holds the second pass onwards */
+        for (int i = 0; i < 2 && rc == 0; ++i) {
+            GLuint tw = (i == 0) ? w : (w + 1) / 2;
+            GLuint th = (i == 0) ? h : (h + 1) / 2;
+            rc = teatime_create_texture(&(tex[i][0]), tw, th, 1);
+            if (rc == 0)
+                rc = teatime_create_texture(&(tex[i][1]), tw, th, 1);
+            if (rc < 0)
+                break;
+            glGenFramebuffers(1, &(fbo[i]));
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                    GL_TEXTURE_2D, tex[i][0], 0);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                    GL_TEXTURE_2D, tex[i][1], 0);
+            glDrawBuffers(2, bufs);
+            TEATIME_BREAKONERROR_FB(glFramebufferTexture2D, rc);
+            TEATIME_BREAKONERROR(glFramebufferTexture2D, rc);
+        }
+        if (rc < 0)
+            break;
+        /* the first pass reads the data */
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo[0]);
+        teatime_apply_viewport(obj, w, h, 0);
+        glUseProgram(seed);
+        TEATIME_BREAKONERROR(glUseProgram, rc);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(TEATIME_TEXTURE_TARGET(layers), itexid);
+        glUniform1i(glGetUniformLocation(seed, "idata"), 0);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(TEATIME_TEXTURE_TARGET(layers), rtexid ? rtexid : itexid);
+        glUniform1i(glGetUniformLocation(seed, "rdata"), 1);
+        glUniform2i(glGetUniformLocation(seed, "size"), width, height);
+        glUniform1ui(glGetUniformLocation(seed, "len"), len);
+        glUniform1i(glGetUniformLocation(seed, "compare"), rtexid ? 1 : 0);
+        TEATIME_BREAKONERROR(glUniform1i, rc);
+        teatime_draw(obj);
+        TEATIME_BREAKONERROR(Rendering, rc);
+        /* and the others halve what the pass before them left */
+        glUseProgram(combine);
+        TEATIME_BREAKONERROR(glUseProgram, rc);
+        glUniform1i(glGetUniformLocation(combine, "xdata"), 0);
+        glUniform1i(glGetUniformLocation(combine, "sdata"), 1);
+        while (w > 1 || h > 1) {
+            GLuint nw = (w + 1) / 2, nh = (h + 1) / 2;
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo[1 - cur]);
+            teatime_apply_viewport(obj, nw, nh, 0);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, tex[cur][0]);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, tex[cur][1]);
+            glUniform2i(glGetUniformLocation(combine, "size"), w, h);
+            teatime_draw(obj);
+            TEATIME_BREAKONERROR(Rendering, rc);
+            cur = 1 - cur;
+            w = nw;
+            h = nh;
+        }
+        if (rc < 0)
+            break;
+        glActiveTexture(GL_TEXTURE0);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo[cur]);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glReadPixels(0, 0, 1, 1, GL_RGBA_INTEGER, GL_UNSIGNED_INT, out);
+        glReadBuffer(GL_COLOR_ATTACHMENT1);
+        glReadPixels(0, 0, 1, 1, GL_RGBA_INTEGER, GL_UNSIGNED_INT, out + 4);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        TEATIME_BREAKONERROR(glReadPixels, rc);
+    } while (0);
+    TEATIME_CHECK_OPERATION(obj, rc);
+    glActiveTexture(GL_TEXTURE0);
+    glBindFramebuffer(GL_FRAMEBUFFER, (GLuint)prev_fbo);
+    teatime_apply_viewport(obj, saved_width, saved_height, saved_len);
+    for (int i = 0; i < 2; ++i) {
+        if (fbo[i] > 0)
+            glDeleteFramebuffers(1, &(fbo[i]));
+        for (int j = 0; j < 2; ++j) {
+            if (tex[i][j] > 0)
+                glDeleteTextures(1, &(tex[i][j]));
+        }
+    }
+    return rc;
+}
+
+/* as teatime_reduce_fragment() for len words in storage buffers */
+static int teatime_reduce_compute(teatime_t *obj, GLuint ibuf, GLuint rbuf,
+        uint32_t len, uint32_t out[8])
+{
+    int rc = 0;
+    GLuint program = 0, obuf = 0;
+    GLuint count = (len + 3) / 4;
+    GLuint groups = (count + obj->workgroup_size - 1) / obj->workgroup_size;
+    GLuint groups_x = (groups < obj->max_groups) ? groups : obj->max_groups;
+    char source[sizeof(TEA_COMPUTE_REDUCE_SOURCE) + 64];
+    snprintf(source, sizeof(source), TEA_COMPUTE_REDUCE_SOURCE, obj->workgroup_size,
+            obj->workgroup_size, obj->workgroup_size);
+    memset(out, 0, 8 * sizeof(uint32_t));
+    /* the XOR and sum of nothing are 0, and there would be no groups */
+    if (len == 0)
+        return 0;
+    do {
+        rc = teatime_helper_program(obj, source, &program);
+        if (rc < 0)
+            break;
+        glGenBuffers(1, &obuf);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, obuf);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, 8 * sizeof(uint32_t), out,
+                GL_DYNAMIC_READ);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        TEATIME_BREAKONERROR(glBufferData, rc);
+        glUseProgram(program);
+        TEATIME_BREAKONERROR(glUseProgram, rc);
+        glUniform1ui(glGetUniformLocation(program, "len"), len);
+        glUniform1ui(glGetUniformLocation(program, "count"), count);
+        glUniform1i(glGetUniformLocation(program, "compare"), rbuf ? 1 : 0);
+        TEATIME_BREAKONERROR(glUniform1i, rc);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ibuf);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, rbuf ? rbuf : ibuf);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, obuf);
+        TEATIME_BREAKONERROR(glBindBufferBase, rc);
+        glDispatchCompute(groups_x, (groups + groups_x - 1) / groups_x, 1);
+        TEATIME_BREAKONERROR(glDispatchCompute, rc);
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        TEATIME_BREAKONERROR(glMemoryBarrier, rc);
+        rc = teatime_ssbo_read(obj, obuf, out, 8);
+    } while (0);
+    TEATIME_CHECK_OPERATION(obj, rc);
+    if (obuf > 0)
+        glDeleteBuffers(1, &obuf);
+    return rc;
+}
+
+static void teatime_reduce_result(const uint32_t out[8], teatime_fingerprint_t *fp)
+{
+    memcpy(fp->xor_lanes, out, sizeof(fp->xor_lanes));
+    memcpy(fp->sum_lanes, out + 4, sizeof(fp->sum_lanes));
+}
+
+/* the fingerprint of data on the host, to compare with those of the GPU */
+int teatime_fingerprint(const uint32_t *data, uint32_t nwords,
+        teatime_fingerprint_t *fp)
+{
+    if (data && fp) {
+        memset(fp, 0, sizeof(*fp));
+        for (uint32_t i = 0; i < nwords; ++i) {
+            fp->xor_lanes[i % 4] ^= data[i];
+            fp->sum_lanes[i % 4] += data[i];
+        }
+        return 0;
+    }
+    return -EINVAL;
+}
+
+/*
+ * The fingerprint of the result of teatime_run_program(), reduced where it
+ * is so that only a few words are read back.
+ */
+int teatime_fingerprint_output(teatime_t *obj, teatime_fingerprint_t *fp)
+{
+    if (obj && fp && (obj->itexid > 0 || obj->data_loaded)) {
+        uint32_t out[8];
+        int rc = 0;
+        if (obj->backend == TEATIME_BACKEND_CPU)
+            return teatime_fingerprint(obj->cpu_data, obj->data_len, fp);
+        if (obj->backend == TEATIME_BACKEND_COMPUTE)
+            rc = teatime_reduce_compute(obj, obj->ossbo, 0, obj->data_len, out);
+        else
+            rc = teatime_reduce_fragment(obj, obj->otexid, 0, obj->tex_layers,
+                    obj->data_width, obj->data_height, obj->data_len, out);
+        if (rc == 0)
+            teatime_reduce_result(out, fp);
+        return rc;
+    }
+    return -EINVAL;
+}
+
+/* the texture holding the current data of a buffer */
+static GLuint teatime_buffer_texture(teatime_t *obj, teatime_buffer_t *buf,
+        GLuint *layers)
+{
+    teatime_texpair_t *pair = teatime_pool_find(obj, buf->itexid);
+    if (!pair)
+        return 0;
+    *layers = pair->layers;
+    return buf->in_output ? pair->otexid : pair->itexid;
+}
+
+int teatime_buffer_fingerprint(teatime_t *obj, teatime_buffer_t *buf,
+        teatime_fingerprint_t *fp)
+{
+    if (obj && buf && fp) {
+        uint32_t out[8];
+        GLuint texid = 0, layers = 1;
+        int rc = 0;
+        if (buf->data)
+            return teatime_fingerprint(buf->data, buf->len, fp);
+        if (buf->ssbo[0] > 0) {
+            rc = teatime_reduce_compute(obj, buf->ssbo[buf->in_output ? 1 : 0], 0,
+                    buf->len, out);
+        } else {
+            texid = teatime_buffer_texture(obj, buf, &layers);
+            if (texid == 0)
+                return -EINVAL;
+            rc = teatime_reduce_fragment(obj, texid, 0, layers, buf->data_width,
+                    buf->data_height, buf->len, out);
+        }
+        if (rc == 0)
+            teatime_reduce_result(out, fp);
+        return rc;
+    }
+    return -EINVAL;
+}
+
+/*
+ * Counts the words of a buffer that differ from those of a reference buffer
+ * of the same length, e.g. the expected output of a production batch, on the
+ * GPU. Both must have been created by the same object with the same
+ * settings.
+ */
+int teatime_buffer_mismatches(teatime_t *obj, teatime_buffer_t *buf,
+        teatime_buffer_t *ref, uint32_t *mismatches)
+{
+    if (obj && buf && ref && mismatches && buf->len == ref->len &&
+        buf->data_width == ref->data_width && buf->data_height == ref->data_height &&
+        (!buf->data) == (!ref->data) && (!buf->ssbo[0]) == (!ref->ssbo[0])) {
+        uint32_t out[8];
+        int rc = 0;
+        *mismatches = 0;
+        if (buf->data) {
+            for (uint32_t i = 0; i < buf->len; ++i)
+                *mismatches += (buf->data[i] != ref->data[i]) ? 1 : 0;
+            return 0;
+        }
+        if (buf->ssbo[0] > 0) {
+            rc = teatime_reduce_compute(obj, buf->ssbo[buf->in_output ? 1 : 0],
+                    ref->ssbo[ref->in_output ? 1 : 0], buf->len, out);
+        } else {
+            GLuint layers = 1, rlayers = 1;
+            GLuint texid = teatime_buffer_texture(obj, buf, &layers);
+            GLuint rtexid = teatime_buffer_texture(obj, ref, &rlayers);
+            if (texid == 0 || rtexid == 0 || layers != rlayers)
+                return -EINVAL;
+            rc = teatime_reduce_fragment(obj, texid, rtexid, layers, buf->data_width,
+                    buf->data_height, buf->len, out);
+        }
+        if (rc == 0)
+            *mismatches = out[4] + out[5] + out[6] + out[7];
+        return rc;
+    } else if (obj && buf && ref && buf->len != ref->len) {
+        teatime_log(TEATIME_LOG_ERROR, "Buffer lengths %u and %u differ\n",
+                buf->len, ref->len);
+    }
+    return -EINVAL;
+}
+
 const char *teatime_encrypt_source()
 {
     return TEA_ENCRYPT_SOURCE;
@@ -515,3 +5231,13 @@ const char *teatime_decrypt_source()
 {
     return TEA_DECRYPT_SOURCE;
 }
+
+const char *teatime_xtea_encrypt_source()
+{
+    return XTEA_ENCRYPT_SOURCE;
+}
+
+const char *teatime_xtea_decrypt_source()
+{
+    return XTEA_DECRYPT_SOURCE;
+}
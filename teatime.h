@@ -18,35 +18,501 @@
     #define uint64_t UINT64
     #define uint16_t UINT16
 #endif
+#include <stdbool.h>
 #include <GL/glew.h>
 #include <GL/glut.h>
 
+/* log levels, messages above the current level are dropped */
+#define TEATIME_LOG_NONE 0
+#define TEATIME_LOG_ERROR 1
+#define TEATIME_LOG_WARN 2
+#define TEATIME_LOG_INFO 3
+#define TEATIME_LOG_DEBUG 4
+
+/* GL error checking modes, see teatime_set_error_checks() */
+#define TEATIME_CHECKS_FULL 0 /* glGetError() after every GL call */
+#define TEATIME_CHECKS_FAST 1 /* one glGetError() per operation */
+
+/* headless context types */
+#define TEATIME_CONTEXT_EGL 1
+#define TEATIME_CONTEXT_OSMESA 2
+
+typedef struct teatime_context_s teatime_context_t;
+
+/* the multi-threaded SIMD engine of the CPU backend */
+typedef struct teatime_cpu_s teatime_cpu_t;
+
+/* threads with a context each, see teatime_workers_create() */
+typedef struct teatime_workers_s teatime_workers_t;
+
+/* a linked program kept resident in the program cache */
+typedef struct {
+    uint64_t hash; /* hash of the shader source, the cache key */
+    size_t length; /* length of the shader source, checked with the hash */
+    uint64_t variant; /* key of a generated kernel, 0 for caller sources */
+    GLuint program; /* program reference */
+    GLint locn_input; /* input variable location in shader */
+    GLint locn_output; /* output variable location in shader */
+    GLint locn_key; /* key location in shader */
+    GLint locn_rounds; /* no. of rounds location in shader */
+    GLint locn_count; /* no. of texels location in compute shaders */
+    GLint locn_counter; /* first block counter location in CTR shaders */
+    GLint locn_width; /* viewport or stream width location in shaders */
+    GLint locn_iv; /* IV location in CBC decryption shaders */
+    GLint locn_chain; /* previous ciphertext location in CBC encryption shaders */
+    GLint locn_ivs; /* IV texture location in CBC encryption shaders */
+    GLint locn_keys; /* key texture location in batch shaders */
+    GLint locn_kindex; /* key index texture location in batch shaders */
+    GLint locn_known; /* known plaintext location in key search shaders */
+    GLint locn_target; /* known ciphertext location in key search shaders */
+    uint32_t fanout; /* no. of block pairs per fragment */
+    GLuint local_size; /* compute workgroup size, 0 for fragment programs */
+    uint32_t rounds; /* rounds baked into the kernel, 0 for a uniform */
+    int direction; /* TEATIME_ENCRYPT etc., -1 for caller sources */
+    int algorithm; /* TEATIME_ALG_TEA etc. */
+    uint32_t block_words; /* words per block, more than 2 for XXTEA only */
+} teatime_program_t;
+
+/* program directions for teatime_load_program() */
+#define TEATIME_ENCRYPT 0
+#define TEATIME_DECRYPT 1
+/* CTR mode, the input XORed with the encrypted block counters */
+#define TEATIME_CTR 2
+/* the encrypted block counters alone, without any input */
+#define TEATIME_KEYSTREAM 3
+/* CBC decryption, in parallel over the blocks */
+#define TEATIME_CBC_DECRYPT 4
+/* CBC encryption of many streams at once, see teatime_cbc_encrypt() */
+#define TEATIME_CBC_ENCRYPT 5
+/* many segments under their own keys at once, see teatime_run_batch() */
+#define TEATIME_BATCH_ENCRYPT 6
+#define TEATIME_BATCH_DECRYPT 7
+/* known-plaintext key search, see teatime_search_keys() */
+#define TEATIME_KEY_SEARCH 8
+
+#define TEATIME_IS_CTR(D) ((D) == TEATIME_CTR || (D) == TEATIME_KEYSTREAM)
+#define TEATIME_IS_BATCH(D) ((D) == TEATIME_BATCH_ENCRYPT || (D) == TEATIME_BATCH_DECRYPT)
+
+/* block ciphers for teatime_set_algorithm() */
+#define TEATIME_ALG_TEA 0
+#define TEATIME_ALG_XTEA 1
+/* Corrected Block TEA over blocks of a chosen no. of words */
+#define TEATIME_ALG_XXTEA 2
+
+/* max. XXTEA block length in words */
+#define TEATIME_XXTEA_MAX_WORDS 64
+
+/* the customary no. of XXTEA rounds for blocks of N words */
+#define TEATIME_XXTEA_ROUNDS(N) (6 + 52 / (N))
+
+/* max. rounds of a kernel specialized by teatime_load_program_rounds() */
+#define TEATIME_UNROLL_MAX 256
+
+/* default input size in words below which hybrid runs use the CPU only */
+#define TEATIME_HYBRID_CROSSOVER (1 << 20)
+
+/* weight of the latest measurement in the hybrid throughput averages */
+#define TEATIME_HYBRID_WEIGHT 0.25
+
+/* dispatch backends for teatime_set_backend() */
+#define TEATIME_BACKEND_FRAGMENT 1
+#define TEATIME_BACKEND_COMPUTE 2
+#define TEATIME_BACKEND_CPU 3
+
+/* default no. of invocations in a compute workgroup */
+#define TEATIME_WORKGROUP_SIZE 64
+
+/* max. no. of block pairs per fragment, i.e. render targets */
+#define TEATIME_FANOUT_MAX 8
+
+/* fan-out planes are stored as the layers of array textures */
+#define TEATIME_TEXTURE_TARGET(L) (((L) > 1) ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D)
+
+/* an input/output texture pair with its framebuffer in the texture pool */
+typedef struct {
+    GLuint width; /* power-of-two texture width */
+    GLuint height; /* power-of-two texture height */
+    GLuint layers; /* no. of layers, i.e. the fan-out */
+    GLuint itexid; /* input texture id */
+    GLuint otexid; /* output texture id */
+    GLuint fbo; /* framebuffer with otexid attached */
+    GLuint pbo; /* pixel pack buffer for asynchronous readback */
+    GLsizeiptr pbo_size; /* allocated size of the pack buffer in bytes */
+    bool in_use; /* acquired by teatime_create_textures() or a job */
+    uint64_t last_used; /* pool clock at the last acquire */
+} teatime_texpair_t;
+
+typedef struct {
+    uint64_t hits; /* requests served by a free pair of the right size */
+    uint64_t misses; /* requests that had to allocate a new pair */
+    uint64_t evictions; /* free pairs deleted to respect the pool size */
+    uint32_t pairs; /* pairs currently allocated */
+    uint32_t in_use; /* pairs currently acquired */
+} teatime_pool_stats_t;
+
+/* a slot in the ring of pixel buffers used for streaming */
+typedef struct {
+    GLuint upbo; /* pixel unpack buffer for the input chunk */
+    GLuint dpbo; /* pixel pack buffer for the output chunk */
+    GLsizeiptr size; /* allocated size of each buffer in bytes */
+    GLuint itexid; /* input texture of the pooled pair in flight */
+    uint32_t *output; /* where the chunk is copied once it is read back */
+    uint32_t len; /* no. of words in the chunk */
+    bool pending; /* readback issued and not yet copied out */
+} teatime_stream_slot_t;
+
+/* a tile of an asynchronous job in flight */
 typedef struct {
+    GLuint itexid; /* input texture of the pooled pair owned by the tile */
+    GLuint ssbo; /* output storage buffer owned by the tile, compute only */
+    GLsizeiptr size; /* allocated size of the storage buffer in bytes */
+    GLsync fence; /* signaled once the tile is read back, if recycled */
+    uint32_t *output; /* where the tile is copied on completion */
+    uint32_t len; /* no. of words in the tile */
+} teatime_job_tile_t;
+
+/* handle returned by teatime_submit() */
+typedef struct {
+    GLsync fence; /* signaled once all the tiles are read back */
+    teatime_job_tile_t *tiles; /* ring of at most TEATIME_JOB_TILES_MAX tiles */
+    uint32_t ntiles;
+    bool done; /* output has been written */
+} teatime_job_t;
+
+/* a slot of a ring of persistently mapped buffers, see teatime_ring_create() */
+typedef struct {
+    GLuint ibuf; /* input buffer object, 0 on the CPU backend */
+    GLuint obuf; /* output buffer object, 0 on the CPU backend */
+    uint32_t *input; /* where the caller writes the input, mapped from ibuf */
+    uint32_t *output; /* where the output lands, mapped from obuf */
+    GLsync fence; /* signaled once the GPU is done with both buffers */
+    uint32_t len; /* no. of words of the run in flight */
+    bool acquired; /* handed out and not yet released */
+    bool submitted; /* a run was queued since it was acquired */
+} teatime_ring_slot_t;
+
+/* handle returned by teatime_ring_create() */
+typedef struct {
+    teatime_ring_slot_t *slots;
+    uint32_t nslots;
+    uint32_t slot_words; /* capacity of each slot in words */
+    uint32_t next; /* slot handed out by the next teatime_ring_acquire() */
+} teatime_ring_t;
+
+/* a run queued on a context pool, owned by the caller until it is done */
+typedef struct teatime_work_s {
+    int direction; /* TEATIME_ENCRYPT, TEATIME_DECRYPT, TEATIME_CTR or TEATIME_KEYSTREAM */
+    uint32_t ikey[4];
+    uint32_t rounds;
+    uint64_t counter; /* first block counter of CTR and keystream runs */
+    const uint32_t *input;
+    uint32_t *output;
+    uint32_t nwords;
+    int status; /* result of teatime_run() once done */
+    bool done;
+    struct teatime_work_s *next; /* queue link, private to the pool */
+} teatime_work_t;
+
+/* data kept on the GPU between runs, see teatime_buffer_create() */
+typedef struct {
+    GLuint itexid; /* input texture of the pooled pair owned by the buffer */
+    GLuint data_width; /* width of the data in texels */
+    GLuint data_height; /* height of the data in texels */
+    GLuint ssbo[2]; /* input/output storage buffers, compute only */
+    uint32_t *data; /* host copy of the data, CPU only */
+    uint32_t len; /* no. of words */
+    bool in_output; /* data is in the output texture of the pair */
+} teatime_buffer_t;
+
+/* checksum of some data, word i goes into lane i % 4 */
+typedef struct {
+    uint32_t xor_lanes[4]; /* XOR of the words of each lane */
+    uint32_t sum_lanes[4]; /* sum of the words of each lane, modulo 2^32 */
+} teatime_fingerprint_t;
+
+/* stages timed by the statistics, see teatime_get_stats() */
+#define TEATIME_STAGE_UPLOAD 0
+#define TEATIME_STAGE_DRAW 1
+#define TEATIME_STAGE_READBACK 2
+#define TEATIME_NUM_STAGES 3
+
+/* histogram bucket i counts durations of 2^i to 2^(i+1) microseconds, the
+ * first also counts shorter ones and the last longer ones */
+#define TEATIME_STATS_BUCKETS 24
+
+/* no. of GL_TIME_ELAPSED queries in flight per stage */
+#define TEATIME_STATS_QUERIES 8
+
+/* GPU time of a stage below which no GPU throughput is computed */
+#define TEATIME_STATS_MIN_GPU_NS 100000
+
+typedef struct {
+    uint64_t count; /* no. of calls */
+    uint64_t bytes; /* bytes moved, or processed by the draws */
+    uint64_t wall_ns; /* CPU wall clock time spent in the calls */
+    uint64_t max_wall_ns; /* longest call */
+    uint64_t gpu_count; /* calls timed on the GPU */
+    uint64_t gpu_bytes; /* bytes of the calls timed on the GPU */
+    uint64_t gpu_ns; /* GPU time of those calls from GL_TIME_ELAPSED queries */
+    double wall_gbps; /* bytes per wall clock ns, i.e. GB/s */
+    double gpu_gbps; /* GPU bytes per GPU ns, 0 below TEATIME_STATS_MIN_GPU_NS */
+    uint64_t wall_histogram[TEATIME_STATS_BUCKETS]; /* if histograms are on */
+    uint64_t gpu_histogram[TEATIME_STATS_BUCKETS]; /* if histograms are on */
+} teatime_stage_stats_t;
+
+/* result of teatime_get_stats() */
+typedef struct {
+    teatime_stage_stats_t stages[TEATIME_NUM_STAGES];
+} teatime_stats_t;
+
+/* a GL_TIME_ELAPSED query in the ring of a stage */
+typedef struct {
+    GLuint query;
+    uint64_t bytes; /* bytes of the timed call */
+    uint64_t start_ns; /* wall clock time the query began */
+    bool pending; /* ended and its result not yet collected */
+} teatime_timer_t;
+
+/* result of teatime_search_keys() */
+typedef struct {
+    uint64_t searched; /* no. of candidate keys tried */
+    uint64_t nhits; /* no. of matching keys, including those not kept */
+    uint64_t elapsed_ns; /* wall clock time of the search */
+    double keys_per_sec; /* candidate keys tried per second */
+} teatime_search_stats_t;
+
+/* max. no. of hits kept per dispatch of a key search */
+#define TEATIME_SEARCH_MAX_HITS 1024
+
+/* timeout for teatime_wait() that never expires */
+#define TEATIME_WAIT_FOREVER UINT64_MAX
+
+/* max. no. of tiles of a job in flight, see teatime_submit() */
+#define TEATIME_JOB_TILES_MAX 4
+
+/* max. no. of slots in the streaming ring */
+#define TEATIME_STREAM_SLOTS_MAX 8
+
+/* default max. tile width and height, capped at the max. texture size */
+#define TEATIME_TILE_SIZE 4096
+
+/* default no. of free texture pairs kept in the pool */
+#define TEATIME_POOL_SIZE 8
+
+typedef struct {
+    teatime_context_t *ctx; /* headless context, if created by teatime_setup() */
     GLuint ofb; /* off-screen framebuffer */
     GLint maxtexsz; /* maximum texture size */
-    GLuint tex_size; /* texture size - calculated using input size */
+    GLuint tile_width; /* max. width of a single dispatch in texels */
+    GLuint tile_height; /* max. height of a single dispatch in texels */
+    GLuint data_width; /* viewport width - calculated using input size */
+    GLuint data_height; /* viewport height - calculated using input size */
+    uint32_t data_len; /* no. of words in the viewport */
+    GLuint tex_width; /* allocated width of the current textures */
+    GLuint tex_height; /* allocated height of the current textures */
+    GLuint tex_layers; /* no. of layers of the current textures */
+    uint32_t fanout; /* no. of block pairs per fragment */
     GLuint itexid; /* input texture id */
     GLuint otexid; /* output texture id */
-    GLuint program; /* program reference */
-    GLuint shader; /* shader reference */
+    GLuint program; /* current program reference */
+    uint32_t program_fanout; /* fan-out of the current program */
+    GLuint program_local_size; /* workgroup size of the current program */
+    uint32_t program_rounds; /* rounds baked into the current program */
+    int program_algorithm; /* block cipher of the current program */
+    uint32_t program_block_words; /* block length of the current program */
+    int algorithm; /* block cipher of teatime_load_program() */
+    uint32_t block_words; /* XXTEA block length of teatime_load_program() */
     GLint locn_input; /* input variable location in shader */
     GLint locn_output; /* output variable location in shader */
     GLint locn_key; /* key location in shader */
     GLint locn_rounds; /* no. of rounds location in shader */
+    GLint locn_count; /* no. of texels location in compute shaders */
+    GLint locn_counter; /* first block counter location in CTR shaders */
+    GLint locn_width; /* viewport or stream width location in shaders */
+    GLint locn_iv; /* IV location in CBC decryption shaders */
+    GLint locn_chain; /* previous ciphertext location in CBC encryption shaders */
+    GLint locn_ivs; /* IV texture location in CBC encryption shaders */
+    GLint locn_keys; /* key texture location in batch shaders */
+    GLint locn_kindex; /* key index texture location in batch shaders */
+    GLint locn_known; /* known plaintext location in key search shaders */
+    GLint locn_target; /* known ciphertext location in key search shaders */
+    uint64_t counter; /* counter of the next block in CTR mode */
+    uint32_t iv[2]; /* block before the next one in CBC decryption */
+    bool have_barrier; /* GL supports glTextureBarrier() */
+    teatime_program_t *programs; /* resident programs keyed by source hash */
+    uint32_t num_programs; /* no. of programs in the cache */
+    uint32_t max_programs; /* allocated size of the cache */
+    bool program_binary; /* GL can save and restore program binaries */
+    bool have_sync; /* GL supports fence sync objects */
+    char *cache_dir; /* on-disk program binary cache, NULL if disabled */
+    uint32_t binary_loads; /* programs restored from the on-disk cache */
+    teatime_texpair_t *pool; /* texture pairs bucketed by size class */
+    uint32_t pool_len; /* no. of pairs in the pool */
+    uint32_t pool_max; /* allocated size of the pool */
+    uint32_t pool_size; /* max. no. of free pairs kept in the pool */
+    uint64_t pool_clock; /* acquire counter for LRU eviction */
+    teatime_pool_stats_t pool_stats; /* pool hit/miss counters */
+    teatime_stream_slot_t *slots; /* streaming ring, NULL if not streaming */
+    uint32_t nslots; /* no. of slots in the streaming ring */
+    int backend; /* TEATIME_BACKEND_FRAGMENT or TEATIME_BACKEND_COMPUTE */
+    bool have_compute; /* GL supports compute shaders and storage buffers */
+    uint32_t workgroup_size; /* invocations per workgroup for new programs */
+    uint64_t ssbo_words; /* max. words in a shader storage block */
+    GLuint max_groups; /* max. workgroups in a single dimension */
+    GLuint issbo; /* input storage buffer of the compute backend */
+    GLuint ossbo; /* output storage buffer of the compute backend */
+    GLsizeiptr ssbo_size; /* allocated size of each storage buffer in bytes */
+    bool data_loaded; /* input has been uploaded to issbo or cpu_data */
+    bool have_gl; /* an OpenGL 3.0 context is current */
+    teatime_cpu_t *cpu; /* CPU engine, created for the CPU backend */
+    int program_direction; /* direction of the current program, -1 for caller sources */
+    uint32_t *cpu_data; /* staging buffer of the CPU backend */
+    uint32_t cpu_size; /* allocated size of the staging buffer in words */
+    bool hybrid; /* teatime_run() splits the work between GPU and CPU */
+    uint32_t hybrid_crossover; /* inputs smaller than this go to the CPU only */
+    double gpu_rate; /* recent GPU throughput in words/sec, 0 if unknown */
+    double cpu_rate; /* recent CPU throughput in words/sec, 0 if unknown */
+    teatime_stats_t stats; /* per-stage counters, see teatime_get_stats() */
+    bool have_timer; /* GL supports GL_TIME_ELAPSED queries */
+    bool stats_gpu; /* time the stages on the GPU as well */
+    bool stats_histograms; /* keep histograms of the durations */
+    teatime_timer_t timers[TEATIME_NUM_STAGES][TEATIME_STATS_QUERIES];
+    uint32_t timer_next[TEATIME_NUM_STAGES]; /* next query in the ring of each stage */
+    int timer_stage; /* stage whose query is active, -1 if none */
+    bool have_debug; /* a KHR_debug message callback is installed */
+    bool have_core; /* a core profile context is current */
+    GLuint vao; /* empty vertex array drawn by the fragment backend */
+    GLuint vertex_shader; /* full-screen triangle, linked into fragment programs */
+    bool have_buffer_storage; /* GL supports persistently mapped buffers */
 } teatime_t;
 
 void teatime_print_version(FILE *fp);
+void teatime_log(int level, const char *fmt, ...);
+void teatime_set_log_level(int level);
+int teatime_get_log_level(void);
+int teatime_set_error_checks(int mode);
+int teatime_get_error_checks(void);
+teatime_context_t *teatime_context_create();
+void teatime_context_destroy(teatime_context_t *ctx);
+const char *teatime_context_name(const teatime_context_t *ctx);
+teatime_cpu_t *teatime_cpu_create(uint32_t nthreads);
+void teatime_cpu_destroy(teatime_cpu_t *cpu);
+const char *teatime_cpu_isa(const teatime_cpu_t *cpu);
+uint32_t teatime_cpu_threads(const teatime_cpu_t *cpu);
+int teatime_cpu_set_algorithm(teatime_cpu_t *cpu, int algorithm,
+        uint32_t block_words);
+int teatime_cpu_set_counter(teatime_cpu_t *cpu, uint64_t counter);
+int teatime_cpu_set_iv(teatime_cpu_t *cpu, const uint32_t iv[2]);
+int teatime_cpu_get_iv(const teatime_cpu_t *cpu, uint32_t iv[2]);
+int teatime_cpu_cbc_encrypt(teatime_cpu_t *cpu, const uint32_t key[4],
+        uint32_t rounds, const uint32_t *ivs, const uint32_t *input,
+        uint32_t *output, uint32_t nstreams, uint32_t stream_words);
+int teatime_cpu_batch(teatime_cpu_t *cpu, int direction, const uint32_t *keys,
+        uint32_t nkeys, uint32_t rounds, const uint32_t *key_index,
+        const uint32_t *input, uint32_t *output, uint32_t nsegments,
+        uint32_t segment_words);
+int teatime_cpu_search(teatime_cpu_t *cpu, const uint32_t key[4], uint32_t rounds,
+        const uint32_t known[4], const uint32_t target[4], uint32_t count,
+        uint32_t *hits, uint32_t maxhits, uint32_t *nhits);
+int teatime_cpu_run(teatime_cpu_t *cpu, int direction, const uint32_t key[4],
+        uint32_t rounds, const uint32_t *input, uint32_t *output, uint32_t nwords);
+int teatime_cpu_start(teatime_cpu_t *cpu, int direction, const uint32_t key[4],
+        uint32_t rounds, const uint32_t *input, uint32_t *output, uint32_t nwords);
+int teatime_cpu_finish(teatime_cpu_t *cpu, uint64_t *elapsed_ns);
+uint64_t teatime_clock_ns(void);
+void TEA_cpu_encrypt(const uint32_t input[2], const uint32_t key[4],
+        uint32_t output[2], uint16_t rounds);
+void TEA_cpu_decrypt(const uint32_t input[2], const uint32_t key[4],
+        uint32_t output[2], uint16_t rounds);
+void XTEA_cpu_encrypt(const uint32_t input[2], const uint32_t key[4],
+        uint32_t output[2], uint16_t rounds);
+void XTEA_cpu_decrypt(const uint32_t input[2], const uint32_t key[4],
+        uint32_t output[2], uint16_t rounds);
+void XXTEA_cpu_encrypt(uint32_t *v, uint32_t n, const uint32_t key[4],
+        uint32_t rounds);
+void XXTEA_cpu_decrypt(uint32_t *v, uint32_t n, const uint32_t key[4],
+        uint32_t rounds);
 teatime_t *teatime_setup();
 void teatime_cleanup(teatime_t *obj);
 int teatime_set_viewport(teatime_t *obj, uint32_t ilen);
+int teatime_set_tile_size(teatime_t *obj, GLuint width, GLuint height);
 int teatime_create_textures(teatime_t *obj, const uint32_t *input, uint32_t ilen);
 void teatime_delete_textures(teatime_t *obj);
+void teatime_clear_pool(teatime_t *obj);
+void teatime_set_pool_size(teatime_t *obj, uint32_t npairs);
+void teatime_get_pool_stats(const teatime_t *obj, teatime_pool_stats_t *stats);
 int teatime_read_textures(teatime_t *obj, uint32_t *output, uint32_t olen);
 int teatime_create_program(teatime_t *obj, const char *source);
+int teatime_load_program(teatime_t *obj, int direction);
+int teatime_load_program_rounds(teatime_t *obj, int direction, uint32_t rounds);
+int teatime_set_fanout(teatime_t *obj, uint32_t fanout);
+int teatime_set_algorithm(teatime_t *obj, int algorithm, uint32_t block_words);
 void teatime_delete_program(teatime_t *obj);
+void teatime_clear_programs(teatime_t *obj);
+int teatime_set_cache_dir(teatime_t *obj, const char *dir);
+int teatime_set_backend(teatime_t *obj, int backend);
+const char *teatime_backend_name(int backend);
+int teatime_set_workgroup_size(teatime_t *obj, uint32_t size);
 int teatime_run_program(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds);
+int teatime_set_streaming(teatime_t *obj, uint32_t nslots);
+teatime_job_t *teatime_submit(teatime_t *obj, const uint32_t ikey[4],
+        uint32_t rounds, const uint32_t *input, uint32_t *output, uint32_t nwords);
+int teatime_poll(teatime_t *obj, teatime_job_t *job);
+int teatime_wait(teatime_t *obj, teatime_job_t *job, uint64_t timeout_ns);
+void teatime_job_release(teatime_t *obj, teatime_job_t *job);
+teatime_ring_t *teatime_ring_create(teatime_t *obj, uint32_t nslots,
+        uint32_t slot_words);
+int teatime_ring_acquire(teatime_t *obj, teatime_ring_t *ring);
+int teatime_ring_submit(teatime_t *obj, teatime_ring_t *ring, uint32_t slot,
+        const uint32_t ikey[4], uint32_t rounds, uint32_t nwords);
+int teatime_ring_wait(teatime_t *obj, teatime_ring_t *ring, uint32_t slot,
+        uint64_t timeout_ns);
+int teatime_ring_release(teatime_t *obj, teatime_ring_t *ring, uint32_t slot);
+void teatime_ring_destroy(teatime_t *obj, teatime_ring_t *ring);
+teatime_workers_t *teatime_workers_create(uint32_t nworkers,
+        int (*init)(teatime_t *, void *), void *arg);
+void teatime_workers_destroy(teatime_workers_t *pool);
+uint32_t teatime_workers_count(const teatime_workers_t *pool);
+int teatime_workers_submit(teatime_workers_t *pool, teatime_work_t *work);
+int teatime_workers_wait(teatime_workers_t *pool, teatime_work_t *work);
+int teatime_workers_run(teatime_workers_t *pool, teatime_work_t *works, uint32_t nworks);
+teatime_buffer_t *teatime_buffer_create(teatime_t *obj, const uint32_t *input,
+        uint32_t nwords);
+int teatime_buffer_run(teatime_t *obj, teatime_buffer_t *buf,
+        const uint32_t ikey[4], uint32_t rounds);
+int teatime_buffer_read(teatime_t *obj, teatime_buffer_t *buf, uint32_t *output,
+        uint32_t olen);
+void teatime_buffer_release(teatime_t *obj, teatime_buffer_t *buf);
+int teatime_buffer_fingerprint(teatime_t *obj, teatime_buffer_t *buf,
+        teatime_fingerprint_t *fp);
+int teatime_buffer_mismatches(teatime_t *obj, teatime_buffer_t *buf,
+        teatime_buffer_t *ref, uint32_t *mismatches);
+int teatime_fingerprint_output(teatime_t *obj, teatime_fingerprint_t *fp);
+int teatime_set_stats(teatime_t *obj, bool gpu_timers, bool histograms);
+int teatime_get_stats(teatime_t *obj, teatime_stats_t *stats);
+void teatime_reset_stats(teatime_t *obj);
+void teatime_print_stats(teatime_t *obj, FILE *fp);
+const char *teatime_stage_name(int stage);
+int teatime_fingerprint(const uint32_t *data, uint32_t nwords,
+        teatime_fingerprint_t *fp);
+int teatime_run(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds,
+        const uint32_t *input, uint32_t *output, uint32_t nwords);
+int teatime_set_hybrid(teatime_t *obj, bool enable, uint32_t crossover);
+int teatime_set_counter(teatime_t *obj, uint64_t counter);
+int teatime_set_iv(teatime_t *obj, const uint32_t iv[2]);
+int teatime_cbc_encrypt(teatime_t *obj, const uint32_t ikey[4], uint32_t rounds,
+        const uint32_t *ivs, const uint32_t *input, uint32_t *output,
+        uint32_t nstreams, uint32_t stream_words);
+int teatime_run_batch(teatime_t *obj, const uint32_t *keys, uint32_t nkeys,
+        uint32_t rounds, const uint32_t *key_index, const uint32_t *input,
+        uint32_t *output, uint32_t nsegments, uint32_t segment_words);
+int teatime_search_keys(teatime_t *obj, const uint32_t key[4], uint64_t count,
+        uint32_t rounds, const uint32_t known[4], const uint32_t target[4],
+        uint32_t *found, uint32_t maxfound, teatime_search_stats_t *stats);
 const char *teatime_encrypt_source();
 const char *teatime_decrypt_source();
+const char *teatime_xtea_encrypt_source();
+const char *teatime_xtea_decrypt_source();
 int teatime_check_gl_errors(int line, const char *fn_name);
 int teatime_check_gl_fb_errors(int line, const char *fn_name);
 
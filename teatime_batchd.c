@@ -0,0 +1,634 @@
+/*
+ * COPYRIGHT: Stealthy Labs LLC
+ * DATE: 29th May 2015
+ * AUTHOR: Stealthy Labs
+ * SOFTWARE: Tea Time
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <teatime.h>
+#include <teatime_client.h>
+
+/*
+ * teatime-batchd owns the OpenGL context so that processes which encrypt a
+ * few KB each do not pay for a context and a dispatch of their own. Requests
+ * arrive over a Unix-domain socket and name a range of a memfd that the client
+ * shared at connect time. They are held for a window, or until enough payload
+ * has arrived, and then each request is cut into segments and all of them run
+ * under their own keys in one teatime_run_batch() call. The results are
+ * scattered back into the shared buffers and every client gets its reply.
+ */
+
+#define BATCHD_WINDOW_US 500
+#define BATCHD_BATCH_KB 4096
+#define BATCHD_SEGMENT_WORDS 256
+#define BATCHD_MAX_CLIENTS 1024
+#define BATCHD_MAX_SHM_BYTES (1ULL << 30)
+
+typedef struct {
+    int fd;
+    uint32_t *shm; /* the shared buffer of the client */
+    size_t shm_words;
+    bool pending;
+    teatime_batchd_request_t req;
+    uint64_t arrival_ns;
+} batchd_conn_t;
+
+typedef struct {
+    teatime_t *tea;
+    int lfd;
+    uint64_t window_ns;
+    uint64_t batch_words; /* closes a batch early, and caps each group */
+    uint32_t segment_words;
+    int direction; /* of the loaded program, -1 for none */
+    batchd_conn_t *conns;
+    size_t nconns;
+    uint32_t npending;
+    uint64_t pending_words; /* including the padding of the last segments */
+    uint64_t oldest_ns; /* arrival of the first request of the batch */
+    /* staging of a batch, grown as needed */
+    uint32_t *input;
+    uint32_t *output;
+    size_t cap_words;
+    uint32_t *key_index;
+    size_t cap_segments;
+    uint32_t *keys;
+    batchd_conn_t **group;
+    size_t cap_group;
+    uint64_t start_ns;
+    teatime_batchd_stats_t stats;
+} batchd_t;
+
+static volatile sig_atomic_t batchd_quit = 0;
+
+static void batchd_signal(int sig)
+{
+    (void)sig;
+    batchd_quit = 1;
+}
+
+static uint64_t batchd_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void batchd_usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-s SOCKET] [-w WINDOW_US] [-b BATCH_KB] [-g SEGMENT_WORDS]\n"
+        "          [-a tea|xtea] [-v]\n"
+        "       %s -S [-s SOCKET]\n"
+        "  -s SOCKET        socket path (default %s)\n"
+        "  -w WINDOW_US     how long a batch stays open (default %d)\n"
+        "  -b BATCH_KB      close a batch once it holds this much payload (default %d)\n"
+        "  -g SEGMENT_WORDS words per segment, a multiple of 4 (default %d)\n"
+        "  -a CIPHER        tea (default) or xtea\n"
+        "  -v               print the counters on exit\n"
+        "  -S               print the counters of a running daemon\n",
+        prog, prog, teatime_client_default_path(), BATCHD_WINDOW_US,
+        BATCHD_BATCH_KB, BATCHD_SEGMENT_WORDS);
+}
+
+static void batchd_drop(batchd_t *d, batchd_conn_t *conn);
+
+/* words a request takes in a batch, up to the end of its last segment */
+static uint64_t batchd_padded(const batchd_t *d, uint32_t nwords)
+{
+    return ((uint64_t)nwords + d->segment_words - 1) / d->segment_words *
+        d->segment_words;
+}
+
+/*
+ * The client sockets are non-blocking, so a client that stops reading its
+ * replies cannot stall the daemon and the other clients. A reply that does
+ * not fit in the socket buffer fails with EAGAIN and the client is dropped.
+ */
+static int batchd_reply(batchd_conn_t *conn, int status, uint32_t batch_requests,
+        uint64_t queue_ns, uint64_t service_ns, const void *data, size_t dlen)
+{
+    char buf[sizeof(teatime_batchd_reply_t) + sizeof(teatime_batchd_stats_t)];
+    teatime_batchd_reply_t reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.status = status;
+    reply.batch_requests = batch_requests;
+    reply.queue_ns = queue_ns;
+    reply.service_ns = service_ns;
+    memcpy(buf, &reply, sizeof(reply));
+    if (dlen > 0)
+        memcpy(buf + sizeof(reply), data, dlen);
+    if (send(conn->fd, buf, sizeof(reply) + dlen, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        int rc = -errno;
+        if (rc == -EAGAIN || rc == -EWOULDBLOCK)
+            teatime_log(TEATIME_LOG_WARN, "Dropping a client that does not read its replies\n");
+        else
+            teatime_log(TEATIME_LOG_DEBUG, "send() error: %s\n", strerror(-rc));
+        return rc;
+    }
+    return 0;
+}
+
+static int batchd_reserve(batchd_t *d, size_t words, size_t segments, size_t nreqs)
+{
+    if (words > d->cap_words) {
+        uint32_t *in = realloc(d->input, words * sizeof(uint32_t));
+        uint32_t *out = in ? realloc(d->output, words * sizeof(uint32_t)) : NULL;
+        if (in)
+            d->input = in;
+        if (!in || !out)
+            return -ENOMEM;
+        d->output = out;
+        d->cap_words = words;
+    }
+    if (segments > d->cap_segments) {
+        uint32_t *idx = realloc(d->key_index, segments * sizeof(uint32_t));
+        if (!idx)
+            return -ENOMEM;
+        d->key_index = idx;
+        d->cap_segments = segments;
+    }
+    if (nreqs > d->cap_group) {
+        uint32_t *keys = realloc(d->keys, nreqs * 4 * sizeof(uint32_t));
+        batchd_conn_t **group = keys ? realloc(d->group, nreqs * sizeof(batchd_conn_t *)) :
+            NULL;
+        if (keys)
+            d->keys = keys;
+        if (!keys || !group)
+            return -ENOMEM;
+        d->group = group;
+        d->cap_group = nreqs;
+    }
+    return 0;
+}
+
+/* one teatime_run_batch() for the requests with the same direction and
+ * rounds */
+static void batchd_run_group(batchd_t *d, uint32_t n, uint64_t close_ns)
+{
+    int rc = 0;
+    uint32_t segw = d->segment_words;
+    uint32_t nsegments = 0;
+    uint64_t words = 0;
+    uint64_t done_ns;
+    const teatime_batchd_request_t *first = &(d->group[0]->req);
+    int direction = (first->direction == TEATIME_CLIENT_DECRYPT) ?
+        TEATIME_BATCH_DECRYPT : TEATIME_BATCH_ENCRYPT;
+    for (uint32_t i = 0; i < n; ++i)
+        nsegments += (d->group[i]->req.nwords + segw - 1) / segw;
+    do {
+        uint32_t seg = 0;
+        uint64_t t0;
+        rc = batchd_reserve(d, (size_t)nsegments * segw, nsegments, 0);
+        if (rc < 0)
+            break;
+        /* gather, the padding of the last segment of a request is
+         * encrypted too but never scattered back */
+        for (uint32_t i = 0; i < n; ++i) {
+            const batchd_conn_t *conn = d->group[i];
+            uint32_t nw = conn->req.nwords;
+            uint32_t nseg = (nw + segw - 1) / segw;
+            uint32_t *dst = d->input + (size_t)seg * segw;
+            memcpy(dst, conn->shm + conn->req.offset, nw * sizeof(uint32_t));
+            memset(dst + nw, 0, ((size_t)nseg * segw - nw) * sizeof(uint32_t));
+            memcpy(d->keys + 4 * i, conn->req.key, 4 * sizeof(uint32_t));
+            for (uint32_t s = 0; s < nseg; ++s)
+                d->key_index[seg + s] = i;
+            seg += nseg;
+            words += nw;
+        }
+        if (d->direction != direction) {
+            d->direction = -1;
+            rc = teatime_load_program(d->tea, direction);
+            if (rc < 0)
+                break;
+            d->direction = direction;
+        }
+        t0 = batchd_now_ns();
+        rc = teatime_run_batch(d->tea, d->keys, n, first->rounds, d->key_index,
+                d->input, d->output, nsegments, segw);
+        d->stats.engine_ns += batchd_now_ns() - t0;
+        if (rc < 0)
+            break;
+        seg = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            const batchd_conn_t *conn = d->group[i];
+            memcpy(conn->shm + conn->req.offset, d->output + (size_t)seg * segw,
+                    conn->req.nwords * sizeof(uint32_t));
+            seg += (conn->req.nwords + segw - 1) / segw;
+        }
+    } while (0);
+    if (rc < 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Batch of %u requests failed: %s\n", n,
+                strerror(-rc));
+        d->stats.errors += n;
+    }
+    done_ns = batchd_now_ns();
+    d->stats.batches++;
+    d->stats.requests += n;
+    d->stats.words += words;
+    if (n > d->stats.max_batch_requests)
+        d->stats.max_batch_requests = n;
+    for (uint32_t i = 0; i < n; ++i) {
+        batchd_conn_t *conn = d->group[i];
+        uint64_t queue_ns = close_ns - conn->arrival_ns;
+        uint64_t service_ns = done_ns - conn->arrival_ns;
+        d->stats.queue_ns += queue_ns;
+        d->stats.service_ns += service_ns;
+        if (queue_ns > d->stats.max_queue_ns)
+            d->stats.max_queue_ns = queue_ns;
+        if (service_ns > d->stats.max_service_ns)
+            d->stats.max_service_ns = service_ns;
+        conn->pending = false;
+        if (batchd_reply(conn, rc, n, queue_ns, service_ns, NULL, 0) < 0)
+            batchd_drop(d, conn);
+    }
+}
+
+static void batchd_flush(batchd_t *d)
+{
+    uint64_t close_ns = batchd_now_ns();
+    if (batchd_reserve(d, 0, 0, d->npending) < 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory for a batch of %u requests\n",
+                d->npending);
+        return;
+    }
+    for (;;) {
+        const batchd_conn_t *first = NULL;
+        uint32_t n = 0;
+        uint64_t words = 0;
+        for (size_t i = 0; i < d->nconns && !first; ++i) {
+            if (d->conns[i].pending)
+                first = &(d->conns[i]);
+        }
+        if (!first)
+            break;
+        /* a group never holds more than batch_words, and the requests that
+         * would pass it go in the next one */
+        for (size_t i = 0; i < d->nconns; ++i) {
+            batchd_conn_t *conn = &(d->conns[i]);
+            uint64_t padded = batchd_padded(d, conn->req.nwords);
+            if (conn->pending && conn->req.direction == first->req.direction &&
+                conn->req.rounds == first->req.rounds &&
+                words + padded <= d->batch_words) {
+                d->group[n++] = conn;
+                words += padded;
+            }
+        }
+        batchd_run_group(d, n, close_ns);
+    }
+    d->npending = 0;
+    d->pending_words = 0;
+}
+
+static int batchd_hello(batchd_conn_t *conn, const teatime_batchd_request_t *req, int fd)
+{
+    struct stat st;
+    void *p;
+    int seals = fcntl(fd, F_GET_SEALS);
+    /* a buffer that could shrink would take the daemon down with SIGBUS */
+    if (conn->shm || seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) < 0 ||
+        req->offset == 0 || req->offset > BATCHD_MAX_SHM_BYTES ||
+        (req->offset % sizeof(uint32_t)) != 0 || (uint64_t)st.st_size < req->offset)
+        return -EINVAL;
+    p = mmap(NULL, (size_t)req->offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return -errno;
+    conn->shm = p;
+    conn->shm_words = (size_t)(req->offset / sizeof(uint32_t));
+    return 0;
+}
+
+static int batchd_recv(batchd_t *d, batchd_conn_t *conn)
+{
+    int rc = 0;
+    int fd = -1;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    teatime_batchd_request_t req;
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    if (n <= 0)
+        return (n == 0) ? -ECONNRESET : -errno;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if ((size_t)n != sizeof(req)) {
+        rc = -EPROTO;
+    } else if (req.op == TEATIME_BATCHD_HELLO) {
+        rc = (fd >= 0) ? batchd_hello(conn, &req, fd) : -EINVAL;
+        rc = batchd_reply(conn, rc, 0, 0, 0, NULL, 0);
+    } else if (req.op == TEATIME_BATCHD_STATS) {
+        teatime_batchd_stats_t stats = d->stats;
+        stats.uptime_ns = batchd_now_ns() - d->start_ns;
+        stats.clients = d->nconns;
+        rc = batchd_reply(conn, 0, 0, 0, 0, &stats, sizeof(stats));
+    } else if (req.op == TEATIME_BATCHD_RUN) {
+        int status = 0;
+        if (!conn->shm)
+            status = -ENOTCONN;
+        else if (conn->pending)
+            status = -EBUSY;
+        else if (req.nwords == 0 || (req.nwords % 2) != 0 ||
+                req.offset > conn->shm_words ||
+                req.nwords > conn->shm_words - req.offset ||
+                (req.direction != TEATIME_CLIENT_ENCRYPT &&
+                 req.direction != TEATIME_CLIENT_DECRYPT))
+            status = -EINVAL;
+        else if (batchd_padded(d, req.nwords) > d->batch_words)
+            status = -E2BIG;
+        if (status < 0) {
+            d->stats.errors++;
+            rc = batchd_reply(conn, status, 0, 0, 0, NULL, 0);
+        } else {
+            conn->req = req;
+            conn->pending = true;
+            conn->arrival_ns = batchd_now_ns();
+            if (d->npending++ == 0)
+                d->oldest_ns = conn->arrival_ns;
+            d->pending_words += batchd_padded(d, req.nwords);
+        }
+    } else {
+        rc = batchd_reply(conn, -EINVAL, 0, 0, 0, NULL, 0);
+    }
+    if (fd >= 0)
+        close(fd);
+    return rc;
+}
+
+static void batchd_drop(batchd_t *d, batchd_conn_t *conn)
+{
+    if (conn->pending) {
+        d->npending--;
+        d->pending_words -= batchd_padded(d, conn->req.nwords);
+        conn->pending = false;
+    }
+    if (conn->shm)
+        munmap(conn->shm, conn->shm_words * sizeof(uint32_t));
+    conn->shm = NULL;
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+static int batchd_listen(batchd_t *d, const char *path)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        teatime_log(TEATIME_LOG_ERROR, "Socket path %s is too long\n", path);
+        return -ENAMETOOLONG;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    /* a socket left behind by a daemon that died is taken over */
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Another daemon is listening on %s\n", path);
+        close(fd);
+        return -EADDRINUSE;
+    }
+    if (fd >= 0)
+        close(fd);
+    unlink(path);
+    d->lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (d->lfd < 0) {
+        teatime_log(TEATIME_LOG_ERROR, "socket() error: %s\n", strerror(errno));
+        return -errno;
+    }
+    /* only the user running the daemon can connect */
+    mask = umask(077);
+    if (bind(d->lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(d->lfd, 128) < 0) {
+        int rc = -errno;
+        umask(mask);
+        teatime_log(TEATIME_LOG_ERROR, "Unable to listen on %s: %s\n", path,
+                strerror(errno));
+        return rc;
+    }
+    umask(mask);
+    teatime_log(TEATIME_LOG_INFO, "Listening on %s\n", path);
+    return 0;
+}
+
+static int batchd_loop(batchd_t *d)
+{
+    struct pollfd *fds = calloc(BATCHD_MAX_CLIENTS + 1, sizeof(struct pollfd));
+    if (!fds)
+        return -ENOMEM;
+    d->conns = calloc(BATCHD_MAX_CLIENTS, sizeof(batchd_conn_t));
+    if (!d->conns) {
+        free(fds);
+        return -ENOMEM;
+    }
+    while (!batchd_quit) {
+        struct timespec ts;
+        struct timespec *tsp = NULL;
+        size_t nconns = d->nconns;
+        uint64_t now;
+        int n;
+        fds[0].fd = d->lfd;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < nconns; ++i) {
+            fds[i + 1].fd = d->conns[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        if (d->npending > 0) {
+            uint64_t deadline = d->oldest_ns + d->window_ns;
+            now = batchd_now_ns();
+            now = (deadline > now) ? deadline - now : 0;
+            ts.tv_sec = (time_t)(now / 1000000000ULL);
+            ts.tv_nsec = (long)(now % 1000000000ULL);
+            tsp = &ts;
+        }
+        n = ppoll(fds, nconns + 1, tsp, NULL);
+        if (n < 0 && errno != EINTR) {
+            teatime_log(TEATIME_LOG_ERROR, "ppoll() error: %s\n", strerror(errno));
+            break;
+        }
+        for (size_t i = 0; n > 0 && i < nconns; ++i) {
+            /* a flush may have dropped a client further on */
+            if (d->conns[i].fd < 0 || !fds[i + 1].revents)
+                continue;
+            if (batchd_recv(d, &(d->conns[i])) < 0)
+                batchd_drop(d, &(d->conns[i]));
+            /* close a full batch now rather than after the whole pass */
+            if (d->npending > 0 && d->pending_words >= d->batch_words)
+                batchd_flush(d);
+        }
+        if (n > 0 && (fds[0].revents & POLLIN)) {
+            int fd = accept4(d->lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd >= 0 && d->nconns >= BATCHD_MAX_CLIENTS) {
+                teatime_log(TEATIME_LOG_WARN, "Too many clients, max. %d\n",
+                        BATCHD_MAX_CLIENTS);
+                close(fd);
+            } else if (fd >= 0) {
+                memset(&(d->conns[d->nconns]), 0, sizeof(batchd_conn_t));
+                d->conns[d->nconns++].fd = fd;
+            }
+        }
+        /* pending requests never move, the batch keeps pointers to them */
+        if (d->npending > 0 && (d->pending_words >= d->batch_words ||
+                    batchd_now_ns() - d->oldest_ns >= d->window_ns))
+            batchd_flush(d);
+        for (size_t i = 0; i < d->nconns; ) {
+            if (d->conns[i].fd < 0)
+                d->conns[i] = d->conns[--d->nconns];
+            else
+                ++i;
+        }
+    }
+    for (size_t i = 0; i < d->nconns; ++i)
+        batchd_drop(d, &(d->conns[i]));
+    d->nconns = 0;
+    free(d->conns);
+    free(fds);
+    return 0;
+}
+
+static int batchd_print_remote(const char *path)
+{
+    teatime_batchd_stats_t stats;
+    int rc;
+    teatime_client_t *cl = teatime_client_connect(path, sizeof(uint32_t));
+    if (!cl) {
+        fprintf(stderr, "Unable to connect to %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    rc = teatime_client_get_stats(cl, &stats);
+    if (rc == 0)
+        teatime_client_print_stats(&stats, stdout);
+    teatime_client_close(cl);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    int rc = 0;
+    int ch;
+    int algorithm = TEATIME_ALG_TEA;
+    bool verbose = false;
+    bool remote = false;
+    const char *path = teatime_client_default_path();
+    struct sigaction sa;
+    batchd_t d;
+    memset(&d, 0, sizeof(d));
+    d.lfd = -1;
+    d.direction = -1;
+    d.window_ns = BATCHD_WINDOW_US * 1000ULL;
+    d.batch_words = BATCHD_BATCH_KB * 1024ULL / sizeof(uint32_t);
+    d.segment_words = BATCHD_SEGMENT_WORDS;
+    while ((ch = getopt(argc, argv, "s:w:b:g:a:vSh")) != -1) {
+        switch (ch) {
+        case 's':
+            path = optarg;
+            break;
+        case 'w':
+            d.window_ns = strtoull(optarg, NULL, 10) * 1000ULL;
+            break;
+        case 'b':
+            d.batch_words = strtoull(optarg, NULL, 10) * 1024ULL / sizeof(uint32_t);
+            break;
+        case 'g':
+            d.segment_words = (uint32_t)strtoul(optarg, NULL, 10);
+            if (d.segment_words == 0 || (d.segment_words % 4) != 0) {
+                fprintf(stderr, "The segment must be a multiple of 4 words\n");
+                return 2;
+            }
+            break;
+        case 'a':
+            if (strcmp(optarg, "tea") && strcmp(optarg, "xtea")) {
+                batchd_usage(argv[0]);
+                return 2;
+            }
+            algorithm = strcmp(optarg, "xtea") ? TEATIME_ALG_TEA : TEATIME_ALG_XTEA;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'S':
+            remote = true;
+            break;
+        default:
+            batchd_usage(argv[0]);
+            return (ch == 'h') ? 0 : 2;
+        }
+    }
+    if (optind < argc) {
+        batchd_usage(argv[0]);
+        return 2;
+    }
+    /* whole segments, and no more words than one teatime_run_batch() takes */
+    if (d.batch_words > UINT32_MAX)
+        d.batch_words = UINT32_MAX;
+    d.batch_words -= d.batch_words % d.segment_words;
+    if (d.batch_words == 0) {
+        fprintf(stderr, "The batch must hold at least one segment\n");
+        return 2;
+    }
+    if (remote)
+        return (batchd_print_remote(path) < 0) ? 1 : 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = batchd_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    do {
+        d.tea = teatime_setup();
+        if (!d.tea) {
+            rc = -ENOMEM;
+            break;
+        }
+        rc = teatime_set_algorithm(d.tea, algorithm, 2);
+        if (rc < 0)
+            break;
+        rc = batchd_listen(&d, path);
+        if (rc < 0)
+            break;
+        d.start_ns = batchd_now_ns();
+        rc = batchd_loop(&d);
+    } while (0);
+    if (d.lfd >= 0) {
+        close(d.lfd);
+        unlink(path);
+    }
+    if (verbose && d.tea) {
+        d.stats.uptime_ns = batchd_now_ns() - d.start_ns;
+        teatime_client_print_stats(&d.stats, stderr);
+        teatime_print_stats(d.tea, stderr);
+    }
+    if (d.tea) {
+        teatime_delete_program(d.tea);
+        teatime_cleanup(d.tea);
+    }
+    free(d.input);
+    free(d.output);
+    free(d.key_index);
+    free(d.keys);
+    free(d.group);
+    return (rc < 0) ? 1 : 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * COPYRIGHT: Stealthy Labs LLC
+ * DATE: 29th May 2015
+ * AUTHOR: Stealthy Labs
+ * SOFTWARE: Tea Time
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <teatime_client.h>
+
+struct teatime_client_s {
+    int fd; /* SOCK_SEQPACKET connection to the daemon */
+    int memfd;
+    uint32_t *shm;
+    size_t shm_bytes;
+};
+
+const char *teatime_client_default_path(void)
+{
+    static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    const char *env = getenv("TEATIME_BATCHD_SOCKET");
+    const char *rundir = getenv("XDG_RUNTIME_DIR");
+    if (env && env[0])
+        return env;
+    if (rundir && rundir[0])
+        snprintf(path, sizeof(path), "%s/teatime-batchd.sock", rundir);
+    else
+        snprintf(path, sizeof(path), "/tmp/teatime-batchd-%u.sock", (unsigned)getuid());
+    return path;
+}
+
+/* sends a request and waits for its reply, and for the data following it */
+static int teatime_client_call(teatime_client_t *cl,
+        const teatime_batchd_request_t *req, int fd, teatime_batchd_reply_t *reply,
+        void *data, size_t dlen)
+{
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    char rbuf[sizeof(teatime_batchd_reply_t) + sizeof(teatime_batchd_stats_t)];
+    struct iovec iov = { (void *)req, sizeof(*req) };
+    struct msghdr msg;
+    ssize_t n;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        struct cmsghdr *cmsg;
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    do {
+        n = sendmsg(cl->fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return -errno;
+    do {
+        n = recv(cl->fd, rbuf, sizeof(teatime_batchd_reply_t) + dlen, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return -errno;
+    if ((size_t)n < sizeof(teatime_batchd_reply_t) + dlen)
+        return -EPROTO;
+    memcpy(reply, rbuf, sizeof(teatime_batchd_reply_t));
+    if (dlen > 0)
+        memcpy(data, rbuf + sizeof(teatime_batchd_reply_t), dlen);
+    return reply->status;
+}
+
+teatime_client_t *teatime_client_connect(const char *path, size_t shm_bytes)
+{
+    int rc = 0;
+    struct sockaddr_un addr;
+    teatime_batchd_request_t req;
+    teatime_batchd_reply_t reply;
+    teatime_client_t *cl = calloc(1, sizeof(teatime_client_t));
+    if (!cl)
+        return NULL;
+    cl->fd = -1;
+    cl->memfd = -1;
+    if (!path)
+        path = teatime_client_default_path();
+    if (shm_bytes == 0)
+        shm_bytes = TEATIME_CLIENT_SHM_BYTES;
+    shm_bytes = (shm_bytes + 7) & ~(size_t)7;
+    do {
+        void *p;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            rc = -ENAMETOOLONG;
+            break;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        cl->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (cl->fd < 0 || connect(cl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            rc = -errno;
+            break;
+        }
+        /* the daemon maps the buffer too, so it must not shrink under it */
+        cl->memfd = memfd_create("teatime-client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (cl->memfd < 0 || ftruncate(cl->memfd, (off_t)shm_bytes) < 0 ||
+            fcntl(cl->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+            rc = -errno;
+            break;
+        }
+        p = mmap(NULL, shm_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, cl->memfd, 0);
+        if (p == MAP_FAILED) {
+            rc = -errno;
+            break;
+        }
+        cl->shm = p;
+        cl->shm_bytes = shm_bytes;
+        memset(&req, 0, sizeof(req));
+        req.op = TEATIME_BATCHD_HELLO;
+        req.offset = shm_bytes;
+        rc = teatime_client_call(cl, &req, cl->memfd, &reply, NULL, 0);
+    } while (0);
+    if (rc < 0) {
+        teatime_client_close(cl);
+        errno = -rc;
+        return NULL;
+    }
+    return cl;
+}
+
+void teatime_client_close(teatime_client_t *cl)
+{
+    if (cl) {
+        if (cl->shm)
+            munmap(cl->shm, cl->shm_bytes);
+        if (cl->memfd >= 0)
+            close(cl->memfd);
+        if (cl->fd >= 0)
+            close(cl->fd);
+        free(cl);
+    }
+}
+
+uint32_t *teatime_client_buffer(teatime_client_t *cl)
+{
+    return cl ? cl->shm : NULL;
+}
+
+size_t teatime_client_buffer_words(const teatime_client_t *cl)
+{
+    return cl ? cl->shm_bytes / sizeof(uint32_t) : 0;
+}
+
+int teatime_client_run(teatime_client_t *cl, int direction, const uint32_t key[4],
+        uint32_t rounds, const uint32_t *input, uint32_t *output, uint32_t nwords,
+        teatime_batchd_reply_t *reply)
+{
+    int rc = 0;
+    teatime_batchd_request_t req;
+    teatime_batchd_reply_t rep;
+    size_t words = teatime_client_buffer_words(cl);
+    size_t offset = 0;
+    if (!cl || !key || !input || !output || nwords == 0 || (nwords % 2) != 0 ||
+        nwords > words ||
+        (direction != TEATIME_CLIENT_ENCRYPT && direction != TEATIME_CLIENT_DECRYPT))
+        return -EINVAL;
+    /* data already in the shared buffer is run in place */
+    if (input >= cl->shm && input + nwords <= cl->shm + words)
+        offset = (size_t)(input - cl->shm);
+    else
+        memcpy(cl->shm, input, nwords * sizeof(uint32_t));
+    memset(&req, 0, sizeof(req));
+    req.op = TEATIME_BATCHD_RUN;
+    req.direction = (uint32_t)direction;
+    memcpy(req.key, key, sizeof(req.key));
+    req.rounds = rounds;
+    req.nwords = nwords;
+    req.offset = offset;
+    rc = teatime_client_call(cl, &req, -1, &rep, NULL, 0);
+    if (rc < 0)
+        return rc;
+    if (output != cl->shm + offset)
+        memcpy(output, cl->shm + offset, nwords * sizeof(uint32_t));
+    if (reply)
+        *reply = rep;
+    return 0;
+}
+
+int teatime_client_get_stats(teatime_client_t *cl, teatime_batchd_stats_t *stats)
+{
+    teatime_batchd_request_t req;
+    teatime_batchd_reply_t rep;
+    if (!cl || !stats)
+        return -EINVAL;
+    memset(&req, 0, sizeof(req));
+    req.op = TEATIME_BATCHD_STATS;
+    return teatime_client_call(cl, &req, -1, &rep, stats, sizeof(*stats));
+}
+
+void teatime_client_print_stats(const teatime_batchd_stats_t *stats, FILE *fp)
+{
+    double secs, engine_secs;
+    uint64_t n;
+    if (!stats || !fp)
+        return;
+    n = stats->requests ? stats->requests : 1;
+    secs = stats->uptime_ns ? stats->uptime_ns / 1e9 : 1.0;
+    engine_secs = stats->engine_ns ? stats->engine_ns / 1e9 : 1.0;
+    fprintf(fp, "clients : %llu connected\n", (unsigned long long)stats->clients);
+    fprintf(fp, "requests: %llu (%llu errors) %.1f/s in %llu batches of %.1f, max %llu\n",
+            (unsigned long long)stats->requests, (unsigned long long)stats->errors,
+            stats->requests / secs, (unsigned long long)stats->batches,
+            stats->batches ? (double)stats->requests / stats->batches : 0.0,
+            (unsigned long long)stats->max_batch_requests);
+    fprintf(fp, "latency : queue %.3f ms (max %.3f ms) service %.3f ms (max %.3f ms)\n",
+            stats->queue_ns / 1e6 / n, stats->max_queue_ns / 1e6,
+            stats->service_ns / 1e6 / n, stats->max_service_ns / 1e6);
+    fprintf(fp, "payload : %llu bytes %.3f MB/s overall, %.3f MB/s in the engine\n",
+            (unsigned long long)(stats->words * 4), stats->words * 4 / secs / 1e6,
+            stats->words * 4 / engine_secs / 1e6);
+}
@@ -0,0 +1,83 @@
+/*
+ * COPYRIGHT: Stealthy Labs LLC
+ * DATE: 29th May 2015
+ * AUTHOR: Stealthy Labs
+ * SOFTWARE: Tea Time
+ */
+#ifndef __TEATIME_CLIENT_H__
+#define __TEATIME_CLIENT_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Client side of teatime-batchd. The daemon owns the OpenGL context and
+ * coalesces the requests of many processes into one batch run. A client
+ * shares a sealed memfd with the daemon once, at connect time, and each
+ * request only names a range of it, so the payload never goes through the
+ * socket. This header does not need the OpenGL headers.
+ */
+
+/* directions, same values as TEATIME_ENCRYPT and TEATIME_DECRYPT */
+#define TEATIME_CLIENT_ENCRYPT 0
+#define TEATIME_CLIENT_DECRYPT 1
+
+/* socket messages */
+#define TEATIME_BATCHD_HELLO 1 /* carries the memfd */
+#define TEATIME_BATCHD_RUN 2
+#define TEATIME_BATCHD_STATS 3
+
+/* default size of the shared buffer of a client */
+#define TEATIME_CLIENT_SHM_BYTES (1 << 20)
+
+typedef struct {
+    uint32_t op; /* TEATIME_BATCHD_* */
+    uint32_t direction; /* TEATIME_CLIENT_ENCRYPT or TEATIME_CLIENT_DECRYPT */
+    uint32_t key[4];
+    uint32_t rounds;
+    uint32_t nwords; /* even, i.e. whole 64-bit blocks */
+    uint64_t offset; /* words into the shared buffer, its bytes for HELLO */
+} teatime_batchd_request_t;
+
+typedef struct {
+    int32_t status; /* 0 or a negative errno */
+    uint32_t batch_requests; /* requests in the batch of this one */
+    uint64_t queue_ns; /* from receipt until the batch was closed */
+    uint64_t service_ns; /* from receipt until the reply */
+} teatime_batchd_reply_t;
+
+/* daemon counters, since it started */
+typedef struct {
+    uint64_t uptime_ns;
+    uint64_t clients; /* connected now */
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t words; /* payload words of the requests */
+    uint64_t batches;
+    uint64_t max_batch_requests;
+    uint64_t queue_ns; /* sum over the requests */
+    uint64_t max_queue_ns;
+    uint64_t service_ns; /* sum over the requests */
+    uint64_t max_service_ns;
+    uint64_t engine_ns; /* time spent in the engine */
+} teatime_batchd_stats_t;
+
+typedef struct teatime_client_s teatime_client_t;
+
+/* $TEATIME_BATCHD_SOCKET, $XDG_RUNTIME_DIR/teatime-batchd.sock or
+ * /tmp/teatime-batchd-<uid>.sock */
+const char *teatime_client_default_path(void);
+/* path may be NULL for the default and shm_bytes 0 for the default size */
+teatime_client_t *teatime_client_connect(const char *path, size_t shm_bytes);
+void teatime_client_close(teatime_client_t *cl);
+/* data in the shared buffer is not copied by teatime_client_run() */
+uint32_t *teatime_client_buffer(teatime_client_t *cl);
+size_t teatime_client_buffer_words(const teatime_client_t *cl);
+/* blocks until the batch with the request has run, reply may be NULL */
+int teatime_client_run(teatime_client_t *cl, int direction, const uint32_t key[4],
+        uint32_t rounds, const uint32_t *input, uint32_t *output, uint32_t nwords,
+        teatime_batchd_reply_t *reply);
+int teatime_client_get_stats(teatime_client_t *cl, teatime_batchd_stats_t *stats);
+void teatime_client_print_stats(const teatime_batchd_stats_t *stats, FILE *fp);
+
+#endif /* __TEATIME_CLIENT_H__ */
@@ -0,0 +1,322 @@
+/*
+ * COPYRIGHT: Stealthy Labs LLC
+ * DATE: 29th May 2015
+ * AUTHOR: Stealthy Labs
+ * SOFTWARE: Tea Time
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <teatime.h>
+#ifdef TEATIME_HAVE_EGL
+    #include <EGL/egl.h>
+    #include <EGL/eglext.h>
+    #include <pthread.h>
+#endif
+#ifdef TEATIME_HAVE_OSMESA
+    #include <GL/osmesa.h>
+#endif
+
+/*
+ * A headless context lets the engine run on batch nodes and CI machines that
+ * have no X display and no GPU. We try a surfaceless EGL context first since
+ * that works with both Mesa (llvmpipe/softpipe or real hardware) and the
+ * proprietary drivers, and fall back to OSMesa if EGL is not usable.
+ * TEATIME_CONTEXT=egl or TEATIME_CONTEXT=osmesa allows only the one.
+ */
+struct teatime_context_s {
+    int type; /* TEATIME_CONTEXT_EGL or TEATIME_CONTEXT_OSMESA */
+#ifdef TEATIME_HAVE_EGL
+    EGLDisplay display;
+    EGLContext context;
+    EGLSurface surface; /* only if surfaceless is not supported */
+#endif
+#ifdef TEATIME_HAVE_OSMESA
+    OSMesaContext osmesa;
+    GLubyte osmesa_buf[4]; /* 1x1 RGBA color buffer for OSMesaMakeCurrent */
+#endif
+};
+
+#ifdef TEATIME_HAVE_EGL
+/* every context of the process gets the same display, and eglTerminate()
+ * would pull it from under the others, e.g. the threads of a context pool */
+static pthread_mutex_t teatime_egl_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t teatime_egl_refs = 0;
+
+static bool teatime_egl_has_extension(EGLDisplay dpy, const char *name)
+{
+    const char *exts = eglQueryString(dpy, EGL_EXTENSIONS);
+    size_t nlen = strlen(name);
+    while (exts && *exts) {
+        const char *end = strchr(exts, ' ');
+        size_t elen = end ? (size_t)(end - exts) : strlen(exts);
+        if (elen == nlen && strncmp(exts, name, nlen) == 0)
+            return true;
+        if (!end)
+            break;
+        exts = end + 1;
+    }
+    return false;
+}
+
+static EGLDisplay teatime_egl_get_display(void)
+{
+    EGLDisplay dpy = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    /* client extensions are queried on EGL_NO_DISPLAY */
+    if (get_platform_display &&
+        teatime_egl_has_extension(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless")) {
+        dpy = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                EGL_DEFAULT_DISPLAY, NULL);
+        if (dpy != EGL_NO_DISPLAY)
+            return dpy;
+    }
+    if (get_platform_display &&
+        teatime_egl_has_extension(EGL_NO_DISPLAY, "EGL_EXT_platform_device")) {
+        PFNEGLQUERYDEVICESEXTPROC query_devices =
+            (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+        EGLDeviceEXT device;
+        EGLint ndevices = 0;
+        if (query_devices && query_devices(1, &device, &ndevices) && ndevices > 0) {
+            dpy = get_platform_display(EGL_PLATFORM_DEVICE_EXT, device, NULL);
+            if (dpy != EGL_NO_DISPLAY)
+                return dpy;
+        }
+    }
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+static int teatime_egl_create(teatime_context_t *ctx)
+{
+    int rc = 0;
+    EGLint major = 0, minor = 0;
+    EGLConfig config = NULL;
+    const EGLint ctxattribs[] = { EGL_NONE };
+    const EGLint coreattribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    const char *profile = getenv("TEATIME_GL_PROFILE");
+    ctx->display = teatime_egl_get_display();
+    if (ctx->display == EGL_NO_DISPLAY) {
+        teatime_log(TEATIME_LOG_WARN, "Unable to get an EGL display\n");
+        return -ENODEV;
+    }
+    if (!eglInitialize(ctx->display, &major, &minor)) {
+        teatime_log(TEATIME_LOG_WARN, "eglInitialize() error: 0x%x\n", eglGetError());
+        ctx->display = EGL_NO_DISPLAY;
+        return -ENODEV;
+    }
+    pthread_mutex_lock(&teatime_egl_lock);
+    teatime_egl_refs++;
+    pthread_mutex_unlock(&teatime_egl_lock);
+    do {
+        teatime_log(TEATIME_LOG_INFO, "Initialized EGL %d.%d from %s\n", major, minor,
+                eglQueryString(ctx->display, EGL_VENDOR));
+        if (!eglBindAPI(EGL_OPENGL_API)) {
+            teatime_log(TEATIME_LOG_WARN, "eglBindAPI() error: 0x%x\n", eglGetError());
+            rc = -ENOTSUP;
+            break;
+        }
+        if (!teatime_egl_has_extension(ctx->display, "EGL_KHR_no_config_context") ||
+            !teatime_egl_has_extension(ctx->display, "EGL_KHR_surfaceless_context")) {
+            const EGLint cfgattribs[] = {
+                EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+                EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                EGL_NONE
+            };
+            EGLint nconfigs = 0;
+            if (!eglChooseConfig(ctx->display, cfgattribs, &config, 1, &nconfigs) ||
+                nconfigs < 1) {
+                teatime_log(TEATIME_LOG_WARN, "eglChooseConfig() error: 0x%x\n",
+                        eglGetError());
+                rc = -ENOTSUP;
+                break;
+            }
+        }
+        /* the engine uses no fixed-function state, so a core profile is
+         * asked for first as it is the leaner one on most drivers. EGL 1.4
+         * without EGL_KHR_create_context only makes the default context. */
+        if ((!profile || strcmp(profile, "compat") != 0) &&
+            (major > 1 || (major == 1 && minor >= 5) ||
+             teatime_egl_has_extension(ctx->display, "EGL_KHR_create_context"))) {
+            ctx->context = eglCreateContext(ctx->display, config, EGL_NO_CONTEXT,
+                    coreattribs);
+            if (ctx->context == EGL_NO_CONTEXT)
+                teatime_log(TEATIME_LOG_INFO, "No OpenGL 3.3 core profile context (0x%x). "
+                        "Trying the default context\n", eglGetError());
+        }
+        if (ctx->context == EGL_NO_CONTEXT)
+            ctx->context = eglCreateContext(ctx->display, config, EGL_NO_CONTEXT,
+                    ctxattribs);
+        if (ctx->context == EGL_NO_CONTEXT) {
+            teatime_log(TEATIME_LOG_WARN, "eglCreateContext() error: 0x%x\n",
+                    eglGetError());
+            rc = -ENOTSUP;
+            break;
+        }
+        ctx->surface = EGL_NO_SURFACE;
+        if (!teatime_egl_has_extension(ctx->display, "EGL_KHR_surfaceless_context")) {
+            /* all rendering goes to an FBO so a 1x1 pbuffer is enough */
+            const EGLint pbattribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+            ctx->surface = eglCreatePbufferSurface(ctx->display, config, pbattribs);
+            if (ctx->surface == EGL_NO_SURFACE) {
+                teatime_log(TEATIME_LOG_WARN, "eglCreatePbufferSurface() error: 0x%x\n",
+                        eglGetError());
+                rc = -ENOTSUP;
+                break;
+            }
+        }
+        if (!eglMakeCurrent(ctx->display, ctx->surface, ctx->surface,
+                    ctx->context)) {
+            teatime_log(TEATIME_LOG_WARN, "eglMakeCurrent() error: 0x%x\n", eglGetError());
+            rc = -ENOTSUP;
+            break;
+        }
+        ctx->type = TEATIME_CONTEXT_EGL;
+        rc = 0;
+    } while (0);
+    return rc;
+}
+
+static void teatime_egl_destroy(teatime_context_t *ctx)
+{
+    if (ctx->display != EGL_NO_DISPLAY) {
+        eglMakeCurrent(ctx->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                EGL_NO_CONTEXT);
+        if (ctx->surface != EGL_NO_SURFACE)
+            eglDestroySurface(ctx->display, ctx->surface);
+        if (ctx->context != EGL_NO_CONTEXT)
+            eglDestroyContext(ctx->display, ctx->context);
+        pthread_mutex_lock(&teatime_egl_lock);
+        if (--teatime_egl_refs == 0)
+            eglTerminate(ctx->display);
+        pthread_mutex_unlock(&teatime_egl_lock);
+    }
+    ctx->display = EGL_NO_DISPLAY;
+    ctx->context = EGL_NO_CONTEXT;
+    ctx->surface = EGL_NO_SURFACE;
+}
+#endif /* TEATIME_HAVE_EGL */
+
+#ifdef TEATIME_HAVE_OSMESA
+static int teatime_osmesa_create(teatime_context_t *ctx)
+{
+    ctx->osmesa = OSMesaCreateContextExt(OSMESA_RGBA, 0, 0, 0, NULL);
+    if (!ctx->osmesa) {
+        teatime_log(TEATIME_LOG_WARN, "OSMesaCreateContextExt() failed\n");
+        return -ENOTSUP;
+    }
+    if (!OSMesaMakeCurrent(ctx->osmesa, ctx->osmesa_buf, GL_UNSIGNED_BYTE, 1, 1)) {
+        teatime_log(TEATIME_LOG_WARN, "OSMesaMakeCurrent() failed\n");
+        OSMesaDestroyContext(ctx->osmesa);
+        ctx->osmesa = NULL;
+        return -ENOTSUP;
+    }
+    ctx->type = TEATIME_CONTEXT_OSMESA;
+    return 0;
+}
+
+static void teatime_osmesa_destroy(teatime_context_t *ctx)
+{
+    if (ctx->osmesa)
+        OSMesaDestroyContext(ctx->osmesa);
+    ctx->osmesa = NULL;
+}
+#endif /* TEATIME_HAVE_OSMESA */
+
+teatime_context_t *teatime_context_create()
+{
+    int rc = -ENOTSUP;
+    teatime_context_t *ctx = calloc(1, sizeof(teatime_context_t));
+    if (!ctx) {
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                sizeof(teatime_context_t));
+        return NULL;
+    }
+    do {
+        GLenum err = GLEW_OK;
+        const char *only = getenv("TEATIME_CONTEXT");
+        (void)only;
+#ifdef TEATIME_HAVE_EGL
+        ctx->display = EGL_NO_DISPLAY;
+        ctx->context = EGL_NO_CONTEXT;
+        ctx->surface = EGL_NO_SURFACE;
+        if (!only || strcmp(only, "osmesa") != 0) {
+            rc = teatime_egl_create(ctx);
+            if (rc < 0) {
+                teatime_log(TEATIME_LOG_WARN, "Unable to create a headless EGL context\n");
+                teatime_egl_destroy(ctx);
+            }
+        }
+#endif
+#ifdef TEATIME_HAVE_OSMESA
+        if (rc < 0 && (!only || strcmp(only, "egl") != 0))
+            rc = teatime_osmesa_create(ctx);
+#endif
+        if (rc < 0) {
+            teatime_log(TEATIME_LOG_ERROR, "No headless OpenGL context is available\n");
+            break;
+        }
+        /* initialize GLEW now that a context is current */
+        glewExperimental = GL_TRUE;
+        err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+        /* a GLX-built GLEW cannot find an X display but the GL entry
+         * points are loaded before that check, so this is harmless */
+        if (err == GLEW_ERROR_NO_GLX_DISPLAY)
+            err = GLEW_OK;
+#endif
+        if (err != GLEW_OK) {
+            teatime_log(TEATIME_LOG_ERROR, "glewInit() error: %s\n",
+                    (const char *)glewGetErrorString(err));
+            rc = -ENOTSUP;
+            break;
+        }
+        /* glewInit() may leave GL_INVALID_ENUM behind on some drivers */
+        while (glGetError() != GL_NO_ERROR)
+            ;
+        teatime_log(TEATIME_LOG_INFO, "Created headless %s context with renderer: %s\n",
+                teatime_context_name(ctx), (const char *)glGetString(GL_RENDERER));
+        rc = 0;
+    } while (0);
+    if (rc < 0) {
+        teatime_context_destroy(ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+void teatime_context_destroy(teatime_context_t *ctx)
+{
+    if (ctx) {
+#ifdef TEATIME_HAVE_EGL
+        teatime_egl_destroy(ctx);
+#endif
+#ifdef TEATIME_HAVE_OSMESA
+        teatime_osmesa_destroy(ctx);
+#endif
+        free(ctx);
+        ctx = NULL;
+    }
+}
+
+const char *teatime_context_name(const teatime_context_t *ctx)
+{
+    if (ctx) {
+        switch (ctx->type) {
+        case TEATIME_CONTEXT_EGL:
+            return "EGL";
+        case TEATIME_CONTEXT_OSMESA:
+            return "OSMesa";
+        default:
+            break;
+        }
+    }
+    return "none";
+}
@@ -0,0 +1,1122 @@
+/*
+ * COPYRIGHT: Stealthy Labs LLC
+ * DATE: 29th May 2015
+ * AUTHOR: Stealthy Labs
+ * SOFTWARE: Tea Time
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <teatime.h>
+#ifndef WIN32
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define TEATIME_CPU_X86
+#endif
+
+/*
+ * The CPU engine runs the same kernels as the shaders on hosts without a
+ * GPU, and is the baseline the GPU numbers are compared against. Blocks are
+ * de-interleaved so that each SIMD lane holds one block, the widest
+ * instruction set the CPU supports is picked at runtime, and large inputs
+ * are split over a pool of threads that lives as long as the engine.
+ */
+
+#define TEA_DELTA 0x9e3779b9U
+
+/* inputs smaller than this many words are not worth waking the pool for */
+#define TEATIME_CPU_MIN_SPLIT 16384
+
+/* chunks handed to the threads are a multiple of this many words */
+#define TEATIME_CPU_CHUNK_ALIGN 64
+
+/* CTR and CBC modes work on this many words at a time on the stack */
+#define TEATIME_CPU_PIECE_WORDS 1024
+
+void TEA_cpu_encrypt(const uint32_t input[2],
+                   const uint32_t key[4],
+                   uint32_t output[2], uint16_t rounds)
+{
+    uint32_t v0 = input[0];
+    uint32_t v1 = input[1];
+    const uint32_t DELTA = TEA_DELTA;
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < rounds; ++i) {
+        sum += DELTA;
+        v0 += ((v1 << 4) + key[0]) ^ (v1 + sum) ^ ((v1 >> 5) + key[1]);
+        v1 += ((v0 << 4) + key[2]) ^ (v0 + sum) ^ ((v0 >> 5) + key[3]);
+    }
+    output[0] = v0;
+    output[1] = v1;
+}
+
+void TEA_cpu_decrypt(const uint32_t input[2],
+                   const uint32_t key[4],
+                   uint32_t output[2], uint16_t rounds)
+{
+    uint32_t v0 = input[0];
+    uint32_t v1 = input[1];
+    const uint32_t DELTA = TEA_DELTA;
+    uint32_t sum = DELTA * rounds;
+    for (uint16_t i = 0; i < rounds; ++i) {
+        v1 -= ((v0 << 4) + key[2]) ^ (v0 + sum) ^ ((v0 >> 5) + key[3]);
+        v0 -= ((v1 << 4) + key[0]) ^ (v1 + sum) ^ ((v1 >> 5) + key[1]);
+        sum -= DELTA;
+    }
+    output[0] = v0;
+    output[1] = v1;
+}
+
+/* XTEA picks the key word for each half-round from the running sum */
+void XTEA_cpu_encrypt(const uint32_t input[2],
+                    const uint32_t key[4],
+                    uint32_t output[2], uint16_t rounds)
+{
+    uint32_t v0 = input[0];
+    uint32_t v1 = input[1];
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < rounds; ++i) {
+        v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + key[sum & 3]);
+        sum += TEA_DELTA;
+        v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + key[(sum >> 11) & 3]);
+    }
+    output[0] = v0;
+    output[1] = v1;
+}
+
+void XTEA_cpu_decrypt(const uint32_t input[2],
+                    const uint32_t key[4],
+                    uint32_t output[2], uint16_t rounds)
+{
+    uint32_t v0 = input[0];
+    uint32_t v1 = input[1];
+    uint32_t sum = TEA_DELTA * rounds;
+    for (uint16_t i = 0; i < rounds; ++i) {
+        v1 -= (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + key[(sum >> 11) & 3]);
+        sum -= TEA_DELTA;
+        v0 -= (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + key[sum & 3]);
+    }
+    output[0] = v0;
+    output[1] = v1;
+}
+
+#define XXTEA_MX(Y, Z, SUM, K) \
+    ((((Z) >> 5) ^ ((Y) << 2)) + (((Y) >> 3) ^ ((Z) << 4))) ^ (((SUM) ^ (Y)) + ((K) ^ (Z)))
+
+/*
+ * XXTEA, a.k.a. Corrected Block TEA, mixes a whole block of n words in
+ * place. Here rounds is the no. of passes over the block, usually
+ * TEATIME_XXTEA_ROUNDS(n), and 0 rounds leave the block as is.
+ */
+void XXTEA_cpu_encrypt(uint32_t *v, uint32_t n, const uint32_t key[4],
+                    uint32_t rounds)
+{
+    uint32_t sum = 0;
+    uint32_t z = v[n - 1];
+    for (uint32_t i = 0; i < rounds; ++i) {
+        uint32_t e;
+        sum += TEA_DELTA;
+        e = (sum >> 2) & 3;
+        for (uint32_t p = 0; p < n; ++p) {
+            uint32_t y = v[(p + 1 < n) ? p + 1 : 0];
+            v[p] += XXTEA_MX(y, z, sum, key[(p & 3) ^ e]);
+            z = v[p];
+        }
+    }
+}
+
+void XXTEA_cpu_decrypt(uint32_t *v, uint32_t n, const uint32_t key[4],
+                    uint32_t rounds)
+{
+    uint32_t sum = TEA_DELTA * rounds;
+    uint32_t y = v[0];
+    for (uint32_t i = 0; i < rounds; ++i) {
+        uint32_t e = (sum >> 2) & 3;
+        for (uint32_t p = n; p-- > 0;) {
+            uint32_t z = v[(p > 0) ? p - 1 : n - 1];
+            v[p] -= XXTEA_MX(y, z, sum, key[(p & 3) ^ e]);
+            y = v[p];
+        }
+        sum -= TEA_DELTA;
+    }
+}
+
+/* processes nblocks 64-bit blocks and returns the no. of blocks done */
+typedef uint32_t (*teatime_cpu_kernel_t)(int algorithm, bool decrypt,
+        const uint32_t key[4], uint32_t rounds, const uint32_t *input,
+        uint32_t *output, uint32_t nblocks);
+
+/* processes nblocks XXTEA blocks of n words and returns the no. done */
+typedef uint32_t (*teatime_cpu_xxtea_t)(bool decrypt, const uint32_t key[4],
+        uint32_t rounds, uint32_t n, const uint32_t *input, uint32_t *output,
+        uint32_t nblocks);
+
+static uint32_t teatime_cpu_scalar(int algorithm, bool decrypt,
+        const uint32_t key[4], uint32_t rounds, const uint32_t *input,
+        uint32_t *output, uint32_t nblocks)
+{
+    for (uint32_t b = 0; b < nblocks; ++b) {
+        uint32_t v0 = input[2 * b];
+        uint32_t v1 = input[2 * b + 1];
+        if (algorithm == TEATIME_ALG_XTEA && decrypt) {
+            uint32_t sum = TEA_DELTA * rounds;
+            for (uint32_t i = 0; i < rounds; ++i) {
+                v1 -= (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + key[(sum >> 11) & 3]);
+                sum -= TEA_DELTA;
+                v0 -= (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + key[sum & 3]);
+            }
+        } else if (algorithm == TEATIME_ALG_XTEA) {
+            uint32_t sum = 0;
+            for (uint32_t i = 0; i < rounds; ++i) {
+                v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + key[sum & 3]);
+                sum += TEA_DELTA;
+                v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + key[(sum >> 11) & 3]);
+            }
+        } else if (decrypt) {
+            uint32_t sum = TEA_DELTA * rounds;
+            for (uint32_t i = 0; i < rounds; ++i) {
+                v1 -= ((v0 << 4) + key[2]) ^ (v0 + sum) ^ ((v0 >> 5) + key[3]);
+                v0 -= ((v1 << 4) + key[0]) ^ (v1 + sum) ^ ((v1 >> 5) + key[1]);
+                sum -= TEA_DELTA;
+            }
+        } else {
+            uint32_t sum = 0;
+            for (uint32_t i = 0; i < rounds; ++i) {
+                sum += TEA_DELTA;
+                v0 += ((v1 << 4) + key[0]) ^ (v1 + sum) ^ ((v1 >> 5) + key[1]);
+                v1 += ((v0 << 4) + key[2]) ^ (v0 + sum) ^ ((v0 >> 5) + key[3]);
+            }
+        }
+        output[2 * b] = v0;
+        output[2 * b + 1] = v1;
+    }
+    return nblocks;
+}
+
+static uint32_t teatime_cpu_xxtea_scalar(bool decrypt, const uint32_t key[4],
+        uint32_t rounds, uint32_t n, const uint32_t *input, uint32_t *output,
+        uint32_t nblocks)
+{
+    for (uint32_t b = 0; b < nblocks; ++b) {
+        uint32_t *v = output + (size_t)b * n;
+        if (v != input + (size_t)b * n)
+            memcpy(v, input + (size_t)b * n, n * sizeof(uint32_t));
+        if (decrypt)
+            XXTEA_cpu_decrypt(v, n, key, rounds);
+        else
+            XXTEA_cpu_encrypt(v, n, key, rounds);
+    }
+    return nblocks;
+}
+
+#ifdef TEATIME_CPU_X86
+/*
+ * The vector kernels only handle whole vectors worth of blocks and leave the
+ * rest to teatime_cpu_scalar(). Each kernel is compiled for its own
+ * instruction set so the rest of the file does not need any -m flags.
+ */
+#define TEA_SIMD_ROUNDS(ADD, SUB, XOR, SLL, SRL, SET1) \
+    if (decrypt) { \
+        uint32_t sum = TEA_DELTA * rounds; \
+        for (uint32_t i = 0; i < rounds; ++i) { \
+            v1 = SUB(v1, XOR(XOR(ADD(SLL(v0, 4), k2), ADD(v0, SET1((int)sum))), \
+                        ADD(SRL(v0, 5), k3))); \
+            v0 = SUB(v0, XOR(XOR(ADD(SLL(v1, 4), k0), ADD(v1, SET1((int)sum))), \
+                        ADD(SRL(v1, 5), k1))); \
+            sum -= TEA_DELTA; \
+        } \
+    } else { \
+        uint32_t sum = 0; \
+        for (uint32_t i = 0; i < rounds; ++i) { \
+            sum += TEA_DELTA; \
+            v0 = ADD(v0, XOR(XOR(ADD(SLL(v1, 4), k0), ADD(v1, SET1((int)sum))), \
+                        ADD(SRL(v1, 5), k1))); \
+            v1 = ADD(v1, XOR(XOR(ADD(SLL(v0, 4), k2), ADD(v0, SET1((int)sum))), \
+                        ADD(SRL(v0, 5), k3))); \
+        } \
+    }
+
+/* the key words of XTEA depend on the sum alone so they are broadcast */
+#define XTEA_SIMD_ROUNDS(ADD, SUB, XOR, SLL, SRL, SET1) \
+    if (decrypt) { \
+        uint32_t sum = TEA_DELTA * rounds; \
+        for (uint32_t i = 0; i < rounds; ++i) { \
+            v1 = SUB(v1, XOR(ADD(XOR(SLL(v0, 4), SRL(v0, 5)), v0), \
+                        SET1((int)(sum + key[(sum >> 11) & 3])))); \
+            sum -= TEA_DELTA; \
+            v0 = SUB(v0, XOR(ADD(XOR(SLL(v1, 4), SRL(v1, 5)), v1), \
+                        SET1((int)(sum + key[sum & 3])))); \
+        } \
+    } else { \
+        uint32_t sum = 0; \
+        for (uint32_t i = 0; i < rounds; ++i) { \
+            v0 = ADD(v0, XOR(ADD(XOR(SLL(v1, 4), SRL(v1, 5)), v1), \
+                        SET1((int)(sum + key[sum & 3])))); \
+            sum += TEA_DELTA; \
+            v1 = ADD(v1, XOR(ADD(XOR(SLL(v0, 4), SRL(v0, 5)), v0), \
+                        SET1((int)(sum + key[(sum >> 11) & 3])))); \
+        } \
+    }
+
+#define TEA_SIMD_ALGORITHM(ADD, SUB, XOR, SLL, SRL, SET1) \
+    if (algorithm == TEATIME_ALG_XTEA) { \
+        XTEA_SIMD_ROUNDS(ADD, SUB, XOR, SLL, SRL, SET1) \
+    } else { \
+        TEA_SIMD_ROUNDS(ADD, SUB, XOR, SLL, SRL, SET1) \
+    }
+
+/*
+ * XXTEA blocks are transposed through a small buffer so that vector j holds
+ * word j of LANES blocks, after which the passes over the block are the
+ * same for every lane and the key words are broadcast.
+ */
+#define XXTEA_SIMD_MX(ADD, XOR, SLL, SRL, Y, Z, SUM, K) \
+    XOR(ADD(XOR(SRL(Z, 5), SLL(Y, 2)), XOR(SRL(Y, 3), SLL(Z, 4))), \
+        ADD(XOR(SUM, Y), XOR(K, Z)))
+
+#define XXTEA_SIMD_BLOCKS(VEC, LANES, LOAD, STORE, ADD, SUB, XOR, SLL, SRL, SET1) \
+    VEC v[TEATIME_XXTEA_MAX_WORDS]; \
+    uint32_t lane[LANES] __attribute__((aligned(64))); \
+    const VEC kv[4] = { SET1((int)key[0]), SET1((int)key[1]), \
+                        SET1((int)key[2]), SET1((int)key[3]) }; \
+    uint32_t b = 0; \
+    if (n > TEATIME_XXTEA_MAX_WORDS) \
+        return 0; \
+    for (; b + LANES <= nblocks; b += LANES) { \
+        for (uint32_t j = 0; j < n; ++j) { \
+            for (uint32_t l = 0; l < LANES; ++l) \
+                lane[l] = input[(size_t)(b + l) * n + j]; \
+            v[j] = LOAD((const void *)lane); \
+        } \
+        if (decrypt) { \
+            uint32_t sum = TEA_DELTA * rounds; \
+            VEC y = v[0]; \
+            for (uint32_t i = 0; i < rounds; ++i) { \
+                uint32_t e = (sum >> 2) & 3; \
+                VEC s = SET1((int)sum); \
+                for (uint32_t p = n; p-- > 0;) { \
+                    VEC z = v[(p > 0) ? p - 1 : n - 1]; \
+                    v[p] = SUB(v[p], XXTEA_SIMD_MX(ADD, XOR, SLL, SRL, y, z, s, \
+                                kv[(p & 3) ^ e])); \
+                    y = v[p]; \
+                } \
+                sum -= TEA_DELTA; \
+            } \
+        } else { \
+            uint32_t sum = 0; \
+            VEC z = v[n - 1]; \
+            for (uint32_t i = 0; i < rounds; ++i) { \
+                uint32_t e; \
+                VEC s; \
+                sum += TEA_DELTA; \
+                e = (sum >> 2) & 3; \
+                s = SET1((int)sum); \
+                for (uint32_t p = 0; p < n; ++p) { \
+                    VEC y = v[(p + 1 < n) ? p + 1 : 0]; \
+                    v[p] = ADD(v[p], XXTEA_SIMD_MX(ADD, XOR, SLL, SRL, y, z, s, \
+                                kv[(p & 3) ^ e])); \
+                    z = v[p]; \
+                } \
+            } \
+        } \
+        for (uint32_t j = 0; j < n; ++j) { \
+            STORE((void *)lane, v[j]); \
+            for (uint32_t l = 0; l < LANES; ++l) \
+                output[(size_t)(b + l) * n + j] = lane[l]; \
+        } \
+    } \
+    return b;
+
+__attribute__((target("sse2")))
+static uint32_t teatime_cpu_sse2(int algorithm, bool decrypt,
+        const uint32_t key[4], uint32_t rounds, const uint32_t *input,
+        uint32_t *output, uint32_t nblocks)
+{
+    const __m128i k0 = _mm_set1_epi32((int)key[0]);
+    const __m128i k1 = _mm_set1_epi32((int)key[1]);
+    const __m128i k2 = _mm_set1_epi32((int)key[2]);
+    const __m128i k3 = _mm_set1_epi32((int)key[3]);
+    uint32_t b = 0;
+    for (; b + 4 <= nblocks; b += 4) {
+        /* a0 a1 b0 b1 | c0 c1 d0 d1 -> a0 b0 c0 d0 | a1 b1 c1 d1 */
+        __m128i x = _mm_loadu_si128((const __m128i *)(input + 2 * b));
+        __m128i y = _mm_loadu_si128((const __m128i *)(input + 2 * b + 4));
+        __m128i v0, v1;
+        x = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 1, 2, 0));
+        y = _mm_shuffle_epi32(y, _MM_SHUFFLE(3, 1, 2, 0));
+        v0 = _mm_unpacklo_epi64(x, y);
+        v1 = _mm_unpackhi_epi64(x, y);
+        TEA_SIMD_ALGORITHM(_mm_add_epi32, _mm_sub_epi32, _mm_xor_si128,
+                _mm_slli_epi32, _mm_srli_epi32, _mm_set1_epi32)
+        _mm_storeu_si128((__m128i *)(output + 2 * b), _mm_unpacklo_epi32(v0, v1));
+        _mm_storeu_si128((__m128i *)(output + 2 * b + 4), _mm_unpackhi_epi32(v0, v1));
+    }
+    return b;
+}
+
+__attribute__((target("avx2")))
+static uint32_t teatime_cpu_avx2(int algorithm, bool decrypt,
+        const uint32_t key[4], uint32_t rounds, const uint32_t *input,
+        uint32_t *output, uint32_t nblocks)
+{
+    const __m256i k0 = _mm256_set1_epi32((int)key[0]);
+    const __m256i k1 = _mm256_set1_epi32((int)key[1]);
+    const __m256i k2 = _mm256_set1_epi32((int)key[2]);
+    const __m256i k3 = _mm256_set1_epi32((int)key[3]);
+    uint32_t b = 0;
+    for (; b + 8 <= nblocks; b += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(input + 2 * b));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(input + 2 * b + 8));
+        __m256i v0, v1;
+        /* even words to the low half and odd words to the high half */
+        x = _mm256_permute4x64_epi64(_mm256_shuffle_epi32(x, _MM_SHUFFLE(3, 1, 2, 0)),
+                _MM_SHUFFLE(3, 1, 2, 0));
+        y = _mm256_permute4x64_epi64(_mm256_shuffle_epi32(y, _MM_SHUFFLE(3, 1, 2, 0)),
+                _MM_SHUFFLE(3, 1, 2, 0));
+        v0 = _mm256_permute2x128_si256(x, y, 0x20);
+        v1 = _mm256_permute2x128_si256(x, y, 0x31);
+        TEA_SIMD_ALGORITHM(_mm256_add_epi32, _mm256_sub_epi32, _mm256_xor_si256,
+                _mm256_slli_epi32, _mm256_srli_epi32, _mm256_set1_epi32)
+        /* and back again, the shuffles are their own inverses */
+        x = _mm256_permute2x128_si256(v0, v1, 0x20);
+        y = _mm256_permute2x128_si256(v0, v1, 0x31);
+        x = _mm256_shuffle_epi32(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 1, 2, 0)),
+                _MM_SHUFFLE(3, 1, 2, 0));
+        y = _mm256_shuffle_epi32(_mm256_permute4x64_epi64(y, _MM_SHUFFLE(3, 1, 2, 0)),
+                _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)(output + 2 * b), x);
+        _mm256_storeu_si256((__m256i *)(output + 2 * b + 8), y);
+    }
+    return b;
+}
+
+__attribute__((target("avx512f")))
+static uint32_t teatime_cpu_avx512(int algorithm, bool decrypt,
+        const uint32_t key[4], uint32_t rounds, const uint32_t *input,
+        uint32_t *output, uint32_t nblocks)
+{
+    const __m512i k0 = _mm512_set1_epi32((int)key[0]);
+    const __m512i k1 = _mm512_set1_epi32((int)key[1]);
+    const __m512i k2 = _mm512_set1_epi32((int)key[2]);
+    const __m512i k3 = _mm512_set1_epi32((int)key[3]);
+    const __m512i even = _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16,
+            14, 12, 10, 8, 6, 4, 2, 0);
+    const __m512i odd = _mm512_set_epi32(31, 29, 27, 25, 23, 21, 19, 17,
+            15, 13, 11, 9, 7, 5, 3, 1);
+    const __m512i lo = _mm512_set_epi32(23, 7, 22, 6, 21, 5, 20, 4,
+            19, 3, 18, 2, 17, 1, 16, 0);
+    const __m512i hi = _mm512_set_epi32(31, 15, 30, 14, 29, 13, 28, 12,
+            27, 11, 26, 10, 25, 9, 24, 8);
+    uint32_t b = 0;
+    for (; b + 16 <= nblocks; b += 16) {
+        __m512i x = _mm512_loadu_si512((const void *)(input + 2 * b));
+        __m512i y = _mm512_loadu_si512((const void *)(input + 2 * b + 16));
+        __m512i v0 = _mm512_permutex2var_epi32(x, even, y);
+        __m512i v1 = _mm512_permutex2var_epi32(x, odd, y);
+        TEA_SIMD_ALGORITHM(_mm512_add_epi32, _mm512_sub_epi32, _mm512_xor_si512,
+                _mm512_slli_epi32, _mm512_srli_epi32, _mm512_set1_epi32)
+        _mm512_storeu_si512((void *)(output + 2 * b),
+                _mm512_permutex2var_epi32(v0, lo, v1));
+        _mm512_storeu_si512((void *)(output + 2 * b + 16),
+                _mm512_permutex2var_epi32(v0, hi, v1));
+    }
+    return b;
+}
+
+__attribute__((target("sse2")))
+static uint32_t teatime_cpu_xxtea_sse2(bool decrypt, const uint32_t key[4],
+        uint32_t rounds, uint32_t n, const uint32_t *input, uint32_t *output,
+        uint32_t nblocks)
+{
+    XXTEA_SIMD_BLOCKS(__m128i, 4, _mm_load_si128, _mm_store_si128,
+            _mm_add_epi32, _mm_sub_epi32, _mm_xor_si128, _mm_slli_epi32,
+            _mm_srli_epi32, _mm_set1_epi32)
+}
+
+__attribute__((target("avx2")))
+static uint32_t teatime_cpu_xxtea_avx2(bool decrypt, const uint32_t key[4],
+        uint32_t rounds, uint32_t n, const uint32_t *input, uint32_t *output,
+        uint32_t nblocks)
+{
+    XXTEA_SIMD_BLOCKS(__m256i, 8, _mm256_load_si256, _mm256_store_si256,
+            _mm256_add_epi32, _mm256_sub_epi32, _mm256_xor_si256,
+            _mm256_slli_epi32, _mm256_srli_epi32, _mm256_set1_epi32)
+}
+
+__attribute__((target("avx512f")))
+static uint32_t teatime_cpu_xxtea_avx512(bool decrypt, const uint32_t key[4],
+        uint32_t rounds, uint32_t n, const uint32_t *input, uint32_t *output,
+        uint32_t nblocks)
+{
+    XXTEA_SIMD_BLOCKS(__m512i, 16, _mm512_load_si512, _mm512_store_si512,
+            _mm512_add_epi32, _mm512_sub_epi32, _mm512_xor_si512,
+            _mm512_slli_epi32, _mm512_srli_epi32, _mm512_set1_epi32)
+}
+#endif /* TEATIME_CPU_X86 */
+
+/* the work shared by the threads between teatime_cpu_start() and
+ * teatime_cpu_finish() */
+typedef struct {
+    int direction;
+    int algorithm; /* TEATIME_ALG_TEA etc. */
+    uint32_t block_words; /* words per block, more than 2 for XXTEA only */
+    uint32_t key[4];
+    uint32_t rounds;
+    const uint32_t *input;
+    uint32_t *output;
+    uint32_t nwords;
+    uint64_t counter; /* counter of the first block in CTR mode */
+    const uint32_t *chain; /* block before each chunk in CBC decryption */
+    const uint32_t *ivs; /* one IV per stream in CBC encryption */
+    const uint32_t *keys; /* 4 words per key in batches */
+    const uint32_t *key_index; /* key of each segment in batches */
+    uint32_t stream_words; /* words per CBC encryption stream or batch segment */
+    const uint32_t *known; /* two known plaintext blocks in a key search */
+    const uint32_t *target; /* their ciphertext under the key searched for */
+    uint32_t *hits; /* offsets of the matching keys in a key search */
+    uint32_t maxhits; /* no. of hits that fit */
+    uint32_t nhits; /* no. of hits found, including those not kept */
+    uint32_t chunk; /* words per chunk */
+    uint32_t next; /* offset of the next chunk to hand out */
+    uint32_t done; /* no. of words completed */
+    uint64_t begin_ns; /* when the first chunk was handed out */
+    uint64_t end_ns; /* when the last chunk was completed */
+} teatime_cpu_work_t;
+
+struct teatime_cpu_s {
+    teatime_cpu_kernel_t kernel; /* widest kernel the CPU supports */
+    teatime_cpu_xxtea_t xxtea; /* widest XXTEA kernel the CPU supports */
+    const char *isa; /* name of the kernel's instruction set */
+    uint32_t nthreads; /* no. of threads including the caller */
+#ifndef WIN32
+    pthread_t *threads; /* the pool, nthreads - 1 workers */
+    pthread_mutex_t lock;
+    pthread_cond_t wake; /* signaled when there is new work or on exit */
+    pthread_cond_t idle; /* signaled when the last worker is done */
+    uint64_t generation; /* incremented for each run handed to the pool */
+    uint32_t busy; /* no. of workers still on the current run */
+    bool exiting;
+#endif
+    int algorithm; /* block cipher of the next run */
+    uint32_t block_words; /* XXTEA block length of the next run in words */
+    uint64_t counter; /* counter of the next block in CTR mode */
+    uint32_t iv[2]; /* block before the next one in CBC decryption */
+    uint32_t *chain; /* teatime_cpu_work_t.chain, only grows */
+    uint32_t chain_size; /* allocated size of the chain in words */
+    teatime_cpu_work_t work;
+};
+
+#ifdef WIN32
+    #define TEATIME_CPU_LOCK(C)
+    #define TEATIME_CPU_UNLOCK(C)
+#else
+    #define TEATIME_CPU_LOCK(C) pthread_mutex_lock(&((C)->lock))
+    #define TEATIME_CPU_UNLOCK(C) pthread_mutex_unlock(&((C)->lock))
+#endif
+
+/* runs the block cipher of the work over nwords words with the given key */
+static void teatime_cpu_blocks(const teatime_cpu_t *cpu,
+        const teatime_cpu_work_t *work, const uint32_t key[4], bool decrypt,
+        const uint32_t *in, uint32_t *out, uint32_t nwords)
+{
+    if (work->algorithm == TEATIME_ALG_XXTEA) {
+        uint32_t n = work->block_words;
+        uint32_t done = cpu->xxtea(decrypt, key, work->rounds, n, in, out,
+                nwords / n);
+        if (done < nwords / n)
+            teatime_cpu_xxtea_scalar(decrypt, key, work->rounds, n,
+                    in + (size_t)done * n, out + (size_t)done * n, nwords / n - done);
+    } else {
+        uint32_t done = cpu->kernel(work->algorithm, decrypt, key, work->rounds,
+                in, out, nwords / 2);
+        if (done < nwords / 2)
+            teatime_cpu_scalar(work->algorithm, decrypt, key, work->rounds,
+                    in + 2 * done, out + 2 * done, nwords / 2 - done);
+    }
+}
+
+/*
+ * CTR mode encrypts the block counters, high word first, and XORs the
+ * result into the input. The keystream is built in a separate buffer since
+ * the input and output may be the same memory.
+ */
+static void teatime_cpu_ctr(const teatime_cpu_t *cpu, const teatime_cpu_work_t *work,
+        uint32_t off, uint32_t len)
+{
+    uint32_t ks[TEATIME_CPU_PIECE_WORDS];
+    for (uint32_t pos = 0; pos < len; pos += TEATIME_CPU_PIECE_WORDS) {
+        uint32_t n = (len - pos < TEATIME_CPU_PIECE_WORDS) ? (len - pos) :
+            TEATIME_CPU_PIECE_WORDS;
+        uint64_t ctr = work->counter + (off + pos) / 2;
+        uint32_t *out = work->output + off + pos;
+        for (uint32_t b = 0; b < n / 2; ++b, ++ctr) {
+            ks[2 * b] = (uint32_t)(ctr >> 32);
+            ks[2 * b + 1] = (uint32_t)ctr;
+        }
+        teatime_cpu_blocks(cpu, work, work->key, false, ks, ks, n);
+        if (work->direction == TEATIME_KEYSTREAM) {
+            memcpy(out, ks, n * sizeof(uint32_t));
+        } else {
+            const uint32_t *in = work->input + off + pos;
+            for (uint32_t i = 0; i < n; ++i)
+                out[i] = in[i] ^ ks[i];
+        }
+    }
+}
+
+/*
+ * CBC decryption is D(C_i) XOR C_i-1 for every block, so the chunks are
+ * independent as long as the block before each one is saved before any
+ * thread overwrites it in place. The ciphertext of a piece is copied out for
+ * the same reason.
+ */
+static void teatime_cpu_cbc_decrypt(const teatime_cpu_t *cpu,
+        const teatime_cpu_work_t *work, uint32_t off, uint32_t len)
+{
+    uint32_t ct[TEATIME_CPU_PIECE_WORDS], pt[TEATIME_CPU_PIECE_WORDS];
+    const uint32_t *chain = work->chain + 2 * (off / work->chunk);
+    uint32_t prev[2] = { chain[0], chain[1] };
+    for (uint32_t pos = 0; pos < len; pos += TEATIME_CPU_PIECE_WORDS) {
+        uint32_t n = (len - pos < TEATIME_CPU_PIECE_WORDS) ? (len - pos) :
+            TEATIME_CPU_PIECE_WORDS;
+        uint32_t *out = work->output + off + pos;
+        memcpy(ct, work->input + off + pos, n * sizeof(uint32_t));
+        teatime_cpu_blocks(cpu, work, work->key, true, ct, pt, n);
+        out[0] = pt[0] ^ prev[0];
+        out[1] = pt[1] ^ prev[1];
+        for (uint32_t i = 2; i < n; ++i)
+            out[i] = pt[i] ^ ct[i - 2];
+        prev[0] = ct[n - 2];
+        prev[1] = ct[n - 1];
+    }
+}
+
+/* CBC encryption is serial within a stream, the chunks are whole streams */
+static void teatime_cpu_cbc_encrypt_streams(const teatime_cpu_t *cpu,
+        const teatime_cpu_work_t *work, uint32_t off, uint32_t len)
+{
+    for (uint32_t s = off / work->stream_words; s < (off + len) / work->stream_words;
+            ++s) {
+        const uint32_t *in = work->input + (size_t)s * work->stream_words;
+        uint32_t *out = work->output + (size_t)s * work->stream_words;
+        uint32_t v[2] = { work->ivs[2 * s], work->ivs[2 * s + 1] };
+        for (uint32_t i = 0; i < work->stream_words; i += 2) {
+            v[0] ^= in[i];
+            v[1] ^= in[i + 1];
+            teatime_cpu_blocks(cpu, work, work->key, false, v, v, 2);
+            out[i] = v[0];
+            out[i + 1] = v[1];
+        }
+    }
+}
+
+/* the segments of a batch each have their own key, the chunks are whole
+ * segments */
+static void teatime_cpu_batch_segments(const teatime_cpu_t *cpu,
+        const teatime_cpu_work_t *work, uint32_t off, uint32_t len)
+{
+    for (uint32_t s = off / work->stream_words; s < (off + len) / work->stream_words;
+            ++s) {
+        size_t pos = (size_t)s * work->stream_words;
+        teatime_cpu_blocks(cpu, work, work->keys + 4 * (size_t)work->key_index[s],
+                work->direction == TEATIME_BATCH_DECRYPT, work->input + pos,
+                work->output + pos, work->stream_words);
+    }
+}
+
+/*
+ * A key search tries the keys whose last 64 bits are those of the work's key
+ * plus the candidate's offset on both known blocks. The chunks are ranges
+ * of candidates, and the rare hits are added under the lock.
+ */
+static void teatime_cpu_search_keys(teatime_cpu_t *cpu, teatime_cpu_work_t *work,
+        uint32_t off, uint32_t len)
+{
+    uint64_t first = ((uint64_t)work->key[2] << 32) | work->key[3];
+    for (uint32_t i = off; i < off + len; ++i) {
+        uint64_t c = first + i;
+        uint32_t key[4] = { work->key[0], work->key[1], (uint32_t)(c >> 32),
+            (uint32_t)c };
+        uint32_t out[4];
+        teatime_cpu_blocks(cpu, work, key, false, work->known, out, 4);
+        if (memcmp(out, work->target, sizeof(out)) != 0)
+            continue;
+        TEATIME_CPU_LOCK(cpu);
+        if (work->nhits < work->maxhits)
+            work->hits[work->nhits] = i;
+        work->nhits++;
+        TEATIME_CPU_UNLOCK(cpu);
+    }
+}
+
+static void teatime_cpu_chunk(teatime_cpu_t *cpu, teatime_cpu_work_t *work,
+        uint32_t off, uint32_t len)
+{
+    if (TEATIME_IS_CTR(work->direction))
+        teatime_cpu_ctr(cpu, work, off, len);
+    else if (work->direction == TEATIME_CBC_DECRYPT)
+        teatime_cpu_cbc_decrypt(cpu, work, off, len);
+    else if (work->direction == TEATIME_CBC_ENCRYPT)
+        teatime_cpu_cbc_encrypt_streams(cpu, work, off, len);
+    else if (TEATIME_IS_BATCH(work->direction))
+        teatime_cpu_batch_segments(cpu, work, off, len);
+    else if (work->direction == TEATIME_KEY_SEARCH)
+        teatime_cpu_search_keys(cpu, work, off, len);
+    else
+        teatime_cpu_blocks(cpu, work, work->key, work->direction == TEATIME_DECRYPT,
+                work->input + off, work->output + off, len);
+}
+
+/* hands out chunks until there are none left */
+static void teatime_cpu_drain(teatime_cpu_t *cpu)
+{
+    teatime_cpu_work_t *work = &(cpu->work);
+    for (;;) {
+        uint32_t off, len;
+        TEATIME_CPU_LOCK(cpu);
+        off = work->next;
+        len = (work->nwords - off < work->chunk) ? (work->nwords - off) : work->chunk;
+        work->next += len;
+        if (off == 0 && len > 0)
+            work->begin_ns = teatime_clock_ns();
+        TEATIME_CPU_UNLOCK(cpu);
+        if (len == 0)
+            break;
+        teatime_cpu_chunk(cpu, work, off, len);
+        TEATIME_CPU_LOCK(cpu);
+        work->done += len;
+        if (work->done == work->nwords)
+            work->end_ns = teatime_clock_ns();
+        TEATIME_CPU_UNLOCK(cpu);
+    }
+}
+
+#ifndef WIN32
+static void *teatime_cpu_worker(void *arg)
+{
+    teatime_cpu_t *cpu = arg;
+    uint64_t seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&(cpu->lock));
+        while (!cpu->exiting && cpu->generation == seen)
+            pthread_cond_wait(&(cpu->wake), &(cpu->lock));
+        if (cpu->exiting) {
+            pthread_mutex_unlock(&(cpu->lock));
+            break;
+        }
+        seen = cpu->generation;
+        pthread_mutex_unlock(&(cpu->lock));
+        teatime_cpu_drain(cpu);
+        pthread_mutex_lock(&(cpu->lock));
+        if (--cpu->busy == 0)
+            pthread_cond_signal(&(cpu->idle));
+        pthread_mutex_unlock(&(cpu->lock));
+    }
+    return NULL;
+}
+#endif /* WIN32 */
+
+teatime_cpu_t *teatime_cpu_create(uint32_t nthreads)
+{
+    teatime_cpu_t *cpu = calloc(1, sizeof(teatime_cpu_t));
+    if (!cpu) {
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                sizeof(teatime_cpu_t));
+        return NULL;
+    }
+    cpu->kernel = teatime_cpu_scalar;
+    cpu->xxtea = teatime_cpu_xxtea_scalar;
+    cpu->isa = "scalar";
+    cpu->algorithm = TEATIME_ALG_TEA;
+    cpu->block_words = 2;
+#ifdef TEATIME_CPU_X86
+    {
+        /* TEATIME_CPU_ISA caps the instruction set for comparisons */
+        const char *cap = getenv("TEATIME_CPU_ISA");
+        int level = 3;
+        if (cap && strcmp(cap, "avx2") == 0)
+            level = 2;
+        else if (cap && strcmp(cap, "sse2") == 0)
+            level = 1;
+        else if (cap && strcmp(cap, "scalar") == 0)
+            level = 0;
+        __builtin_cpu_init();
+        if (level >= 3 && __builtin_cpu_supports("avx512f")) {
+            cpu->kernel = teatime_cpu_avx512;
+            cpu->xxtea = teatime_cpu_xxtea_avx512;
+            cpu->isa = "avx512";
+        } else if (level >= 2 && __builtin_cpu_supports("avx2")) {
+            cpu->kernel = teatime_cpu_avx2;
+            cpu->xxtea = teatime_cpu_xxtea_avx2;
+            cpu->isa = "avx2";
+        } else if (level >= 1 && __builtin_cpu_supports("sse2")) {
+            cpu->kernel = teatime_cpu_sse2;
+            cpu->xxtea = teatime_cpu_xxtea_sse2;
+            cpu->isa = "sse2";
+        }
+    }
+#endif
+#ifdef WIN32
+    cpu->nthreads = 1;
+#else
+    if (nthreads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (ncpus > 0) ? (uint32_t)ncpus : 1;
+    }
+    cpu->nthreads = 1;
+    pthread_mutex_init(&(cpu->lock), NULL);
+    pthread_cond_init(&(cpu->wake), NULL);
+    pthread_cond_init(&(cpu->idle), NULL);
+    if (nthreads > 1) {
+        cpu->threads = calloc(nthreads - 1, sizeof(pthread_t));
+        if (!cpu->threads) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                    (nthreads - 1) * sizeof(pthread_t));
+            teatime_cpu_destroy(cpu);
+            return NULL;
+        }
+        for (uint32_t i = 0; i < nthreads - 1; ++i) {
+            int rc = pthread_create(&(cpu->threads[i]), NULL, teatime_cpu_worker, cpu);
+            if (rc != 0) {
+                teatime_log(TEATIME_LOG_ERROR, "pthread_create() error: %s\n",
+                        strerror(rc));
+                break;
+            }
+            cpu->nthreads++;
+        }
+    }
+#endif
+    teatime_log(TEATIME_LOG_INFO, "CPU engine using %s with %u threads\n", cpu->isa,
+            cpu->nthreads);
+    return cpu;
+}
+
+void teatime_cpu_destroy(teatime_cpu_t *cpu)
+{
+    if (cpu) {
+#ifndef WIN32
+        pthread_mutex_lock(&(cpu->lock));
+        cpu->exiting = true;
+        pthread_cond_broadcast(&(cpu->wake));
+        pthread_mutex_unlock(&(cpu->lock));
+        for (uint32_t i = 0; i + 1 < cpu->nthreads; ++i)
+            pthread_join(cpu->threads[i], NULL);
+        free(cpu->threads);
+        free(cpu->chain);
+        pthread_cond_destroy(&(cpu->idle));
+        pthread_cond_destroy(&(cpu->wake));
+        pthread_mutex_destroy(&(cpu->lock));
+#endif
+        free(cpu);
+        cpu = NULL;
+    }
+}
+
+const char *teatime_cpu_isa(const teatime_cpu_t *cpu)
+{
+    return cpu ? cpu->isa : "none";
+}
+
+uint32_t teatime_cpu_threads(const teatime_cpu_t *cpu)
+{
+    return cpu ? cpu->nthreads : 0;
+}
+
+int teatime_cpu_set_counter(teatime_cpu_t *cpu, uint64_t counter)
+{
+    if (cpu) {
+        cpu->counter = counter;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+int teatime_cpu_set_iv(teatime_cpu_t *cpu, const uint32_t iv[2])
+{
+    if (cpu && iv) {
+        cpu->iv[0] = iv[0];
+        cpu->iv[1] = iv[1];
+        return 0;
+    }
+    return -EINVAL;
+}
+
+/* the IV of the next CBC decryption, i.e. the last block of the previous one */
+int teatime_cpu_get_iv(const teatime_cpu_t *cpu, uint32_t iv[2])
+{
+    if (cpu && iv) {
+        iv[0] = cpu->iv[0];
+        iv[1] = cpu->iv[1];
+        return 0;
+    }
+    return -EINVAL;
+}
+
+/* the block cipher of the following runs, block_words is 2 for TEA and XTEA */
+int teatime_cpu_set_algorithm(teatime_cpu_t *cpu, int algorithm,
+        uint32_t block_words)
+{
+    if (cpu && (algorithm == TEATIME_ALG_TEA || algorithm == TEATIME_ALG_XTEA ||
+            algorithm == TEATIME_ALG_XXTEA) && block_words >= 2 &&
+        (block_words % 2) == 0 && block_words <= TEATIME_XXTEA_MAX_WORDS &&
+        (algorithm == TEATIME_ALG_XXTEA || block_words == 2)) {
+        cpu->algorithm = algorithm;
+        cpu->block_words = block_words;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+/* wakes the pool for chunks of the given size, if it is worth it */
+static void teatime_cpu_wake(teatime_cpu_t *cpu, uint32_t chunk)
+{
+    cpu->work.chunk = chunk;
+#ifndef WIN32
+    pthread_mutex_lock(&(cpu->lock));
+    cpu->busy = cpu->nthreads - 1;
+    cpu->generation++;
+    pthread_cond_broadcast(&(cpu->wake));
+    pthread_mutex_unlock(&(cpu->lock));
+#endif
+}
+
+/* saves the block before each chunk before any of them is decrypted in place */
+static int teatime_cpu_save_chain(teatime_cpu_t *cpu)
+{
+    teatime_cpu_work_t *work = &(cpu->work);
+    uint32_t nchunks = (work->nwords + work->chunk - 1) / work->chunk;
+    if (cpu->chain_size < 2 * nchunks) {
+        uint32_t *chain = realloc(cpu->chain, 2 * nchunks * sizeof(uint32_t));
+        if (!chain) {
+            teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                    2 * nchunks * sizeof(uint32_t));
+            return -ENOMEM;
+        }
+        cpu->chain = chain;
+        cpu->chain_size = 2 * nchunks;
+    }
+    cpu->chain[0] = cpu->iv[0];
+    cpu->chain[1] = cpu->iv[1];
+    for (uint32_t k = 1; k < nchunks; ++k)
+        memcpy(cpu->chain + 2 * k, work->input + k * work->chunk - 2,
+                2 * sizeof(uint32_t));
+    work->chain = cpu->chain;
+    /* and the last ciphertext block is the IV of the next run */
+    memcpy(cpu->iv, work->input + work->nwords - 2, sizeof(cpu->iv));
+    return 0;
+}
+
+/*
+ * Hands the work to the pool and returns without waiting for it, so the
+ * caller can drive the GPU in the meantime. Without any workers, or for
+ * small inputs, all of it is done by teatime_cpu_finish() instead. CTR runs
+ * advance the counter by the no. of blocks, and TEATIME_KEYSTREAM needs no
+ * input. The CTR and CBC modes need a 64-bit block cipher.
+ */
+int teatime_cpu_start(teatime_cpu_t *cpu, int direction, const uint32_t key[4],
+        uint32_t rounds, const uint32_t *input, uint32_t *output, uint32_t nwords)
+{
+    if (cpu && key && (input || direction == TEATIME_KEYSTREAM) && output &&
+        nwords > 0 && (nwords % cpu->block_words) == 0 &&
+        direction >= TEATIME_ENCRYPT && direction <= TEATIME_CBC_DECRYPT &&
+        (direction <= TEATIME_DECRYPT || cpu->block_words == 2)) {
+        teatime_cpu_work_t *work = &(cpu->work);
+        work->direction = direction;
+        work->algorithm = cpu->algorithm;
+        work->block_words = cpu->block_words;
+        memcpy(work->key, key, sizeof(work->key));
+        work->rounds = rounds;
+        work->input = input;
+        work->output = output;
+        work->nwords = nwords;
+        work->counter = cpu->counter;
+        if (TEATIME_IS_CTR(direction))
+            cpu->counter += nwords / 2;
+        work->chain = NULL;
+        work->next = work->done = 0;
+        work->begin_ns = work->end_ns = 0;
+        work->chunk = nwords;
+        if (cpu->nthreads > 1 && nwords >= TEATIME_CPU_MIN_SPLIT) {
+            /* a few chunks per thread evens out threads that start late */
+            /* and whole XXTEA blocks */
+            uint32_t align = TEATIME_CPU_CHUNK_ALIGN * (cpu->block_words / 2);
+            work->chunk = nwords / (cpu->nthreads * 4);
+            work->chunk += align - (work->chunk % align);
+        }
+        if (direction == TEATIME_CBC_DECRYPT && teatime_cpu_save_chain(cpu) < 0)
+            return -ENOMEM;
+        if (work->chunk < nwords)
+            teatime_cpu_wake(cpu, work->chunk);
+        return 0;
+    } else if (cpu && nwords > 0 && (nwords % cpu->block_words) != 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Input length %u is not a whole no. of %u-bit blocks\n",
+                nwords, 32 * cpu->block_words);
+    } else if (cpu && direction > TEATIME_DECRYPT && cpu->block_words != 2) {
+        teatime_log(TEATIME_LOG_ERROR, "Only 64-bit blocks can be chained or counted\n");
+    }
+    return -EINVAL;
+}
+
+/* completes the work with the caller's help and returns how long it took */
+int teatime_cpu_finish(teatime_cpu_t *cpu, uint64_t *elapsed_ns)
+{
+    if (cpu) {
+        teatime_cpu_drain(cpu);
+#ifndef WIN32
+        pthread_mutex_lock(&(cpu->lock));
+        while (cpu->busy > 0)
+            pthread_cond_wait(&(cpu->idle), &(cpu->lock));
+        pthread_mutex_unlock(&(cpu->lock));
+#endif
+        if (elapsed_ns)
+            *elapsed_ns = cpu->work.end_ns - cpu->work.begin_ns;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+/*
+ * Encrypts nstreams independent CBC messages of stream_words words each, with
+ * one IV per stream in ivs. The threads take whole streams.
+ */
+int teatime_cpu_cbc_encrypt(teatime_cpu_t *cpu, const uint32_t key[4],
+        uint32_t rounds, const uint32_t *ivs, const uint32_t *input,
+        uint32_t *output, uint32_t nstreams, uint32_t stream_words)
+{
+    if (cpu && key && ivs && input && output && nstreams > 0 && stream_words > 0 &&
+        (stream_words % 2) == 0 && cpu->block_words == 2 &&
+        (uint64_t)nstreams * stream_words <= UINT32_MAX) {
+        teatime_cpu_work_t *work = &(cpu->work);
+        uint32_t per_chunk = nstreams;
+        work->direction = TEATIME_CBC_ENCRYPT;
+        work->algorithm = cpu->algorithm;
+        work->block_words = cpu->block_words;
+        memcpy(work->key, key, sizeof(work->key));
+        work->rounds = rounds;
+        work->input = input;
+        work->output = output;
+        work->nwords = nstreams * stream_words;
+        work->ivs = ivs;
+        work->stream_words = stream_words;
+        work->next = work->done = 0;
+        work->begin_ns = work->end_ns = 0;
+        work->chunk = work->nwords;
+        if (cpu->nthreads > 1 && nstreams > 1 &&
+            work->nwords >= TEATIME_CPU_MIN_SPLIT) {
+            per_chunk = (nstreams + cpu->nthreads * 4 - 1) / (cpu->nthreads * 4);
+            teatime_cpu_wake(cpu, per_chunk * stream_words);
+        }
+        return teatime_cpu_finish(cpu, NULL);
+    } else if (cpu && (stream_words % 2) != 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Stream length %u is not a whole no. of 64-bit blocks\n",
+                stream_words);
+    }
+    return -EINVAL;
+}
+
+/*
+ * Runs a batch of nsegments segments of segment_words words each, with
+ * segment i under the key at keys + 4 * key_index[i]. The threads take whole
+ * segments.
+ */
+int teatime_cpu_batch(teatime_cpu_t *cpu, int direction, const uint32_t *keys,
+        uint32_t nkeys, uint32_t rounds, const uint32_t *key_index,
+        const uint32_t *input, uint32_t *output, uint32_t nsegments,
+        uint32_t segment_words)
+{
+    if (cpu && TEATIME_IS_BATCH(direction) && keys && nkeys > 0 && key_index &&
+        input && output && nsegments > 0 && segment_words > 0 &&
+        (segment_words % cpu->block_words) == 0 &&
+        (uint64_t)nsegments * segment_words <= UINT32_MAX) {
+        teatime_cpu_work_t *work = &(cpu->work);
+        for (uint32_t i = 0; i < nsegments; ++i) {
+            if (key_index[i] >= nkeys) {
+                teatime_log(TEATIME_LOG_ERROR, "Key index %u of segment %u exceeds the %u keys\n",
+                        key_index[i], i, nkeys);
+                return -EINVAL;
+            }
+        }
+        work->direction = direction;
+        work->algorithm = cpu->algorithm;
+        work->block_words = cpu->block_words;
+        work->rounds = rounds;
+        work->input = input;
+        work->output = output;
+        work->nwords = nsegments * segment_words;
+        work->keys = keys;
+        work->key_index = key_index;
+        work->stream_words = segment_words;
+        work->next = work->done = 0;
+        work->begin_ns = work->end_ns = 0;
+        work->chunk = work->nwords;
+        if (cpu->nthreads > 1 && nsegments > 1 &&
+            work->nwords >= TEATIME_CPU_MIN_SPLIT) {
+            uint32_t per_chunk = (nsegments + cpu->nthreads * 4 - 1) /
+                (cpu->nthreads * 4);
+            teatime_cpu_wake(cpu, per_chunk * segment_words);
+        }
+        return teatime_cpu_finish(cpu, NULL);
+    } else if (cpu && segment_words > 0 && (segment_words % cpu->block_words) != 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Segment length %u is not a whole no. of %u-bit blocks\n",
+                segment_words, 32 * cpu->block_words);
+    }
+    return -EINVAL;
+}
+
+/*
+ * Tries count candidate keys, whose last 64 bits are those of key plus the
+ * candidate's offset, high word first, on the two known plaintext blocks.
+ * The offsets of up to maxhits keys that give both target blocks go in hits,
+ * in no particular order, and nhits is set to the no. of such keys. The
+ * threads take ranges of candidates.
+ */
+int teatime_cpu_search(teatime_cpu_t *cpu, const uint32_t key[4], uint32_t rounds,
+        const uint32_t known[4], const uint32_t target[4], uint32_t count,
+        uint32_t *hits, uint32_t maxhits, uint32_t *nhits)
+{
+    if (cpu && key && known && target && count > 0 && (hits || maxhits == 0) &&
+        nhits && cpu->block_words == 2) {
+        teatime_cpu_work_t *work = &(cpu->work);
+        int rc = 0;
+        work->direction = TEATIME_KEY_SEARCH;
+        work->algorithm = cpu->algorithm;
+        work->block_words = cpu->block_words;
+        memcpy(work->key, key, sizeof(work->key));
+        work->rounds = rounds;
+        work->known = known;
+        work->target = target;
+        work->hits = hits;
+        work->maxhits = maxhits;
+        work->nhits = 0;
+        work->nwords = count;
+        work->next = work->done = 0;
+        work->begin_ns = work->end_ns = 0;
+        work->chunk = count;
+        if (cpu->nthreads > 1 && count >= TEATIME_CPU_CHUNK_ALIGN * cpu->nthreads) {
+            uint32_t chunk = count / (cpu->nthreads * 4);
+            teatime_cpu_wake(cpu, chunk + TEATIME_CPU_CHUNK_ALIGN -
+                    (chunk % TEATIME_CPU_CHUNK_ALIGN));
+        }
+        rc = teatime_cpu_finish(cpu, NULL);
+        *nhits = work->nhits;
+        return rc;
+    } else if (cpu && cpu->block_words != 2) {
+        teatime_log(TEATIME_LOG_ERROR, "Only 64-bit blocks can be searched\n");
+    }
+    return -EINVAL;
+}
+
+int teatime_cpu_run(teatime_cpu_t *cpu, int direction, const uint32_t key[4],
+        uint32_t rounds, const uint32_t *input, uint32_t *output, uint32_t nwords)
+{
+    int rc = teatime_cpu_start(cpu, direction, key, rounds, input, output, nwords);
+    if (rc < 0)
+        return rc;
+    return teatime_cpu_finish(cpu, NULL);
+}
@@ -0,0 +1,616 @@
+/*
+ * COPYRIGHT: Stealthy Labs LLC
+ * DATE: 29th May 2015
+ * AUTHOR: Stealthy Labs
+ * SOFTWARE: Tea Time
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <teatime.h>
+
+/*
+ * teatime-crypt encrypts or decrypts a file or a stream of any size. Regular
+ * input files are mapped and each chunk is uploaded straight from the page
+ * cache. The chunks are submitted as asynchronous jobs, two at a time, so the
+ * upload of the next chunk overlaps the draws and the readback of the current
+ * one. Regular output files are mapped too and the engine writes the readback
+ * into them in place. Pipes get the output through a memfd that is spliced
+ * into them, and anything else gets a plain write().
+ */
+
+#define TEACRYPT_ROUNDS 32
+#define TEACRYPT_CHUNK_MB 16
+#define TEACRYPT_MAX_CHUNK_MB 1024
+#define TEACRYPT_BLOCK 8 /* bytes in a 64-bit block */
+
+typedef struct {
+    uint32_t key[4];
+    uint64_t nonce; /* initial CTR counter */
+    uint32_t rounds;
+    int algorithm;
+    bool decrypt;
+    bool ctr;
+    bool verbose;
+    size_t chunk; /* bytes per chunk, a multiple of the block */
+} teacrypt_opts_t;
+
+/* a chunk in flight */
+typedef struct {
+    teatime_job_t *job;
+    uint8_t *ibuf; /* read buffer if the input is not mapped */
+    const uint8_t *in;
+    uint8_t *out;
+    size_t len; /* bytes in the chunk, whole blocks only */
+    size_t off; /* byte offset of the chunk in the input */
+    bool busy;
+} teacrypt_slot_t;
+
+typedef struct {
+    teatime_t *tea;
+    const teacrypt_opts_t *opts;
+    int ifd;
+    int ofd;
+    bool iregular; /* input size is known up front */
+    const uint8_t *imap; /* whole input, if it is a regular file */
+    size_t isize;
+    size_t ibody; /* whole blocks of a regular input */
+    size_t ioff; /* bytes of the input consumed */
+    bool ieof;
+    bool omapped; /* output is a mapped regular file */
+    uint8_t *omap;
+    size_t osize;
+    size_t ooff; /* bytes of the output produced */
+    int memfd; /* staging for pipes */
+    uint8_t *obuf; /* one chunk per slot, mapped from memfd or allocated */
+    bool osplice;
+    bool unpadded; /* ECB decryption found the padding */
+    uint8_t tail[TEACRYPT_BLOCK]; /* trailing partial block */
+    size_t ntail;
+    teacrypt_slot_t slots[2];
+} teacrypt_t;
+
+static void teacrypt_usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-e|-d] [-m ecb|ctr] [-a tea|xtea] (-k KEY | -K KEYFILE)\n"
+        "          [-n NONCE] [-r ROUNDS] [-c CHUNK_MB] [-v] [INPUT [OUTPUT]]\n"
+        "  -e          encrypt (default)\n"
+        "  -d          decrypt\n"
+        "  -m MODE     ecb with PKCS#7 padding (default) or ctr\n"
+        "  -a CIPHER   tea (default) or xtea\n"
+        "  -k KEY      128-bit key as 32 hex digits\n"
+        "  -K KEYFILE  read the key from a file instead\n"
+        "  -n NONCE    initial CTR counter as up to 16 hex digits (default 0)\n"
+        "  -r ROUNDS   cipher rounds (default %d)\n"
+        "  -c CHUNK_MB chunk size in MiB (default %d)\n"
+        "  -v          print the transfer statistics\n"
+        "INPUT and OUTPUT default to '-', i.e. stdin and stdout.\n",
+        prog, TEACRYPT_ROUNDS, TEACRYPT_CHUNK_MB);
+}
+
+/* parses 8 hex digits per word, the first word first */
+static int teacrypt_parse_key(const char *s, uint32_t key[4])
+{
+    char word[9];
+    size_t n = strlen(s);
+    while (n > 0 && (s[n - 1] == '\n' || s[n - 1] == '\r' || s[n - 1] == ' '))
+        n--;
+    if (n != 32 || strspn(s, "0123456789abcdefABCDEF") < n)
+        return -EINVAL;
+    for (int i = 0; i < 4; ++i) {
+        memcpy(word, s + 8 * i, 8);
+        word[8] = '\0';
+        key[i] = (uint32_t)strtoul(word, NULL, 16);
+    }
+    return 0;
+}
+
+static int teacrypt_read_key(const char *path, uint32_t key[4])
+{
+    char line[128];
+    int rc = -EINVAL;
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        rc = -errno;
+        fprintf(stderr, "teatime-crypt: %s: %s\n", path, strerror(errno));
+        return rc;
+    }
+    if (fgets(line, sizeof(line), fp))
+        rc = teacrypt_parse_key(line, key);
+    fclose(fp);
+    return rc;
+}
+
+static int teacrypt_open_input(teacrypt_t *c, const char *path)
+{
+    struct stat st;
+    c->ifd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+    if (c->ifd < 0 || fstat(c->ifd, &st) < 0) {
+        int rc = -errno;
+        fprintf(stderr, "teatime-crypt: %s: %s\n", path, strerror(errno));
+        return rc;
+    }
+    if (S_ISREG(st.st_mode)) {
+        c->isize = (size_t)st.st_size;
+        c->iregular = true;
+        if (c->isize > 0) {
+            void *p = mmap(NULL, c->isize, PROT_READ, MAP_SHARED, c->ifd, 0);
+            if (p == MAP_FAILED) {
+                /* e.g. a file system without mmap, read it like a pipe */
+                c->iregular = false;
+            } else {
+                c->imap = p;
+                madvise(p, c->isize, MADV_SEQUENTIAL);
+            }
+        }
+    }
+    if (c->iregular) {
+        c->ibody = c->isize - (c->isize % TEACRYPT_BLOCK);
+        if (c->opts->decrypt && !c->opts->ctr &&
+            (c->isize == 0 || c->ibody != c->isize)) {
+            fprintf(stderr, "teatime-crypt: %s is not a whole no. of blocks\n", path);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int teacrypt_open_output(teacrypt_t *c, const char *path)
+{
+    struct stat ist, st;
+    bool have_ist = (fstat(c->ifd, &ist) == 0 && S_ISREG(ist.st_mode));
+    if (strcmp(path, "-") == 0) {
+        c->ofd = STDOUT_FILENO;
+    } else {
+        /* truncating the input would lose it before it is read */
+        if (have_ist && stat(path, &st) == 0 && st.st_dev == ist.st_dev &&
+            st.st_ino == ist.st_ino) {
+            fprintf(stderr, "teatime-crypt: %s is also the input\n", path);
+            return -EINVAL;
+        }
+        c->ofd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    }
+    if (c->ofd < 0 || fstat(c->ofd, &st) < 0) {
+        int rc = -errno;
+        fprintf(stderr, "teatime-crypt: %s: %s\n", path, strerror(errno));
+        return rc;
+    }
+    if (have_ist && S_ISREG(st.st_mode) && st.st_dev == ist.st_dev &&
+        st.st_ino == ist.st_ino) {
+        fprintf(stderr, "teatime-crypt: the output is also the input\n");
+        return -EINVAL;
+    }
+    /* a redirected stdout is usually write-only and cannot be mapped */
+    if (c->iregular && S_ISREG(st.st_mode) &&
+        (fcntl(c->ofd, F_GETFL) & O_ACCMODE) == O_RDWR) {
+        /* ECB decryption truncates the padding at the end */
+        if (c->opts->ctr || c->opts->decrypt)
+            c->osize = c->isize;
+        else
+            c->osize = c->ibody + TEACRYPT_BLOCK;
+        if (ftruncate(c->ofd, (off_t)c->osize) == 0) {
+            void *p = (c->osize > 0) ? mmap(NULL, c->osize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, c->ofd, 0) : NULL;
+            if (p != MAP_FAILED) {
+                c->omap = p;
+                c->omapped = true;
+                return 0;
+            }
+        }
+    }
+    c->memfd = memfd_create("teatime-crypt", MFD_CLOEXEC);
+    if (c->memfd >= 0 && ftruncate(c->memfd, (off_t)(2 * c->opts->chunk)) == 0) {
+        void *p = mmap(NULL, 2 * c->opts->chunk, PROT_READ | PROT_WRITE, MAP_SHARED,
+                c->memfd, 0);
+        if (p != MAP_FAILED) {
+            c->obuf = p;
+            c->osplice = S_ISFIFO(st.st_mode);
+            return 0;
+        }
+    }
+    if (c->memfd >= 0)
+        close(c->memfd);
+    c->memfd = -1;
+    c->obuf = malloc(2 * c->opts->chunk);
+    if (!c->obuf) {
+        fprintf(stderr, "teatime-crypt: Out of memory allocating %zu bytes\n",
+                2 * c->opts->chunk);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* reads the next chunk into the slot, a partial block at the end goes to
+ * the tail */
+static int teacrypt_fill(teacrypt_t *c, teacrypt_slot_t *slot)
+{
+    size_t got = 0;
+    slot->len = 0;
+    slot->off = c->ioff;
+    if (c->ieof)
+        return 0;
+    if (c->iregular) {
+        got = c->ibody - c->ioff;
+        if (got > c->opts->chunk)
+            got = c->opts->chunk;
+        slot->in = c->imap + c->ioff;
+        c->ioff += got;
+        if (c->ioff == c->ibody) {
+            c->ntail = c->isize - c->ibody;
+            if (c->ntail > 0)
+                memcpy(c->tail, c->imap + c->ibody, c->ntail);
+            c->ieof = true;
+        }
+        slot->len = got;
+        return 0;
+    }
+    if (!slot->ibuf) {
+        slot->ibuf = malloc(c->opts->chunk);
+        if (!slot->ibuf) {
+            fprintf(stderr, "teatime-crypt: Out of memory allocating %zu bytes\n",
+                    c->opts->chunk);
+            return -ENOMEM;
+        }
+    }
+    while (got < c->opts->chunk) {
+        ssize_t n = read(c->ifd, slot->ibuf + got, c->opts->chunk - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            int rc = -errno;
+            fprintf(stderr, "teatime-crypt: read error: %s\n", strerror(errno));
+            return rc;
+        }
+        if (n == 0) {
+            c->ieof = true;
+            break;
+        }
+        got += (size_t)n;
+    }
+    if (c->ieof) {
+        c->ntail = got % TEACRYPT_BLOCK;
+        if (c->ntail > 0 && c->opts->decrypt && !c->opts->ctr) {
+            fprintf(stderr, "teatime-crypt: input is not a whole no. of blocks\n");
+            return -EINVAL;
+        }
+        got -= c->ntail;
+        memcpy(c->tail, slot->ibuf + got, c->ntail);
+    }
+    slot->in = slot->ibuf;
+    slot->len = got;
+    c->ioff += got;
+    return 0;
+}
+
+static int teacrypt_submit(teacrypt_t *c, teacrypt_slot_t *slot, int idx)
+{
+    const teacrypt_opts_t *opts = c->opts;
+    slot->out = c->omapped ? c->omap + slot->off : c->obuf + idx * opts->chunk;
+    slot->busy = true;
+    if (c->tea->backend == TEATIME_BACKEND_CPU || c->tea->have_sync) {
+        slot->job = teatime_submit(c->tea, opts->key, opts->rounds,
+                (const uint32_t *)slot->in, (uint32_t *)slot->out,
+                (uint32_t)(slot->len / sizeof(uint32_t)));
+        return slot->job ? 0 : -EIO;
+    }
+    /* no fences, so there is nothing to overlap */
+    return teatime_run(c->tea, opts->key, opts->rounds, (const uint32_t *)slot->in,
+            (uint32_t *)slot->out, (uint32_t)(slot->len / sizeof(uint32_t)));
+}
+
+static int teacrypt_write(teacrypt_t *c, const uint8_t *buf, size_t len)
+{
+    loff_t off = (loff_t)(buf - c->obuf);
+    size_t left = len;
+    while (c->osplice && left > 0) {
+        ssize_t n = splice(c->memfd, &off, c->ofd, NULL, left, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL && left == len) {
+            c->osplice = false;
+            break;
+        }
+        if (n < 0) {
+            int rc = -errno;
+            fprintf(stderr, "teatime-crypt: splice error: %s\n", strerror(errno));
+            return rc;
+        }
+        left -= (size_t)n;
+    }
+    if (c->osplice) {
+        /* the pipe still references the spliced pages, so the slot gets
+         * fresh ones instead of overwriting them. The whole slot is punched
+         * since a partial page would be zeroed in place. */
+        if (fallocate(c->memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    (off_t)(buf - c->obuf), (off_t)c->opts->chunk) < 0) {
+            int rc = -errno;
+            fprintf(stderr, "teatime-crypt: fallocate error: %s\n", strerror(errno));
+            return rc;
+        }
+        return 0;
+    }
+    while (left > 0) {
+        ssize_t n = write(c->ofd, buf + (len - left), left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            int rc = -errno;
+            fprintf(stderr, "teatime-crypt: write error: %s\n", strerror(errno));
+            return rc;
+        }
+        left -= (size_t)n;
+    }
+    return 0;
+}
+
+/* waits for the chunk and writes it out, the last one of an ECB decryption
+ * loses its padding */
+static int teacrypt_complete(teacrypt_t *c, teacrypt_slot_t *slot, bool last)
+{
+    int rc = 0;
+    size_t len = slot->len;
+    if (!slot->busy)
+        return 0;
+    slot->busy = false;
+    if (slot->job) {
+        rc = teatime_wait(c->tea, slot->job, TEATIME_WAIT_FOREVER);
+        teatime_job_release(c->tea, slot->job);
+        slot->job = NULL;
+        if (rc < 0)
+            return rc;
+    }
+    if (last && c->opts->decrypt && !c->opts->ctr) {
+        uint8_t pad = slot->out[len - 1];
+        if (pad < 1 || pad > TEACRYPT_BLOCK) {
+            fprintf(stderr, "teatime-crypt: bad padding, wrong key?\n");
+            return -EBADMSG;
+        }
+        for (size_t i = len - pad; i < len; ++i) {
+            if (slot->out[i] != pad) {
+                fprintf(stderr, "teatime-crypt: bad padding, wrong key?\n");
+                return -EBADMSG;
+            }
+        }
+        len -= pad;
+        c->unpadded = true;
+    }
+    if (!c->omapped)
+        rc = teacrypt_write(c, slot->out, len);
+    c->ooff += len;
+    return rc;
+}
+
+/* the trailing partial block: ECB pads it to a whole one, CTR encrypts a
+ * whole counter block and keeps as many bytes as there are */
+static int teacrypt_finish(teacrypt_t *c)
+{
+    int rc = 0;
+    uint32_t block[2] = { 0, 0 };
+    uint32_t out[2] = { 0, 0 };
+    size_t len = c->ntail;
+    if (c->opts->decrypt && !c->opts->ctr) {
+        if (!c->unpadded) {
+            fprintf(stderr, "teatime-crypt: input is missing its padding\n");
+            return -EBADMSG;
+        }
+        return 0;
+    }
+    if (c->opts->ctr && len == 0)
+        return 0;
+    memcpy(block, c->tail, c->ntail);
+    if (!c->opts->ctr) {
+        memset((uint8_t *)block + c->ntail, (int)(TEACRYPT_BLOCK - c->ntail),
+                TEACRYPT_BLOCK - c->ntail);
+        len = TEACRYPT_BLOCK;
+    }
+    rc = teatime_run(c->tea, c->opts->key, c->opts->rounds, block, out, 2);
+    if (rc < 0)
+        return rc;
+    if (c->omapped) {
+        memcpy(c->omap + c->ooff, out, len);
+    } else {
+        /* every slot has been written out by now */
+        memcpy(c->obuf, out, len);
+        rc = teacrypt_write(c, c->obuf, len);
+    }
+    c->ooff += len;
+    return rc;
+}
+
+static int teacrypt_process(teacrypt_t *c)
+{
+    int rc = 0;
+    teacrypt_slot_t *prev = NULL;
+    for (int idx = 0; ; idx ^= 1) {
+        teacrypt_slot_t *slot = &(c->slots[idx]);
+        rc = teacrypt_fill(c, slot);
+        if (rc < 0)
+            break;
+        if (slot->len > 0) {
+            rc = teacrypt_submit(c, slot, idx);
+            if (rc < 0)
+                break;
+        }
+        /* the chunk just submitted runs while the previous one is written */
+        if (prev) {
+            rc = teacrypt_complete(c, prev, slot->len == 0);
+            if (rc < 0)
+                break;
+        }
+        if (slot->len == 0)
+            break;
+        prev = slot;
+    }
+    if (rc < 0)
+        return rc;
+    return teacrypt_finish(c);
+}
+
+static void teacrypt_close(teacrypt_t *c)
+{
+    for (int i = 0; i < 2; ++i) {
+        if (c->slots[i].job)
+            teatime_job_release(c->tea, c->slots[i].job);
+        free(c->slots[i].ibuf);
+    }
+    if (c->imap)
+        munmap((void *)c->imap, c->isize);
+    if (c->omap)
+        munmap(c->omap, c->osize);
+    if (c->omapped && c->ooff != c->osize && ftruncate(c->ofd, (off_t)c->ooff) < 0)
+        fprintf(stderr, "teatime-crypt: ftruncate error: %s\n", strerror(errno));
+    if (c->memfd >= 0) {
+        munmap(c->obuf, 2 * c->opts->chunk);
+        close(c->memfd);
+    } else {
+        free(c->obuf);
+    }
+    if (c->ifd > STDERR_FILENO)
+        close(c->ifd);
+    if (c->ofd > STDERR_FILENO)
+        close(c->ofd);
+}
+
+int main(int argc, char **argv)
+{
+    int rc = 0;
+    int ch;
+    bool have_key = false;
+    const char *ipath = "-";
+    const char *opath = "-";
+    teacrypt_opts_t opts;
+    teacrypt_t c;
+    memset(&opts, 0, sizeof(opts));
+    memset(&c, 0, sizeof(c));
+    opts.rounds = TEACRYPT_ROUNDS;
+    opts.algorithm = TEATIME_ALG_TEA;
+    opts.chunk = (size_t)TEACRYPT_CHUNK_MB << 20;
+    while ((ch = getopt(argc, argv, "edm:a:k:K:n:r:c:vh")) != -1) {
+        switch (ch) {
+        case 'e':
+            opts.decrypt = false;
+            break;
+        case 'd':
+            opts.decrypt = true;
+            break;
+        case 'm':
+            if (strcmp(optarg, "ecb") && strcmp(optarg, "ctr")) {
+                teacrypt_usage(argv[0]);
+                return 2;
+            }
+            opts.ctr = (strcmp(optarg, "ctr") == 0);
+            break;
+        case 'a':
+            if (strcmp(optarg, "tea") && strcmp(optarg, "xtea")) {
+                teacrypt_usage(argv[0]);
+                return 2;
+            }
+            opts.algorithm = strcmp(optarg, "xtea") ? TEATIME_ALG_TEA : TEATIME_ALG_XTEA;
+            break;
+        case 'k':
+            if (teacrypt_parse_key(optarg, opts.key) < 0) {
+                fprintf(stderr, "teatime-crypt: the key must be 32 hex digits\n");
+                return 2;
+            }
+            have_key = true;
+            break;
+        case 'K':
+            if (teacrypt_read_key(optarg, opts.key) < 0) {
+                fprintf(stderr, "teatime-crypt: %s must hold 32 hex digits\n", optarg);
+                return 2;
+            }
+            have_key = true;
+            break;
+        case 'n':
+            if (strlen(optarg) > 16 ||
+                strspn(optarg, "0123456789abcdefABCDEF") != strlen(optarg)) {
+                fprintf(stderr, "teatime-crypt: the nonce must be up to 16 hex digits\n");
+                return 2;
+            }
+            opts.nonce = strtoull(optarg, NULL, 16);
+            break;
+        case 'r':
+            opts.rounds = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'c': {
+            unsigned long mb = strtoul(optarg, NULL, 10);
+            if (mb < 1 || mb > TEACRYPT_MAX_CHUNK_MB) {
+                fprintf(stderr, "teatime-crypt: the chunk must be 1 to %d MiB\n",
+                        TEACRYPT_MAX_CHUNK_MB);
+                return 2;
+            }
+            opts.chunk = (size_t)mb << 20;
+            break;
+        }
+        case 'v':
+            opts.verbose = true;
+            break;
+        default:
+            teacrypt_usage(argv[0]);
+            return (ch == 'h') ? 0 : 2;
+        }
+    }
+    if (!have_key || argc - optind > 2) {
+        teacrypt_usage(argv[0]);
+        return 2;
+    }
+    if (optind < argc)
+        ipath = argv[optind++];
+    if (optind < argc)
+        opath = argv[optind++];
+    c.opts = &opts;
+    c.ifd = -1;
+    c.ofd = -1;
+    c.memfd = -1;
+    do {
+        int direction = opts.ctr ? TEATIME_CTR :
+            (opts.decrypt ? TEATIME_DECRYPT : TEATIME_ENCRYPT);
+        rc = teacrypt_open_input(&c, ipath);
+        if (rc < 0)
+            break;
+        rc = teacrypt_open_output(&c, opath);
+        if (rc < 0)
+            break;
+        c.tea = teatime_setup();
+        if (!c.tea) {
+            rc = -ENOMEM;
+            break;
+        }
+        if (opts.verbose)
+            teatime_set_stats(c.tea, true, false);
+        rc = teatime_set_algorithm(c.tea, opts.algorithm, 2);
+        if (rc < 0)
+            break;
+        rc = teatime_load_program(c.tea, direction);
+        if (rc < 0)
+            break;
+        if (opts.ctr) {
+            rc = teatime_set_counter(c.tea, opts.nonce);
+            if (rc < 0)
+                break;
+        }
+        rc = teacrypt_process(&c);
+    } while (0);
+    if (opts.verbose && c.tea) {
+        fprintf(stderr, "teatime-crypt: %zu bytes in, %zu bytes out, %s backend, "
+                "%s input, %s output\n", c.ioff + c.ntail, c.ooff,
+                teatime_backend_name(c.tea->backend),
+                c.imap ? "mapped" : "read", c.omapped ? "mapped" :
+                (c.osplice ? "spliced" : "written"));
+        teatime_print_stats(c.tea, stderr);
+    }
+    teacrypt_close(&c);
+    if (c.tea) {
+        teatime_delete_program(c.tea);
+        teatime_cleanup(c.tea);
+    }
+    return (rc < 0) ? 1 : 0;
+}
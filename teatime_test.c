@@ -0,0 +1,1426 @@
+/*
+ * COPYRIGHT: Stealthy Labs LLC
+ * DATE: 29th May 2015
+ * AUTHOR: Stealthy Labs
+ * SOFTWARE: Tea Time
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <teatime.h>
+#include <teatime_client.h>
+
+/*
+ * Round-trip and known-answer checks run by make check. Every check gets a
+ * fresh teatime_t on each backend, compares the output against the CPU
+ * reference functions and returns 0, -ENOTSUP if it does not apply to the
+ * backend, or another negative errno on failure.
+ */
+
+#define TEATEST_ROUNDS 32
+/* the -b of the teatime-batchd that make check starts */
+#define TEATEST_BATCHD_KB 512
+
+typedef struct {
+    const char *name;
+    int (*run)(teatime_t *tea);
+} teatest_check_t;
+
+static const uint32_t teatest_key[4] = {
+    0xDEADBEEF, 0xCAFEFACE, 0xFACEB00C, 0xF00D1337
+};
+
+/* a pattern that differs in every word */
+static uint32_t *teatest_alloc(uint32_t nwords, uint32_t seed)
+{
+    uint32_t *buf = malloc((size_t)nwords * sizeof(uint32_t));
+    if (!buf) {
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                (size_t)nwords * sizeof(uint32_t));
+        return NULL;
+    }
+    for (uint32_t i = 0; i < nwords; ++i)
+        buf[i] = (i + seed) * 2654435761u;
+    return buf;
+}
+
+/* reports the first word that differs */
+static int teatest_compare(const char *what, const uint32_t *output,
+        const uint32_t *expected, uint32_t nwords)
+{
+    for (uint32_t i = 0; i < nwords; ++i) {
+        if (output[i] != expected[i]) {
+            teatime_log(TEATIME_LOG_ERROR, "%s: word %u of %u is %08x, expected %08x\n",
+                    what, i, nwords, output[i], expected[i]);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/* silences the error that a call expected to fail logs */
+static void teatest_quiet(bool quiet)
+{
+    static int level = TEATIME_LOG_WARN;
+    if (quiet) {
+        level = teatime_get_log_level();
+        teatime_set_log_level(TEATIME_LOG_NONE);
+    } else {
+        teatime_set_log_level(level);
+    }
+}
+
+static void teatest_ecb(bool decrypt, const uint32_t key[4], const uint32_t *input,
+        uint32_t *output, uint32_t nwords)
+{
+    for (uint32_t i = 0; i < nwords; i += 2) {
+        if (decrypt)
+            TEA_cpu_decrypt(input + i, key, output + i, TEATEST_ROUNDS);
+        else
+            TEA_cpu_encrypt(input + i, key, output + i, TEATEST_ROUNDS);
+    }
+}
+
+/* encrypts and decrypts nwords with teatime_run(), the latter in place */
+static int teatest_round_trip(teatime_t *tea, uint32_t nwords)
+{
+    int rc = -ENOMEM;
+    uint32_t *input = teatest_alloc(nwords, nwords);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    do {
+        if (!input || !output || !expected)
+            break;
+        teatest_ecb(false, teatest_key, input, expected, nwords);
+        rc = teatime_load_program(tea, TEATIME_ENCRYPT);
+        if (rc < 0)
+            break;
+        rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, input, output, nwords);
+        if (rc < 0)
+            break;
+        rc = teatest_compare("encryption", output, expected, nwords);
+        if (rc < 0)
+            break;
+        rc = teatime_load_program(tea, TEATIME_DECRYPT);
+        if (rc < 0)
+            break;
+        rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, output, output, nwords);
+        if (rc < 0)
+            break;
+        rc = teatest_compare("decryption", output, input, nwords);
+    } while (0);
+    free(input);
+    free(output);
+    free(expected);
+    return rc;
+}
+
+/* the published all-zero test vector, then a round trip */
+static int teatest_known_answer(teatime_t *tea)
+{
+    int rc = 0;
+    const uint32_t zero[4] = { 0, 0, 0, 0 };
+    const uint32_t expected[4] = { 0x41EA3A0A, 0x94BAA940, 0x41EA3A0A, 0x94BAA940 };
+    uint32_t output[4] = { 0, 0, 0, 0 };
+    do {
+        rc = teatime_load_program(tea, TEATIME_ENCRYPT);
+        if (rc < 0)
+            break;
+        rc = teatime_run(tea, zero, TEATEST_ROUNDS, zero, output, 4);
+        if (rc < 0)
+            break;
+        rc = teatest_compare("TEA test vector", output, expected, 4);
+        if (rc < 0)
+            break;
+        rc = teatest_round_trip(tea, 1024);
+    } while (0);
+    return rc;
+}
+
+/*
+ * A headless context of one kind, forced with TEATIME_CONTEXT while no context
+ * is current, runs a round trip. A kind the build lacks must fail to be
+ * created, and is reported as skipped.
+ */
+static int teatest_headless(const char *only, const char *name, bool built)
+{
+    int rc = 0;
+    const char *saved = getenv("TEATIME_CONTEXT");
+    char *prev = saved ? strdup(saved) : NULL;
+    if (saved && !prev)
+        return -ENOMEM;
+    setenv("TEATIME_CONTEXT", only, 1);
+    if (!built) {
+        teatime_context_t *ctx;
+        teatest_quiet(true);
+        ctx = teatime_context_create();
+        teatest_quiet(false);
+        if (ctx) {
+            teatime_log(TEATIME_LOG_ERROR, "TEATIME_CONTEXT=%s made a %s context\n",
+                    only, teatime_context_name(ctx));
+            rc = -EIO;
+        } else {
+            rc = -ENOTSUP;
+        }
+        teatime_context_destroy(ctx);
+    } else {
+        teatime_t *tea = teatime_setup();
+        if (!tea || strcmp(teatime_context_name(tea->ctx), name) != 0) {
+            teatime_log(TEATIME_LOG_ERROR, "TEATIME_CONTEXT=%s made a %s context\n",
+                    only, tea ? teatime_context_name(tea->ctx) : "none");
+            rc = -EIO;
+        }
+        if (rc == 0)
+            rc = teatime_set_backend(tea, TEATIME_BACKEND_FRAGMENT);
+        if (rc == 0)
+            rc = teatest_round_trip(tea, 1030);
+        teatime_cleanup(tea);
+    }
+    if (prev)
+        setenv("TEATIME_CONTEXT", prev, 1);
+    else
+        unsetenv("TEATIME_CONTEXT");
+    free(prev);
+    return rc;
+}
+
+/* encrypts with a teatime_t of its own and reports how many of its programs
+ * came from the on-disk cache */
+static int teatest_fresh_run(int backend, const uint32_t *input, uint32_t *output,
+        uint32_t nwords, uint32_t *loads)
+{
+    int rc = -ENOMEM;
+    teatime_t *tea = teatime_setup();
+    if (tea)
+        rc = teatime_set_backend(tea, backend);
+    if (rc == 0)
+        rc = teatime_load_program(tea, TEATIME_ENCRYPT);
+    if (rc == 0)
+        rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, input, output, nwords);
+    if (rc == 0)
+        *loads = tea->binary_loads;
+    teatime_cleanup(tea);
+    return rc;
+}
+
+/* cuts every file in dir to half its size, or removes them and dir */
+static int teatest_cache_files(const char *dir, bool remove_all, uint32_t *nfiles)
+{
+    int rc = 0;
+    struct dirent *ent;
+    DIR *dp = opendir(dir);
+    if (!dp)
+        return -errno;
+    *nfiles = 0;
+    while ((ent = readdir(dp)) != NULL && rc == 0) {
+        char path[4096];
+        struct stat st;
+        if (ent->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (remove_all)
+            rc = (remove(path) == 0) ? 0 : -errno;
+        else if (stat(path, &st) < 0 || truncate(path, st.st_size / 2) < 0)
+            rc = -errno;
+        (*nfiles)++;
+    }
+    closedir(dp);
+    if (rc == 0 && remove_all && rmdir(dir) < 0)
+        rc = -errno;
+    return rc;
+}
+
+/*
+ * A program built by one teatime_t is restored from TEATIME_CACHE_DIR by the
+ * next one with the same output, and a truncated cache file is rebuilt.
+ */
+static int teatest_program_cache(teatime_t *tea)
+{
+    int rc = -ENOMEM;
+    char dir[] = "/tmp/teatest.XXXXXX";
+    const char *saved = getenv("TEATIME_CACHE_DIR");
+    char *prev = saved ? strdup(saved) : NULL;
+    uint32_t nwords = 1030, loads = 0, nfiles = 0;
+    uint32_t *input = teatest_alloc(nwords, 3);
+    uint32_t *first = teatest_alloc(nwords, 0);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    if (tea->backend == TEATIME_BACKEND_CPU || !tea->program_binary) {
+        free(prev);
+        free(input);
+        free(first);
+        free(output);
+        return -ENOTSUP;
+    }
+    if (!mkdtemp(dir)) {
+        teatime_log(TEATIME_LOG_ERROR, "Unable to create %s: %s\n", dir, strerror(errno));
+        rc = -errno;
+    } else if (input && first && output && (!saved || prev)) {
+        rc = (setenv("TEATIME_CACHE_DIR", dir, 1) == 0) ? 0 : -errno;
+    }
+    if (rc == 0)
+        rc = teatest_fresh_run(tea->backend, input, first, nwords, &loads);
+    if (rc == 0 && loads != 0) {
+        teatime_log(TEATIME_LOG_ERROR, "%u programs loaded from an empty cache\n", loads);
+        rc = -EIO;
+    }
+    if (rc == 0)
+        rc = teatest_fresh_run(tea->backend, input, output, nwords, &loads);
+    if (rc == 0 && loads == 0) {
+        teatime_log(TEATIME_LOG_ERROR, "The program was built again instead of loaded\n");
+        rc = -EIO;
+    }
+    if (rc == 0)
+        rc = teatest_compare("cached program", output, first, nwords);
+    if (rc == 0)
+        rc = teatest_cache_files(dir, false, &nfiles);
+    if (rc == 0) {
+        memset(output, 0, nwords * sizeof(uint32_t));
+        teatest_quiet(true);
+        rc = teatest_fresh_run(tea->backend, input, output, nwords, &loads);
+        teatest_quiet(false);
+    }
+    if (rc == 0 && (nfiles == 0 || loads != 0)) {
+        teatime_log(TEATIME_LOG_ERROR, "%u of %u truncated programs were loaded\n",
+                loads, nfiles);
+        rc = -EIO;
+    }
+    if (rc == 0)
+        rc = teatest_compare("rebuilt program", output, first, nwords);
+    if (dir[strlen(dir) - 1] != 'X')
+        teatest_cache_files(dir, true, &nfiles);
+    if (prev)
+        setenv("TEATIME_CACHE_DIR", prev, 1);
+    else
+        unsetenv("TEATIME_CACHE_DIR");
+    free(prev);
+    free(input);
+    free(first);
+    free(output);
+    return rc;
+}
+
+/* runs of one size class reuse a pair, and every pair is back when done */
+static int teatest_pool(teatime_t *tea)
+{
+    int rc = 0;
+    teatime_pool_stats_t stats;
+    for (uint32_t i = 0; i < 4 && rc == 0; ++i)
+        rc = teatest_round_trip(tea, 4096 - 2 * i);
+    if (rc < 0)
+        return rc;
+    teatime_get_pool_stats(tea, &stats);
+    if (stats.in_use != 0) {
+        teatime_log(TEATIME_LOG_ERROR, "%u pairs are still in use\n", stats.in_use);
+        return -EIO;
+    }
+    if (tea->backend == TEATIME_BACKEND_FRAGMENT && (stats.hits == 0 || stats.pairs == 0)) {
+        teatime_log(TEATIME_LOG_ERROR, "%llu pool hits with %u pairs\n",
+                (unsigned long long)stats.hits, stats.pairs);
+        return -EIO;
+    }
+    teatime_set_pool_size(tea, 0);
+    teatime_get_pool_stats(tea, &stats);
+    if (stats.pairs != 0) {
+        teatime_log(TEATIME_LOG_ERROR, "%u pairs are left in an empty pool\n", stats.pairs);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* lengths that leave a partial row or a half texel, on one and many tiles */
+static int teatest_odd_sizes(teatime_t *tea)
+{
+    int rc = 0;
+    const uint32_t sizes[] = { 2, 6, 10, 4098, 3 * 64 * 64 * 4 + 6 };
+    uint32_t output[3] = { 0, 0, 0 };
+    int rc2 = 0;
+    for (int tiled = 0; tiled < 2 && rc == 0; ++tiled) {
+        if (tiled)
+            rc = teatime_set_tile_size(tea, 64, 64);
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && rc == 0; ++i)
+            rc = teatest_round_trip(tea, sizes[i]);
+    }
+    /* and half a block is rejected */
+    teatest_quiet(true);
+    rc2 = teatime_run(tea, teatest_key, TEATEST_ROUNDS, teatest_key, output, 3);
+    teatest_quiet(false);
+    if (rc == 0 && rc2 != -EINVAL) {
+        teatime_log(TEATIME_LOG_ERROR, "An odd no. of words was accepted\n");
+        rc = -EIO;
+    }
+    return rc;
+}
+
+/* multi-tile runs through rings of pixel buffers of both parities */
+static int teatest_streaming(teatime_t *tea)
+{
+    int rc = teatime_set_tile_size(tea, 64, 64);
+    for (uint32_t nslots = 2; nslots <= 3 && rc == 0; ++nslots) {
+        rc = teatime_set_streaming(tea, nslots);
+        if (rc == 0)
+            rc = teatest_round_trip(tea, 7 * 64 * 64 * 4 + 2);
+    }
+    if (rc == 0)
+        rc = teatime_set_streaming(tea, 0);
+    return rc;
+}
+
+/* two jobs in flight, each with more tiles than a job keeps in flight */
+static int teatest_async(teatime_t *tea)
+{
+    int rc = -ENOMEM;
+    uint32_t nwords = (TEATIME_JOB_TILES_MAX + 2) * 64 * 64 * 4 + 6;
+    uint32_t *input = teatest_alloc(nwords, 1);
+    uint32_t *output[2] = { teatest_alloc(nwords, 0), teatest_alloc(nwords, 0) };
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    teatime_job_t *jobs[2] = { NULL, NULL };
+    teatime_pool_stats_t stats;
+    do {
+        if (!input || !output[0] || !output[1] || !expected)
+            break;
+        teatest_ecb(false, teatest_key, input, expected, nwords);
+        rc = teatime_set_tile_size(tea, 64, 64);
+        if (rc < 0)
+            break;
+        rc = teatime_load_program(tea, TEATIME_ENCRYPT);
+        if (rc < 0)
+            break;
+        for (int j = 0; j < 2 && rc == 0; ++j) {
+            jobs[j] = teatime_submit(tea, teatest_key, TEATEST_ROUNDS, input,
+                    output[j], nwords);
+            if (!jobs[j])
+                rc = -EIO;
+        }
+        if (rc < 0)
+            break;
+        teatime_get_pool_stats(tea, &stats);
+        if (stats.in_use > 2 * TEATIME_JOB_TILES_MAX) {
+            teatime_log(TEATIME_LOG_ERROR, "%u pairs are held by 2 jobs\n", stats.in_use);
+            rc = -EIO;
+            break;
+        }
+        for (int j = 0; j < 2 && rc == 0; ++j) {
+            if (teatime_wait(tea, jobs[j], TEATIME_WAIT_FOREVER) != 1 ||
+                teatime_poll(tea, jobs[j]) != 1)
+                rc = -EIO;
+            else
+                rc = teatest_compare("job", output[j], expected, nwords);
+        }
+    } while (0);
+    for (int j = 0; j < 2; ++j)
+        teatime_job_release(tea, jobs[j]);
+    teatime_get_pool_stats(tea, &stats);
+    if (rc == 0 && stats.in_use != 0) {
+        teatime_log(TEATIME_LOG_ERROR, "%u pairs are still in use\n", stats.in_use);
+        rc = -EIO;
+    }
+    free(input);
+    free(output[0]);
+    free(output[1]);
+    free(expected);
+    return rc;
+}
+
+/* encryption then decryption on a buffer that stays on the GPU in between */
+static int teatest_buffers(teatime_t *tea)
+{
+    int rc = -ENOMEM;
+    uint32_t nwords = 4098;
+    uint32_t *input = teatest_alloc(nwords, 2);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    teatime_buffer_t *buf = NULL;
+    do {
+        if (!input || !output || !expected)
+            break;
+        teatest_ecb(false, teatest_key, input, expected, nwords);
+        buf = teatime_buffer_create(tea, input, nwords);
+        if (!buf) {
+            rc = -EIO;
+            break;
+        }
+        rc = teatime_load_program(tea, TEATIME_ENCRYPT);
+        if (rc < 0)
+            break;
+        rc = teatime_buffer_run(tea, buf, teatest_key, TEATEST_ROUNDS);
+        if (rc < 0)
+            break;
+        rc = teatime_buffer_read(tea, buf, output, nwords);
+        if (rc < 0)
+            break;
+        rc = teatest_compare("buffer encryption", output, expected, nwords);
+        if (rc < 0)
+            break;
+        rc = teatime_load_program(tea, TEATIME_DECRYPT);
+        if (rc < 0)
+            break;
+        rc = teatime_buffer_run(tea, buf, teatest_key, TEATEST_ROUNDS);
+        if (rc < 0)
+            break;
+        rc = teatime_buffer_read(tea, buf, output, nwords);
+        if (rc < 0)
+            break;
+        rc = teatest_compare("buffer decryption", output, input, nwords);
+    } while (0);
+    teatime_buffer_release(tea, buf);
+    free(input);
+    free(output);
+    free(expected);
+    return rc;
+}
+
+/* several block pairs per fragment, with planes that end mid-row */
+static int teatest_fanout(teatime_t *tea)
+{
+    int rc = 0;
+    if (tea->backend != TEATIME_BACKEND_FRAGMENT)
+        return -ENOTSUP;
+    rc = teatime_set_tile_size(tea, 64, 64);
+    for (uint32_t fanout = 2; fanout <= TEATIME_FANOUT_MAX && rc == 0; fanout *= 2) {
+        rc = teatime_set_fanout(tea, fanout);
+        if (rc == 0)
+            rc = teatest_round_trip(tea, 1030);
+        if (rc == 0)
+            rc = teatest_round_trip(tea, 2 * fanout * 64 * 64 * 4 + 6);
+    }
+    return rc;
+}
+
+/* workgroups that do not divide the no. of texels */
+static int teatest_workgroups(teatime_t *tea)
+{
+    int rc = 0;
+    const uint32_t sizes[] = { 1, 48, 256 };
+    if (tea->backend != TEATIME_BACKEND_COMPUTE)
+        return -ENOTSUP;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && rc == 0; ++i) {
+        rc = teatime_set_workgroup_size(tea, sizes[i]);
+        if (rc == 0)
+            rc = teatest_round_trip(tea, 1030);
+    }
+    return rc;
+}
+
+/* kernels unrolled for a round count, which reject any other count */
+static int teatest_specialized(teatime_t *tea)
+{
+    int rc = -ENOMEM;
+    const uint32_t rounds[] = { 1, 8, 32 };
+    uint32_t nwords = 1030;
+    uint32_t *input = teatest_alloc(nwords, 3);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    if (input && output && expected)
+        rc = 0;
+    for (size_t r = 0; r < sizeof(rounds) / sizeof(rounds[0]) && rc == 0; ++r) {
+        int rc2 = 0;
+        for (uint32_t i = 0; i < nwords; i += 2)
+            TEA_cpu_encrypt(input + i, teatest_key, expected + i, rounds[r]);
+        rc = teatime_load_program_rounds(tea, TEATIME_ENCRYPT, rounds[r]);
+        if (rc == 0)
+            rc = teatime_run(tea, teatest_key, rounds[r], input, output, nwords);
+        if (rc == 0)
+            rc = teatest_compare("specialized encryption", output, expected, nwords);
+        teatest_quiet(true);
+        rc2 = teatime_run(tea, teatest_key, rounds[r] + 1, input, output, nwords);
+        teatest_quiet(false);
+        if (rc == 0 && rc2 != -EINVAL) {
+            teatime_log(TEATIME_LOG_ERROR, "A kernel for %u rounds ran %u\n",
+                    rounds[r], rounds[r] + 1);
+            rc = -EIO;
+        }
+        if (rc == 0)
+            rc = teatime_load_program_rounds(tea, TEATIME_DECRYPT, rounds[r]);
+        if (rc == 0)
+            rc = teatime_run(tea, teatest_key, rounds[r], expected, output, nwords);
+        if (rc == 0)
+            rc = teatest_compare("specialized decryption", output, input, nwords);
+    }
+    free(input);
+    free(output);
+    free(expected);
+    return rc;
+}
+
+/* the backend gives the same output as the multi-threaded CPU engine */
+static int teatest_equivalence(teatime_t *tea)
+{
+    int rc = -ENOMEM;
+    const int directions[] = { TEATIME_ENCRYPT, TEATIME_DECRYPT, TEATIME_CTR };
+    uint32_t nwords = 64 * 64 * 4 * 3 + 10;
+    uint32_t *input = teatest_alloc(nwords, 4);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    teatime_cpu_t *cpu = teatime_cpu_create(0);
+    if (input && output && expected && cpu)
+        rc = teatime_set_tile_size(tea, 64, 64);
+    for (int d = 0; d < 3 && rc == 0; ++d) {
+        rc = teatime_cpu_set_counter(cpu, 0xFFFFFFF0ULL);
+        if (rc == 0)
+            rc = teatime_set_counter(tea, 0xFFFFFFF0ULL);
+        if (rc == 0)
+            rc = teatime_cpu_run(cpu, directions[d], teatest_key, TEATEST_ROUNDS,
+                    input, expected, nwords);
+        if (rc == 0)
+            rc = teatime_load_program(tea, directions[d]);
+        if (rc == 0)
+            rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, input, output, nwords);
+        if (rc == 0)
+            rc = teatest_compare(teatime_cpu_isa(cpu), output, expected, nwords);
+    }
+    teatime_cpu_destroy(cpu);
+    free(input);
+    free(output);
+    free(expected);
+    return rc;
+}
+
+/* runs below the crossover on the CPU, and above it split between both sides
+ * at whatever ratio the measured rates give */
+static int teatest_hybrid(teatime_t *tea)
+{
+    int rc = 0;
+    if (tea->backend == TEATIME_BACKEND_CPU)
+        return -ENOTSUP;
+    rc = teatime_set_hybrid(tea, true, 4096);
+    if (rc == 0)
+        rc = teatime_set_tile_size(tea, 64, 64);
+    for (int i = 0; i < 3 && rc == 0; ++i) {
+        rc = teatest_round_trip(tea, 1030);
+        if (rc == 0)
+            rc = teatest_round_trip(tea, 64 * 64 * 4 * 3 + 10);
+    }
+    return rc;
+}
+
+/* block i is XORed with the encryption of counter + i, high word first */
+static void teatest_ctr(uint64_t counter, const uint32_t *input, uint32_t *output,
+        uint32_t nwords)
+{
+    for (uint32_t i = 0; i < nwords; i += 2, ++counter) {
+        uint32_t block[2] = { (uint32_t)(counter >> 32), (uint32_t)counter };
+        TEA_cpu_encrypt(block, teatest_key, block, TEATEST_ROUNDS);
+        output[i] = (input ? input[i] : 0) ^ block[0];
+        output[i + 1] = (input ? input[i + 1] : 0) ^ block[1];
+    }
+}
+
+/* CTR and its keystream over several tiles, with counters that carry into
+ * the high word, continued across runs */
+static int teatest_ctr_mode(teatime_t *tea)
+{
+    int rc = -ENOMEM;
+    const uint64_t counters[] = { 0, 0xFFFFFFF0ULL, 0xFFFFFFFFFFFFFF00ULL };
+    uint32_t nwords = 64 * 64 * 4 * 3 + 10;
+    uint32_t half = 64 * 64 * 4 + 2;
+    uint32_t *input = teatest_alloc(nwords, 5);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    if (input && output && expected)
+        rc = teatime_set_tile_size(tea, 64, 64);
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]) && rc == 0; ++c) {
+        teatest_ctr(counters[c], input, expected, nwords);
+        rc = teatime_load_program(tea, TEATIME_CTR);
+        if (rc == 0)
+            rc = teatime_set_counter(tea, counters[c]);
+        if (rc == 0)
+            rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, input, output, half);
+        if (rc == 0)
+            rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, input + half,
+                    output + half, nwords - half);
+        if (rc == 0)
+            rc = teatest_compare("CTR", output, expected, nwords);
+        if (rc == 0 && tea->counter != counters[c] + nwords / 2) {
+            teatime_log(TEATIME_LOG_ERROR, "Counter is %llu after %u blocks from %llu\n",
+                    (unsigned long long)tea->counter, nwords / 2,
+                    (unsigned long long)counters[c]);
+            rc = -EIO;
+        }
+        /* decryption is the same operation */
+        if (rc == 0)
+            rc = teatime_set_counter(tea, counters[c]);
+        if (rc == 0)
+            rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, output, output, nwords);
+        if (rc == 0)
+            rc = teatest_compare("CTR decryption", output, input, nwords);
+        teatest_ctr(counters[c], NULL, expected, nwords);
+        if (rc == 0)
+            rc = teatime_load_program(tea, TEATIME_KEYSTREAM);
+        if (rc == 0)
+            rc = teatime_set_counter(tea, counters[c]);
+        if (rc == 0)
+            rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, NULL, output, nwords);
+        if (rc == 0)
+            rc = teatest_compare("keystream", output, expected, nwords);
+    }
+    free(input);
+    free(output);
+    free(expected);
+    return rc;
+}
+
+static void teatest_cbc(const uint32_t iv[2], const uint32_t *input, uint32_t *output,
+        uint32_t nwords)
+{
+    uint32_t chain[2] = { iv[0], iv[1] };
+    for (uint32_t i = 0; i < nwords; i += 2) {
+        uint32_t block[2] = { input[i] ^ chain[0], input[i + 1] ^ chain[1] };
+        TEA_cpu_encrypt(block, teatest_key, chain, TEATEST_ROUNDS);
+        output[i] = chain[0];
+        output[i + 1] = chain[1];
+    }
+}
+
+/* streams encrypted side by side, then each decrypted in two runs that carry
+ * the IV over */
+static int teatest_cbc_mode(teatime_t *tea)
+{
+    int rc = -ENOMEM;
+    const uint32_t nstreams = 150, stream_words = 63 * 4;
+    uint32_t nwords = nstreams * stream_words;
+    uint32_t half = 64 * 64 * 4 + 2;
+    uint32_t *input = teatest_alloc(nwords, 6);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    uint32_t *ivs = teatest_alloc(2 * nstreams, 7);
+    if (input && output && expected && ivs)
+        rc = teatime_set_tile_size(tea, 64, 64);
+    for (uint32_t i = 0; i < nstreams && rc == 0; ++i)
+        teatest_cbc(ivs + 2 * i, input + i * stream_words, expected + i * stream_words,
+                stream_words);
+    if (rc == 0)
+        rc = teatime_load_program(tea, TEATIME_CBC_ENCRYPT);
+    if (rc == 0)
+        rc = teatime_cbc_encrypt(tea, teatest_key, TEATEST_ROUNDS, ivs, input, output,
+                nstreams, stream_words);
+    if (rc == 0)
+        rc = teatest_compare("CBC encryption", output, expected, nwords);
+    /* one long stream for the decryption, across several tiles */
+    if (rc == 0) {
+        teatest_cbc(ivs, input, expected, nwords);
+        rc = teatime_load_program(tea, TEATIME_CBC_DECRYPT);
+    }
+    if (rc == 0)
+        rc = teatime_set_iv(tea, ivs);
+    if (rc == 0)
+        rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, expected, output, half);
+    if (rc == 0)
+        rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, expected + half,
+                output + half, nwords - half);
+    if (rc == 0)
+        rc = teatest_compare("CBC decryption", output, input, nwords);
+    if (rc == 0 && (tea->iv[0] != expected[nwords - 2] || tea->iv[1] != expected[nwords - 1])) {
+        teatime_log(TEATIME_LOG_ERROR, "IV is not the last ciphertext block\n");
+        rc = -EIO;
+    }
+    free(input);
+    free(output);
+    free(expected);
+    free(ivs);
+    return rc;
+}
+
+/* the reference of any of the ciphers, block by block */
+static void teatest_cipher(int algorithm, uint32_t block_words, bool decrypt,
+        const uint32_t key[4], uint32_t rounds, const uint32_t *input,
+        uint32_t *output, uint32_t nwords)
+{
+    if (algorithm == TEATIME_ALG_XXTEA) {
+        memcpy(output, input, (size_t)nwords * sizeof(uint32_t));
+        for (uint32_t i = 0; i < nwords; i += block_words) {
+            if (decrypt)
+                XXTEA_cpu_decrypt(output + i, block_words, key, rounds);
+            else
+                XXTEA_cpu_encrypt(output + i, block_words, key, rounds);
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < nwords; i += 2) {
+        if (algorithm == TEATIME_ALG_XTEA && decrypt)
+            XTEA_cpu_decrypt(input + i, key, output + i, rounds);
+        else if (algorithm == TEATIME_ALG_XTEA)
+            XTEA_cpu_encrypt(input + i, key, output + i, rounds);
+        else if (decrypt)
+            TEA_cpu_decrypt(input + i, key, output + i, rounds);
+        else
+            TEA_cpu_encrypt(input + i, key, output + i, rounds);
+    }
+}
+
+/* the published XTEA and XXTEA test vectors, then round trips over several
+ * tiles with every block length the backend takes */
+static int teatest_xtea(teatime_t *tea)
+{
+    const struct {
+        int algorithm;
+        uint32_t key[4];
+        uint32_t input[2];
+        uint32_t expected[2];
+    } vectors[] = {
+        { TEATIME_ALG_XTEA, { 0x00010203, 0x04050607, 0x08090A0B, 0x0C0D0E0F },
+            { 0x41424344, 0x45464748 }, { 0x497DF3D0, 0x72612CB5 } },
+        { TEATIME_ALG_XXTEA, { 0, 0, 0, 0 }, { 0, 0 }, { 0x053704AB, 0x575D8C80 } }
+    };
+    const struct {
+        int algorithm;
+        uint32_t block_words;
+    } ciphers[] = {
+        { TEATIME_ALG_XTEA, 2 },
+        { TEATIME_ALG_XXTEA, 2 },
+        { TEATIME_ALG_XXTEA, 4 },
+        { TEATIME_ALG_XXTEA, 16 }
+    };
+    int rc = -ENOMEM;
+    uint32_t nwords = 64 * 64 * 4 * 3 + 16;
+    uint32_t *input = teatest_alloc(nwords, 8);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    if (input && output && expected)
+        rc = 0;
+    for (size_t v = 0; v < sizeof(vectors) / sizeof(vectors[0]) && rc == 0; ++v) {
+        int algorithm = vectors[v].algorithm;
+        rc = teatime_set_algorithm(tea, algorithm, 2);
+        if (rc == 0)
+            rc = teatime_load_program(tea, TEATIME_ENCRYPT);
+        if (rc == 0)
+            rc = teatime_run(tea, vectors[v].key, (algorithm == TEATIME_ALG_XXTEA) ?
+                    TEATIME_XXTEA_ROUNDS(2) : TEATEST_ROUNDS, vectors[v].input, output, 2);
+        if (rc == 0)
+            rc = teatest_compare("test vector", output, vectors[v].expected, 2);
+    }
+    if (rc == 0)
+        rc = teatime_set_tile_size(tea, 64, 64);
+    for (size_t c = 0; c < sizeof(ciphers) / sizeof(ciphers[0]) && rc == 0; ++c) {
+        int algorithm = ciphers[c].algorithm;
+        uint32_t bw = ciphers[c].block_words;
+        uint32_t rounds = (algorithm == TEATIME_ALG_XXTEA) ?
+            TEATIME_XXTEA_ROUNDS(bw) : TEATEST_ROUNDS;
+        /* longer blocks do not fit in a texel */
+        if (bw > 4 && tea->backend == TEATIME_BACKEND_FRAGMENT)
+            continue;
+        teatest_cipher(algorithm, bw, false, teatest_key, rounds, input, expected,
+                nwords);
+        rc = teatime_set_algorithm(tea, algorithm, bw);
+        if (rc == 0)
+            rc = teatime_load_program(tea, TEATIME_ENCRYPT);
+        if (rc == 0)
+            rc = teatime_run(tea, teatest_key, rounds, input, output, nwords);
+        if (rc == 0)
+            rc = teatest_compare("encryption", output, expected, nwords);
+        if (rc == 0)
+            rc = teatime_load_program(tea, TEATIME_DECRYPT);
+        if (rc == 0)
+            rc = teatime_run(tea, teatest_key, rounds, output, output, nwords);
+        if (rc == 0)
+            rc = teatest_compare("decryption", output, input, nwords);
+    }
+    free(input);
+    free(output);
+    free(expected);
+    return rc;
+}
+
+/* segments under their own keys, from many per tile row to one per row */
+static int teatest_batch(teatime_t *tea)
+{
+    const struct {
+        uint32_t nsegments;
+        uint32_t segment_words;
+    } shapes[] = { { 5001, 4 }, { 700, 16 }, { 100, 256 } };
+    const uint32_t nkeys = 37;
+    int rc = -ENOMEM;
+    uint32_t nwords = 100 * 256;
+    uint32_t *keys = teatest_alloc(4 * nkeys, 9);
+    uint32_t *kindex = teatest_alloc(5001, 0);
+    uint32_t *input = teatest_alloc(nwords, 10);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    if (keys && kindex && input && output && expected)
+        rc = teatime_set_tile_size(tea, 64, 64);
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]) && rc == 0; ++s) {
+        uint32_t n = shapes[s].nsegments, sw = shapes[s].segment_words;
+        int rc2 = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            kindex[i] = (i * 13 + 5) % nkeys;
+            teatest_cipher(TEATIME_ALG_TEA, 2, false, keys + 4 * kindex[i],
+                    TEATEST_ROUNDS, input + i * sw, expected + i * sw, sw);
+        }
+        rc = teatime_load_program(tea, TEATIME_BATCH_ENCRYPT);
+        teatime_reset_stats(tea);
+        if (rc == 0)
+            rc = teatime_run_batch(tea, keys, nkeys, TEATEST_ROUNDS, kindex, input,
+                    output, n, sw);
+        if (rc == 0)
+            rc = teatest_compare("batch encryption", output, expected, n * sw);
+        /* a fragment tile row holds as many whole segments as fit */
+        if (rc == 0 && tea->backend == TEATIME_BACKEND_FRAGMENT) {
+            uint32_t per_tile = (64 / (sw / 4)) * 64;
+            teatime_stats_t stats;
+            rc = teatime_get_stats(tea, &stats);
+            if (rc == 0 && stats.stages[TEATIME_STAGE_DRAW].count !=
+                    (n + per_tile - 1) / per_tile) {
+                teatime_log(TEATIME_LOG_ERROR, "%u segments of %u words took %llu draws\n",
+                        n, sw, (unsigned long long)stats.stages[TEATIME_STAGE_DRAW].count);
+                rc = -EIO;
+            }
+        }
+        if (rc == 0)
+            rc = teatime_load_program(tea, TEATIME_BATCH_DECRYPT);
+        if (rc == 0)
+            rc = teatime_run_batch(tea, keys, nkeys, TEATEST_ROUNDS, kindex, expected,
+                    output, n, sw);
+        if (rc == 0)
+            rc = teatest_compare("batch decryption", output, input, n * sw);
+        /* the kernels trust the indices, so the call checks them */
+        kindex[n - 1] = nkeys;
+        teatest_quiet(true);
+        rc2 = teatime_run_batch(tea, keys, nkeys, TEATEST_ROUNDS, kindex, expected,
+                output, n, sw);
+        teatest_quiet(false);
+        if (rc == 0 && rc2 != -EINVAL) {
+            teatime_log(TEATIME_LOG_ERROR, "A key index past the keys was accepted\n");
+            rc = -EIO;
+        }
+    }
+    free(keys);
+    free(kindex);
+    free(input);
+    free(output);
+    free(expected);
+    return rc;
+}
+
+/* finds a key planted past a carry into the third key word, with TEA and XTEA */
+static int teatest_search(teatime_t *tea)
+{
+    const uint64_t count = 200000;
+    const uint32_t known[4] = { 0x01234567, 0x89ABCDEF, 0x13572468, 0x24681357 };
+    const uint32_t start[4] = { 0xDEADBEEF, 0xFEEDFACE, 7, 0xFFFFFFFF - 1000 };
+    uint64_t planted = (((uint64_t)start[2] << 32) | start[3]) + count / 2 + 7;
+    uint32_t key[4] = { start[0], start[1], (uint32_t)(planted >> 32), (uint32_t)planted };
+    uint32_t target[4], found[4 * 4];
+    int rc = teatime_set_tile_size(tea, 64, 64);
+    for (int algorithm = TEATIME_ALG_TEA; algorithm <= TEATIME_ALG_XTEA && rc == 0;
+            ++algorithm) {
+        teatime_search_stats_t stats;
+        teatest_cipher(algorithm, 2, false, key, TEATEST_ROUNDS, known, target, 4);
+        rc = teatime_set_algorithm(tea, algorithm, 2);
+        if (rc == 0)
+            rc = teatime_load_program(tea, TEATIME_KEY_SEARCH);
+        if (rc == 0)
+            rc = teatime_search_keys(tea, start, count, TEATEST_ROUNDS, known, target,
+                    found, 4, &stats);
+        if (rc >= 0 && (rc != 1 || stats.searched != count || stats.nhits != 1)) {
+            teatime_log(TEATIME_LOG_ERROR, "%d keys found, %llu hits in %llu keys\n", rc,
+                    (unsigned long long)stats.nhits, (unsigned long long)stats.searched);
+            rc = -EIO;
+        } else if (rc == 1) {
+            rc = teatest_compare("found key", found, key, 4);
+        }
+    }
+    return rc;
+}
+
+/* fingerprints and mismatch counts of buffers against the host, for lengths
+ * that end mid-texel and mid-row */
+static int teatest_reductions(teatime_t *tea)
+{
+    const uint32_t sizes[] = { 2, 6, 1030, 65538 };
+    int rc = -ENOMEM;
+    uint32_t nwords = 65538;
+    uint32_t *input = teatest_alloc(nwords, 11);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    if (input && expected)
+        rc = teatime_load_program(tea, TEATIME_ENCRYPT);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && rc == 0; ++i) {
+        uint32_t n = sizes[i], mismatches = 0;
+        teatime_buffer_t *buf = teatime_buffer_create(tea, input, n);
+        teatime_buffer_t *ref = NULL;
+        teatime_fingerprint_t gpu_fp, cpu_fp;
+        teatest_ecb(false, teatest_key, input, expected, n);
+        /* the reference differs in the first and the last word */
+        expected[0] ^= 1;
+        expected[n - 1] ^= 0x80000000;
+        ref = teatime_buffer_create(tea, expected, n);
+        expected[0] ^= 1;
+        expected[n - 1] ^= 0x80000000;
+        if (!buf || !ref)
+            rc = -EIO;
+        if (rc == 0)
+            rc = teatime_buffer_run(tea, buf, teatest_key, TEATEST_ROUNDS);
+        if (rc == 0)
+            rc = teatime_buffer_fingerprint(tea, buf, &gpu_fp);
+        if (rc == 0)
+            rc = teatime_fingerprint(expected, n, &cpu_fp);
+        if (rc == 0 && memcmp(&gpu_fp, &cpu_fp, sizeof(cpu_fp)) != 0) {
+            teatime_log(TEATIME_LOG_ERROR, "Fingerprint of %u words differs\n", n);
+            rc = -EIO;
+        }
+        if (rc == 0)
+            rc = teatime_buffer_mismatches(tea, buf, ref, &mismatches);
+        if (rc == 0 && mismatches != 2) {
+            teatime_log(TEATIME_LOG_ERROR, "%u mismatches in %u words\n", mismatches, n);
+            rc = -EIO;
+        }
+        teatime_buffer_release(tea, buf);
+        teatime_buffer_release(tea, ref);
+    }
+    free(input);
+    free(expected);
+    return rc;
+}
+
+/* chunks of different lengths queued through a ring of mapped buffers with
+ * several slots in flight, then CTR chunks that carry the counter along */
+static int teatest_ring(teatime_t *tea)
+{
+    int rc = -ENOMEM;
+    enum { NSLOTS = 3, NCHUNKS = 8 };
+    uint32_t slot_words = 4098;
+    uint32_t nwords = NCHUNKS * slot_words;
+    uint32_t *input, *output, *expected;
+    uint32_t lens[NCHUNKS];
+    int slots[NCHUNKS];
+    teatime_ring_t *ring = NULL;
+    if (tea->backend != TEATIME_BACKEND_CPU &&
+            (!tea->have_buffer_storage || !tea->have_sync))
+        return -ENOTSUP;
+    input = teatest_alloc(nwords, 17);
+    output = teatest_alloc(nwords, 0);
+    expected = teatest_alloc(nwords, 0);
+    if (input && output && expected)
+        rc = teatime_load_program(tea, TEATIME_ENCRYPT);
+    if (rc == 0) {
+        ring = teatime_ring_create(tea, NSLOTS, slot_words);
+        if (!ring)
+            rc = -EIO;
+    }
+    for (uint32_t c = 0; c < NCHUNKS + NSLOTS && rc == 0; ++c) {
+        /* complete the oldest chunk once every slot is taken */
+        if (c >= NSLOTS) {
+            uint32_t old = c - NSLOTS;
+            rc = teatime_ring_wait(tea, ring, slots[old], TEATIME_WAIT_FOREVER);
+            rc = (rc == 1) ? 0 : (rc < 0) ? rc : -EIO;
+            if (rc == 0)
+                memcpy(output + old * slot_words, ring->slots[slots[old]].output,
+                        lens[old] * sizeof(uint32_t));
+            if (rc == 0)
+                rc = teatime_ring_release(tea, ring, slots[old]);
+        }
+        if (c < NCHUNKS && rc == 0) {
+            lens[c] = slot_words - 2 * (c % 3);
+            slots[c] = teatime_ring_acquire(tea, ring);
+            rc = (slots[c] < 0) ? slots[c] : 0;
+            if (rc == 0) {
+                memcpy(ring->slots[slots[c]].input, input + c * slot_words,
+                        lens[c] * sizeof(uint32_t));
+                rc = teatime_ring_submit(tea, ring, slots[c], teatest_key,
+                        TEATEST_ROUNDS, lens[c]);
+            }
+        }
+    }
+    for (uint32_t c = 0; c < NCHUNKS && rc == 0; ++c) {
+        teatest_ecb(false, teatest_key, input + c * slot_words,
+                expected + c * slot_words, lens[c]);
+        rc = teatest_compare("ring", output + c * slot_words,
+                expected + c * slot_words, lens[c]);
+    }
+    if (rc == 0)
+        rc = teatime_load_program(tea, TEATIME_CTR);
+    if (rc == 0)
+        rc = teatime_set_counter(tea, 77);
+    for (uint32_t c = 0; c < NCHUNKS && rc == 0; ++c) {
+        int slot = teatime_ring_acquire(tea, ring);
+        rc = (slot < 0) ? slot : 0;
+        if (rc == 0) {
+            memcpy(ring->slots[slot].input, input + c * slot_words,
+                    slot_words * sizeof(uint32_t));
+            rc = teatime_ring_submit(tea, ring, slot, teatest_key,
+                    TEATEST_ROUNDS, slot_words);
+        }
+        if (rc == 0) {
+            rc = teatime_ring_wait(tea, ring, slot, TEATIME_WAIT_FOREVER);
+            rc = (rc == 1) ? 0 : (rc < 0) ? rc : -EIO;
+        }
+        if (rc == 0)
+            memcpy(output + c * slot_words, ring->slots[slot].output,
+                    slot_words * sizeof(uint32_t));
+        if (slot >= 0)
+            teatime_ring_release(tea, ring, slot);
+    }
+    if (rc == 0) {
+        teatest_ctr(77, input, expected, nwords);
+        rc = teatest_compare("CTR ring", output, expected, nwords);
+    }
+    teatime_ring_destroy(tea, ring);
+    free(input);
+    free(output);
+    free(expected);
+    return rc;
+}
+
+/* compares the counters of each stage with those of one call per stage, or of
+ * the draw only on the CPU backend, and the rates with the counters */
+static int teatest_stage_counts(teatime_t *tea, const char *what, uint64_t bytes)
+{
+    teatime_stats_t stats;
+    int rc = teatime_get_stats(tea, &stats);
+    for (int s = 0; s < TEATIME_NUM_STAGES && rc == 0; ++s) {
+        const teatime_stage_stats_t *st = &(stats.stages[s]);
+        uint64_t count = (tea->backend != TEATIME_BACKEND_CPU ||
+                s == TEATIME_STAGE_DRAW) ? 1 : 0;
+        double wall_gbps = (st->wall_ns > 0) ? (double)st->bytes / (double)st->wall_ns : 0;
+        double gpu_gbps = (st->gpu_ns >= TEATIME_STATS_MIN_GPU_NS) ?
+            (double)st->gpu_bytes / (double)st->gpu_ns : 0;
+        if (st->count != count || st->bytes != count * bytes ||
+            st->gpu_count > st->count || st->gpu_bytes != st->gpu_count * bytes ||
+            st->wall_gbps != wall_gbps || st->gpu_gbps != gpu_gbps) {
+            teatime_log(TEATIME_LOG_ERROR, "%s: %s stage has %llu calls of %llu bytes, "
+                    "%llu of %llu bytes on the GPU, at %g and %g GB/s\n", what,
+                    teatime_stage_name(s), (unsigned long long)st->count,
+                    (unsigned long long)st->bytes, (unsigned long long)st->gpu_count,
+                    (unsigned long long)st->gpu_bytes, st->wall_gbps, st->gpu_gbps);
+            rc = -EIO;
+        }
+    }
+    return rc;
+}
+
+/* the stage counters of a buffer and of a run of known sizes */
+static int teatest_stats(teatime_t *tea)
+{
+    int rc = -ENOMEM;
+    uint32_t nwords = 4098;
+    uint64_t bytes = (uint64_t)nwords * sizeof(uint32_t);
+    uint32_t *input = teatest_alloc(nwords, 15);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    teatime_buffer_t *buf = NULL;
+    if (input && output)
+        rc = teatime_load_program(tea, TEATIME_ENCRYPT);
+    if (rc == 0) {
+        teatime_reset_stats(tea);
+        buf = teatime_buffer_create(tea, input, nwords);
+        rc = buf ? teatime_buffer_run(tea, buf, teatest_key, TEATEST_ROUNDS) : -EIO;
+    }
+    if (rc == 0)
+        rc = teatime_buffer_read(tea, buf, output, nwords);
+    if (rc == 0)
+        rc = teatest_stage_counts(tea, "buffer", bytes);
+    if (rc == 0) {
+        teatime_reset_stats(tea);
+        rc = teatime_run(tea, teatest_key, TEATEST_ROUNDS, input, output, nwords);
+    }
+    if (rc == 0)
+        rc = teatest_stage_counts(tea, "run", bytes);
+    teatime_buffer_release(tea, buf);
+    free(input);
+    free(output);
+    return rc;
+}
+
+/* runs fn with stderr going to a temporary file and returns what it logged */
+static int teatest_capture_log(void (*fn)(void), char *buf, size_t blen)
+{
+    int rc = 0;
+    size_t nb = 0;
+    FILE *fp = tmpfile();
+    int saved = dup(STDERR_FILENO);
+    if (!fp || saved < 0) {
+        if (fp)
+            fclose(fp);
+        return -errno;
+    }
+    fflush(stderr);
+    if (dup2(fileno(fp), STDERR_FILENO) < 0)
+        rc = -errno;
+    if (rc == 0)
+        fn();
+    fflush(stderr);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    rewind(fp);
+    if (rc == 0)
+        nb = fread(buf, 1, blen - 1, fp);
+    buf[nb] = '\0';
+    fclose(fp);
+    return rc;
+}
+
+/* an invalid enum, reported right away by the debug callback */
+static void teatest_gl_error(void)
+{
+    glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    glBindBuffer(GL_TEXTURE_2D, 0);
+    glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    while (glGetError() != GL_NO_ERROR)
+        ;
+}
+
+/*
+ * TEATIME_CHECKS picks the error checking mode, the log level and the mode
+ * set by the caller survive another teatime_setup(), and with KHR_debug a GL
+ * error reaches the log through the debug callback.
+ */
+static int teatest_logging(teatime_t *tea)
+{
+    int rc = 0;
+    int level = teatime_get_log_level();
+    int checks = teatime_get_error_checks();
+    int other_level = (level == TEATIME_LOG_ERROR) ? TEATIME_LOG_WARN : TEATIME_LOG_ERROR;
+    int other_checks = (checks == TEATIME_CHECKS_FAST) ? TEATIME_CHECKS_FULL :
+        TEATIME_CHECKS_FAST;
+    const char *env = getenv("TEATIME_CHECKS");
+    teatime_t *other = NULL;
+    char buf[4096];
+    if (env && (strcmp(env, "fast") == 0) != (checks == TEATIME_CHECKS_FAST)) {
+        teatime_log(TEATIME_LOG_ERROR, "TEATIME_CHECKS=%s is not in effect\n", env);
+        return -EIO;
+    }
+    /* before another teatime_t shares the context and removes the callback
+     * on cleanup */
+    if (tea->have_debug) {
+        teatime_set_log_level(TEATIME_LOG_ERROR);
+        rc = teatest_capture_log(teatest_gl_error, buf, sizeof(buf));
+        if (rc == 0 && !strstr(buf, "GL debug message")) {
+            teatime_log(TEATIME_LOG_ERROR, "A GL error was not logged by the debug callback\n");
+            rc = -EIO;
+        }
+    }
+    teatime_set_log_level(other_level);
+    teatime_set_error_checks(other_checks);
+    other = (rc == 0) ? teatime_setup() : NULL;
+    if (rc == 0 && !other) {
+        rc = -ENOMEM;
+    } else if (rc == 0 && (teatime_get_log_level() != other_level ||
+            teatime_get_error_checks() != other_checks)) {
+        teatime_log(TEATIME_LOG_ERROR, "teatime_setup() reset the log level or the checks\n");
+        rc = -EIO;
+    }
+    teatime_cleanup(other);
+    teatime_set_error_checks(checks);
+    teatime_set_log_level(level);
+    if (rc == 0)
+        rc = teatest_round_trip(tea, 1030);
+    return rc;
+}
+
+static int teatest_workers_init(teatime_t *tea, void *arg)
+{
+    return teatime_set_backend(tea, *(const int *)arg);
+}
+
+/* ECB and CTR runs spread over the threads of a context pool */
+static int teatest_workers(teatime_t *tea)
+{
+    int rc = -ENOMEM;
+    teatime_work_t works[8];
+    uint32_t nworks = sizeof(works) / sizeof(works[0]);
+    uint32_t nwords = 4098;
+    uint32_t *input = teatest_alloc(nwords, 13);
+    uint32_t *output = teatest_alloc(nworks * nwords, 0);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    teatime_workers_t *pool = teatime_workers_create(2, teatest_workers_init,
+            &(tea->backend));
+    memset(works, 0, sizeof(works));
+    for (uint32_t i = 0; i < nworks; ++i) {
+        works[i].direction = (i % 2) ? TEATIME_CTR : TEATIME_ENCRYPT;
+        memcpy(works[i].ikey, teatest_key, sizeof(works[i].ikey));
+        works[i].rounds = TEATEST_ROUNDS;
+        works[i].counter = 1000ULL * i;
+        works[i].input = input;
+        works[i].output = output + i * nwords;
+        works[i].nwords = nwords;
+    }
+    if (!pool)
+        rc = -EIO;
+    else if (input && output && expected)
+        rc = teatime_workers_run(pool, works, nworks);
+    for (uint32_t i = 0; i < nworks && rc == 0; ++i) {
+        if (works[i].direction == TEATIME_CTR)
+            teatest_ctr(works[i].counter, input, expected, nwords);
+        else
+            teatest_ecb(false, teatest_key, input, expected, nwords);
+        rc = works[i].done ? works[i].status : -EIO;
+        if (rc == 0)
+            rc = teatest_compare("work", works[i].output, expected, nwords);
+    }
+    teatime_workers_destroy(pool);
+    free(input);
+    free(output);
+    free(expected);
+    return rc;
+}
+
+static const teatest_check_t teatest_checks[] = {
+    { "known answer", teatest_known_answer },
+    { "program cache", teatest_program_cache },
+    { "pool", teatest_pool },
+    { "odd sizes", teatest_odd_sizes },
+    { "streaming", teatest_streaming },
+    { "async jobs", teatest_async },
+    { "buffers", teatest_buffers },
+    { "fan-out", teatest_fanout },
+    { "workgroups", teatest_workgroups },
+    { "specialized", teatest_specialized },
+    { "CPU equivalence", teatest_equivalence },
+    { "hybrid", teatest_hybrid },
+    { "CTR", teatest_ctr_mode },
+    { "CBC", teatest_cbc_mode },
+    { "XTEA and XXTEA", teatest_xtea },
+    { "batch", teatest_batch },
+    { "key search", teatest_search },
+    { "reductions", teatest_reductions },
+    { "statistics", teatest_stats },
+    { "logging", teatest_logging },
+    { "context pool", teatest_workers },
+    { "mapped ring", teatest_ring }
+};
+
+/*
+ * Talks to a running teatime-batchd: round trips of several lengths from two
+ * clients with their own keys and rounds, one of them run in place in the
+ * shared buffer and the longest as large as a batch, a request past that
+ * which must fail, then the daemon's counters.
+ */
+static int teatest_batchd(const char *path)
+{
+    const uint32_t batch_words = TEATEST_BATCHD_KB * 1024 / sizeof(uint32_t);
+    const uint32_t sizes[] = { 2, 6, 4098, 65538, batch_words };
+    const uint32_t rounds[2] = { TEATEST_ROUNDS, 16 };
+    uint32_t keys[2][4] = {
+        { 0xDEADBEEF, 0xCAFEFACE, 0xFACEB00C, 0xF00D1337 },
+        { 1, 2, 3, 4 }
+    };
+    teatime_client_t *clients[2] = {
+        teatime_client_connect(path, 0), teatime_client_connect(path, 0)
+    };
+    teatime_batchd_stats_t stats;
+    int rc = -ENOMEM;
+    uint32_t nwords = batch_words + 2, nrequests = 0;
+    uint32_t *input = teatest_alloc(nwords, 12);
+    uint32_t *output = teatest_alloc(nwords, 0);
+    uint32_t *expected = teatest_alloc(nwords, 0);
+    if (!clients[0] || !clients[1]) {
+        teatime_log(TEATIME_LOG_ERROR, "Unable to connect to %s\n", path);
+        rc = -ENOTCONN;
+    } else if (input && output && expected) {
+        rc = 0;
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && rc == 0; ++i) {
+        for (int c = 0; c < 2 && rc == 0; ++c) {
+            uint32_t n = sizes[i];
+            const uint32_t *src = input;
+            uint32_t *buf = output;
+            /* the second client runs in place, past the first block */
+            if (c == 1) {
+                buf = teatime_client_buffer(clients[c]) + 2;
+                memcpy(buf, input, n * sizeof(uint32_t));
+                src = buf;
+            }
+            for (uint32_t j = 0; j < n; j += 2)
+                TEA_cpu_encrypt(input + j, keys[c], expected + j, rounds[c]);
+            rc = teatime_client_run(clients[c], TEATIME_CLIENT_ENCRYPT, keys[c],
+                    rounds[c], src, buf, n, NULL);
+            if (rc == 0)
+                rc = teatest_compare("batchd encryption", buf, expected, n);
+            if (rc == 0)
+                rc = teatime_client_run(clients[c], TEATIME_CLIENT_DECRYPT, keys[c],
+                        rounds[c], buf, buf, n, NULL);
+            if (rc == 0)
+                rc = teatest_compare("batchd decryption", buf, input, n);
+            nrequests += 2;
+        }
+    }
+    if (rc == 0) {
+        rc = teatime_client_run(clients[0], TEATIME_CLIENT_ENCRYPT, keys[0],
+                rounds[0], input, output, nwords, NULL);
+        if (rc != -E2BIG) {
+            teatime_log(TEATIME_LOG_ERROR, "A request past the batch returned %d\n", rc);
+            rc = -EIO;
+        } else {
+            rc = 0;
+        }
+    }
+    if (rc == 0)
+        rc = teatime_client_get_stats(clients[0], &stats);
+    if (rc == 0 && (stats.clients != 2 || stats.requests != nrequests || stats.errors != 1)) {
+        teatime_log(TEATIME_LOG_ERROR, "Daemon counts %llu clients, %llu requests and "
+                "%llu errors\n", (unsigned long long)stats.clients,
+                (unsigned long long)stats.requests, (unsigned long long)stats.errors);
+        rc = -EIO;
+    }
+    printf("%-8s %-16s %s\n", "batchd", "protocol", (rc == 0) ? "ok" : "FAILED");
+    teatime_client_close(clients[0]);
+    teatime_client_close(clients[1]);
+    free(input);
+    free(output);
+    free(expected);
+    return rc;
+}
+
+typedef struct {
+    const char *only; /* value of TEATIME_CONTEXT */
+    const char *name; /* teatime_context_name() of the context */
+    bool built;
+} teatest_context_t;
+
+static const teatest_context_t teatest_contexts[] = {
+#ifdef TEATIME_HAVE_EGL
+    { "egl", "EGL", true },
+#else
+    { "egl", "EGL", false },
+#endif
+#ifdef TEATIME_HAVE_OSMESA
+    { "osmesa", "OSMesa", true }
+#else
+    { "osmesa", "OSMesa", false }
+#endif
+};
+
+static const int teatest_backends[] = {
+    TEATIME_BACKEND_FRAGMENT,
+    TEATIME_BACKEND_COMPUTE,
+    TEATIME_BACKEND_CPU
+};
+
+int main(int argc, char **argv)
+{
+    uint32_t nchecks = sizeof(teatest_checks) / sizeof(teatest_checks[0]);
+    uint32_t nbackends = sizeof(teatest_backends) / sizeof(teatest_backends[0]);
+    uint32_t ncontexts = sizeof(teatest_contexts) / sizeof(teatest_contexts[0]);
+    uint32_t failures = 0;
+    /* -s SOCKET checks a running teatime-batchd instead */
+    if (argc == 3 && strcmp(argv[1], "-s") == 0)
+        return (teatest_batchd(argv[2]) < 0) ? 1 : 0;
+    /* no context is current yet, so these get one of their own */
+    for (uint32_t x = 0; x < ncontexts; ++x) {
+        int rc = teatest_headless(teatest_contexts[x].only, teatest_contexts[x].name,
+                teatest_contexts[x].built);
+        printf("%-8s %-16s %s\n", teatest_contexts[x].name, "headless context",
+                (rc == 0) ? "ok" : (rc == -ENOTSUP) ? "skipped" : "FAILED");
+        if (rc < 0 && rc != -ENOTSUP)
+            failures++;
+    }
+    for (uint32_t b = 0; b < nbackends; ++b) {
+        const char *backend = teatime_backend_name(teatest_backends[b]);
+        for (uint32_t c = 0; c < nchecks; ++c) {
+            teatime_t *tea = teatime_setup();
+            int rc = tea ? teatime_set_backend(tea, teatest_backends[b]) : -ENOMEM;
+            if (rc == 0)
+                rc = teatest_checks[c].run(tea);
+            printf("%-8s %-16s %s\n", backend, teatest_checks[c].name,
+                    (rc == 0) ? "ok" : (rc == -ENOTSUP) ? "skipped" : "FAILED");
+            if (rc < 0 && rc != -ENOTSUP)
+                failures++;
+            teatime_cleanup(tea);
+        }
+    }
+    printf("%u of %u checks failed\n", failures, ncontexts + nbackends * nchecks);
+    return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,291 @@
+/*
+ * COPYRIGHT: Stealthy Labs LLC
+ * DATE: 29th May 2015
+ * AUTHOR: Stealthy Labs
+ * SOFTWARE: Tea Time
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <teatime.h>
+#ifndef WIN32
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+
+/*
+ * A GL context is current in one thread only, so a teatime_t cannot be shared
+ * by threads without serializing every call. The pool instead runs a thread
+ * per context, each with its own headless context and its own teatime_t, i.e.
+ * its own FBO, programs, textures and buffers. Callers queue work items and
+ * any idle thread picks them up, so several cores (llvmpipe) or several
+ * command queues (real drivers) are busy at once.
+ */
+
+typedef struct {
+    teatime_workers_t *pool;
+    teatime_t *tea;
+    int direction; /* of the loaded program, -1 for none */
+#ifndef WIN32
+    pthread_t thread;
+#endif
+    bool started;
+} teatime_worker_t;
+
+struct teatime_workers_s {
+    uint32_t nworkers;
+    teatime_worker_t *workers;
+    int (*init)(teatime_t *, void *);
+    void *arg;
+#ifndef WIN32
+    pthread_mutex_t lock;
+    pthread_cond_t wake; /* signaled when there is new work or on exit */
+    pthread_cond_t done; /* signaled when a work item completes */
+    pthread_cond_t ready; /* signaled when a thread has set up its context */
+#endif
+    teatime_work_t *head; /* the queue, in submission order */
+    teatime_work_t *tail;
+    uint32_t nready; /* threads done with their setup */
+    int setup_rc; /* first setup error */
+    bool exiting;
+};
+
+#ifndef WIN32
+/* context creation and destruction touch process-wide state, the EGL display
+ * and the GLEW entry points, so they are never run by two threads at once */
+static pthread_mutex_t teatime_workers_setup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int teatime_worker_run(teatime_worker_t *w, teatime_work_t *work)
+{
+    int rc = 0;
+    if (w->direction != work->direction) {
+        w->direction = -1;
+        rc = teatime_load_program(w->tea, work->direction);
+        if (rc < 0)
+            return rc;
+        w->direction = work->direction;
+    }
+    if (TEATIME_IS_CTR(work->direction)) {
+        rc = teatime_set_counter(w->tea, work->counter);
+        if (rc < 0)
+            return rc;
+    }
+    return teatime_run(w->tea, work->ikey, work->rounds, work->input, work->output,
+            work->nwords);
+}
+
+static void *teatime_worker_main(void *arg)
+{
+    teatime_worker_t *w = (teatime_worker_t *)arg;
+    teatime_workers_t *pool = w->pool;
+    int rc = 0;
+    pthread_mutex_lock(&teatime_workers_setup_lock);
+    w->tea = teatime_setup();
+    if (!w->tea)
+        rc = -ENODEV;
+    else if (pool->init)
+        rc = pool->init(w->tea, pool->arg);
+    pthread_mutex_unlock(&teatime_workers_setup_lock);
+    pthread_mutex_lock(&pool->lock);
+    if (rc < 0 && pool->setup_rc == 0)
+        pool->setup_rc = rc;
+    pool->nready++;
+    pthread_cond_broadcast(&pool->ready);
+    while (rc == 0) {
+        teatime_work_t *work;
+        while (!pool->head && !pool->exiting)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        /* the queue is drained before the threads exit */
+        if (!pool->head)
+            break;
+        work = pool->head;
+        pool->head = work->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+        rc = teatime_worker_run(w, work);
+        pthread_mutex_lock(&pool->lock);
+        work->status = rc;
+        work->done = true;
+        pthread_cond_broadcast(&pool->done);
+        /* a failed run is reported to its caller, the thread carries on */
+        rc = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_lock(&teatime_workers_setup_lock);
+    if (w->tea) {
+        teatime_delete_program(w->tea);
+        teatime_cleanup(w->tea);
+    }
+    w->tea = NULL;
+    pthread_mutex_unlock(&teatime_workers_setup_lock);
+    return NULL;
+}
+#endif /* WIN32 */
+
+teatime_workers_t *teatime_workers_create(uint32_t nworkers,
+        int (*init)(teatime_t *, void *), void *arg)
+{
+#ifdef WIN32
+    (void)nworkers;
+    (void)init;
+    (void)arg;
+    teatime_log(TEATIME_LOG_ERROR, "The context pool needs pthreads\n");
+    return NULL;
+#else
+    int rc = 0;
+    teatime_workers_t *pool = NULL;
+    if (nworkers == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = (ncpus > 0) ? (uint32_t)ncpus : 1;
+    }
+    pool = calloc(1, sizeof(teatime_workers_t));
+    if (!pool) {
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                sizeof(teatime_workers_t));
+        return NULL;
+    }
+    pool->workers = calloc(nworkers, sizeof(teatime_worker_t));
+    if (!pool->workers) {
+        teatime_log(TEATIME_LOG_ERROR, "Out of memory allocating %zu bytes\n",
+                nworkers * sizeof(teatime_worker_t));
+        free(pool);
+        return NULL;
+    }
+    pool->init = init;
+    pool->arg = arg;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    for (uint32_t i = 0; i < nworkers; ++i) {
+        teatime_worker_t *w = &(pool->workers[i]);
+        w->pool = pool;
+        w->direction = -1;
+        if (pthread_create(&w->thread, NULL, teatime_worker_main, w) != 0) {
+            teatime_log(TEATIME_LOG_ERROR, "Unable to start context pool thread %u\n", i);
+            rc = -EAGAIN;
+            break;
+        }
+        w->started = true;
+        pool->nworkers++;
+    }
+    /* no work is taken until every context exists, so that the GLEW entry
+     * points are not reloaded under a running thread */
+    pthread_mutex_lock(&pool->lock);
+    while (pool->nready < pool->nworkers)
+        pthread_cond_wait(&pool->ready, &pool->lock);
+    if (rc == 0)
+        rc = pool->setup_rc;
+    pthread_mutex_unlock(&pool->lock);
+    if (rc < 0) {
+        teatime_log(TEATIME_LOG_ERROR, "Unable to set up the context pool: %s\n",
+                strerror(-rc));
+        teatime_workers_destroy(pool);
+        return NULL;
+    }
+    teatime_log(TEATIME_LOG_INFO, "Context pool with %u threads on the %s backend\n",
+            pool->nworkers, teatime_backend_name(pool->workers[0].tea->backend));
+    return pool;
+#endif
+}
+
+void teatime_workers_destroy(teatime_workers_t *pool)
+{
+#ifndef WIN32
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        pool->exiting = true;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+        for (uint32_t i = 0; i < pool->nworkers; ++i) {
+            if (pool->workers[i].started)
+                pthread_join(pool->workers[i].thread, NULL);
+        }
+        pthread_cond_destroy(&pool->ready);
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->wake);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->workers);
+        free(pool);
+    }
+#else
+    (void)pool;
+#endif
+}
+
+uint32_t teatime_workers_count(const teatime_workers_t *pool)
+{
+    return pool ? pool->nworkers : 0;
+}
+
+int teatime_workers_submit(teatime_workers_t *pool, teatime_work_t *work)
+{
+#ifndef WIN32
+    if (pool && work && work->output && work->nwords > 0 &&
+        (work->input || work->direction == TEATIME_KEYSTREAM) &&
+        (work->direction == TEATIME_ENCRYPT || work->direction == TEATIME_DECRYPT ||
+         TEATIME_IS_CTR(work->direction))) {
+        work->status = 0;
+        work->done = false;
+        work->next = NULL;
+        pthread_mutex_lock(&pool->lock);
+        if (pool->exiting) {
+            pthread_mutex_unlock(&pool->lock);
+            return -ESHUTDOWN;
+        }
+        if (pool->tail)
+            pool->tail->next = work;
+        else
+            pool->head = work;
+        pool->tail = work;
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+#else
+    (void)pool;
+    (void)work;
+#endif
+    return -EINVAL;
+}
+
+int teatime_workers_wait(teatime_workers_t *pool, teatime_work_t *work)
+{
+#ifndef WIN32
+    if (pool && work) {
+        int rc;
+        pthread_mutex_lock(&pool->lock);
+        while (!work->done)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        rc = work->status;
+        pthread_mutex_unlock(&pool->lock);
+        return rc;
+    }
+#else
+    (void)pool;
+    (void)work;
+#endif
+    return -EINVAL;
+}
+
+int teatime_workers_run(teatime_workers_t *pool, teatime_work_t *works, uint32_t nworks)
+{
+    int rc = 0;
+    uint32_t nsubmitted = 0;
+    if (!pool || !works)
+        return -EINVAL;
+    for (; nsubmitted < nworks; ++nsubmitted) {
+        rc = teatime_workers_submit(pool, &(works[nsubmitted]));
+        if (rc < 0)
+            break;
+    }
+    for (uint32_t i = 0; i < nsubmitted; ++i) {
+        int wrc = teatime_workers_wait(pool, &(works[i]));
+        if (rc == 0 && wrc < 0)
+            rc = wrc;
+    }
+    return rc;
+}